@@ -844,6 +844,7 @@ unsigned int EmbeddedNetworkController::handleControlPlaneHttpPOST(
 					if (b.count("enableBroadcast")) network["enableBroadcast"] = OSUtils::jsonBool(b["enableBroadcast"],false);
 					if (b.count("allowPassiveBridging")) network["allowPassiveBridging"] = OSUtils::jsonBool(b["allowPassiveBridging"],false);
 					if (b.count("multicastLimit")) network["multicastLimit"] = OSUtils::jsonInt(b["multicastLimit"],32ULL);
+					if (b.count("mtu")) network["mtu"] = std::max(std::min(OSUtils::jsonInt(b["mtu"],(uint64_t)ZT_DEFAULT_MTU),(uint64_t)ZT_MAX_MTU),(uint64_t)ZT_MIN_MTU);
 
 					if (b.count("v4AssignMode")) {
 						json nv4m;
@@ -1431,6 +1432,7 @@ void EmbeddedNetworkController::_request(
 	if (OSUtils::jsonBool(network["allowPassiveBridging"],false)) nc.flags |= ZT_NETWORKCONFIG_FLAG_ALLOW_PASSIVE_BRIDGING;
 	Utils::scopy(nc.name,sizeof(nc.name),OSUtils::jsonString(network["name"],"").c_str());
 	nc.multicastLimit = (unsigned int)OSUtils::jsonInt(network["multicastLimit"],32ULL);
+	nc.mtu = (unsigned int)std::max(std::min(OSUtils::jsonInt(network["mtu"],(uint64_t)ZT_DEFAULT_MTU),(uint64_t)ZT_MAX_MTU),(uint64_t)ZT_MIN_MTU);
 
 	for(std::set<Address>::const_iterator ab(nmi.activeBridges.begin());ab!=nmi.activeBridges.end();++ab) {
 		nc.addSpecialist(*ab,ZT_NETWORKCONFIG_SPECIALIST_TYPE_ACTIVE_BRIDGE);
@@ -52,15 +52,13 @@ extern "C" {
 #define ZT_DEFAULT_PORT 9993
 
 /**
- * Maximum MTU for ZeroTier virtual networks
+ * Default MTU for ZeroTier virtual networks
  *
- * This is pretty much an unchangeable global constant. To make it change
- * across nodes would require logic to send ICMP packet too big messages,
- * which would complicate things. 1500 has been good enough on most LANs
- * for ages, so a larger MTU should be fine for the forseeable future. This
- * typically results in two UDP packets per single large frame. Experimental
- * results seem to show that this is good. Larger MTUs resulting in more
- * fragments seemed too brittle on slow/crummy links for no benefit.
+ * This is the MTU of networks whose controller doesn't set one, and the
+ * largest frame nodes older than protocol version 10 will accept. 1500 has
+ * been good enough on most LANs for ages, so a larger MTU should be fine for
+ * the forseeable future. This typically results in two UDP packets per
+ * single large frame. Experimental results seem to show that this is good.
  *
  * If this does change, also change it in tap.h in the tuntaposx code under
  * mac-tap.
@@ -74,7 +72,23 @@ extern "C" {
  * We use 2800, which leaves some room for other payload in other types of
  * messages such as multicast propagation or future support for bridging.
  */
-#define ZT_MAX_MTU 2800
+#define ZT_DEFAULT_MTU 2800
+
+/**
+ * Minimum MTU a network controller may set (the IPv6 minimum)
+ */
+#define ZT_MIN_MTU 1280
+
+/**
+ * Maximum MTU a network controller may set
+ *
+ * This allows 9000 byte jumbo frames with room to spare. A full size frame
+ * takes eight UDP packets at the default UDP MTU, which is what sizes
+ * ZT_MAX_PACKET_FRAGMENTS. Frames this big are only sent to peers speaking
+ * protocol version 10 or newer, since older ones drop anything larger than
+ * ZT_DEFAULT_MTU.
+ */
+#define ZT_MAX_MTU 10000
 
 /**
  * Maximum length of network short name
@@ -454,6 +468,9 @@ typedef struct
 
 /**
  * Current node status
+ *
+ * Grew in 1.3.0 (everything after online was added), so callers that
+ * allocate this must be rebuilt against this header. See ZT_version().
  */
 typedef struct
 {
@@ -480,6 +497,81 @@ typedef struct
 	 * True if some kind of connectivity appears available
 	 */
 	int online;
+
+	/**
+	 * Packets currently waiting in transmit pacing queues (0 if pacing is off)
+	 */
+	unsigned long txQueueDepth;
+
+	/**
+	 * Packets dropped because a peer's transmit pacing queue was full
+	 */
+	uint64_t txQueueDrops;
+
+	/**
+	 * Fragments of received packets found missing and NACKed (fragment recovery only)
+	 */
+	uint64_t fragmentsLost;
+
+	/**
+	 * NACKed fragments that were then received
+	 */
+	uint64_t fragmentsRecovered;
+
+	/**
+	 * Fragments never received before their packet was dropped from the RX queue
+	 */
+	uint64_t fragmentsExpired;
+
+	/**
+	 * Fragments we resent because a peer NACKed them
+	 */
+	uint64_t fragmentsRetransmitted;
+
+	/**
+	 * Forward error correction parity packets sent
+	 */
+	uint64_t fecParitySent;
+
+	/**
+	 * Lost packets rebuilt from forward error correction parity
+	 */
+	uint64_t fecPacketsRecovered;
+
+	/**
+	 * Packet buffers obtained from the heap by the queued packet pool
+	 */
+	uint64_t packetPoolAllocated;
+
+	/**
+	 * Packet buffers taken from the pool's free list instead of the heap
+	 */
+	uint64_t packetPoolReused;
+
+	/**
+	 * Packets copied into pooled buffers
+	 */
+	uint64_t packetPoolCopies;
+
+	/**
+	 * Total bytes of packets copied into pooled buffers
+	 */
+	uint64_t packetPoolBytesCopied;
+
+	/**
+	 * Packet buffers currently on the pool's free list
+	 */
+	unsigned long packetPoolFree;
+
+	/**
+	 * Packets and fragments relayed for other peers
+	 */
+	uint64_t relayedPackets;
+
+	/**
+	 * Total bytes relayed for other peers
+	 */
+	uint64_t relayedBytes;
 } ZT_NodeStatus;
 
 /**
@@ -938,7 +1030,7 @@ typedef struct
 	enum ZT_VirtualNetworkType type;
 
 	/**
-	 * Maximum interface MTU
+	 * Interface MTU (set by controller, ZT_MIN_MTU to ZT_MAX_MTU)
 	 */
 	unsigned int mtu;
 
@@ -1018,6 +1110,9 @@ typedef struct
 
 /**
  * Physical network path to a peer
+ *
+ * Fields from mtu on were added in 1.3.0. Since this is embedded in
+ * ZT_Peer its size also sets the stride of ZT_PeerList::peers.
  */
 typedef struct
 {
@@ -1055,10 +1150,64 @@ typedef struct
 	 * Is path preferred?
 	 */
 	int preferred;
+
+	/**
+	 * Current path MTU (payload bytes per UDP packet)
+	 */
+	unsigned int mtu;
+
+	/**
+	 * Packets and fragments sent via this path
+	 */
+	uint64_t packetsSent;
+
+	/**
+	 * Bytes sent via this path
+	 */
+	uint64_t bytesSent;
+
+	/**
+	 * Packets and fragments received via this path
+	 */
+	uint64_t packetsReceived;
+
+	/**
+	 * Bytes received via this path
+	 */
+	uint64_t bytesReceived;
+
+	/**
+	 * Smoothed round trip time in milliseconds or -1 if not yet measured
+	 */
+	int latency;
+
+	/**
+	 * Round trip time jitter in milliseconds or -1 if not yet measured
+	 */
+	int jitter;
+
+	/**
+	 * Median of recent round trip times in milliseconds or -1 if not yet measured
+	 */
+	int latencyMedian;
+
+	/**
+	 * 95th percentile of recent round trip times in milliseconds or -1 if not yet measured
+	 */
+	int latency95;
+
+	/**
+	 * Fraction of recent probes lost from 0.0 to 1.0
+	 */
+	float packetLoss;
 } ZT_PeerPhysicalPath;
 
 /**
  * Peer status result buffer
+ *
+ * The layout changed in 1.3.0 (new queue and FEC fields and a larger
+ * ZT_PeerPhysicalPath), so ZT_PeerList can only be read by code built
+ * against a 1.3.0 or newer header.
  */
 typedef struct
 {
@@ -1092,6 +1241,21 @@ typedef struct
 	 */
 	enum ZT_PeerRole role;
 
+	/**
+	 * Packets currently waiting in this peer's transmit pacing queue
+	 */
+	unsigned int txQueueDepth;
+
+	/**
+	 * Packets to this peer dropped because its transmit pacing queue was full
+	 */
+	uint64_t txQueueDrops;
+
+	/**
+	 * Nonzero if we are sending forward error correction parity to this peer
+	 */
+	int fecActive;
+
 	/**
 	 * Number of paths (size of paths[])
 	 */
@@ -1535,6 +1699,25 @@ typedef int (*ZT_WirePacketSendFunction)(
 	unsigned int,                     /* Packet length */
 	unsigned int);                    /* TTL or 0 to use default */
 
+/**
+ * Function to send a ZeroTier packet with the IP "don't fragment" bit set
+ *
+ * Parameters are the same as ZT_WirePacketSendFunction.
+ *
+ * This is used to send path MTU probes. If the packet cannot be sent with
+ * DF set (or is too big for the local interface), the function must fail
+ * rather than send the packet normally. If it is not provided, path MTU
+ * discovery is disabled and packets are fragmented at the default MTU.
+ */
+typedef int (*ZT_WirePacketSendDontFragmentFunction)(
+	ZT_Node *,                        /* Node */
+	void *,                           /* User ptr */
+	const struct sockaddr_storage *,  /* Local address */
+	const struct sockaddr_storage *,  /* Remote address */
+	const void *,                     /* Packet data */
+	unsigned int,                     /* Packet length */
+	unsigned int);                    /* TTL or 0 to use default */
+
 /**
  * Function to check whether a path should be used for ZeroTier traffic
  *
@@ -1598,7 +1781,7 @@ typedef int (*ZT_PathLookupFunction)(
 struct ZT_Node_Callbacks
 {
 	/**
-	 * Struct version -- must currently be 0
+	 * Struct version -- 0 or 1 (1 adds wirePacketSendDontFragmentFunction)
 	 */
 	long version;
 
@@ -1641,8 +1824,18 @@ struct ZT_Node_Callbacks
 	 * OPTIONAL: Function to get hints to physical paths to ZeroTier addresses
 	 */
 	ZT_PathLookupFunction pathLookupFunction;
+
+	/**
+	 * OPTIONAL (version 1): Function to send packets with IP don't fragment set
+	 */
+	ZT_WirePacketSendDontFragmentFunction wirePacketSendDontFragmentFunction;
 };
 
+/**
+ * Current version of ZT_Node_Callbacks
+ */
+#define ZT_NODE_CALLBACKS_VERSION 1
+
 /**
  * Create a new ZeroTier One node
  *
@@ -2110,9 +2303,79 @@ void ZT_Node_clusterStatus(ZT_Node *node,ZT_ClusterStatus *cs);
  */
 void ZT_Node_setTrustedPaths(ZT_Node *node,const struct sockaddr_storage *networks,const uint64_t *ids,unsigned int count);
 
+/**
+ * Enable or disable multipath striping
+ *
+ * When enabled, unicast frames to a peer with more than one alive direct
+ * path are spread across all of them. Traffic is assigned to paths per
+ * flow (IP addresses, protocol, and ports) so that packets within a TCP
+ * or UDP flow are not reordered. Paths are weighted by measured quality.
+ * Traffic that can't be classified into a flow still uses the single best
+ * path. This is disabled by default.
+ *
+ * @param node Node instance
+ * @param enabled Nonzero to enable, zero to disable
+ */
+void ZT_Node_setMultipathMode(ZT_Node *node,int enabled);
+
+/**
+ * Set transmit pacing
+ *
+ * When a pacing rate is set, outgoing packets are queued per destination
+ * peer and sent at no more than this rate, with each backlogged peer getting
+ * an equal share (deficit round robin). A peer whose queue is full has new
+ * packets dropped. This keeps one bulk transfer from flooding the socket
+ * buffer at the expense of traffic to other peers. Pacing is off by default.
+ *
+ * Queued packets are sent as further packets are sent and when
+ * ZT_Node_processBackgroundTasks() is called, so callers must honor its
+ * next deadline closely while pacing is enabled.
+ *
+ * @param node Node instance
+ * @param bytesPerSecond Pacing rate in bytes per second or 0 to disable pacing
+ * @param maxQueueDepth Maximum packets queued per peer or 0 for default
+ */
+void ZT_Node_setTxPacing(ZT_Node *node,uint64_t bytesPerSecond,unsigned int maxQueueDepth);
+
+/**
+ * Enable or disable fragment recovery
+ *
+ * When enabled, fragmented packets are kept for a short time after sending
+ * so their fragments can be resent, and when a fragmented packet is only
+ * partly received the missing fragments are NACKed to the sender instead of
+ * waiting for the whole packet to expire. Both ends must enable this for it
+ * to have any effect; peers that don't simply ignore NACKs. Off by default.
+ *
+ * @param node Node instance
+ * @param enabled Nonzero to enable, zero to disable
+ */
+void ZT_Node_setFragmentRecovery(ZT_Node *node,int enabled);
+
+/**
+ * Enable or disable forward error correction
+ *
+ * When enabled, this node announces to active peers that it can decode XOR
+ * parity and keeps recently received packets to rebuild lost ones. Parity
+ * is sent to a peer only if it has announced the same and the measured
+ * packet loss on our best path to it exceeds the threshold, so this costs
+ * nothing on clean paths. One parity packet is sent per group of
+ * ZT_FEC_GROUP_SIZE packets and can rebuild one lost packet of the group.
+ * Off by default.
+ *
+ * @param node Node instance
+ * @param enabled Nonzero to enable, zero to disable
+ * @param lossThreshold Path packet loss in per mille above which parity is sent, or 0 for default
+ */
+void ZT_Node_setFecMode(ZT_Node *node,int enabled,unsigned int lossThreshold);
+
 /**
  * Get ZeroTier One version
  *
+ * Version 1.3.0 changed the size and layout of ZT_NodeStatus, ZT_Peer and
+ * ZT_PeerPhysicalPath. Code that links this dynamically and was built
+ * against an older header must not call ZT_Node_status() or ZT_Node_peers()
+ * unless this reports 1.3.0 or later, and vice versa.
+ *
  * @param major Result: major version
  * @param minor Result: minor version
  * @param revision Result: revision
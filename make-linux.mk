@@ -140,13 +140,17 @@ selftest:	$(OBJS) selftest.o
 	$(CXX) $(CXXFLAGS) $(LDFLAGS) -o zerotier-selftest selftest.o $(OBJS) $(LDLIBS)
 	$(STRIP) zerotier-selftest
 
+# Cluster GeoIP database converter and benchmark (see service/ClusterGeoIpService.cpp)
+zerotier-geoip:	$(filter-out service/ClusterGeoIpService.o,$(OBJS))
+	$(CXX) $(CXXFLAGS) -DZT_ENABLE_CLUSTER -DZT_CLUSTERGEOIPSERVICE_TOOL $(LDFLAGS) -o zerotier-geoip service/ClusterGeoIpService.cpp $(filter-out service/ClusterGeoIpService.o,$(OBJS)) $(LDLIBS)
+
 manpages:	FORCE
 	cd doc ; ./build.sh
 
 doc:	manpages
 
 clean: FORCE
-	rm -rf *.so *.o node/*.o controller/*.o osdep/*.o service/*.o ext/http-parser/*.o ext/miniupnpc/*.o ext/libnatpmp/*.o $(OBJS) zerotier-one zerotier-idtool zerotier-cli zerotier-selftest build-* ZeroTierOneInstaller-* *.deb *.rpm .depend debian/files debian/zerotier-one*.debhelper debian/zerotier-one.substvars debian/*.log debian/zerotier-one doc/node_modules
+	rm -rf *.so *.o node/*.o controller/*.o osdep/*.o service/*.o ext/http-parser/*.o ext/miniupnpc/*.o ext/libnatpmp/*.o $(OBJS) zerotier-one zerotier-idtool zerotier-cli zerotier-selftest zerotier-geoip build-* ZeroTierOneInstaller-* *.deb *.rpm .depend debian/files debian/zerotier-one*.debhelper debian/zerotier-one.substvars debian/*.log debian/zerotier-one doc/node_modules
 
 distclean:	clean
 
@@ -92,6 +92,18 @@ public:
 		_l = l;
 	}
 
+	/**
+	 * Copy only the used part of another buffer
+	 *
+	 * The implicit copy constructor would copy all C bytes of capacity, which
+	 * for a Packet is several kilobytes no matter how short the packet is.
+	 */
+	Buffer(const Buffer &b) :
+		_l(b._l)
+	{
+		memcpy(_b,b._b,_l);
+	}
+
 	template<unsigned int C2>
 	Buffer(const Buffer<C2> &b)
 		throw(std::out_of_range)
@@ -111,6 +123,13 @@ public:
 		copyFrom(s.data(),s.length());
 	}
 
+	inline Buffer &operator=(const Buffer &b)
+	{
+		if (&b != this)
+			memcpy(_b,b._b,_l = b._l);
+		return *this;
+	}
+
 	template<unsigned int C2>
 	inline Buffer &operator=(const Buffer<C2> &b)
 		throw(std::out_of_range)
@@ -149,17 +149,23 @@
 #define ZT_UDP_DEFAULT_PAYLOAD_MTU 1444
 
 /**
- * Default MTU used for Ethernet tap device
+ * Maximum number of packet fragments we'll support
+ *
+ * The actual spec allows 16, but this is the most we'll support right
+ * now. Packets with more than this many fragments are dropped. Eight is
+ * enough for a ZT_MAX_MTU frame plus headers at the default UDP MTU.
  */
-#define ZT_IF_MTU ZT_MAX_MTU
+#define ZT_MAX_PACKET_FRAGMENTS 8
 
 /**
- * Maximum number of packet fragments we'll support
+ * Maximum number of packet fragments supported by nodes older than protocol version 10
  *
- * The actual spec allows 16, but this is the most we'll support right
- * now. Packets with more than this many fragments are dropped.
+ * Anything we size ourselves (pushed credentials, gather results, software
+ * update chunks, etc.) stays within this many fragments so that older
+ * peers can still receive it. Only frames bigger than ZT_DEFAULT_MTU, which
+ * only go to newer peers, use more.
  */
-#define ZT_MAX_PACKET_FRAGMENTS 4
+#define ZT_MAX_PACKET_FRAGMENTS_COMPAT 4
 
 /**
  * Size of RX queue
@@ -169,11 +175,104 @@
  */
 #define ZT_RX_QUEUE_SIZE 64
 
+/**
+ * Maximum number of independently locked shards the RX queue can be split into
+ *
+ * The RX queue is only sharded when packets are received on several threads,
+ * with one shard per thread. Each shard holds ZT_RX_QUEUE_SIZE entries and
+ * serves the senders whose physical addresses hash to it, so packets from
+ * different senders can be reassembled and decoded concurrently. This is
+ * also the upper bound on receive worker threads in the service.
+ */
+#define ZT_RX_QUEUE_SHARDS 8
+
 /**
  * RX queue entries older than this do not "exist"
  */
 #define ZT_RX_QUEUE_EXPIRE 4000
 
+/**
+ * Delay after a fragmented packet starts arriving before missing fragments are NACKed
+ */
+#define ZT_FRAGMENT_NACK_DELAY 50
+
+/**
+ * Minimum delay between repeated NACKs for the same packet
+ */
+#define ZT_FRAGMENT_NACK_INTERVAL 150
+
+/**
+ * Maximum NACKs sent for one packet before it is left to expire
+ */
+#define ZT_FRAGMENT_NACK_MAX 3
+
+/**
+ * Number of recently sent fragmented packets kept for retransmission
+ */
+#define ZT_FRAGMENT_RETRANSMIT_BUFFER_SIZE 32
+
+/**
+ * Sent fragmented packets are not retransmitted after this long
+ */
+#define ZT_FRAGMENT_RETRANSMIT_WINDOW 1000
+
+/**
+ * Maximum times a fragmented packet's fragments will be retransmitted
+ */
+#define ZT_FRAGMENT_RETRANSMIT_MAX ZT_FRAGMENT_NACK_MAX
+
+/**
+ * Packets per forward error correction parity group
+ *
+ * XOR parity can rebuild one lost packet per group, at a bandwidth cost of
+ * one parity packet per group.
+ */
+#define ZT_FEC_GROUP_SIZE 8
+
+/**
+ * Largest packet covered by forward error correction
+ *
+ * This leaves room for the parity packet's own headers within the maximum
+ * packet length.
+ */
+#define ZT_FEC_MAX_PACKET_SIZE ((ZT_MAX_PACKET_FRAGMENTS_COMPAT * ZT_UDP_DEFAULT_PAYLOAD_MTU) - 128)
+
+/**
+ * Number of recently received packets kept per decoder shard for rebuilding from parity
+ */
+#define ZT_FEC_HISTORY_SIZE 256
+
+/**
+ * Number of receive side FEC shards (by source address, each with its own lock)
+ *
+ * A shard's packet ring is allocated the first time a source in it sends
+ * parity, so links that never use FEC cost nothing.
+ */
+#define ZT_FEC_DECODER_SHARDS 8
+
+/**
+ * Number of parity sending sources tracked per decoder shard
+ */
+#define ZT_FEC_DECODER_SOURCES 8
+
+/**
+ * Stop keeping a source's packets after this long without parity from it
+ */
+#define ZT_FEC_DECODER_SOURCE_TIMEOUT 10000
+
+/**
+ * Default path loss (per mille) above which parity is sent to a peer
+ */
+#define ZT_FEC_DEFAULT_LOSS_THRESHOLD 10
+
+/**
+ * How often to tell active peers that we can decode parity
+ *
+ * A peer is considered able to decode parity for twice this long after its
+ * last announcement.
+ */
+#define ZT_FEC_ANNOUNCE_INTERVAL 300000
+
 /**
  * Length of secret key in bytes -- 256-bit -- do not change
  */
@@ -219,6 +318,98 @@
  */
 #define ZT_HELLO_MAX_ALLOWABLE_LATENCY 60000
 
+/**
+ * Largest UDP payload path MTU discovery will probe for
+ *
+ * This is the largest whole packet older peers can receive (see
+ * ZT_PROTO_MAX_COMPAT_PACKET_LENGTH in Packet.hpp), and it also bounds the
+ * size of a single fragment and so of fragment reassembly buffers.
+ */
+#define ZT_PATH_MTU_MAX (ZT_MAX_PACKET_FRAGMENTS_COMPAT * ZT_UDP_DEFAULT_PAYLOAD_MTU)
+
+/**
+ * Bytes an OK(ECHO) reply adds to the probe it echoes (in-re verb and packet ID)
+ */
+#define ZT_PATH_MTU_PROBE_REPLY_OVERHEAD 9
+
+/**
+ * Largest path MTU probe whose reply still fits in any peer's packet buffer
+ *
+ * Replies echo the whole probe back, so a probe of ZT_PATH_MTU_MAX would get
+ * a reply too big for ZT_PROTO_MAX_COMPAT_PACKET_LENGTH and never be answered.
+ */
+#define ZT_PATH_MTU_PROBE_MAX (ZT_PATH_MTU_MAX - ZT_PATH_MTU_PROBE_REPLY_OVERHEAD)
+
+/**
+ * How often to re-run path MTU discovery on a live direct path
+ */
+#define ZT_PATH_MTU_DISCOVERY_INTERVAL 600000
+
+/**
+ * Time after which an unanswered path MTU probe is taken to mean "too big"
+ *
+ * This must exceed ZT_PEER_GENERAL_RATE_LIMIT, since peers rate limit ECHO.
+ */
+#define ZT_PATH_MTU_PROBE_TIMEOUT 4000
+
+/**
+ * Path MTU discovery stops when the unknown range is this small
+ */
+#define ZT_PATH_MTU_PROBE_GRANULARITY 32
+
+/**
+ * Marker at the start of the payload of ECHO packets used as path MTU probes
+ */
+#define ZT_PATH_MTU_PROBE_MAGIC 0x4d545550
+
+/**
+ * Default maximum packets queued per peer when transmit pacing is enabled
+ */
+#define ZT_SEND_QUEUE_DEFAULT_DEPTH 256
+
+/**
+ * Bytes of credit each backlogged peer gets per round of the paced send scheduler
+ */
+#define ZT_SEND_QUEUE_QUANTUM ZT_UDP_DEFAULT_PAYLOAD_MTU
+
+/**
+ * Largest burst allowed by transmit pacing, in milliseconds at the pacing rate
+ */
+#define ZT_SEND_QUEUE_BURST 10
+
+/**
+ * Packets the paced send scheduler takes off its queues per lock hold
+ */
+#define ZT_SEND_QUEUE_DRAIN_BATCH 32
+
+/**
+ * Number of slots in Topology's lock-free Path lookup cache (must be a power of two)
+ */
+#define ZT_PATH_CACHE_SIZE 1024
+
+/**
+ * Minimum time between latency/loss probes on a live direct path
+ *
+ * Peers rate limit ECHO per peer, so at most one probe (MTU or latency)
+ * goes to each peer per ping check and paths take turns.
+ */
+#define ZT_PATH_QOS_PROBE_INTERVAL ZT_PING_CHECK_INVERVAL
+
+/**
+ * Time after which an unanswered latency/loss probe counts as lost
+ */
+#define ZT_PATH_QOS_PROBE_TIMEOUT 4000
+
+/**
+ * Marker at the start of the payload of ECHO packets used as latency/loss probes
+ */
+#define ZT_PATH_QOS_PROBE_MAGIC 0x514f5350
+
+/**
+ * Number of recent round trip samples kept per path for percentiles
+ */
+#define ZT_PATH_QOS_WINDOW 32
+
 /**
  * Maximum number of ZT hops allowed (this is not IP hops/TTL)
  *
@@ -226,6 +417,14 @@
  */
 #define ZT_RELAY_MAX_HOPS 3
 
+/**
+ * How long a cached relay forwarding table entry may be used without refresh
+ *
+ * Entries are also invalidated immediately when a peer learns a new path,
+ * so this mostly bounds how long we keep using a path that silently died.
+ */
+#define ZT_RELAY_ROUTE_EXPIRATION 2000
+
 /**
  * Maximum number of upstreams to use (far more than we should ever need)
  */
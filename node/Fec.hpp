@@ -0,0 +1,304 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZT_FEC_HPP
+#define ZT_FEC_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Constants.hpp"
+#include "Address.hpp"
+#include "AtomicCounter.hpp"
+#include "Buffer.hpp"
+#include "Mutex.hpp"
+#include "NonCopyable.hpp"
+
+namespace ZeroTier {
+
+/**
+ * Sender side of XOR parity forward error correction
+ *
+ * Packets sent to a peer are XORed together (each zero padded to the
+ * longest) in groups of ZT_FEC_GROUP_SIZE. After each group a parity packet
+ * is sent listing the group's packet IDs, the XOR of their lengths, and the
+ * XOR of their contents. A receiver that got all but one of the group can
+ * rebuild the missing one exactly as it was sent, armor and all, so it is
+ * then authenticated and decrypted like any other packet.
+ *
+ * Parity payload format (VERB_FEC_PARITY):
+ *   <[1] number of packets in group (0 for a capability announcement)>
+ *   <[8] packet ID> * count
+ *   <[2] XOR of packet lengths>
+ *   <[...] XOR of packet contents, as long as the longest packet>
+ */
+class FecEncoder : NonCopyable
+{
+public:
+	FecEncoder() : _count(0),_maxLen(0),_lenXor(0) {}
+
+	/**
+	 * Add a packet that was just sent
+	 *
+	 * @param packetId Packet ID as sent on the wire
+	 * @param data Packet data as sent
+	 * @param len Packet length
+	 * @return True if the group is now complete and appendParity() should be called
+	 */
+	inline bool add(const uint64_t packetId,const void *data,const unsigned int len)
+	{
+		if (len > ZT_FEC_MAX_PACKET_SIZE)
+			return false; // too big to cover, and too big to be unfragmented anyway
+		Mutex::Lock _l(_lock);
+		_ids[_count++] = packetId;
+		const uint8_t *const d = reinterpret_cast<const uint8_t *>(data);
+		if (len > _maxLen) {
+			memset(_parity + _maxLen,0,len - _maxLen);
+			_maxLen = len;
+		}
+		for(unsigned int i=0;i<len;++i)
+			_parity[i] ^= d[i];
+		_lenXor ^= (uint16_t)len;
+		return (_count >= ZT_FEC_GROUP_SIZE);
+	}
+
+	/**
+	 * Append the current group's parity payload and start a new group
+	 *
+	 * @param b Buffer to append to (e.g. a VERB_FEC_PARITY packet)
+	 * @tparam C Buffer capacity
+	 */
+	template<unsigned int C>
+	inline void appendParity(Buffer<C> &b)
+	{
+		Mutex::Lock _l(_lock);
+		b.append((uint8_t)_count);
+		for(unsigned int i=0;i<_count;++i)
+			b.append(_ids[i]);
+		b.append(_lenXor);
+		b.append(_parity,_maxLen);
+		_count = 0;
+		_maxLen = 0;
+		_lenXor = 0;
+	}
+
+private:
+	uint64_t _ids[ZT_FEC_GROUP_SIZE];
+	uint8_t _parity[ZT_FEC_MAX_PACKET_SIZE];
+	unsigned int _count;
+	unsigned int _maxLen;
+	uint16_t _lenXor;
+	Mutex _lock;
+};
+
+/**
+ * Receiver side of XOR parity forward error correction
+ *
+ * Keeps copies of recently received packets so that parity packets can
+ * rebuild one missing packet per group. Only packets from sources that have
+ * recently sent parity are kept, in a fixed ring of packet buffers per shard
+ * (sharded by source address, each shard with its own lock). Rebuilt packets
+ * stay in the ring flagged as recovered, so if the original turns up late it
+ * can be recognized as a duplicate and dropped.
+ */
+class FecDecoder : NonCopyable
+{
+public:
+	FecDecoder() {}
+
+	~FecDecoder()
+	{
+		for(unsigned int s=0;s<ZT_FEC_DECODER_SHARDS;++s)
+			delete [] _shards[s].history;
+	}
+
+	/**
+	 * Remember a received packet
+	 *
+	 * This is a cheap no-op unless the source has recently sent parity.
+	 *
+	 * @param source Source address from packet header
+	 * @param packetId Packet ID from the wire
+	 * @param data Packet data as received
+	 * @param len Packet length
+	 * @param now Current time
+	 * @return False if this packet was already recovered from parity and is a duplicate
+	 */
+	inline bool received(const Address &source,const uint64_t packetId,const void *data,const unsigned int len,const uint64_t now)
+	{
+		if (len > ZT_FEC_MAX_PACKET_SIZE)
+			return true;
+		_Shard &sh = _shards[source.toInt() % ZT_FEC_DECODER_SHARDS];
+		Mutex::Lock _l(sh.lock);
+		if (!_sendsParity(sh,source,now))
+			return true;
+		_Entry &e = sh.history[packetId % ZT_FEC_HISTORY_SIZE];
+		if ((e.packetId == packetId)&&(e.recovered))
+			return false;
+		e.packetId = packetId;
+		e.recovered = false;
+		e.len = (uint16_t)len;
+		memcpy(e.data,data,len);
+		return true;
+	}
+
+	/**
+	 * Try to rebuild a missing packet from a parity payload
+	 *
+	 * This also marks the source as sending parity, so its packets are kept
+	 * from now on.
+	 *
+	 * @param source Address of peer that sent the parity
+	 * @param parity Parity payload (format in FecEncoder)
+	 * @param parityLen Length of parity payload
+	 * @param out Buffer to receive rebuilt packet (at least ZT_FEC_MAX_PACKET_SIZE bytes)
+	 * @param now Current time
+	 * @return Length of rebuilt packet or 0 if nothing is missing, more than one is missing, or parity is invalid
+	 */
+	inline unsigned int recover(const Address &source,const void *parity,const unsigned int parityLen,void *out,const uint64_t now)
+	{
+		_Shard &sh = _shards[source.toInt() % ZT_FEC_DECODER_SHARDS];
+		Mutex::Lock _l(sh.lock);
+
+		_parityReceived(sh,source,now);
+
+		const uint8_t *const p = reinterpret_cast<const uint8_t *>(parity);
+		if (parityLen < 1)
+			return 0;
+		const unsigned int count = p[0];
+		if ((count == 0)||(count > ZT_FEC_GROUP_SIZE)||(parityLen < (1 + (count * 8) + 2)))
+			return 0;
+		const uint8_t *const xorData = p + 1 + (count * 8) + 2;
+		const unsigned int xorLen = parityLen - (1 + (count * 8) + 2);
+		if (xorLen > ZT_FEC_MAX_PACKET_SIZE)
+			return 0;
+		unsigned int len = ((unsigned int)p[1 + (count * 8)] << 8) | (unsigned int)p[2 + (count * 8)];
+
+		_Entry *missing = (_Entry *)0;
+		uint64_t missingId = 0;
+		for(unsigned int i=0;i<count;++i) {
+			const uint64_t id = _id(p,i);
+			_Entry &e = sh.history[id % ZT_FEC_HISTORY_SIZE];
+			if (e.packetId != id) {
+				if (missing)
+					return 0; // XOR parity can only fill in one
+				missing = &e;
+				missingId = id;
+			}
+		}
+		if (!missing)
+			return 0;
+
+		uint8_t *const o = reinterpret_cast<uint8_t *>(out);
+		memcpy(o,xorData,xorLen);
+		for(unsigned int i=0;i<count;++i) {
+			const uint64_t id = _id(p,i);
+			if (id == missingId)
+				continue;
+			const _Entry &e = sh.history[id % ZT_FEC_HISTORY_SIZE];
+			const unsigned int el = e.len;
+			if (el > xorLen)
+				return 0;
+			for(unsigned int k=0;k<el;++k)
+				o[k] ^= e.data[k];
+			len ^= el;
+		}
+		if ((len == 0)||(len > xorLen))
+			return 0;
+
+		missing->packetId = missingId;
+		missing->recovered = true;
+		missing->len = (uint16_t)len;
+		memcpy(missing->data,o,len);
+		++_recovered;
+		return len;
+	}
+
+	/**
+	 * @return Number of packets rebuilt from parity
+	 */
+	inline uint64_t recovered() const { return (uint64_t)_recovered.load(); }
+
+private:
+	struct _Entry
+	{
+		_Entry() : packetId(0),len(0),recovered(false) {}
+		uint64_t packetId;
+		uint16_t len;
+		bool recovered;
+		uint8_t data[ZT_FEC_MAX_PACKET_SIZE];
+	};
+
+	struct _Source
+	{
+		_Source() : lastParity(0) {}
+		Address address;
+		uint64_t lastParity;
+	};
+
+	struct _Shard
+	{
+		_Shard() : history((_Entry *)0) {}
+		_Entry *history; // allocated on first parity received by this shard, kept after
+		_Source sources[ZT_FEC_DECODER_SOURCES];
+		Mutex lock;
+	};
+
+	static inline uint64_t _id(const uint8_t *p,const unsigned int i)
+	{
+		uint64_t id = 0;
+		for(unsigned int k=0;k<8;++k)
+			id = (id << 8) | (uint64_t)p[1 + (i * 8) + k];
+		return id;
+	}
+
+	// These must be called with the shard's lock held
+	inline bool _sendsParity(const _Shard &sh,const Address &source,const uint64_t now) const
+	{
+		if (!sh.history)
+			return false;
+		for(unsigned int i=0;i<ZT_FEC_DECODER_SOURCES;++i) {
+			if (sh.sources[i].address == source)
+				return ((now - sh.sources[i].lastParity) < ZT_FEC_DECODER_SOURCE_TIMEOUT);
+		}
+		return false;
+	}
+	inline void _parityReceived(_Shard &sh,const Address &source,const uint64_t now)
+	{
+		if (!sh.history)
+			sh.history = new _Entry[ZT_FEC_HISTORY_SIZE];
+		_Source *oldest = &(sh.sources[0]);
+		for(unsigned int i=0;i<ZT_FEC_DECODER_SOURCES;++i) {
+			if (sh.sources[i].address == source) {
+				sh.sources[i].lastParity = now;
+				return;
+			}
+			if (sh.sources[i].lastParity < oldest->lastParity)
+				oldest = &(sh.sources[i]);
+		}
+		oldest->address = source;
+		oldest->lastParity = now;
+	}
+
+	_Shard _shards[ZT_FEC_DECODER_SHARDS];
+	mutable AtomicCounter _recovered; // shards are locked separately
+};
+
+} // namespace ZeroTier
+
+#endif
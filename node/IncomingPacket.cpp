@@ -110,6 +110,8 @@ bool IncomingPacket::tryDecode(const RuntimeEnvironment *RR)
 				case Packet::VERB_CIRCUIT_TEST:               return _doCIRCUIT_TEST(RR,peer);
 				case Packet::VERB_CIRCUIT_TEST_REPORT:        return _doCIRCUIT_TEST_REPORT(RR,peer);
 				case Packet::VERB_USER_MESSAGE:               return _doUSER_MESSAGE(RR,peer);
+				case Packet::VERB_FRAGMENT_NACK:              return _doFRAGMENT_NACK(RR,peer);
+				case Packet::VERB_FEC_PARITY:                 return _doFEC_PARITY(RR,peer);
 			}
 		} else {
 			RR->sw->requestWhois(sourceAddress);
@@ -485,8 +487,10 @@ bool IncomingPacket::_doOK(const RuntimeEnvironment *RR,const SharedPtr<Peer> &p
 				TRACE("%s(%s): OK(HELLO), version %u.%u.%u, latency %u",tmp1.c_str(),tmp2.c_str(),vMajor,vMinor,vRevision,latency);
 #endif
 
-				if (!hops())
+				if (!hops()) {
 					peer->addDirectLatencyMeasurment((unsigned int)latency);
+					_path->rttMeasured((unsigned int)latency);
+				}
 				peer->setRemoteVersion(vProto,vMajor,vMinor,vRevision);
 
 				if ((externalSurfaceAddress)&&(hops() == 0))
@@ -545,6 +549,17 @@ bool IncomingPacket::_doOK(const RuntimeEnvironment *RR,const SharedPtr<Peer> &p
 				}
 			}	break;
 
+			case Packet::VERB_ECHO:
+				// Replies to path MTU and latency/loss probes echo back the probe's payload
+				if ((hops() == 0)&&(size() >= (ZT_PROTO_VERB_OK_IDX_PAYLOAD + 6))) {
+					const uint32_t magic = at<uint32_t>(ZT_PROTO_VERB_OK_IDX_PAYLOAD);
+					if (magic == ZT_PATH_MTU_PROBE_MAGIC)
+						_path->mtuProbeReplied(at<uint16_t>(ZT_PROTO_VERB_OK_IDX_PAYLOAD + 4));
+					else if ((magic == ZT_PATH_QOS_PROBE_MAGIC)&&(size() >= (ZT_PROTO_VERB_OK_IDX_PAYLOAD + 12)))
+						_path->qosProbeReplied(at<uint64_t>(ZT_PROTO_VERB_OK_IDX_PAYLOAD + 4),RR->node->now());
+				}
+				break;
+
 			default: break;
 		}
 
@@ -1117,7 +1132,7 @@ bool IncomingPacket::_doMULTICAST_FRAME(const RuntimeEnvironment *RR,const Share
 
 			//TRACE("<<MC FRAME %.16llx/%s from %s@%s flags %.2x length %u",nwid,to.toString().c_str(),from.toString().c_str(),peer->address().toString().c_str(),flags,frameLen);
 
-			if ((frameLen > 0)&&(frameLen <= ZT_IF_MTU)) {
+			if ((frameLen > 0)&&(frameLen <= ZT_MAX_MTU)) {
 				if (!to.mac().isMulticast()) {
 					TRACE("dropped MULTICAST_FRAME from %s@%s(%s) to %s: destination is unicast, must use FRAME or EXT_FRAME",from.toString().c_str(),peer->address().toString().c_str(),_path->address().toString().c_str(),to.toString().c_str());
 					peer->received(_path,hops(),packetId(),Packet::VERB_MULTICAST_FRAME,0,Packet::VERB_NOP,true); // trustEstablished because COM is okay
@@ -1456,6 +1471,38 @@ bool IncomingPacket::_doUSER_MESSAGE(const RuntimeEnvironment *RR,const SharedPt
 	return true;
 }
 
+bool IncomingPacket::_doFRAGMENT_NACK(const RuntimeEnvironment *RR,const SharedPtr<Peer> &peer)
+{
+	try {
+		unsigned int ptr = ZT_PACKET_IDX_PAYLOAD;
+		while ((ptr + 12) <= size()) {
+			const uint64_t nackedPacketId = at<uint64_t>(ptr);
+			const uint32_t missing = at<uint32_t>(ptr + 8);
+			ptr += 12;
+			RR->sw->retransmitFragments(peer->address(),_path,nackedPacketId,missing);
+		}
+		peer->received(_path,hops(),packetId(),Packet::VERB_FRAGMENT_NACK,0,Packet::VERB_NOP,false);
+	} catch ( ... ) {
+		TRACE("dropped FRAGMENT_NACK from %s(%s): unexpected exception",source().toString().c_str(),_path->address().toString().c_str());
+	}
+	return true;
+}
+
+bool IncomingPacket::_doFEC_PARITY(const RuntimeEnvironment *RR,const SharedPtr<Peer> &peer)
+{
+	try {
+		if ((*this)[ZT_PACKET_IDX_PAYLOAD] == 0) {
+			peer->fecAnnounceReceived(RR->node->now());
+		} else if (RR->node->fecEnabled()) {
+			RR->sw->fecRecover(_path,peer->address(),field(ZT_PACKET_IDX_PAYLOAD,size() - ZT_PACKET_IDX_PAYLOAD),size() - ZT_PACKET_IDX_PAYLOAD);
+		}
+		peer->received(_path,hops(),packetId(),Packet::VERB_FEC_PARITY,0,Packet::VERB_NOP,false);
+	} catch ( ... ) {
+		TRACE("dropped FEC_PARITY from %s(%s): unexpected exception",source().toString().c_str(),_path->address().toString().c_str());
+	}
+	return true;
+}
+
 void IncomingPacket::_sendErrorNeedCredentials(const RuntimeEnvironment *RR,const SharedPtr<Peer> &peer,const uint64_t nwid)
 {
 	const uint64_t now = RR->node->now();
@@ -155,6 +155,8 @@ namespace ZeroTier {
 #define ZT_NETWORKCONFIG_DICT_KEY_FLAGS "f"
 // integer(hex)
 #define ZT_NETWORKCONFIG_DICT_KEY_MULTICAST_LIMIT "ml"
+// integer(hex), missing means ZT_DEFAULT_MTU
+#define ZT_NETWORKCONFIG_DICT_KEY_MTU "mtu"
 // network type (hex)
 #define ZT_NETWORKCONFIG_DICT_KEY_TYPE "t"
 // text
@@ -407,6 +409,7 @@ public:
 		printf("revision==%llu\n",revision);
 		printf("issuedTo==%.10llx\n",issuedTo.toInt());
 		printf("multicastLimit==%u\n",multicastLimit);
+		printf("mtu==%u\n",mtu);
 		printf("flags=%.8lx\n",(unsigned long)flags);
 		printf("specialistCount==%u\n",specialistCount);
 		for(unsigned int i=0;i<specialistCount;++i)
@@ -462,6 +465,11 @@ public:
 	 */
 	unsigned int multicastLimit;
 
+	/**
+	 * Virtual network MTU (ZT_MIN_MTU to ZT_MAX_MTU)
+	 */
+	unsigned int mtu;
+
 	/**
 	 * Number of specialists
 	 */
@@ -21,10 +21,16 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include "../version.h"
 
 #include "Constants.hpp"
+
+#ifndef __WINDOWS__
+#include <sched.h>
+#endif
+
 #include "Node.hpp"
 #include "RuntimeEnvironment.hpp"
 #include "NetworkController.hpp"
@@ -33,6 +39,7 @@
 #include "Topology.hpp"
 #include "Buffer.hpp"
 #include "Packet.hpp"
+#include "PooledPacket.hpp"
 #include "Address.hpp"
 #include "Identity.hpp"
 #include "SelfAwareness.hpp"
@@ -55,11 +62,18 @@ Node::Node(void *uptr,const struct ZT_Node_Callbacks *callbacks,uint64_t now) :
 	_lastPingCheck(0),
 	_lastHousekeepingRun(0)
 {
-	if (callbacks->version != 0)
-		throw std::runtime_error("callbacks struct version mismatch");
-	memcpy(&_cb,callbacks,sizeof(ZT_Node_Callbacks));
+	// Version 0 callers pass the struct as it was before version 1's fields were added
+	memset(&_cb,0,sizeof(ZT_Node_Callbacks));
+	if (callbacks->version == 0)
+		memcpy(&_cb,callbacks,offsetof(ZT_Node_Callbacks,wirePacketSendDontFragmentFunction));
+	else if (callbacks->version == ZT_NODE_CALLBACKS_VERSION)
+		memcpy(&_cb,callbacks,sizeof(ZT_Node_Callbacks));
+	else throw std::runtime_error("callbacks struct version mismatch");
 
 	_online = false;
+	_multipath = false;
+	_fec = false;
+	_fecLossThreshold = ZT_FEC_DEFAULT_LOSS_THRESHOLD;
 
 	memset(_expectingRepliesToBucketPtr,0,sizeof(_expectingRepliesToBucketPtr));
 	memset(_expectingRepliesTo,0,sizeof(_expectingRepliesTo));
@@ -101,14 +115,26 @@ Node::Node(void *uptr,const struct ZT_Node_Callbacks *callbacks,uint64_t now) :
 		throw;
 	}
 
+	try {
+		RR->topology->loadState(now); // warm restart: known peers, keys, and paths
+	} catch ( ... ) {}
+
+	_networkMap = new _NetworkMap(std::vector< std::pair< uint64_t,SharedPtr<Network> > >());
+	_networkMapEpoch = 0;
+
 	postEvent(ZT_EVENT_UP);
 }
 
 Node::~Node()
 {
+	try {
+		RR->topology->saveState(_now,true);
+	} catch ( ... ) {}
+
 	Mutex::Lock _l(_networks_m);
 
-	_networks.clear(); // ensure that networks are destroyed before shutdow
+	_setNetworks(std::vector< std::pair< uint64_t,SharedPtr<Network> > >()); // ensure that networks are destroyed before shutdown
+	delete _networkMap;
 
 	delete RR->sa;
 	delete RR->topology;
@@ -130,6 +156,7 @@ ZT_ResultCode Node::processWirePacket(
 {
 	_now = now;
 	RR->sw->onRemotePacket(*(reinterpret_cast<const InetAddress *>(localAddress)),*(reinterpret_cast<const InetAddress *>(remoteAddress)),packetData,packetLength);
+	_scheduleSwitchTasks(now,nextBackgroundTaskDeadline);
 	return ZT_RESULT_OK;
 }
 
@@ -148,6 +175,7 @@ ZT_ResultCode Node::processVirtualNetworkFrame(
 	SharedPtr<Network> nw(this->network(nwid));
 	if (nw) {
 		RR->sw->onLocalEthernet(nw,MAC(sourceMac),MAC(destMac),etherType,vlanId,frameData,frameLength);
+		_scheduleSwitchTasks(now,nextBackgroundTaskDeadline);
 		return ZT_RESULT_OK;
 	} else return ZT_RESULT_ERROR_NETWORK_NOT_FOUND;
 }
@@ -206,7 +234,9 @@ public:
 			lastReceiveFromUpstream = std::max(p->lastReceive(),lastReceiveFromUpstream);
 			_upstreamsToContact.erase(p->address()); // erase from upstreams to contact so that we can WHOIS those that remain
 		} else if (p->isActive(_now)) {
+			p->doPathProbes(_now); // before keepalives, since peers rate limit ECHO and a lost probe reads as "too big" or as loss
 			p->doPingAndKeepalive(_now,-1);
+			p->doFecCheck(_now);
 		}
 	}
 
@@ -228,18 +258,13 @@ ZT_ResultCode Node::processBackgroundTasks(uint64_t now,volatile uint64_t *nextB
 		try {
 			_lastPingCheck = now;
 
-			// Get networks that need config without leaving mutex locked
-			std::vector< SharedPtr<Network> > needConfig;
-			{
-				Mutex::Lock _l(_networks_m);
-				for(std::vector< std::pair< uint64_t,SharedPtr<Network> > >::const_iterator n(_networks.begin());n!=_networks.end();++n) {
-					if (((now - n->second->lastConfigUpdate()) >= ZT_NETWORK_AUTOCONF_DELAY)||(!n->second->hasConfig()))
-						needConfig.push_back(n->second);
-					n->second->sendUpdatesToMembers();
-				}
+			const std::vector< SharedPtr<Network> > nws(allNetworks());
+			for(std::vector< SharedPtr<Network> >::const_iterator n(nws.begin());n!=nws.end();++n) {
+				const bool needConfig = (((now - (*n)->lastConfigUpdate()) >= ZT_NETWORK_AUTOCONF_DELAY)||(!(*n)->hasConfig()));
+				(*n)->sendUpdatesToMembers();
+				if (needConfig)
+					(*n)->requestConfiguration();
 			}
-			for(std::vector< SharedPtr<Network> >::const_iterator n(needConfig.begin());n!=needConfig.end();++n)
-				(*n)->requestConfiguration();
 
 			// Do pings and keepalives
 			Hashtable< Address,std::vector<InetAddress> > upstreamsToContact;
@@ -286,7 +311,10 @@ ZT_ResultCode Node::processBackgroundTasks(uint64_t now,volatile uint64_t *nextB
 			*nextBackgroundTaskDeadline = now + ZT_CLUSTER_PERIODIC_TASK_PERIOD; // this is really short so just tick at this rate
 		} else {
 #endif
-			*nextBackgroundTaskDeadline = now + (uint64_t)std::max(std::min(timeUntilNextPingCheck,RR->sw->doTimerTasks(now)),(unsigned long)ZT_CORE_TIMER_TASK_GRANULARITY);
+			// Paced sends and fragment NACKs are exempt from the timer granularity floor since they are latency sensitive
+			const unsigned long timeUntilTxQueueDrain = RR->sw->drainTxQueue(now);
+			const unsigned long timeUntilFragmentNack = RR->sw->doFragmentRecovery(now);
+			*nextBackgroundTaskDeadline = now + (uint64_t)std::min(std::max(std::min(timeUntilNextPingCheck,RR->sw->doTimerTasks(now)),(unsigned long)ZT_CORE_TIMER_TASK_GRANULARITY),std::min(timeUntilTxQueueDrain,timeUntilFragmentNack));
 #ifdef ZT_ENABLE_CLUSTER
 		}
 #endif
@@ -300,10 +328,12 @@ ZT_ResultCode Node::processBackgroundTasks(uint64_t now,volatile uint64_t *nextB
 ZT_ResultCode Node::join(uint64_t nwid,void *uptr)
 {
 	Mutex::Lock _l(_networks_m);
-	SharedPtr<Network> nw = _network(nwid);
-	if(!nw)
-		_networks.push_back(std::pair< uint64_t,SharedPtr<Network> >(nwid,SharedPtr<Network>(new Network(RR,nwid,uptr))));
-	std::sort(_networks.begin(),_networks.end()); // will sort by nwid since it's the first in a pair<>
+	if (!_network(nwid)) {
+		std::vector< std::pair< uint64_t,SharedPtr<Network> > > newn(_networkMap->networks);
+		newn.push_back(std::pair< uint64_t,SharedPtr<Network> >(nwid,SharedPtr<Network>(new Network(RR,nwid,uptr))));
+		std::sort(newn.begin(),newn.end()); // will sort by nwid since it's the first in a pair<>
+		_setNetworks(newn);
+	}
 	return ZT_RESULT_OK;
 }
 
@@ -311,7 +341,7 @@ ZT_ResultCode Node::leave(uint64_t nwid,void **uptr)
 {
 	std::vector< std::pair< uint64_t,SharedPtr<Network> > > newn;
 	Mutex::Lock _l(_networks_m);
-	for(std::vector< std::pair< uint64_t,SharedPtr<Network> > >::const_iterator n(_networks.begin());n!=_networks.end();++n) {
+	for(std::vector< std::pair< uint64_t,SharedPtr<Network> > >::const_iterator n(_networkMap->networks.begin());n!=_networkMap->networks.end();++n) {
 		if (n->first != nwid)
 			newn.push_back(*n);
 		else {
@@ -320,10 +350,43 @@ ZT_ResultCode Node::leave(uint64_t nwid,void **uptr)
 			n->second->destroy();
 		}
 	}
-	_networks.swap(newn);
+	if (newn.size() != _networkMap->networks.size())
+		_setNetworks(newn);
 	return ZT_RESULT_OK;
 }
 
+void Node::_setNetworks(const std::vector< std::pair< uint64_t,SharedPtr<Network> > > &nw)
+{
+	_NetworkMap *const m = new _NetworkMap(nw);
+#ifdef __GNUC__
+	__sync_synchronize(); // map must be fully built before other threads can see it
+#endif
+	_NetworkMap *const old = _networkMap;
+	_networkMap = m;
+
+	// Wait out readers that may have loaded the old map (see _NetworkMapReader)
+	for(int phase=0;phase<2;++phase) {
+		const unsigned int e = _networkMapEpoch & 1;
+#ifdef __GNUC__
+		__sync_synchronize();
+#endif
+		_networkMapEpoch = e ^ 1;
+#ifdef __GNUC__
+		__sync_synchronize();
+#endif
+		while (_networkMapReaders[e].load() != 0) {
+			// A reader may have been preempted mid-lookup, so let it run
+#ifdef __WINDOWS__
+			SwitchToThread();
+#else
+			sched_yield();
+#endif
+		}
+	}
+
+	delete old;
+}
+
 ZT_ResultCode Node::multicastSubscribe(uint64_t nwid,uint64_t multicastGroup,unsigned long multicastAdi)
 {
 	SharedPtr<Network> nw(this->network(nwid));
@@ -365,6 +428,19 @@ void Node::status(ZT_NodeStatus *status) const
 	status->publicIdentity = RR->publicIdentityStr.c_str();
 	status->secretIdentity = RR->secretIdentityStr.c_str();
 	status->online = _online ? 1 : 0;
+	status->txQueueDepth = RR->sw->txQueueDepth();
+	status->txQueueDrops = RR->sw->txQueueDrops();
+	RR->sw->fragmentStats(status->fragmentsLost,status->fragmentsRecovered,status->fragmentsExpired,status->fragmentsRetransmitted);
+	status->fecParitySent = RR->sw->fecParitySent();
+	status->fecPacketsRecovered = RR->sw->fecPacketsRecovered();
+	const PooledPacket::Stats pps(PooledPacket::stats());
+	status->packetPoolAllocated = pps.allocated;
+	status->packetPoolReused = pps.reused;
+	status->packetPoolCopies = pps.copies;
+	status->packetPoolBytesCopied = pps.bytesCopied;
+	status->packetPoolFree = pps.free;
+	status->relayedPackets = RR->sw->relayedPackets();
+	status->relayedBytes = RR->sw->relayedBytes();
 }
 
 ZT_PeerList *Node::peers() const
@@ -393,6 +469,8 @@ ZT_PeerList *Node::peers() const
 		}
 		p->latency = pi->second->latency();
 		p->role = RR->topology->role(pi->second->identity().address());
+		RR->sw->txQueueStats(pi->second->address(),p->txQueueDepth,p->txQueueDrops);
+		p->fecActive = (pi->second->fecEncoder()) ? 1 : 0;
 
 		std::vector< std::pair< SharedPtr<Path>,bool > > paths(pi->second->paths(_now));
 		SharedPtr<Path> bestp(pi->second->getBestPath(_now,false));
@@ -405,6 +483,16 @@ ZT_PeerList *Node::peers() const
 			p->paths[p->pathCount].linkQuality = (int)path->first->linkQuality();
 			p->paths[p->pathCount].expired = path->second;
 			p->paths[p->pathCount].preferred = (path->first == bestp) ? 1 : 0;
+			p->paths[p->pathCount].mtu = path->first->mtu();
+			p->paths[p->pathCount].packetsSent = path->first->packetsOut();
+			p->paths[p->pathCount].bytesSent = path->first->bytesOut();
+			p->paths[p->pathCount].packetsReceived = path->first->packetsIn();
+			p->paths[p->pathCount].bytesReceived = path->first->bytesIn();
+			p->paths[p->pathCount].latency = path->first->latency();
+			p->paths[p->pathCount].jitter = path->first->jitter();
+			p->paths[p->pathCount].latencyMedian = path->first->latencyPercentile(50);
+			p->paths[p->pathCount].latency95 = path->first->latencyPercentile(95);
+			p->paths[p->pathCount].packetLoss = (float)path->first->packetLoss() / 1000.0f;
 			++p->pathCount;
 		}
 	}
@@ -414,7 +502,6 @@ ZT_PeerList *Node::peers() const
 
 ZT_VirtualNetworkConfig *Node::networkConfig(uint64_t nwid) const
 {
-	Mutex::Lock _l(_networks_m);
 	SharedPtr<Network> nw = _network(nwid);
 	if(nw) {
 		ZT_VirtualNetworkConfig *nc = (ZT_VirtualNetworkConfig *)::malloc(sizeof(ZT_VirtualNetworkConfig));
@@ -426,17 +513,17 @@ ZT_VirtualNetworkConfig *Node::networkConfig(uint64_t nwid) const
 
 ZT_VirtualNetworkList *Node::networks() const
 {
-	Mutex::Lock _l(_networks_m);
+	const std::vector< SharedPtr<Network> > nws(allNetworks());
 
-	char *buf = (char *)::malloc(sizeof(ZT_VirtualNetworkList) + (sizeof(ZT_VirtualNetworkConfig) * _networks.size()));
+	char *buf = (char *)::malloc(sizeof(ZT_VirtualNetworkList) + (sizeof(ZT_VirtualNetworkConfig) * nws.size()));
 	if (!buf)
 		return (ZT_VirtualNetworkList *)0;
 	ZT_VirtualNetworkList *nl = (ZT_VirtualNetworkList *)buf;
 	nl->networks = (ZT_VirtualNetworkConfig *)(buf + sizeof(ZT_VirtualNetworkList));
 
 	nl->networkCount = 0;
-	for(std::vector< std::pair< uint64_t,SharedPtr<Network> > >::const_iterator n(_networks.begin());n!=_networks.end();++n)
-		n->second->externalConfig(&(nl->networks[nl->networkCount++]));
+	for(std::vector< SharedPtr<Network> >::const_iterator n(nws.begin());n!=nws.end();++n)
+		(*n)->externalConfig(&(nl->networks[nl->networkCount++]));
 
 	return nl;
 }
@@ -619,14 +706,24 @@ void Node::clusterStatus(ZT_ClusterStatus *cs)
 std::string Node::dataStoreGet(const char *name)
 {
 	char buf[1024];
-	std::string r;
 	unsigned long olen = 0;
-	do {
-		long n = _cb.dataStoreGetFunction(reinterpret_cast<ZT_Node *>(this),_uPtr,name,buf,sizeof(buf),(unsigned long)r.length(),&olen);
-		if (n <= 0)
-			return std::string();
-		r.append(buf,n);
-	} while (r.length() < olen);
+	long n = _cb.dataStoreGetFunction(reinterpret_cast<ZT_Node *>(this),_uPtr,name,buf,sizeof(buf),0,&olen);
+	if (n <= 0)
+		return std::string();
+	std::string r(buf,(unsigned long)n);
+
+	// Read the rest of larger objects (e.g. peers.state) straight into the result
+	unsigned long got = (unsigned long)n;
+	if (olen > got) {
+		r.resize(olen);
+		while (got < r.length()) {
+			unsigned long tmp = 0;
+			n = _cb.dataStoreGetFunction(reinterpret_cast<ZT_Node *>(this),_uPtr,name,&(r[got]),(unsigned long)r.length() - got,got,&tmp);
+			if (n <= 0)
+				return std::string();
+			got += (unsigned long)n;
+		}
+	}
 	return r;
 }
 
@@ -639,8 +736,8 @@ bool Node::shouldUsePathForZeroTierTraffic(const Address &ztaddr,const InetAddre
 		return false;
 
 	{
-		Mutex::Lock _l(_networks_m);
-		for(std::vector< std::pair< uint64_t, SharedPtr<Network> > >::const_iterator i=_networks.begin();i!=_networks.end();++i) {
+		_NetworkMapReader r(this);
+		for(std::vector< std::pair< uint64_t, SharedPtr<Network> > >::const_iterator i=r.map->networks.begin();i!=r.map->networks.end();++i) {
 			if (i->second->hasConfig()) {
 				for(unsigned int k=0;k<i->second->config().staticIpCount;++k) {
 					if (i->second->config().staticIps[k].containsAddress(remoteAddress))
@@ -713,6 +810,49 @@ void Node::setTrustedPaths(const struct sockaddr_storage *networks,const uint64_
 	RR->topology->setTrustedPaths(reinterpret_cast<const InetAddress *>(networks),ids,count);
 }
 
+void Node::setTxPacing(uint64_t bytesPerSecond,unsigned int maxQueueDepth)
+{
+	RR->sw->setTxPacing(bytesPerSecond,maxQueueDepth);
+}
+
+void Node::setFragmentRecovery(int enabled)
+{
+	RR->sw->setFragmentRecovery(enabled != 0);
+}
+
+bool Node::saveState()
+{
+	try {
+		return RR->topology->saveState(_now);
+	} catch ( ... ) {
+		return false;
+	}
+}
+
+void Node::setRxQueueShards(unsigned int shards)
+{
+	RR->sw->setRxQueueShards(shards);
+}
+
+unsigned int Node::rxQueueShard(const struct sockaddr_storage *remoteAddress)
+{
+	return Switch::rxQueueShard(*(reinterpret_cast<const InetAddress *>(remoteAddress)));
+}
+
+void Node::_scheduleSwitchTasks(uint64_t now,volatile uint64_t *nextBackgroundTaskDeadline)
+{
+	// If paced sends are waiting, pull the background task deadline in to when they can go
+	if (RR->sw->txQueueDepth()) {
+		const uint64_t dl = now + RR->sw->drainTxQueue(now);
+		if (dl < *nextBackgroundTaskDeadline)
+			*nextBackgroundTaskDeadline = dl;
+	}
+	// Likewise if a partly received packet may need its missing fragments NACKed
+	const uint64_t nackAt = RR->sw->nextFragmentNack();
+	if (nackAt < *nextBackgroundTaskDeadline)
+		*nextBackgroundTaskDeadline = nackAt;
+}
+
 World Node::planet() const
 {
 	return RR->topology->planet();
@@ -1120,6 +1260,34 @@ void ZT_Node_setTrustedPaths(ZT_Node *node,const struct sockaddr_storage *networ
 	} catch ( ... ) {}
 }
 
+void ZT_Node_setMultipathMode(ZT_Node *node,int enabled)
+{
+	try {
+		reinterpret_cast<ZeroTier::Node *>(node)->setMultipathMode(enabled);
+	} catch ( ... ) {}
+}
+
+void ZT_Node_setTxPacing(ZT_Node *node,uint64_t bytesPerSecond,unsigned int maxQueueDepth)
+{
+	try {
+		reinterpret_cast<ZeroTier::Node *>(node)->setTxPacing(bytesPerSecond,maxQueueDepth);
+	} catch ( ... ) {}
+}
+
+void ZT_Node_setFragmentRecovery(ZT_Node *node,int enabled)
+{
+	try {
+		reinterpret_cast<ZeroTier::Node *>(node)->setFragmentRecovery(enabled);
+	} catch ( ... ) {}
+}
+
+void ZT_Node_setFecMode(ZT_Node *node,int enabled,unsigned int lossThreshold)
+{
+	try {
+		reinterpret_cast<ZeroTier::Node *>(node)->setFecMode(enabled,lossThreshold);
+	} catch ( ... ) {}
+}
+
 void ZT_version(int *major,int *minor,int *revision)
 {
 	if (major) *major = ZEROTIER_ONE_VERSION_MAJOR;
@@ -33,6 +33,8 @@
 #include "RuntimeEnvironment.hpp"
 #include "InetAddress.hpp"
 #include "Mutex.hpp"
+#include "NonCopyable.hpp"
+#include "AtomicCounter.hpp"
 #include "MAC.hpp"
 #include "Network.hpp"
 #include "Path.hpp"
@@ -132,8 +134,20 @@ public:
 
 	inline uint64_t now() const throw() { return _now; }
 
-	inline bool putPacket(const InetAddress &localAddress,const InetAddress &addr,const void *data,unsigned int len,unsigned int ttl = 0)
+	inline bool putPacket(const InetAddress &localAddress,const InetAddress &addr,const void *data,unsigned int len,unsigned int ttl = 0,bool dontFragment = false)
 	{
+		if (dontFragment) {
+			if (!_cb.wirePacketSendDontFragmentFunction)
+				return false;
+			return (_cb.wirePacketSendDontFragmentFunction(
+				reinterpret_cast<ZT_Node *>(this),
+				_uPtr,
+				reinterpret_cast<const struct sockaddr_storage *>(&localAddress),
+				reinterpret_cast<const struct sockaddr_storage *>(&addr),
+				data,
+				len,
+				ttl) == 0);
+		}
 		return (_cb.wirePacketSendFunction(
 			reinterpret_cast<ZT_Node *>(this),
 			_uPtr,
@@ -144,6 +158,11 @@ public:
 			ttl) == 0);
 	}
 
+	/**
+	 * @return True if packets can be sent with IP don't fragment set (needed for path MTU discovery)
+	 */
+	inline bool canSendDontFragment() const { return (_cb.wirePacketSendDontFragmentFunction != 0); }
+
 	inline void putFrame(uint64_t nwid,void **nuptr,const MAC &source,const MAC &dest,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
 	{
 		_cb.virtualNetworkFrameFunction(
@@ -159,28 +178,20 @@ public:
 			len);
 	}
 
-	inline SharedPtr<Network> network(uint64_t nwid) const
-	{
-		Mutex::Lock _l(_networks_m);
-		return _network(nwid);
-	}
+	inline SharedPtr<Network> network(uint64_t nwid) const { return _network(nwid); }
 
 	inline bool belongsToNetwork(uint64_t nwid) const
 	{
-		Mutex::Lock _l(_networks_m);
-		for(std::vector< std::pair< uint64_t, SharedPtr<Network> > >::const_iterator i=_networks.begin();i!=_networks.end();++i) {
-			if (i->first == nwid)
-				return true;
-		}
-		return false;
+		_NetworkMapReader r(this);
+		return (r.map->get(nwid) != (const SharedPtr<Network> *)0);
 	}
 
 	inline std::vector< SharedPtr<Network> > allNetworks() const
 	{
+		_NetworkMapReader r(this);
 		std::vector< SharedPtr<Network> > nw;
-		Mutex::Lock _l(_networks_m);
-		nw.reserve(_networks.size());
-		for(std::vector< std::pair< uint64_t, SharedPtr<Network> > >::const_iterator i=_networks.begin();i!=_networks.end();++i)
+		nw.reserve(r.map->networks.size());
+		for(std::vector< std::pair< uint64_t, SharedPtr<Network> > >::const_iterator i=r.map->networks.begin();i!=r.map->networks.end();++i)
 			nw.push_back(i->second);
 		return nw;
 	}
@@ -212,6 +223,30 @@ public:
 	uint64_t prng();
 	void postCircuitTestReport(const ZT_CircuitTestReport *report);
 	void setTrustedPaths(const struct sockaddr_storage *networks,const uint64_t *ids,unsigned int count);
+	inline void setMultipathMode(int enabled) { _multipath = (enabled != 0); }
+	inline bool multipathEnabled() const throw() { return _multipath; }
+	void setTxPacing(uint64_t bytesPerSecond,unsigned int maxQueueDepth);
+	void setFragmentRecovery(int enabled);
+	void setRxQueueShards(unsigned int shards); // only before any packets are processed; see Switch::setRxQueueShards()
+	static unsigned int rxQueueShard(const struct sockaddr_storage *remoteAddress); // steer senders to RX threads; see Switch::rxQueueShard()
+
+	/**
+	 * Save peers for a warm restart if they have changed since the last save
+	 *
+	 * This serializes and encrypts every peer, so call it now and then from a
+	 * thread other than the one running processBackgroundTasks(). State is
+	 * also saved when the node is deleted.
+	 *
+	 * @return True if state was written
+	 */
+	bool saveState();
+	inline void setFecMode(int enabled,unsigned int lossThreshold)
+	{
+		_fecLossThreshold = (lossThreshold) ? lossThreshold : ZT_FEC_DEFAULT_LOSS_THRESHOLD;
+		_fec = (enabled != 0);
+	}
+	inline bool fecEnabled() const throw() { return _fec; }
+	inline unsigned int fecLossThreshold() const throw() { return _fecLossThreshold; }
 
 	World planet() const;
 	std::vector<World> moons() const;
@@ -275,16 +310,92 @@ public:
 	virtual void ncSendError(uint64_t nwid,uint64_t requestPacketId,const Address &destination,NetworkController::ErrorCode errorCode);
 
 private:
-	inline SharedPtr<Network> _network(uint64_t nwid) const
+	void _scheduleSwitchTasks(uint64_t now,volatile uint64_t *nextBackgroundTaskDeadline);
+
+	/**
+	 * Immutable set of joined networks, replaced as a whole on join and leave
+	 *
+	 * Every frame in or out looks up its network, so readers just load the
+	 * current map pointer and probe its open addressed hash index without
+	 * locking (see _NetworkMapReader). A replaced map is deleted as soon as
+	 * no reader can still be using it, so a network that is left still gets
+	 * destroyed (and its port torn down) right away.
+	 */
+	class _NetworkMap : NonCopyable
 	{
-		// assumes _networks_m is locked
-		for(std::vector< std::pair< uint64_t, SharedPtr<Network> > >::const_iterator i=_networks.begin();i!=_networks.end();++i) {
-			if (i->first == nwid)
-				return i->second;
+	public:
+		_NetworkMap(const std::vector< std::pair< uint64_t, SharedPtr<Network> > > &nw) :
+			networks(nw)
+		{
+			unsigned long cap = 8;
+			while (cap < (networks.size() * 2))
+				cap <<= 1;
+			_mask = cap - 1;
+			_slots.resize(cap,0);
+			for(unsigned long i=0;i<networks.size();++i) {
+				unsigned long s = _hash(networks[i].first) & _mask;
+				while (_slots[s])
+					s = (s + 1) & _mask;
+				_slots[s] = (uint32_t)(i + 1);
+			}
 		}
-		return SharedPtr<Network>();
+
+		inline const SharedPtr<Network> *get(const uint64_t nwid) const
+		{
+			for(unsigned long s=(_hash(nwid) & _mask);;s=((s + 1) & _mask)) {
+				const uint32_t i = _slots[s];
+				if (!i)
+					return (const SharedPtr<Network> *)0;
+				if (networks[i - 1].first == nwid)
+					return &(networks[i - 1].second);
+			}
+		}
+
+		const std::vector< std::pair< uint64_t, SharedPtr<Network> > > networks; // sorted by network ID
+
+	private:
+		static inline unsigned long _hash(const uint64_t nwid) { return (unsigned long)((nwid * 0x9e3779b97f4a7c15ULL) >> 32); }
+
+		std::vector<uint32_t> _slots; // index into networks + 1, or 0 if empty
+		unsigned long _mask;
+	};
+
+	/**
+	 * Read side of the network map
+	 *
+	 * Readers count themselves in one of two counters chosen by the current
+	 * epoch, then load the map. A writer publishes its new map and then flips
+	 * the epoch and waits for the old epoch's counter to drain, twice, after
+	 * which no reader can still see the old map. Readers never wait, and only
+	 * join and leave ever spin.
+	 */
+	class _NetworkMapReader : NonCopyable
+	{
+	public:
+		_NetworkMapReader(const Node *n) :
+			_c(const_cast<Node *>(n)->_networkMapReaders[n->_networkMapEpoch & 1])
+		{
+			++_c; // full barrier, so the map is loaded after we're counted
+			map = n->_networkMap;
+		}
+		~_NetworkMapReader() { --_c; }
+
+		const _NetworkMap *map;
+
+	private:
+		AtomicCounter &_c;
+	};
+
+	inline SharedPtr<Network> _network(uint64_t nwid) const
+	{
+		_NetworkMapReader r(this);
+		const SharedPtr<Network> *const nw = r.map->get(nwid);
+		return ((nw) ? *nw : SharedPtr<Network>());
 	}
 
+	// Publish a new network map and delete the old one once readers are done; assumes _networks_m is locked
+	void _setNetworks(const std::vector< std::pair< uint64_t, SharedPtr<Network> > > &nw);
+
 	RuntimeEnvironment _RR;
 	RuntimeEnvironment *RR;
 	void *_uPtr; // _uptr (lower case) is reserved in Visual Studio :P
@@ -297,8 +408,10 @@ private:
 	// Time of last identity verification indexed by InetAddress.rateGateHash() -- used in IncomingPacket::_doHELLO() via rateGateIdentityVerification()
 	uint64_t _lastIdentityVerification[16384];
 
-	std::vector< std::pair< uint64_t, SharedPtr<Network> > > _networks;
-	Mutex _networks_m;
+	_NetworkMap *volatile _networkMap;
+	volatile unsigned int _networkMapEpoch;
+	AtomicCounter _networkMapReaders[2];
+	Mutex _networks_m; // held by writers (join, leave) only
 
 	std::vector< ZT_CircuitTest * > _circuitTests;
 	Mutex _circuitTests_m;
@@ -316,6 +429,9 @@ private:
 	uint64_t _lastPingCheck;
 	uint64_t _lastHousekeepingRun;
 	bool _online;
+	volatile bool _multipath;
+	volatile bool _fec;
+	unsigned int _fecLossThreshold;
 };
 
 } // namespace ZeroTier
@@ -96,7 +96,7 @@ void OutboundMulticast::sendOnly(const RuntimeEnvironment *RR,const Address &toA
 		RR->node->expectReplyTo(_packet.packetId());
 
 		Packet tmp(_packet); // make a copy of packet so as not to garble the original -- GitHub issue #461
-		RR->sw->send(tmp,true);
+		RR->sw->send(tmp,true,0,(_frameLen > ZT_DEFAULT_MTU)); // dropped there, now or once queued, if toAddr can't take it
 	}
 }
 
@@ -22,7 +22,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <new>
+
 #include "Packet.hpp"
+#include "PooledPacket.hpp"
+#include "Mutex.hpp"
 
 #ifdef _MSC_VER
 #define FORCE_INLINE static __forceinline
@@ -1040,6 +1044,8 @@ const char *Packet::verbString(Verb v)
 		case VERB_CIRCUIT_TEST: return "CIRCUIT_TEST";
 		case VERB_CIRCUIT_TEST_REPORT: return "CIRCUIT_TEST_REPORT";
 		case VERB_USER_MESSAGE: return "USER_MESSAGE";
+		case VERB_FRAGMENT_NACK: return "FRAGMENT_NACK";
+		case VERB_FEC_PARITY: return "FEC_PARITY";
 	}
 	return "(unknown)";
 }
@@ -1166,4 +1172,74 @@ bool Packet::uncompress()
 	return true;
 }
 
+static Mutex _packetPool_m;
+static void *_packetPool[ZT_PACKET_POOL_MAX_FREE];
+static unsigned long _packetPoolFree = 0;
+static PooledPacket::Stats _packetPoolStats = { 0,0,0,0,0 };
+static uint64_t _packetPoolCopies = 0; // copies and bytesCopied are counted outside _packetPool_m
+static uint64_t _packetPoolBytesCopied = 0;
+
+void *PooledPacket::operator new(size_t s)
+{
+	if (s == sizeof(PooledPacket)) {
+		Mutex::Lock _l(_packetPool_m);
+		if (_packetPoolFree) {
+			++_packetPoolStats.reused;
+			return _packetPool[--_packetPoolFree];
+		}
+		++_packetPoolStats.allocated;
+	}
+	void *const p = ::malloc(s);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void PooledPacket::operator delete(void *p)
+{
+	if (!p)
+		return;
+	{
+		Mutex::Lock _l(_packetPool_m);
+		if (_packetPoolFree < ZT_PACKET_POOL_MAX_FREE) {
+			_packetPool[_packetPoolFree++] = p;
+			return;
+		}
+	}
+	::free(p);
+}
+
+PooledPacket::Stats PooledPacket::stats()
+{
+	Stats s;
+	{
+		Mutex::Lock _l(_packetPool_m);
+		s = _packetPoolStats;
+		s.free = _packetPoolFree;
+	}
+#ifdef __GNUC__
+	s.copies = __sync_add_and_fetch(&_packetPoolCopies,0);
+	s.bytesCopied = __sync_add_and_fetch(&_packetPoolBytesCopied,0);
+#else
+	{
+		Mutex::Lock _l(_packetPool_m);
+		s.copies = _packetPoolCopies;
+		s.bytesCopied = _packetPoolBytesCopied;
+	}
+#endif
+	return s;
+}
+
+void PooledPacket::_counted(const unsigned int len)
+{
+#ifdef __GNUC__
+	__sync_add_and_fetch(&_packetPoolCopies,1);
+	__sync_add_and_fetch(&_packetPoolBytesCopied,(uint64_t)len);
+#else
+	Mutex::Lock _l(_packetPool_m);
+	++_packetPoolCopies;
+	_packetPoolBytesCopied += len;
+#endif
+}
+
 } // namespace ZeroTier
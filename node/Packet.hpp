@@ -25,6 +25,7 @@
 
 #include <string>
 #include <iostream>
+#include <algorithm>
 
 #include "Constants.hpp"
 
@@ -66,10 +67,17 @@
  *   + Tags and Capabilities
  *   + Inline push of CertificateOfMembership deprecated
  *   + Certificates of representation for federation and mesh
- * 9 - 1.2.0 ... CURRENT
+ * 9 - 1.2.0 ... 1.2.2 (builds before jumbo frame support)
  *   + In-band encoding of packet counter for link quality measurement
+ * 10 - 1.2.2 (builds with jumbo frame support) ... CURRENT
+ *   + Frames up to ZT_MAX_MTU in up to ZT_MAX_PACKET_FRAGMENTS fragments
  */
-#define ZT_PROTO_VERSION 9
+#define ZT_PROTO_VERSION 10
+
+/**
+ * First protocol version that accepts frames larger than ZT_DEFAULT_MTU
+ */
+#define ZT_PROTO_VERSION_JUMBO_FRAMES 10
 
 /**
  * Minimum supported protocol version
@@ -230,6 +238,15 @@
  */
 #define ZT_PROTO_MAX_PACKET_LENGTH (ZT_MAX_PACKET_FRAGMENTS * ZT_UDP_DEFAULT_PAYLOAD_MTU)
 
+/**
+ * Largest packet that peers of any supported protocol version can receive
+ *
+ * Messages we fill up to some size limit must stay within this, not
+ * ZT_PROTO_MAX_PACKET_LENGTH, or peers older than protocol version 10 drop
+ * them for having too many fragments.
+ */
+#define ZT_PROTO_MAX_COMPAT_PACKET_LENGTH (ZT_MAX_PACKET_FRAGMENTS_COMPAT * ZT_UDP_DEFAULT_PAYLOAD_MTU)
+
 /**
  * Minimum viable packet length (a.k.a. header length)
  */
@@ -253,6 +270,11 @@
  */
 #define ZT_PROTO_MIN_FRAGMENT_LENGTH ZT_PACKET_FRAGMENT_IDX_PAYLOAD
 
+/**
+ * Maximum fragment length (a fragment is never bigger than one UDP packet)
+ */
+#define ZT_PROTO_MAX_FRAGMENT_LENGTH ZT_PATH_MTU_MAX
+
 // Field incides for parsing verbs -------------------------------------------
 
 // Some verbs have variable-length fields. Those aren't fully defined here
@@ -413,23 +435,23 @@ public:
 	 * receipt to authenticate and decrypt; there is no per-fragment MAC. (But if
 	 * fragments are corrupt, the MAC will fail for the whole assembled packet.)
 	 */
-	class Fragment : public Buffer<ZT_PROTO_MAX_PACKET_LENGTH>
+	class Fragment : public Buffer<ZT_PROTO_MAX_FRAGMENT_LENGTH>
 	{
 	public:
 		Fragment() :
-			Buffer<ZT_PROTO_MAX_PACKET_LENGTH>()
+			Buffer<ZT_PROTO_MAX_FRAGMENT_LENGTH>()
 		{
 		}
 
 		template<unsigned int C2>
 		Fragment(const Buffer<C2> &b)
 	 		throw(std::out_of_range) :
-	 		Buffer<ZT_PROTO_MAX_PACKET_LENGTH>(b)
+	 		Buffer<ZT_PROTO_MAX_FRAGMENT_LENGTH>(b)
 		{
 		}
 
 		Fragment(const void *data,unsigned int len) :
-			Buffer<ZT_PROTO_MAX_PACKET_LENGTH>(data,len)
+			Buffer<ZT_PROTO_MAX_FRAGMENT_LENGTH>(data,len)
 		{
 		}
 
@@ -1073,7 +1095,42 @@ public:
 		 * ZeroTier, Inc. itself. We recommend making up random ones for your own
 		 * implementations.
 		 */
-		VERB_USER_MESSAGE = 0x14
+		VERB_USER_MESSAGE = 0x14,
+
+		/**
+		 * Negative acknowledgement of missing fragments:
+		 *   <[8] 64-bit packet ID of fragmented packet>
+		 *   <[4] 32-bit mask of missing fragments (bit 0 is the head)>
+		 *  [... additional packet ID / mask pairs ...]
+		 *
+		 * Sent by nodes with fragment recovery enabled when a fragmented
+		 * packet has been partly received for a while. The sender, if it still
+		 * has the packet in its retransmit buffer, resends the missing
+		 * fragments exactly as they were originally sent. NACKs are only sent
+		 * for packets whose head arrived, since fragments carry no source.
+		 *
+		 * This generates no OK or ERROR response.
+		 */
+		VERB_FRAGMENT_NACK = 0x15,
+
+		/**
+		 * Forward error correction parity:
+		 *   <[1] number of packets in group, or 0 for announcement>
+		 *   <[8] packet ID of each packet in group>
+		 *   <[2] XOR of lengths of packets in group>
+		 *   <[...] XOR of contents of packets in group>
+		 *
+		 * Sent after each group of ZT_FEC_GROUP_SIZE packets to a peer when
+		 * forward error correction is active toward it. A receiver that got
+		 * all but one packet of a group can rebuild that packet, exactly as
+		 * it was sent on the wire, and process it normally.
+		 *
+		 * A group size of zero announces that the sender can decode parity.
+		 * Nodes only send parity to peers that have announced recently.
+		 *
+		 * This generates no OK or ERROR response.
+		 */
+		VERB_FEC_PARITY = 0x16
 	};
 
 	/**
@@ -1248,6 +1305,63 @@ public:
 		else (*this)[ZT_PACKET_IDX_FLAGS] &= (char)(~ZT_PROTO_FLAG_FRAGMENTED);
 	}
 
+	/**
+	 * Pass this (armored) packet to a function as it goes on the wire
+	 *
+	 * A packet that fits in mtu goes whole. Otherwise it goes as a head of
+	 * mtu bytes followed by fragments of at most mtu bytes each. The
+	 * fragmented flag must already have been set to match before armor().
+	 *
+	 * @param mtu Largest datagram to send
+	 * @param pieces Bit mask of pieces to send: bit 0 is the head, bit N is fragment N
+	 * @param f Function called as f(const void *data,unsigned int len) and returning true on success
+	 * @return False if the head was to be sent and f() failed (no fragments are sent then)
+	 * @tparam F Function type
+	 */
+	template<typename F>
+	inline bool sendPieces(const unsigned int mtu,const uint32_t pieces,F &f) const
+	{
+		unsigned int chunkSize = std::min(size(),mtu);
+		if (((pieces & 1) != 0)&&(!f(data(),chunkSize)))
+			return false;
+		if (chunkSize < size()) {
+			const unsigned int fragPayload = mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH;
+			unsigned int fragStart = chunkSize;
+			unsigned int remaining = size() - chunkSize;
+			const unsigned int totalFragments = ((remaining + fragPayload - 1) / fragPayload) + 1;
+			for(unsigned int fno=1;fno<totalFragments;++fno) {
+				chunkSize = std::min(remaining,fragPayload);
+				if ((pieces & (((uint32_t)1) << fno)) != 0) {
+					Fragment frag(*this,fragStart,chunkSize,fno,totalFragments);
+					f(frag.data(),frag.size());
+				}
+				fragStart += chunkSize;
+				remaining -= chunkSize;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * @param mtu Largest datagram to send
+	 * @param pieces Bit mask of pieces as in sendPieces()
+	 * @return Total bytes sendPieces() would put on the wire
+	 */
+	inline unsigned int wireLength(const unsigned int mtu,const uint32_t pieces) const
+	{
+		unsigned int chunkSize = std::min(size(),mtu);
+		unsigned int len = ((pieces & 1) != 0) ? chunkSize : 0;
+		const unsigned int fragPayload = mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH;
+		unsigned int remaining = size() - chunkSize;
+		for(unsigned int fno=1;remaining;++fno) {
+			chunkSize = std::min(remaining,fragPayload);
+			if ((pieces & (((uint32_t)1) << fno)) != 0)
+				len += chunkSize + ZT_PROTO_MIN_FRAGMENT_LENGTH;
+			remaining -= chunkSize;
+		}
+		return len;
+	}
+
 	/**
 	 * @return True if compressed (result only valid if unencrypted)
 	 */
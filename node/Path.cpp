@@ -26,6 +26,8 @@ bool Path::send(const RuntimeEnvironment *RR,const void *data,unsigned int len,u
 {
 	if (RR->node->putPacket(_localAddress,address(),data,len)) {
 		_lastOut = now;
+		++_packetsOut;
+		_bytesOut += len;
 		return true;
 	}
 	return false;
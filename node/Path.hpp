@@ -28,6 +28,7 @@
 
 #include "Constants.hpp"
 #include "InetAddress.hpp"
+#include "Buffer.hpp"
 #include "SharedPtr.hpp"
 #include "AtomicCounter.hpp"
 #include "NonCopyable.hpp"
@@ -85,6 +86,8 @@ public:
 					for(unsigned int i=0;i<8;++i) b[i] = a[i];
 					a += 8;
 					for(unsigned int i=0;i<8;++i) b[i] ^= a[i];
+				} else {
+					_k[3] = 0;
 				}
 			} else {
 				_k[0] = 0;
@@ -94,7 +97,15 @@ public:
 			}
 		}
 
-		inline unsigned long hashCode() const { return (unsigned long)(_k[0] + _k[1] + _k[2] + _k[3]); }
+		inline unsigned long hashCode() const
+		{
+			// Multiply-xorshift mix so that keys differing only in port or low address bits spread out
+			uint64_t h = _k[0] * 0x9e3779b97f4a7c15ULL;
+			h = (h ^ (h >> 29) ^ _k[1]) * 0xbf58476d1ce4e5b9ULL;
+			h = (h ^ (h >> 29) ^ _k[2]) * 0x94d049bb133111ebULL;
+			h = (h ^ (h >> 29) ^ _k[3]) * 0x9e3779b97f4a7c15ULL;
+			return (unsigned long)(h ^ (h >> 32));
+		}
 
 		inline bool operator==(const HashKey &k) const { return ( (_k[0] == k._k[0]) && (_k[1] == k._k[1]) && (_k[2] == k._k[2]) && (_k[3] == k._k[3]) ); }
 		inline bool operator!=(const HashKey &k) const { return (!(*this == k)); }
@@ -112,6 +123,25 @@ public:
 		_incomingLinkQualitySlowLogCounter(-64), // discard first fast log
 		_incomingLinkQualityPreviousPacketCounter(0),
 		_outgoingPacketCounter(0),
+		_lastMtuDiscovery(0),
+		_mtuProbeSent(0),
+		_mtu(ZT_UDP_DEFAULT_PAYLOAD_MTU),
+		_mtuProbeLow(0),
+		_mtuProbeHigh(0),
+		_mtuProbeSize(0),
+		_packetsOut(0),
+		_bytesOut(0),
+		_packetsIn(0),
+		_bytesIn(0),
+		_qosProbeSent(0),
+		_qosLossLog(0),
+		_qosSamples(0),
+		_qosProbeOutstanding(false),
+		_rttSamples(0),
+		_srtt8(0),
+		_jitter16(0),
+		_lastRtt(0),
+		_key(),
 		_addr(),
 		_localAddress(),
 		_ipScope(InetAddress::IP_SCOPE_NONE)
@@ -129,6 +159,25 @@ public:
 		_incomingLinkQualitySlowLogCounter(-64), // discard first fast log
 		_incomingLinkQualityPreviousPacketCounter(0),
 		_outgoingPacketCounter(0),
+		_lastMtuDiscovery(0),
+		_mtuProbeSent(0),
+		_mtu(ZT_UDP_DEFAULT_PAYLOAD_MTU),
+		_mtuProbeLow(0),
+		_mtuProbeHigh(0),
+		_mtuProbeSize(0),
+		_packetsOut(0),
+		_bytesOut(0),
+		_packetsIn(0),
+		_bytesIn(0),
+		_qosProbeSent(0),
+		_qosLossLog(0),
+		_qosSamples(0),
+		_qosProbeOutstanding(false),
+		_rttSamples(0),
+		_srtt8(0),
+		_jitter16(0),
+		_lastRtt(0),
+		_key(localAddress,addr),
 		_addr(addr),
 		_localAddress(localAddress),
 		_ipScope(addr.ipScope())
@@ -141,8 +190,14 @@ public:
 	 * Called when a packet is received from this remote path, regardless of content
 	 *
 	 * @param t Time of receive
+	 * @param len Length of packet or fragment in bytes
 	 */
-	inline void received(const uint64_t t) { _lastIn = t; }
+	inline void received(const uint64_t t,const unsigned int len)
+	{
+		_lastIn = t;
+		++_packetsIn;
+		_bytesIn += len;
+	}
 
 	/**
 	 * Update link quality using a counter from an incoming packet (or packet head in fragmented case)
@@ -200,6 +255,11 @@ public:
 	 */
 	inline void sent(const uint64_t t) { _lastOut = t; }
 
+	/**
+	 * @return Key under which this path is stored in Topology
+	 */
+	inline const HashKey &key() const { return _key; }
+
 	/**
 	 * @return Address of local side of this path or NULL if unspecified
 	 */
@@ -290,6 +350,26 @@ public:
 	 */
 	inline uint64_t lastIn() const { return _lastIn; }
 
+	/**
+	 * @return Packets and fragments sent via this path
+	 */
+	inline uint64_t packetsOut() const { return _packetsOut; }
+
+	/**
+	 * @return Bytes sent via this path
+	 */
+	inline uint64_t bytesOut() const { return _bytesOut; }
+
+	/**
+	 * @return Packets and fragments received via this path
+	 */
+	inline uint64_t packetsIn() const { return _packetsIn; }
+
+	/**
+	 * @return Bytes received via this path
+	 */
+	inline uint64_t bytesIn() const { return _bytesIn; }
+
 	/**
 	 * Return and increment outgoing packet counter (used with Packet::armor())
 	 *
@@ -297,7 +377,274 @@ public:
 	 */
 	inline unsigned int nextOutgoingCounter() { return _outgoingPacketCounter++; }
 
+	/**
+	 * @return Largest packet known to reach the other end of this path in one UDP datagram
+	 */
+	inline unsigned int mtu() const { return _mtu; }
+
+	/**
+	 * Advance path MTU discovery and get the size of the next probe to send
+	 *
+	 * Discovery is a binary search between ZT_UDP_DEFAULT_PAYLOAD_MTU and
+	 * ZT_PATH_MTU_PROBE_MAX, starting with a probe at the maximum so that jumbo
+	 * frame LANs are confirmed in one round trip. A probe that is not
+	 * answered within ZT_PATH_MTU_PROBE_TIMEOUT counts as too big.
+	 *
+	 * @param now Current time
+	 * @return Size of probe packet to send now or 0 for none
+	 */
+	inline unsigned int nextMtuProbe(const uint64_t now)
+	{
+		if (_mtuProbeSize) {
+			if ((now - _mtuProbeSent) < ZT_PATH_MTU_PROBE_TIMEOUT)
+				return 0;
+			_mtuProbeHigh = _mtuProbeSize;
+			_mtuProbeSize = 0;
+		}
+
+		if (!_mtuProbeHigh) {
+			if ((now - _lastMtuDiscovery) < ZT_PATH_MTU_DISCOVERY_INTERVAL)
+				return 0;
+			_mtuProbeLow = ZT_UDP_DEFAULT_PAYLOAD_MTU;
+			_mtuProbeHigh = ZT_PATH_MTU_PROBE_MAX + 1;
+		}
+
+		if ((_mtuProbeHigh - _mtuProbeLow) <= ZT_PATH_MTU_PROBE_GRANULARITY) {
+			_mtu = _mtuProbeLow;
+			_mtuProbeHigh = 0;
+			_lastMtuDiscovery = now;
+			return 0;
+		}
+
+		_mtuProbeSize = (_mtuProbeHigh > ZT_PATH_MTU_PROBE_MAX) ? ZT_PATH_MTU_PROBE_MAX : ((_mtuProbeLow + _mtuProbeHigh) / 2);
+		_mtuProbeSent = now;
+		return _mtuProbeSize;
+	}
+
+	/**
+	 * Called when a probe could not be sent at all (e.g. larger than local interface MTU)
+	 *
+	 * @param size Probe size
+	 */
+	inline void mtuProbeFailed(const unsigned int size)
+	{
+		if (size == _mtuProbeSize) {
+			_mtuProbeHigh = size;
+			_mtuProbeSize = 0;
+		}
+	}
+
+	/**
+	 * Called when a reply to a path MTU probe arrives via this path
+	 *
+	 * @param size Size of probe being answered
+	 */
+	inline void mtuProbeReplied(const unsigned int size)
+	{
+		if ((size)&&(size == _mtuProbeSize)) {
+			_mtuProbeLow = size;
+			_mtuProbeSize = 0;
+			if (size > _mtu)
+				_mtu = size;
+		}
+	}
+
+	/**
+	 * @return True if a latency/loss probe should be sent on this path
+	 */
+	inline bool qosProbeDue(const uint64_t now) const { return ((now - _qosProbeSent) >= ZT_PATH_QOS_PROBE_INTERVAL); }
+
+	/**
+	 * @return Time the last latency/loss probe was sent
+	 */
+	inline uint64_t lastQosProbe() const { return _qosProbeSent; }
+
+	/**
+	 * Called when a latency/loss probe is sent via this path
+	 *
+	 * If the previous probe was never answered it is counted as lost.
+	 *
+	 * @param now Current time (also sent in the probe and echoed back)
+	 */
+	inline void qosProbeSent(const uint64_t now)
+	{
+		if (_qosProbeOutstanding)
+			_qosLossSample(true);
+		_qosProbeSent = now;
+		_qosProbeOutstanding = true;
+	}
+
+	/**
+	 * Called when a reply to a latency/loss probe arrives via this path
+	 *
+	 * @param sentAt Send timestamp echoed back in reply
+	 * @param now Current time
+	 */
+	inline void qosProbeReplied(const uint64_t sentAt,const uint64_t now)
+	{
+		if ((_qosProbeOutstanding)&&(sentAt == _qosProbeSent)&&((now - sentAt) < ZT_PATH_QOS_PROBE_TIMEOUT)) {
+			_qosProbeOutstanding = false;
+			_qosLossSample(false);
+			rttMeasured((unsigned int)(now - sentAt));
+		}
+	}
+
+	/**
+	 * Add a round trip time sample (from a probe or any other timed request/reply)
+	 *
+	 * Smoothed RTT is an EWMA with gain 1/8 as in TCP (RFC 6298). Jitter is the
+	 * mean deviation between consecutive samples with gain 1/16 (RFC 3550).
+	 *
+	 * @param rtt Round trip time in milliseconds
+	 */
+	inline void rttMeasured(unsigned int rtt)
+	{
+		if (rtt > 65535)
+			rtt = 65535;
+		if (_rttSamples) {
+			_srtt8 = _srtt8 + rtt - (_srtt8 >> 3);
+			const unsigned int d = (rtt > _lastRtt) ? (rtt - _lastRtt) : (_lastRtt - rtt);
+			_jitter16 = _jitter16 + d - (_jitter16 >> 4);
+		} else {
+			_srtt8 = rtt << 3;
+			_jitter16 = 0;
+		}
+		_lastRtt = rtt;
+		_rttWindow[_rttSamples++ % ZT_PATH_QOS_WINDOW] = (uint16_t)rtt;
+	}
+
+	/**
+	 * @return Smoothed round trip time in milliseconds or -1 if not yet measured
+	 */
+	inline int latency() const { return ((_rttSamples) ? (int)(_srtt8 >> 3) : -1); }
+
+	/**
+	 * @return Round trip time jitter in milliseconds or -1 if not yet measured
+	 */
+	inline int jitter() const { return ((_rttSamples) ? (int)(_jitter16 >> 4) : -1); }
+
+	/**
+	 * Get a percentile of recent round trip times
+	 *
+	 * @param pct Percentile from 0 to 100
+	 * @return Round trip time in milliseconds or -1 if not yet measured
+	 */
+	inline int latencyPercentile(const unsigned int pct) const
+	{
+		const unsigned int n = (_rttSamples > ZT_PATH_QOS_WINDOW) ? ZT_PATH_QOS_WINDOW : _rttSamples;
+		if (!n)
+			return -1;
+		uint16_t w[ZT_PATH_QOS_WINDOW];
+		for(unsigned int i=0;i<n;++i)
+			w[i] = _rttWindow[i];
+		const unsigned int k = (((n - 1) * ((pct > 100) ? 100 : pct)) + 50) / 100;
+		std::nth_element(w,w + k,w + n);
+		return (int)w[k];
+	}
+
+	/**
+	 * @return Fraction of recent probes lost in parts per thousand (0 if not yet measured)
+	 */
+	inline unsigned int packetLoss() const
+	{
+		const unsigned int n = (_qosSamples > 64) ? 64 : _qosSamples;
+		if (!n)
+			return 0;
+		const uint64_t mask = (n >= 64) ? 0xffffffffffffffffULL : ((1ULL << n) - 1ULL);
+		return (unsigned int)((Utils::countBits((uint64_t)(_qosLossLog & mask)) * 1000) / n);
+	}
+
+	/**
+	 * Penalty applied to this path's score in Peer for poor measured quality
+	 *
+	 * This is in the same units (milliseconds) as the rest of the score.
+	 * Latency plus twice the jitter is charged as is, and loss costs up to
+	 * half a ping period so that a path losing everything looks no better
+	 * than one that recently died.
+	 *
+	 * @return Penalty or 0 if quality has not been measured
+	 */
+	inline uint64_t qualityPenalty() const
+	{
+		if (!_rttSamples)
+			return 0;
+		const uint64_t p = (uint64_t)(_srtt8 >> 3) + (uint64_t)(_jitter16 >> 4) * 2 + ((uint64_t)packetLoss() * (ZT_PEER_PING_PERIOD / 2)) / 1000;
+		return std::min(p,(uint64_t)(ZT_PEER_PING_PERIOD / 2));
+	}
+
+	/**
+	 * Serialize measured state (liveness, MTU, latency, loss) for a warm restart
+	 *
+	 * Addresses are not included since they are the path's key in Topology.
+	 *
+	 * @param b Buffer to append to
+	 */
+	template<unsigned int C>
+	inline void serializeState(Buffer<C> &b) const
+	{
+		const unsigned int sizeAt = b.size();
+		b.addSize(2); // length of state
+		b.append((uint64_t)_lastIn);
+		b.append((uint64_t)_lastTrustEstablishedPacketReceived);
+		b.append((uint16_t)_mtu);
+		b.append((uint64_t)_lastMtuDiscovery);
+		const unsigned int rs = (_rttSamples > ZT_PATH_QOS_WINDOW) ? ZT_PATH_QOS_WINDOW : _rttSamples;
+		b.append((uint8_t)rs);
+		b.append((uint32_t)_srtt8);
+		b.append((uint32_t)_jitter16);
+		b.append((uint16_t)_lastRtt);
+		for(unsigned int i=0;i<rs;++i)
+			b.append((uint16_t)_rttWindow[i]);
+		b.append((uint8_t)((_qosSamples > 64) ? 64 : _qosSamples));
+		b.append((uint64_t)_qosLossLog);
+		b.setAt(sizeAt,(uint16_t)(b.size() - (sizeAt + 2)));
+	}
+
+	/**
+	 * Restore state saved by serializeState()
+	 *
+	 * @param b Buffer to read from
+	 * @param startAt Index of state in buffer
+	 * @return Number of bytes of state (including its length) to skip
+	 * @throws std::out_of_range State extends beyond end of buffer
+	 */
+	template<unsigned int C>
+	inline unsigned int deserializeState(const Buffer<C> &b,unsigned int startAt = 0)
+	{
+		const unsigned int len = b.template at<uint16_t>(startAt);
+		unsigned int p = startAt + 2;
+		b.field(p,len); // bounds check
+		if (len >= 27) {
+			_lastIn = b.template at<uint64_t>(p); p += 8;
+			_lastTrustEstablishedPacketReceived = b.template at<uint64_t>(p); p += 8;
+			const unsigned int mtu = b.template at<uint16_t>(p); p += 2;
+			if ((mtu >= ZT_UDP_DEFAULT_PAYLOAD_MTU)&&(mtu <= ZT_PATH_MTU_PROBE_MAX))
+				_mtu = mtu;
+			_lastMtuDiscovery = b.template at<uint64_t>(p); p += 8;
+			const unsigned int rs = b[p++];
+			if ((rs <= ZT_PATH_QOS_WINDOW)&&(len >= (27 + 10 + (rs * 2) + 9))) {
+				_srtt8 = b.template at<uint32_t>(p); p += 4;
+				_jitter16 = b.template at<uint32_t>(p); p += 4;
+				_lastRtt = b.template at<uint16_t>(p); p += 2;
+				for(unsigned int i=0;i<rs;++i) {
+					_rttWindow[i] = b.template at<uint16_t>(p);
+					p += 2;
+				}
+				_rttSamples = rs;
+				_qosSamples = b[p++];
+				_qosLossLog = b.template at<uint64_t>(p);
+			}
+		}
+		return (2 + len);
+	}
+
 private:
+	inline void _qosLossSample(const bool lost)
+	{
+		_qosLossLog = (_qosLossLog << 1) | (uint64_t)lost;
+		++_qosSamples;
+	}
+
 	volatile uint64_t _lastOut;
 	volatile uint64_t _lastIn;
 	volatile uint64_t _lastTrustEstablishedPacketReceived;
@@ -306,10 +653,30 @@ private:
 	volatile signed int _incomingLinkQualitySlowLogCounter;
 	volatile unsigned int _incomingLinkQualityPreviousPacketCounter;
 	volatile unsigned int _outgoingPacketCounter;
+	volatile uint64_t _lastMtuDiscovery;
+	volatile uint64_t _mtuProbeSent;
+	volatile unsigned int _mtu;
+	volatile unsigned int _mtuProbeLow; // largest size known to work during discovery
+	volatile unsigned int _mtuProbeHigh; // smallest size known not to work, 0 if not discovering
+	volatile unsigned int _mtuProbeSize; // size of outstanding probe or 0 if none
+	volatile uint64_t _packetsOut;
+	volatile uint64_t _bytesOut;
+	volatile uint64_t _packetsIn;
+	volatile uint64_t _bytesIn;
+	volatile uint64_t _qosProbeSent;
+	volatile uint64_t _qosLossLog; // bit per probe, 1 if lost, LSB is most recent
+	volatile unsigned int _qosSamples;
+	volatile bool _qosProbeOutstanding;
+	volatile unsigned int _rttSamples;
+	volatile unsigned int _srtt8; // smoothed RTT * 8
+	volatile unsigned int _jitter16; // jitter * 16
+	volatile unsigned int _lastRtt;
+	HashKey _key; // key this path was created under in Topology
 	InetAddress _addr;
 	InetAddress _localAddress;
 	InetAddress::IpScope _ipScope; // memoize this since it's a computed value checked often
 	volatile uint8_t _incomingLinkQualitySlowLog[32];
+	volatile uint16_t _rttWindow[ZT_PATH_QOS_WINDOW];
 	AtomicCounter __refCount;
 };
 
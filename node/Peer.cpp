@@ -16,11 +16,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <math.h>
+
 #include "../version.h"
 
 #include "Constants.hpp"
 #include "Peer.hpp"
 #include "Node.hpp"
+#include "Topology.hpp"
 #include "Switch.hpp"
 #include "Network.hpp"
 #include "SelfAwareness.hpp"
@@ -37,7 +40,7 @@
 
 namespace ZeroTier {
 
-Peer::Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Identity &peerIdentity) :
+Peer::Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Identity &peerIdentity,const void *key) :
 	RR(renv),
 	_lastReceive(0),
 	_lastNontrivialReceive(0),
@@ -51,6 +54,8 @@ Peer::Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Ident
 	_lastComRequestSent(0),
 	_lastCredentialsReceived(0),
 	_lastTrustEstablishedPacketReceived(0),
+	_lastFecAnnounceSent(0),
+	_lastFecAnnounceReceived(0),
 	_remoteClusterOptimal4(0),
 	_vProto(0),
 	_vMajor(0),
@@ -60,11 +65,60 @@ Peer::Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Ident
 	_numPaths(0),
 	_latency(0),
 	_directPathPushCutoffCount(0),
-	_credentialsCutoffCount(0)
+	_credentialsCutoffCount(0),
+	_fec((FecEncoder *)0),
+	_fecActive(false)
 {
 	memset(_remoteClusterOptimal6,0,sizeof(_remoteClusterOptimal6));
-	if (!myIdentity.agree(peerIdentity,_key,ZT_PEER_SECRET_KEY_LENGTH))
+	if (key) {
+		memcpy(_key,key,ZT_PEER_SECRET_KEY_LENGTH);
+	} else if (!myIdentity.agree(peerIdentity,_key,ZT_PEER_SECRET_KEY_LENGTH)) {
 		throw std::runtime_error("new peer identity key agreement failed");
+	}
+}
+
+SharedPtr<Peer> Peer::deserializeNew(const RuntimeEnvironment *renv,const Identity &myIdentity,const Buffer<ZT_PEER_SUGGESTED_SERIALIZATION_BUFFER_SIZE> &b,unsigned int &p)
+{
+	if (b[p++] != 1)
+		throw std::invalid_argument("unrecognized peer serialization version");
+
+	// Not locallyValidate()'d again since that's slow and the state was sealed by us
+	Identity id;
+	p += id.deserialize(b,p);
+
+	SharedPtr<Peer> np(new Peer(renv,myIdentity,id,b.field(p,ZT_PEER_SECRET_KEY_LENGTH)));
+	p += ZT_PEER_SECRET_KEY_LENGTH;
+	np->_lastReceive = b.at<uint64_t>(p); p += 8;
+	np->_lastNontrivialReceive = b.at<uint64_t>(p); p += 8;
+	np->_lastTrustEstablishedPacketReceived = b.at<uint64_t>(p); p += 8;
+	np->_vProto = b.at<uint16_t>(p); p += 2;
+	np->_vMajor = b.at<uint16_t>(p); p += 2;
+	np->_vMinor = b.at<uint16_t>(p); p += 2;
+	np->_vRevision = b.at<uint16_t>(p); p += 2;
+	np->_latency = b.at<uint16_t>(p); p += 2;
+
+	const unsigned int numPaths = b[p++];
+	for(unsigned int i=0;i<numPaths;++i) {
+		InetAddress localAddress,address;
+		p += localAddress.deserialize(b,p);
+		p += address.deserialize(b,p);
+		const uint64_t lastReceive = b.at<uint64_t>(p); p += 8;
+		if ((np->_numPaths < ZT_MAX_PEER_NETWORK_PATHS)&&(Path::isAddressValidForPath(address))) {
+			const SharedPtr<Path> path(renv->topology->getPath(localAddress,address));
+			p += path->deserializeState(b,p);
+			np->_paths[np->_numPaths].lastReceive = lastReceive;
+			np->_paths[np->_numPaths].path = path;
+			np->_paths[np->_numPaths].multipathWeight = 0;
+#ifdef ZT_ENABLE_CLUSTER
+			np->_paths[np->_numPaths].localClusterSuboptimal = false;
+#endif
+			++np->_numPaths;
+		} else {
+			p += 2 + b.at<uint16_t>(p);
+		}
+	}
+
+	return np;
 }
 
 void Peer::received(
@@ -151,7 +205,10 @@ void Peer::received(
 			for(unsigned int p=0;p<_numPaths;++p) {
 				if (_paths[p].path->address() == path->address()) {
 					_paths[p].lastReceive = now;
-					_paths[p].path = path; // local address may have changed!
+					if (_paths[p].path != path) {
+						_paths[p].path = path; // local address may have changed!
+						RR->sw->relayRouteChanged(_id.address());
+					}
 #ifdef ZT_ENABLE_CLUSTER
 					_paths[p].localClusterSuboptimal = suboptimalPath;
 #endif
@@ -199,6 +256,8 @@ void Peer::received(
 
 				_paths[slot].lastReceive = now;
 				_paths[slot].path = path;
+				_paths[slot].multipathWeight = 0;
+				RR->sw->relayRouteChanged(_id.address());
 #ifdef ZT_ENABLE_CLUSTER
 				_paths[slot].localClusterSuboptimal = suboptimalPath;
 				if (RR->cluster)
@@ -345,6 +404,56 @@ SharedPtr<Path> Peer::getBestPath(uint64_t now,bool includeExpired)
 	}
 }
 
+SharedPtr<Path> Peer::getMultipathPath(uint64_t now,uint64_t flowId)
+{
+	Mutex::Lock _l(_paths_m);
+
+	// Mix the flow ID so that similar hashes don't all land in one bucket
+	uint64_t x = flowId;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+
+	int bestp = -1;
+	double best = 0.0;
+	for(unsigned int p=0;p<_numPaths;++p) {
+		if ( ((now - _paths[p].lastReceive) <= ZT_PEER_PATH_EXPIRATION) && (_paths[p].path->alive(now)) ) {
+#ifdef ZT_ENABLE_CLUSTER
+			if (_paths[p].localClusterSuboptimal)
+				continue;
+#endif
+			// Weight by delivery rate over round trip time (peer latency until the path is measured)
+			const int pl = _paths[p].path->latency();
+			const uint64_t rtt = (uint64_t)((pl >= 0) ? (unsigned int)pl : _latency);
+			const uint64_t w = (((uint64_t)_paths[p].path->linkQuality() + 1) * (uint64_t)(1001 - _paths[p].path->packetLoss())) / (rtt + 1) + 1;
+
+			// Quantize to a power of two and only requantize outside [weight/2,weight*4)
+			uint64_t &qw = _paths[p].multipathWeight;
+			if ((!qw)||(w < (qw >> 1))||(w >= (qw << 2))) {
+				qw = 1;
+				while ((qw << 1) <= w)
+					qw <<= 1;
+			}
+
+			// Weighted rendezvous hash: score = weight / -ln(u) for a uniform u in (0,1) from (flow,path)
+			uint64_t h = x ^ ((uint64_t)_paths[p].path->address().hashCode() * 0x9e3779b97f4a7c15ULL);
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ULL;
+			h ^= h >> 33;
+			const double u = ((double)(h >> 11) + 0.5) / 9007199254740992.0; // 2^53
+			const double score = (double)qw / -log(u);
+			if ((bestp < 0)||(score > best)) {
+				best = score;
+				bestp = (int)p;
+			}
+		}
+	}
+
+	if (bestp < 0)
+		return SharedPtr<Path>();
+	return _paths[bestp].path;
+}
+
 void Peer::sendHELLO(const InetAddress &localAddr,const InetAddress &atAddress,uint64_t now,unsigned int counter)
 {
 	Packet outp(_id.address(),RR->identity.address(),Packet::VERB_HELLO);
@@ -442,6 +551,100 @@ bool Peer::doPingAndKeepalive(uint64_t now,int inetAddressFamily)
 	}
 }
 
+void Peer::doPathProbes(uint64_t now)
+{
+	if (_vProto < 5) // probes are ECHOs with a payload, which older peers don't answer
+		return;
+
+	Mutex::Lock _l(_paths_m);
+
+	// MTU probes need DF, which not every host can set; without them paths keep the default MTU
+	const unsigned int mtuPaths = (RR->node->canSendDontFragment()) ? _numPaths : 0;
+	for(unsigned int p=0;p<mtuPaths;++p) {
+		if ( ((now - _paths[p].lastReceive) <= ZT_PEER_PATH_EXPIRATION) && (_paths[p].path->alive(now)) ) {
+			unsigned int probeSize;
+			while ((probeSize = _paths[p].path->nextMtuProbe(now))) {
+				Packet outp(_id.address(),RR->identity.address(),Packet::VERB_ECHO);
+				outp.append((uint32_t)ZT_PATH_MTU_PROBE_MAGIC);
+				outp.append((uint16_t)probeSize);
+				if (probeSize > outp.size())
+					outp.append((unsigned char)0,probeSize - outp.size());
+				RR->node->expectReplyTo(outp.packetId());
+				outp.armor(_key,true,_paths[p].path->nextOutgoingCounter());
+				if (RR->node->putPacket(_paths[p].path->localAddress(),_paths[p].path->address(),outp.data(),outp.size(),0,true)) {
+					_paths[p].path->sent(now);
+					return;
+				}
+				// Could not leave this host with DF set, so try the next smaller size right away
+				_paths[p].path->mtuProbeFailed(probeSize);
+			}
+		}
+	}
+
+	int qp = -1;
+	uint64_t oldest = 0xffffffffffffffffULL;
+	for(unsigned int p=0;p<_numPaths;++p) {
+		if ( ((now - _paths[p].lastReceive) <= ZT_PEER_PATH_EXPIRATION) && (_paths[p].path->alive(now)) && (_paths[p].path->qosProbeDue(now)) && (_paths[p].path->lastQosProbe() < oldest) ) {
+			oldest = _paths[p].path->lastQosProbe();
+			qp = (int)p;
+		}
+	}
+	if (qp >= 0) {
+		Packet outp(_id.address(),RR->identity.address(),Packet::VERB_ECHO);
+		outp.append((uint32_t)ZT_PATH_QOS_PROBE_MAGIC);
+		outp.append(now);
+		RR->node->expectReplyTo(outp.packetId());
+		outp.armor(_key,true,_paths[qp].path->nextOutgoingCounter());
+		_paths[qp].path->qosProbeSent(now);
+		if (RR->node->putPacket(_paths[qp].path->localAddress(),_paths[qp].path->address(),outp.data(),outp.size()))
+			_paths[qp].path->sent(now);
+	}
+}
+
+void Peer::doFecCheck(uint64_t now)
+{
+	if (!RR->node->fecEnabled()) {
+		_fecActive = false;
+		return;
+	}
+
+	Mutex::Lock _l(_paths_m);
+
+	int bestp = -1;
+	uint64_t best = 0ULL;
+	for(unsigned int p=0;p<_numPaths;++p) {
+		if ( ((now - _paths[p].lastReceive) <= ZT_PEER_PATH_EXPIRATION) && (_paths[p].path->alive(now)) ) {
+			const uint64_t s = _pathScore(p,now);
+			if (s >= best) {
+				best = s;
+				bestp = (int)p;
+			}
+		}
+	}
+	if (bestp < 0) {
+		_fecActive = false;
+		return;
+	}
+
+	if ((now - _lastFecAnnounceSent) >= ZT_FEC_ANNOUNCE_INTERVAL) {
+		Packet outp(_id.address(),RR->identity.address(),Packet::VERB_FEC_PARITY);
+		outp.append((uint8_t)0);
+		outp.armor(_key,true,_paths[bestp].path->nextOutgoingCounter());
+		if (RR->node->putPacket(_paths[bestp].path->localAddress(),_paths[bestp].path->address(),outp.data(),outp.size())) {
+			_paths[bestp].path->sent(now);
+			_lastFecAnnounceSent = now;
+		}
+	}
+
+	if ( ((now - _lastFecAnnounceReceived) < (ZT_FEC_ANNOUNCE_INTERVAL * 2)) && (_lastFecAnnounceReceived) && (_paths[bestp].path->packetLoss() > RR->node->fecLossThreshold()) ) {
+		if (!_fec)
+			_fec = new FecEncoder();
+		_fecActive = true;
+	} else {
+		_fecActive = false;
+	}
+}
+
 bool Peer::hasActiveDirectPath(uint64_t now) const
 {
 	Mutex::Lock _l(_paths_m);
@@ -42,6 +42,12 @@
 #include "Hashtable.hpp"
 #include "Mutex.hpp"
 #include "NonCopyable.hpp"
+#include "Fec.hpp"
+
+/**
+ * Buffer size that will always hold one peer's serialize() output
+ */
+#define ZT_PEER_SUGGESTED_SERIALIZATION_BUFFER_SIZE 2048
 
 namespace ZeroTier {
 
@@ -56,7 +62,11 @@ private:
 	Peer() {} // disabled to prevent bugs -- should not be constructed uninitialized
 
 public:
-	~Peer() { Utils::burn(_key,sizeof(_key)); }
+	~Peer()
+	{
+		Utils::burn(_key,sizeof(_key));
+		delete _fec;
+	}
 
 	/**
 	 * Construct a new peer
@@ -64,9 +74,10 @@ public:
 	 * @param renv Runtime environment
 	 * @param myIdentity Identity of THIS node (for key agreement)
 	 * @param peerIdentity Identity of peer
+	 * @param key Key from an earlier agreement with this peer or NULL to perform key agreement
 	 * @throws std::runtime_error Key agreement with peer's identity failed
 	 */
-	Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Identity &peerIdentity);
+	Peer(const RuntimeEnvironment *renv,const Identity &myIdentity,const Identity &peerIdentity,const void *key = (const void *)0);
 
 	/**
 	 * @return This peer's ZT address (short for identity().address())
@@ -142,6 +153,37 @@ public:
 	 */
 	SharedPtr<Path> getBestPath(uint64_t now,bool includeExpired);
 
+	/**
+	 * Get a direct path for a flow when striping across multiple paths
+	 *
+	 * Flows are spread over all alive paths in proportion to each path's
+	 * measured quality using weighted rendezvous hashing. Weights are
+	 * quantized to powers of two and only change when a path's quality moves
+	 * by more than a factor of two, so ordinary RTT and loss jitter never
+	 * moves a flow, and a path coming or going only moves flows to or from
+	 * that path. This avoids reordering within TCP streams.
+	 *
+	 * @param now Current time
+	 * @param flowId Nonzero flow hash
+	 * @return Path for this flow or NULL if there are no alive paths
+	 */
+	SharedPtr<Path> getMultipathPath(uint64_t now,uint64_t flowId);
+
+	/**
+	 * @param now Current time
+	 * @return True if more than one direct path is alive, so flows could be striped
+	 */
+	inline bool hasMultipleAlivePaths(const uint64_t now) const
+	{
+		unsigned int n = 0;
+		Mutex::Lock _l(_paths_m);
+		for(unsigned int p=0;p<_numPaths;++p) {
+			if ( ((now - _paths[p].lastReceive) <= ZT_PEER_PATH_EXPIRATION) && (_paths[p].path->alive(now)) && (++n > 1) )
+				return true;
+		}
+		return false;
+	}
+
 	/**
 	 * Send a HELLO to this peer at a specified physical address
 	 *
@@ -183,6 +225,17 @@ public:
 	 */
 	bool doPingAndKeepalive(uint64_t now,int inetAddressFamily);
 
+	/**
+	 * Send path MTU discovery or latency/loss probes on live direct paths
+	 *
+	 * Peers rate limit ECHO, so at most one probe is sent per call. Pending
+	 * MTU discovery goes first, then whichever path has gone longest without
+	 * a latency/loss probe.
+	 *
+	 * @param now Current time
+	 */
+	void doPathProbes(uint64_t now);
+
 	/**
 	 * @param now Current time
 	 * @return True if this peer has at least one active and alive direct path
@@ -246,6 +299,29 @@ public:
 	 */
 	inline unsigned int latency() const { return _latency; }
 
+	/**
+	 * Announce parity decoding and decide whether to send parity to this peer
+	 *
+	 * Parity is sent if we have forward error correction enabled, this peer
+	 * has announced that it can decode it, and our best path to it is losing
+	 * more than the configured threshold. Called from the ping check.
+	 *
+	 * @param now Current time
+	 */
+	void doFecCheck(uint64_t now);
+
+	/**
+	 * Called when this peer announces that it can decode parity
+	 *
+	 * @param now Current time
+	 */
+	inline void fecAnnounceReceived(const uint64_t now) { _lastFecAnnounceReceived = now; }
+
+	/**
+	 * @return Parity encoder if forward error correction is active toward this peer, otherwise NULL
+	 */
+	inline FecEncoder *fecEncoder() const { return ((_fecActive) ? _fec : (FecEncoder *)0); }
+
 	/**
 	 * This computes a quality score for relays and root servers
 	 *
@@ -318,6 +394,11 @@ public:
 	}
 
 	inline unsigned int remoteVersionProtocol() const { return _vProto; }
+
+	/**
+	 * @return True if peer accepts frames larger than ZT_DEFAULT_MTU
+	 */
+	inline bool acceptsJumboFrames() const { return (_vProto >= ZT_PROTO_VERSION_JUMBO_FRAMES); }
 	inline unsigned int remoteVersionMajor() const { return _vMajor; }
 	inline unsigned int remoteVersionMinor() const { return _vMinor; }
 	inline unsigned int remoteVersionRevision() const { return _vRevision; }
@@ -413,10 +494,75 @@ public:
 		return false;
 	}
 
+	/**
+	 * Serialize this peer's identity, key, and path state for a warm restart
+	 *
+	 * The output contains this peer's secret key, so it must only be stored
+	 * encrypted (see Topology::saveState()).
+	 *
+	 * @param b Buffer to append to
+	 */
+	template<unsigned int C>
+	inline void serialize(Buffer<C> &b) const
+	{
+		b.append((uint8_t)1); // version
+		_id.serialize(b,false);
+		b.append(_key,ZT_PEER_SECRET_KEY_LENGTH);
+		b.append(_lastReceive);
+		b.append(_lastNontrivialReceive);
+		b.append(_lastTrustEstablishedPacketReceived);
+		b.append(_vProto);
+		b.append(_vMajor);
+		b.append(_vMinor);
+		b.append(_vRevision);
+		b.append((uint16_t)_latency);
+
+		Mutex::Lock _l(_paths_m);
+		b.append((uint8_t)_numPaths);
+		for(unsigned int p=0;p<_numPaths;++p) {
+			_paths[p].path->localAddress().serialize(b);
+			_paths[p].path->address().serialize(b);
+			b.append(_paths[p].lastReceive);
+			_paths[p].path->serializeState(b);
+		}
+	}
+
+	/**
+	 * @return Hash of the state worth saving for a restart: version and path addresses, but not estimates that change all the time
+	 */
+	inline uint64_t stateFingerprint() const
+	{
+		uint64_t h = _id.address().toInt() ^ ((uint64_t)_vProto << 40) ^ ((uint64_t)_vMajor << 48) ^ ((uint64_t)_vMinor << 56) ^ ((uint64_t)_vRevision << 24);
+		Mutex::Lock _l(_paths_m);
+		for(unsigned int p=0;p<_numPaths;++p)
+			h = (h * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)_paths[p].path->address().hashCode() << 32) ^ (uint64_t)_paths[p].path->localAddress().hashCode();
+		return (h * 0x9e3779b97f4a7c15ULL);
+	}
+
+	/**
+	 * Create a peer from serialize() output
+	 *
+	 * Paths are looked up (or created) in Topology and get their saved
+	 * state back, so they can be used right away.
+	 *
+	 * @param renv Runtime environment
+	 * @param myIdentity Identity of THIS node
+	 * @param b Buffer to read from
+	 * @param p Index of peer in buffer, advanced past it
+	 * @return New peer
+	 * @throws std::out_of_range Peer extends beyond end of buffer
+	 * @throws std::invalid_argument Unrecognized format
+	 */
+	static SharedPtr<Peer> deserializeNew(const RuntimeEnvironment *renv,const Identity &myIdentity,const Buffer<ZT_PEER_SUGGESTED_SERIALIZATION_BUFFER_SIZE> &b,unsigned int &p);
+
 private:
 	inline uint64_t _pathScore(const unsigned int p,const uint64_t now) const
 	{
-		uint64_t s = ZT_PEER_PING_PERIOD + _paths[p].lastReceive + (uint64_t)(_paths[p].path->preferenceRank() * (ZT_PEER_PING_PERIOD / ZT_PATH_MAX_PREFERENCE_RANK));
+		// Among alive paths, which one heard the latest keepalive says little about
+		// quality, so recency only breaks ties and measured quality decides.
+		const bool alive = _paths[p].path->alive(now);
+		const uint64_t lr = ((alive)&&(now > _paths[p].lastReceive)) ? (now - ((now - _paths[p].lastReceive) / ZT_PATH_HEARTBEAT_PERIOD)) : _paths[p].lastReceive;
+		uint64_t s = ZT_PEER_PING_PERIOD + lr + (uint64_t)(_paths[p].path->preferenceRank() * (ZT_PEER_PING_PERIOD / ZT_PATH_MAX_PREFERENCE_RANK));
 
 		if (_paths[p].path->address().ss_family == AF_INET) {
 			s +=  (uint64_t)(ZT_PEER_PING_PERIOD * (unsigned long)(reinterpret_cast<const struct sockaddr_in *>(&(_paths[p].path->address()))->sin_addr.s_addr == _remoteClusterOptimal4));
@@ -432,7 +578,8 @@ private:
 			s += clusterWeight;
 		}
 
-		s += (ZT_PEER_PING_PERIOD / 2) * (uint64_t)_paths[p].path->alive(now);
+		s += (ZT_PEER_PING_PERIOD / 2) * (uint64_t)alive;
+		s -= _paths[p].path->qualityPenalty();
 
 #ifdef ZT_ENABLE_CLUSTER
 		s -= ZT_PEER_PING_PERIOD * (uint64_t)_paths[p].localClusterSuboptimal;
@@ -457,6 +604,8 @@ private:
 	uint64_t _lastComRequestSent;
 	uint64_t _lastCredentialsReceived;
 	uint64_t _lastTrustEstablishedPacketReceived;
+	uint64_t _lastFecAnnounceSent;
+	uint64_t _lastFecAnnounceReceived;
 
 	uint8_t _remoteClusterOptimal6[16];
 	uint32_t _remoteClusterOptimal4;
@@ -471,6 +620,7 @@ private:
 	struct {
 		uint64_t lastReceive;
 		SharedPtr<Path> path;
+		uint64_t multipathWeight; // quantized weight for getMultipathPath(), 0 if not yet computed
 #ifdef ZT_ENABLE_CLUSTER
 		bool localClusterSuboptimal;
 #endif
@@ -482,6 +632,9 @@ private:
 	unsigned int _directPathPushCutoffCount;
 	unsigned int _credentialsCutoffCount;
 
+	FecEncoder *_fec; // allocated the first time forward error correction is used, kept after
+	volatile bool _fecActive;
+
 	AtomicCounter __refCount;
 };
 
@@ -0,0 +1,97 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZT_POOLEDPACKET_HPP
+#define ZT_POOLEDPACKET_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "Constants.hpp"
+#include "Packet.hpp"
+#include "SharedPtr.hpp"
+#include "AtomicCounter.hpp"
+
+/**
+ * Maximum number of freed packet buffers kept for reuse
+ */
+#define ZT_PACKET_POOL_MAX_FREE 256
+
+namespace ZeroTier {
+
+/**
+ * A reference counted packet whose memory is recycled through a free list
+ *
+ * Queues hold SharedPtr<PooledPacket> handles, so queueing, requeueing, and
+ * retrying a packet move a pointer instead of copying a multi-kilobyte
+ * Packet. The only copy is the one made on the way into the pool, and that
+ * copies only the packet's used length.
+ */
+class PooledPacket : public Packet
+{
+	friend class SharedPtr<PooledPacket>;
+
+public:
+	/**
+	 * Pool statistics since startup
+	 */
+	struct Stats
+	{
+		uint64_t allocated; // buffers obtained from the heap
+		uint64_t reused; // buffers taken from the free list
+		uint64_t copies; // packets copied into pooled buffers
+		uint64_t bytesCopied; // total bytes of those copies
+		unsigned long free; // buffers currently on the free list
+	};
+
+	/**
+	 * @param p Packet to copy (only p.size() bytes are copied)
+	 */
+	PooledPacket(const Packet &p) :
+		Packet(p)
+	{
+		_counted(p.size());
+	}
+
+	/**
+	 * Copy a packet into a pooled buffer
+	 *
+	 * @param p Packet to copy
+	 * @return Handle to copy
+	 */
+	static inline SharedPtr<PooledPacket> copy(const Packet &p) { return SharedPtr<PooledPacket>(new PooledPacket(p)); }
+
+	/**
+	 * @return Pool statistics
+	 */
+	static Stats stats();
+
+	static void *operator new(size_t s);
+	static void operator delete(void *p);
+
+private:
+	~PooledPacket() {}
+
+	static void _counted(const unsigned int len);
+
+	AtomicCounter __refCount;
+};
+
+} // namespace ZeroTier
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZT_RELAYTABLE_HPP
+#define ZT_RELAYTABLE_HPP
+
+#include <stdint.h>
+
+#include "Constants.hpp"
+#include "Address.hpp"
+#include "InetAddress.hpp"
+#include "Hashtable.hpp"
+#include "Mutex.hpp"
+#include "NonCopyable.hpp"
+
+namespace ZeroTier {
+
+/**
+ * Relay forwarding table: destination ZeroTier address -> physical endpoint
+ *
+ * Roots spend most of their time relaying. Resolving a destination normally
+ * means a Topology peer lookup plus scoring all of that peer's paths under
+ * its lock. This caches the result of that work so that subsequent relayed
+ * packets to the same destination are forwarded with one hash lookup.
+ *
+ * Entries are filled in by Switch after a successful relay through the
+ * slow path, dropped when the destination peer learns a new path, and
+ * otherwise expire after ZT_RELAY_ROUTE_EXPIRATION.
+ */
+class RelayTable : NonCopyable
+{
+public:
+	RelayTable() :
+		_routes(64),
+		_relayedPackets(0),
+		_relayedBytes(0)
+	{
+	}
+
+	/**
+	 * Look up a cached route
+	 *
+	 * @param dest Destination ZeroTier address
+	 * @param now Current time
+	 * @param localAddr Result parameter: local socket address to send from
+	 * @param remoteAddr Result parameter: physical address to send to
+	 * @return True if a fresh route was found and result parameters were set
+	 */
+	inline bool get(const Address &dest,const uint64_t now,InetAddress &localAddr,InetAddress &remoteAddr)
+	{
+		Mutex::Lock _l(_lock);
+		const _Route *const r = _routes.get(dest);
+		if ((r)&&((now - r->timestamp) < ZT_RELAY_ROUTE_EXPIRATION)) {
+			localAddr = r->localAddr;
+			remoteAddr = r->remoteAddr;
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Add or refresh a route
+	 *
+	 * @param dest Destination ZeroTier address
+	 * @param localAddr Local socket address
+	 * @param remoteAddr Physical address of destination
+	 * @param now Current time
+	 */
+	inline void set(const Address &dest,const InetAddress &localAddr,const InetAddress &remoteAddr,const uint64_t now)
+	{
+		Mutex::Lock _l(_lock);
+		_Route &r = _routes[dest];
+		r.localAddr = localAddr;
+		r.remoteAddr = remoteAddr;
+		r.timestamp = now;
+	}
+
+	/**
+	 * Drop any route to a destination (e.g. because its paths changed)
+	 *
+	 * @param dest Destination ZeroTier address
+	 */
+	inline void erase(const Address &dest)
+	{
+		Mutex::Lock _l(_lock);
+		_routes.erase(dest);
+	}
+
+	/**
+	 * Remove expired routes
+	 *
+	 * @param now Current time
+	 */
+	inline void clean(const uint64_t now)
+	{
+		Mutex::Lock _l(_lock);
+		Hashtable< Address,_Route >::Iterator i(_routes);
+		Address *a = (Address *)0;
+		_Route *r = (_Route *)0;
+		while (i.next(a,r)) {
+			if ((now - r->timestamp) >= ZT_RELAY_ROUTE_EXPIRATION)
+				_routes.erase(*a);
+		}
+	}
+
+	/**
+	 * Count a relayed packet or fragment
+	 *
+	 * @param len Length in bytes
+	 */
+	inline void relayed(const unsigned int len)
+	{
+#ifdef __GNUC__
+		__sync_add_and_fetch(&_relayedPackets,1ULL);
+		__sync_add_and_fetch(&_relayedBytes,(uint64_t)len);
+#else
+		Mutex::Lock _l(_lock);
+		++_relayedPackets;
+		_relayedBytes += len;
+#endif
+	}
+
+	/**
+	 * @return Total packets and fragments relayed
+	 */
+	inline uint64_t relayedPackets() const { return _relayedPackets; }
+
+	/**
+	 * @return Total bytes relayed
+	 */
+	inline uint64_t relayedBytes() const { return _relayedBytes; }
+
+	/**
+	 * @return Number of cached routes
+	 */
+	inline unsigned long size() const
+	{
+		Mutex::Lock _l(_lock);
+		return _routes.size();
+	}
+
+private:
+	struct _Route
+	{
+		_Route() : localAddr(),remoteAddr(),timestamp(0) {}
+		InetAddress localAddr;
+		InetAddress remoteAddr;
+		uint64_t timestamp;
+	};
+
+	Hashtable< Address,_Route > _routes;
+	volatile uint64_t _relayedPackets;
+	volatile uint64_t _relayedBytes;
+	Mutex _lock;
+};
+
+} // namespace ZeroTier
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZT_SENDQUEUE_HPP
+#define ZT_SENDQUEUE_HPP
+
+#include <stdint.h>
+
+#include <list>
+#include <algorithm>
+
+#include "Constants.hpp"
+#include "Address.hpp"
+#include "Path.hpp"
+#include "Packet.hpp"
+#include "PooledPacket.hpp"
+#include "SharedPtr.hpp"
+#include "Hashtable.hpp"
+#include "Mutex.hpp"
+#include "NonCopyable.hpp"
+
+namespace ZeroTier {
+
+/**
+ * Paced, per-peer fair transmit queue
+ *
+ * When pacing is enabled, outgoing packets are queued per destination peer
+ * and sent by a deficit round robin scheduler limited by a token bucket.
+ * A bulk transfer to one peer then can't burst into the UDP socket buffer
+ * ahead of everyone else: each backlogged peer gets an equal share of the
+ * pacing rate, and a peer whose queue is full has new packets dropped
+ * rather than delaying others.
+ *
+ * Whole packets are queued as PooledPacket handles and admitted or dropped
+ * as a unit, then fragmented as they are sent. Dropping only some fragments
+ * of a packet would waste the rest, since the receiver could never
+ * reassemble it. The send function is called with the queue unlocked, so
+ * slow sends don't hold up enqueueing.
+ *
+ * Only one thread drains at a time, so packets to a peer always go out in
+ * queue order. A thread that finds a drain already running returns at once
+ * and the running drainer makes another pass to pick up what it queued.
+ *
+ * When pacing is disabled (rate of zero) Switch sends directly and this
+ * is never touched.
+ */
+class SendQueue : NonCopyable
+{
+public:
+	SendQueue() :
+		_queues(16),
+		_rate(0),
+		_maxDepth(ZT_SEND_QUEUE_DEFAULT_DEPTH),
+		_tokens(0),
+		_lastRefill(0),
+		_frontCredited(false),
+		_draining(false),
+		_redrain(false),
+		_depth(0),
+		_drops(0)
+	{
+	}
+
+	/**
+	 * Set pacing rate and per-peer queue limit
+	 *
+	 * @param bytesPerSecond Pacing rate or 0 to disable pacing
+	 * @param maxDepth Maximum packets queued per peer (0 for default)
+	 */
+	inline void setPacing(const uint64_t bytesPerSecond,const unsigned int maxDepth)
+	{
+		Mutex::Lock _l(_lock);
+		_rate = bytesPerSecond;
+		_maxDepth = (maxDepth) ? maxDepth : ZT_SEND_QUEUE_DEFAULT_DEPTH;
+	}
+
+	/**
+	 * @return True if pacing is enabled
+	 */
+	inline bool enabled() const { return (_rate != 0); }
+
+	/**
+	 * Queue an armored packet for paced sending
+	 *
+	 * @param peer Destination peer (queueing key)
+	 * @param path Path to send via
+	 * @param packet Armored packet (not copied; must not be modified after this)
+	 * @param mtu Fragmentation MTU (see Packet::sendPieces())
+	 * @param pieces Pieces of packet to send (see Packet::sendPieces())
+	 * @param now Current time
+	 * @return True if queued, false if dropped because this peer's queue is full
+	 */
+	inline bool enqueue(const Address &peer,const SharedPtr<Path> &path,const SharedPtr<PooledPacket> &packet,const unsigned int mtu,const uint32_t pieces,const uint64_t now)
+	{
+		const unsigned int len = packet->wireLength(mtu,pieces);
+		Mutex::Lock _l(_lock);
+		_Queue &q = _queues[peer];
+		q.lastEnqueue = now;
+		if (q.depth >= _maxDepth) {
+			++q.drops;
+			++_drops;
+			return false;
+		}
+		q.packets.push_back(_Packet());
+		q.packets.back().path = path;
+		q.packets.back().packet = packet;
+		q.packets.back().mtu = mtu;
+		q.packets.back().pieces = pieces;
+		q.packets.back().len = len;
+		++q.depth;
+		++_depth;
+		if (!q.active) {
+			q.active = true;
+			_active.push_back(peer);
+		}
+		return true;
+	}
+
+	/**
+	 * Send as much as the pacing rate currently allows
+	 *
+	 * Packets are taken off the queues in batches of up to
+	 * ZT_SEND_QUEUE_DRAIN_BATCH, and each batch is sent after the queue is
+	 * unlocked. If another thread is already draining this returns at once
+	 * and leaves the work to it.
+	 *
+	 * @param send Function called as send(const SharedPtr<Path> &,const Packet &,unsigned int mtu,uint32_t pieces)
+	 * @param now Current time
+	 * @return Milliseconds until more can be sent, or 0xffffffff if nothing is queued (1 if another drain was running)
+	 * @tparam F Send function type
+	 */
+	template<typename F>
+	inline unsigned long drain(F send,const uint64_t now)
+	{
+		{
+			Mutex::Lock _l(_lock);
+			if (_draining) {
+				_redrain = true;
+				return 1; // check back soon in case the running drainer had to stop for pacing
+			}
+			_draining = true;
+		}
+
+		_Packet batch[ZT_SEND_QUEUE_DRAIN_BATCH];
+		for(;;) {
+			unsigned long wait = 0xffffffff;
+			unsigned int n;
+			{
+				Mutex::Lock _l(_lock);
+				_redrain = false;
+				n = _dequeue(batch,now,wait);
+			}
+			for(unsigned int i=0;i<n;++i) {
+				send(batch[i].path,*(batch[i].packet),batch[i].mtu,batch[i].pieces);
+				batch[i].path.zero();
+				batch[i].packet.zero();
+			}
+			if (n < ZT_SEND_QUEUE_DRAIN_BATCH) {
+				Mutex::Lock _l(_lock);
+				if (!_redrain) {
+					_draining = false;
+					return wait;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Forget idle peers' queues (and their drop counters)
+	 *
+	 * @param now Current time
+	 */
+	inline void clean(const uint64_t now)
+	{
+		Mutex::Lock _l(_lock);
+		Hashtable< Address,_Queue >::Iterator i(_queues);
+		Address *a = (Address *)0;
+		_Queue *q = (_Queue *)0;
+		while (i.next(a,q)) {
+			if ((!q->active)&&((now - q->lastEnqueue) >= ZT_PEER_ACTIVITY_TIMEOUT))
+				_queues.erase(*a);
+		}
+	}
+
+	/**
+	 * Get queue statistics for a peer
+	 *
+	 * @param peer Peer address
+	 * @param depth Result parameter: packets currently queued
+	 * @param drops Result parameter: packets dropped because the queue was full
+	 */
+	inline void peerStats(const Address &peer,unsigned int &depth,uint64_t &drops) const
+	{
+		Mutex::Lock _l(_lock);
+		const _Queue *const q = _queues.get(peer);
+		if (q) {
+			depth = q->depth;
+			drops = q->drops;
+		} else {
+			depth = 0;
+			drops = 0;
+		}
+	}
+
+	/**
+	 * @return Total packets currently queued for all peers
+	 */
+	inline unsigned long depth() const { return _depth; }
+
+	/**
+	 * @return Total packets dropped because a peer's queue was full
+	 */
+	inline uint64_t drops() const { return _drops; }
+
+private:
+	struct _Packet
+	{
+		SharedPtr<Path> path;
+		SharedPtr<PooledPacket> packet;
+		unsigned int mtu;
+		uint32_t pieces;
+		unsigned int len; // bytes on the wire
+	};
+
+	struct _Queue
+	{
+		_Queue() : packets(),deficit(0),depth(0),drops(0),lastEnqueue(0),active(false) {}
+		std::list<_Packet> packets;
+		uint64_t deficit;
+		unsigned int depth;
+		uint64_t drops;
+		uint64_t lastEnqueue;
+		bool active; // true if in _active round robin list
+	};
+
+	// Called with _lock held: move up to a batch of sendable packets into out and set wait if more must wait
+	inline unsigned int _dequeue(_Packet *out,const uint64_t now,unsigned long &wait)
+	{
+		unsigned int n = 0;
+
+		if (!_rate) {
+			// Pacing was turned off with packets still queued, so just flush them
+			while ((!_active.empty())&&(n < ZT_SEND_QUEUE_DRAIN_BATCH)) {
+				_Queue *const q = _queues.get(_active.front());
+				if (q) {
+					while ((!q->packets.empty())&&(n < ZT_SEND_QUEUE_DRAIN_BATCH)) {
+						_take(*q,out[n++]);
+						--_depth;
+					}
+					if (!q->packets.empty())
+						break;
+					q->deficit = 0;
+					q->active = false;
+				}
+				_active.pop_front();
+			}
+			_frontCredited = false;
+			return n;
+		}
+
+		// The bucket must hold at least one whole packet or a big one could never go
+		const uint64_t burst = std::max((_rate * ZT_SEND_QUEUE_BURST) / 1000,(uint64_t)(ZT_PROTO_MAX_PACKET_LENGTH + (ZT_MAX_PACKET_FRAGMENTS * ZT_PROTO_MIN_FRAGMENT_LENGTH)));
+		if (now > _lastRefill) {
+			const uint64_t elapsed = std::min(now - _lastRefill,(uint64_t)1000); // a full second already overfills the bucket
+			_tokens = std::min(_tokens + ((elapsed * _rate) / 1000),burst);
+			_lastRefill = now;
+		}
+
+		while ((!_active.empty())&&(n < ZT_SEND_QUEUE_DRAIN_BATCH)) {
+			_Queue *const q = _queues.get(_active.front());
+			if ((!q)||(q->packets.empty())) {
+				if (q) {
+					q->deficit = 0;
+					q->active = false;
+				}
+				_active.pop_front();
+				_frontCredited = false;
+				continue;
+			}
+
+			// Each peer gets one quantum of credit per round and is served while it lasts
+			if (!_frontCredited) {
+				q->deficit += ZT_SEND_QUEUE_QUANTUM;
+				_frontCredited = true;
+			}
+
+			const unsigned int len = q->packets.front().len;
+			if (q->deficit < len) {
+				_active.push_back(_active.front());
+				_active.pop_front();
+				_frontCredited = false;
+				continue;
+			}
+
+			if (_tokens < len) {
+				wait = std::max((unsigned long)((((uint64_t)len - _tokens) * 1000) / _rate),1UL);
+				break;
+			}
+
+			_take(*q,out[n++]);
+			_tokens -= len;
+			q->deficit -= len;
+			--_depth;
+
+			if (q->packets.empty()) {
+				q->deficit = 0;
+				q->active = false;
+				_active.pop_front();
+				_frontCredited = false;
+			}
+		}
+
+		return n;
+	}
+
+	static inline void _take(_Queue &q,_Packet &to)
+	{
+		_Packet &p = q.packets.front();
+		to.path.swap(p.path);
+		to.packet.swap(p.packet);
+		to.mtu = p.mtu;
+		to.pieces = p.pieces;
+		to.len = p.len;
+		q.packets.pop_front();
+		--q.depth;
+	}
+
+	Hashtable< Address,_Queue > _queues;
+	std::list<Address> _active; // peers with queued packets in round robin order
+	uint64_t _rate; // bytes per second, 0 if pacing is disabled
+	unsigned int _maxDepth;
+	uint64_t _tokens;
+	uint64_t _lastRefill;
+	bool _frontCredited; // true if front of _active has received its quantum this round
+	bool _draining; // true while a thread is in drain()
+	bool _redrain; // true if drain() was called while another drain was running
+	volatile unsigned long _depth;
+	volatile uint64_t _drops;
+	Mutex _lock;
+};
+
+} // namespace ZeroTier
+
+#endif
@@ -61,6 +61,13 @@ public:
 	{
 	}
 
+	SharedPtr(SharedPtr &&sp)
+		throw() :
+		_ptr(sp._ptr)
+	{
+		sp._ptr = (T *)0;
+	}
+
 	~SharedPtr()
 	{
 		if (_ptr) {
@@ -82,6 +89,12 @@ public:
 		return *this;
 	}
 
+	inline SharedPtr &operator=(SharedPtr &&sp)
+	{
+		swap(sp);
+		return *this;
+	}
+
 	/**
 	 * Set to a naked pointer and increment its reference count
 	 *
@@ -154,6 +167,25 @@ public:
 		}
 	}
 
+	/**
+	 * Check whether this is the only reference to the object
+	 *
+	 * Like reclaimIfWeak() this does not guard against another thread taking
+	 * a new reference right after the check, so callers must ensure that is
+	 * harmless.
+	 *
+	 * @return True if object is non-NULL and this is its only reference
+	 */
+	inline bool isOnlyReference()
+	{
+		if (_ptr) {
+			const bool only = (++_ptr->__refCount <= 2);
+			--_ptr->__refCount;
+			return only;
+		}
+		return false;
+	}
+
 	inline bool operator==(const SharedPtr &sp) const throw() { return (_ptr == sp._ptr); }
 	inline bool operator!=(const SharedPtr &sp) const throw() { return (_ptr != sp._ptr); }
 	inline bool operator>(const SharedPtr &sp) const throw() { return (_ptr > sp._ptr); }
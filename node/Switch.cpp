@@ -39,6 +39,12 @@
 
 namespace ZeroTier {
 
+// Peers before protocol version 10 would just drop frames over ZT_DEFAULT_MTU, so don't bother
+static inline bool _refusesJumboFrames(const SharedPtr<Peer> &peer)
+{
+	return ((peer)&&(!peer->acceptsJumboFrames()));
+}
+
 #ifdef ZT_TRACE
 static const char *etherTypeName(const unsigned int etherType)
 {
@@ -56,21 +62,60 @@ static const char *etherTypeName(const unsigned int etherType)
 }
 #endif // ZT_TRACE
 
+#ifdef ZT_ENABLE_CLUSTER
+// Sends pieces of a packet via another cluster member (see Packet::sendPieces())
+struct _ClusterSender
+{
+	_ClusterSender(const RuntimeEnvironment *renv,int m,const Address &d) : RR(renv),memberId(m),dest(d) {}
+	inline bool operator()(const void *data,unsigned int len) { return RR->cluster->sendViaCluster(memberId,dest,data,len); }
+	const RuntimeEnvironment *RR;
+	int memberId;
+	const Address &dest;
+};
+#endif
+
 Switch::Switch(const RuntimeEnvironment *renv) :
 	RR(renv),
 	_lastBeaconResponse(0),
 	_outstandingWhoisRequests(32),
-	_lastUniteAttempt(8) // only really used on root servers and upstreams, and it'll grow there just fine
+	_rxQueue(new RXQueueEntry[ZT_RX_QUEUE_SIZE]),
+	_rxQueueShards(1),
+	_txFragmentedPtr(0),
+	_fragmentsRetransmitted(0),
+	_nextFragmentNack(0xffffffffffffffffULL),
+	_fragmentRecovery(false),
+	_lastUniteAttempt(8), // only really used on root servers and upstreams, and it'll grow there just fine
+	_fecParitySent(0)
 {
 }
 
+Switch::~Switch()
+{
+	delete [] _rxQueue;
+}
+
+void Switch::setRxQueueShards(unsigned int shards)
+{
+	shards = std::max(std::min(shards,(unsigned int)ZT_RX_QUEUE_SHARDS),1U);
+	if (shards != _rxQueueShards) {
+		delete [] _rxQueue;
+		_rxQueue = new RXQueueEntry[ZT_RX_QUEUE_SIZE * shards];
+		_rxQueueShards = shards;
+	}
+}
+
 void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &fromAddr,const void *data,unsigned int len)
 {
 	try {
 		const uint64_t now = RR->node->now();
 
+		// Roots forward most traffic to destinations they have recently
+		// relayed to, so try the cached relay route before any Path/Peer work.
+		if ((len > ZT_PROTO_MIN_FRAGMENT_LENGTH)&&(len <= ZT_PROTO_MAX_PACKET_LENGTH)&&(RR->topology->amRoot())&&(_relayFast(now,data,len)))
+			return;
+
 		SharedPtr<Path> path(RR->topology->getPath(localAddr,fromAddr));
-		path->received(now);
+		path->received(now,len);
 
 		if (len == 13) {
 			/* LEGACY: before VERB_PUSH_DIRECT_PATHS, peers used broadcast
@@ -116,7 +161,9 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 						// Note: we don't bother initiating NAT-t for fragments, since heads will set that off.
 						// It wouldn't hurt anything, just redundant and unnecessary.
 						SharedPtr<Peer> relayTo = RR->topology->getPeer(destination);
-						if ((!relayTo)||(!relayTo->sendDirect(fragment.data(),fragment.size(),now,false))) {
+						if ((relayTo)&&(relayTo->sendDirect(fragment.data(),fragment.size(),now,false))) {
+							_relayed(now,relayTo,fragment.size());
+						} else {
 #ifdef ZT_ENABLE_CLUSTER
 							if ((RR->cluster)&&(!isClusterFrontplane)) {
 								RR->cluster->relayViaCluster(Address(),destination,fragment.data(),fragment.size(),false);
@@ -126,8 +173,8 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 
 							// Don't know peer or no direct path -- so relay via someone upstream
 							relayTo = RR->topology->getUpstreamPeer();
-							if (relayTo)
-								relayTo->sendDirect(fragment.data(),fragment.size(),now,true);
+							if ((relayTo)&&(relayTo->sendDirect(fragment.data(),fragment.size(),now,true)))
+								_relayTable.relayed(fragment.size());
 						}
 					} else {
 						TRACE("dropped relay [fragment](%s) -> %s, max hops exceeded",fromAddr.toString().c_str(),destination.toString().c_str());
@@ -144,23 +191,31 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 						// Total fragments must be more than 1, otherwise why are we
 						// seeing a Packet::Fragment?
 
-						Mutex::Lock _l(_rxQueue_m);
-						RXQueueEntry *const rq = _findRXQueueEntry(now,fragmentPacketId);
+						const unsigned int shard = _rxShard(fromAddr);
+						Mutex::Lock _l(_rxQueue_m[shard]);
+						RXQueueEntry *const rq = _findRXQueueEntry(shard,now,fragmentPacketId);
 
 						if ((!rq->timestamp)||(rq->packetId != fragmentPacketId)) {
 							// No packet found, so we received a fragment without its head.
 							//TRACE("fragment (%u/%u) of %.16llx from %s",fragmentNumber + 1,totalFragments,fragmentPacketId,fromAddr.toString().c_str());
 
+							if (rq->timestamp)
+								_rxEntryDropped(shard,rq);
 							rq->timestamp = now;
 							rq->packetId = fragmentPacketId;
 							rq->frags[fragmentNumber - 1] = fragment;
 							rq->totalFragments = totalFragments; // total fragment count is known
 							rq->haveFragments = 1 << fragmentNumber; // we have only this fragment
+							rq->nackedFragments = 0;
+							rq->nackCount = 0;
 							rq->complete = false;
+							_fragmentNackNeeded(now);
 						} else if (!(rq->haveFragments & (1 << fragmentNumber))) {
 							// We have other fragments and maybe the head, so add this one and check
 							//TRACE("fragment (%u/%u) of %.16llx from %s",fragmentNumber + 1,totalFragments,fragmentPacketId,fromAddr.toString().c_str());
 
+							if ((rq->nackedFragments & (1 << fragmentNumber)) != 0)
+								++_rxCounters[shard].recovered;
 							rq->frags[fragmentNumber - 1] = fragment;
 							rq->totalFragments = totalFragments;
 
@@ -214,6 +269,7 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 
 						SharedPtr<Peer> relayTo = RR->topology->getPeer(destination);
 						if ((relayTo)&&(relayTo->sendDirect(packet.data(),packet.size(),now,false))) {
+							_relayed(now,relayTo,packet.size());
 							if ((source != RR->identity.address())&&(_shouldUnite(now,source,destination))) { // don't send RENDEZVOUS for cluster frontplane relays
 								const InetAddress *hintToSource = (InetAddress *)0;
 								const InetAddress *hintToDest = (InetAddress *)0;
@@ -277,8 +333,8 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 							}
 #endif
 							relayTo = RR->topology->getUpstreamPeer(&source,1,true);
-							if (relayTo)
-								relayTo->sendDirect(packet.data(),packet.size(),now,true);
+							if ((relayTo)&&(relayTo->sendDirect(packet.data(),packet.size(),now,true)))
+								_relayTable.relayed(packet.size());
 						}
 					} else {
 						TRACE("dropped relay %s(%s) -> %s, max hops exceeded",packet.source().toString().c_str(),fromAddr.toString().c_str(),destination.toString().c_str());
@@ -297,22 +353,31 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 						((uint64_t)reinterpret_cast<const uint8_t *>(data)[7])
 					);
 
-					Mutex::Lock _l(_rxQueue_m);
-					RXQueueEntry *const rq = _findRXQueueEntry(now,packetId);
+					const unsigned int shard = _rxShard(fromAddr);
+					Mutex::Lock _l(_rxQueue_m[shard]);
+					RXQueueEntry *const rq = _findRXQueueEntry(shard,now,packetId);
 
 					if ((!rq->timestamp)||(rq->packetId != packetId)) {
 						// If we have no other fragments yet, create an entry and save the head
 						//TRACE("fragment (0/?) of %.16llx from %s",pid,fromAddr.toString().c_str());
 
+						if (rq->timestamp)
+							_rxEntryDropped(shard,rq);
 						rq->timestamp = now;
 						rq->packetId = packetId;
 						rq->frag0.init(data,len,path,now);
 						rq->totalFragments = 0;
 						rq->haveFragments = 1;
+						rq->nackedFragments = 0;
+						rq->nackCount = 0;
 						rq->complete = false;
+						_fragmentNackNeeded(now);
 					} else if (!(rq->haveFragments & 1)) {
 						// If we have other fragments but no head, see if we are complete with the head
 
+						if ((rq->nackedFragments & 1) != 0)
+							++_rxCounters[shard].recovered;
+
 						if ((rq->totalFragments > 1)&&(Utils::countBits(rq->haveFragments |= 1) == rq->totalFragments)) {
 							// We have all fragments -- assemble and process full Packet
 							//TRACE("packet %.16llx is complete, assembling and processing...",pid);
@@ -334,15 +399,21 @@ void Switch::onRemotePacket(const InetAddress &localAddr,const InetAddress &from
 				} else {
 					// Packet is unfragmented, so just process it
 					IncomingPacket packet(data,len,path,now);
+					if ((RR->node->fecEnabled())&&(!_fecDecoder.received(packet.source(),packet.packetId(),data,len,now)))
+						return; // already rebuilt from FEC parity
 					if (!packet.tryDecode(RR)) {
-						Mutex::Lock _l(_rxQueue_m);
-						RXQueueEntry *rq = &(_rxQueue[ZT_RX_QUEUE_SIZE - 1]);
+						const unsigned int shard = _rxShard(fromAddr);
+						Mutex::Lock _l(_rxQueue_m[shard]);
+						RXQueueEntry *const q = _rxQueue + (shard * ZT_RX_QUEUE_SIZE);
+						RXQueueEntry *rq = &(q[ZT_RX_QUEUE_SIZE - 1]);
 						unsigned long i = ZT_RX_QUEUE_SIZE - 1;
 						while ((i)&&(rq->timestamp)) {
-							RXQueueEntry *tmp = &(_rxQueue[--i]);
+							RXQueueEntry *tmp = &(q[--i]);
 							if (tmp->timestamp < rq->timestamp)
 								rq = tmp;
 						}
+						if (rq->timestamp)
+							_rxEntryDropped(shard,rq);
 						rq->timestamp = now;
 						rq->packetId = packet.packetId();
 						rq->frag0 = packet;
@@ -367,6 +438,11 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 	if (!network->hasConfig())
 		return;
 
+	if (len > network->config().mtu) {
+		TRACE("%.16llx: %s -> %s %s not sent: %u bytes is over network MTU %u",network->id(),from.toString().c_str(),to.toString().c_str(),etherTypeName(etherType),len,network->config().mtu);
+		return;
+	}
+
 	// Check if this packet is from someone other than the tap -- i.e. bridged in
 	bool fromBridged;
 	if ((fromBridged = (from != network->mac()))) {
@@ -519,7 +595,6 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 		// Destination is another ZeroTier peer on the same network
 
 		Address toZT(to.toAddress(network->id())); // since in-network MACs are derived from addresses and network IDs, we can reverse this
-		SharedPtr<Peer> toPeer(RR->topology->getPeer(toZT));
 
 		if (!network->filterOutgoingPacket(false,RR->identity.address(),toZT,from,to,(const uint8_t *)data,len,etherType,vlanId)) {
 			TRACE("%.16llx: %s -> %s %s packet not sent: filterOutgoingPacket() returned false",network->id(),from.toString().c_str(),to.toString().c_str(),etherTypeName(etherType));
@@ -536,7 +611,7 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 			outp.append(data,len);
 			if (!network->config().disableCompression())
 				outp.compress();
-			send(outp,true);
+			send(outp,true,_flowId(toZT,etherType,data,len),(len > ZT_DEFAULT_MTU));
 		} else {
 			Packet outp(toZT,RR->identity.address(),Packet::VERB_FRAME);
 			outp.append(network->id());
@@ -544,7 +619,7 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 			outp.append(data,len);
 			if (!network->config().disableCompression())
 				outp.compress();
-			send(outp,true);
+			send(outp,true,_flowId(toZT,etherType,data,len),(len > ZT_DEFAULT_MTU));
 		}
 
 		//TRACE("%.16llx: UNICAST: %s -> %s etherType==%s(%.4x) vlanId==%u len==%u fromBridged==%d includeCom==%d",network->id(),from.toString().c_str(),to.toString().c_str(),etherTypeName(etherType),etherType,vlanId,len,(int)fromBridged,(int)includeCom);
@@ -602,7 +677,7 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 				outp.append(data,len);
 				if (!network->config().disableCompression())
 					outp.compress();
-				send(outp,true);
+				send(outp,true,_flowId(bridges[b],etherType,data,len),(len > ZT_DEFAULT_MTU));
 			} else {
 				TRACE("%.16llx: %s -> %s %s packet not sent: filterOutgoingPacket() returned false",network->id(),from.toString().c_str(),to.toString().c_str(),etherTypeName(etherType));
 			}
@@ -610,16 +685,21 @@ void Switch::onLocalEthernet(const SharedPtr<Network> &network,const MAC &from,c
 	}
 }
 
-void Switch::send(Packet &packet,bool encrypt)
+void Switch::send(Packet &packet,bool encrypt,uint64_t flowId,bool jumbo)
 {
 	if (packet.destination() == RR->identity.address()) {
 		TRACE("BUG: caught attempt to send() to self, ignored");
 		return;
 	}
 
-	if (!_trySend(packet,encrypt)) {
+	if ((jumbo)&&(_refusesJumboFrames(RR->topology->getPeerNoCache(packet.destination())))) {
+		TRACE("%s packet not sent: frame is over %s's maximum frame size",Packet::verbString(packet.verb()),packet.destination().toString().c_str());
+		return;
+	}
+
+	if (!_trySend(packet,encrypt,flowId)) {
 		Mutex::Lock _l(_txQueue_m);
-		_txQueue.push_back(TXQueueEntry(packet.destination(),RR->node->now(),packet,encrypt));
+		_txQueue.push_back(TXQueueEntry(packet.destination(),RR->node->now(),PooledPacket::copy(packet),encrypt,jumbo));
 	}
 }
 
@@ -654,11 +734,13 @@ void Switch::doAnythingWaitingForPeer(const SharedPtr<Peer> &peer)
 		_outstandingWhoisRequests.erase(peer->address());
 	}
 
-	{	// finish processing any packets waiting on peer's public key / identity
-		Mutex::Lock _l(_rxQueue_m);
+	// finish processing any packets waiting on peer's public key / identity
+	for(unsigned int shard=0;shard<_rxQueueShards;++shard) {
+		Mutex::Lock _l(_rxQueue_m[shard]);
+		RXQueueEntry *const q = _rxQueue + (shard * ZT_RX_QUEUE_SIZE);
 		unsigned long i = ZT_RX_QUEUE_SIZE;
 		while (i) {
-			RXQueueEntry *rq = &(_rxQueue[--i]);
+			RXQueueEntry *rq = &(q[--i]);
 			if ((rq->timestamp)&&(rq->complete)) {
 				if (rq->frag0.tryDecode(RR))
 					rq->timestamp = 0;
@@ -670,7 +752,10 @@ void Switch::doAnythingWaitingForPeer(const SharedPtr<Peer> &peer)
 		Mutex::Lock _l(_txQueue_m);
 		for(std::list< TXQueueEntry >::iterator txi(_txQueue.begin());txi!=_txQueue.end();) {
 			if (txi->dest == peer->address()) {
-				if (_trySend(txi->packet,txi->encrypt))
+				if ((txi->jumbo)&&(_refusesJumboFrames(peer))) {
+					TRACE("TX %s -> %s dropped: frame is over the peer's maximum frame size",txi->packet->source().toString().c_str(),txi->dest.toString().c_str());
+					_txQueue.erase(txi++);
+				} else if (_trySend(*(txi->packet),txi->encrypt,0))
 					_txQueue.erase(txi++);
 				else ++txi;
 			} else ++txi;
@@ -709,10 +794,13 @@ unsigned long Switch::doTimerTasks(uint64_t now)
 	{	// Time out TX queue packets that never got WHOIS lookups or other info.
 		Mutex::Lock _l(_txQueue_m);
 		for(std::list< TXQueueEntry >::iterator txi(_txQueue.begin());txi!=_txQueue.end();) {
-			if (_trySend(txi->packet,txi->encrypt))
+			if ((txi->jumbo)&&(_refusesJumboFrames(RR->topology->getPeerNoCache(txi->dest)))) {
+				TRACE("TX %s -> %s dropped: frame is over the peer's maximum frame size",txi->packet->source().toString().c_str(),txi->dest.toString().c_str());
+				_txQueue.erase(txi++);
+			} else if (_trySend(*(txi->packet),txi->encrypt,0))
 				_txQueue.erase(txi++);
 			else if ((now - txi->creationTime) > ZT_TRANSMIT_QUEUE_TIMEOUT) {
-				TRACE("TX %s -> %s timed out",txi->packet.source().toString().c_str(),txi->packet.destination().toString().c_str());
+				TRACE("TX %s -> %s timed out",txi->packet->source().toString().c_str(),txi->packet->destination().toString().c_str());
 				_txQueue.erase(txi++);
 			} else ++txi;
 		}
@@ -729,9 +817,186 @@ unsigned long Switch::doTimerTasks(uint64_t now)
 		}
 	}
 
+	_relayTable.clean(now);
+	_sendQueue.clean(now);
+
 	return nextDelay;
 }
 
+unsigned long Switch::doFragmentRecovery(uint64_t now)
+{
+	{
+		Mutex::Lock _l(_nextFragmentNack_m);
+		if (now < _nextFragmentNack)
+			return (_nextFragmentNack == 0xffffffffffffffffULL) ? 0xffffffff : (unsigned long)(_nextFragmentNack - now);
+		_nextFragmentNack = 0xffffffffffffffffULL;
+	}
+	if (!_fragmentRecovery)
+		return 0xffffffff;
+
+	struct _Nack
+	{
+		Address source;
+		uint64_t packetId;
+		uint32_t missing;
+	};
+	std::vector<_Nack> nacks;
+	uint64_t next = 0xffffffffffffffffULL;
+
+	for(unsigned int shard=0;shard<_rxQueueShards;++shard) {
+		Mutex::Lock _l(_rxQueue_m[shard]);
+		for(unsigned long i=0;i<ZT_RX_QUEUE_SIZE;++i) {
+			RXQueueEntry *const rq = &(_rxQueue[(shard * ZT_RX_QUEUE_SIZE) + i]);
+			// We can only NACK if we have the head, since fragments don't say who sent them
+			if ((!rq->timestamp)||(rq->complete)||((rq->haveFragments & 1) == 0)||(rq->nackCount >= ZT_FRAGMENT_NACK_MAX)||((now - rq->timestamp) >= ZT_RX_QUEUE_EXPIRE))
+				continue;
+
+			const uint64_t due = (rq->nackCount) ? (rq->lastNack + ZT_FRAGMENT_NACK_INTERVAL) : (rq->timestamp + ZT_FRAGMENT_NACK_DELAY);
+			if (now < due) {
+				next = std::min(next,due);
+				continue;
+			}
+
+			const uint32_t missing = fragmentsMissing(rq->totalFragments,rq->haveFragments);
+			if (!missing)
+				continue;
+
+			if (!rq->nackCount)
+				_rxCounters[shard].lost += (rq->totalFragments) ? (uint64_t)Utils::countBits(missing) : 1;
+			rq->nackedFragments |= missing;
+			rq->lastNack = now;
+			if (++rq->nackCount < ZT_FRAGMENT_NACK_MAX)
+				next = std::min(next,now + ZT_FRAGMENT_NACK_INTERVAL);
+
+			nacks.push_back(_Nack());
+			nacks.back().source = rq->frag0.source();
+			nacks.back().packetId = rq->packetId;
+			nacks.back().missing = missing;
+		}
+	}
+
+	{
+		Mutex::Lock _l(_nextFragmentNack_m);
+		if (next < _nextFragmentNack)
+			_nextFragmentNack = next;
+		next = _nextFragmentNack;
+	}
+
+	for(std::vector<_Nack>::iterator n(nacks.begin());n!=nacks.end();++n) {
+		Packet outp(n->source,RR->identity.address(),Packet::VERB_FRAGMENT_NACK);
+		outp.append(n->packetId);
+		outp.append(n->missing);
+		send(outp,true);
+	}
+
+	return (next == 0xffffffffffffffffULL) ? 0xffffffff : (unsigned long)std::max(next - now,(uint64_t)1);
+}
+
+void Switch::retransmitFragments(const Address &peer,const SharedPtr<Path> &path,uint64_t packetId,uint32_t missing)
+{
+	const uint64_t now = RR->node->now();
+	SharedPtr<PooledPacket> packet;
+	unsigned int mtu = 0;
+	uint32_t resend = 0;
+	{
+		Mutex::Lock _l(_txFragmented_m);
+		for(unsigned int i=0;i<ZT_FRAGMENT_RETRANSMIT_BUFFER_SIZE;++i) {
+			TXFragmentedEntry &e = _txFragmented[i];
+			if ((!e.timestamp)||(e.packet->packetId() != packetId)||(e.dest != peer))
+				continue;
+			if (((now - e.timestamp) >= ZT_FRAGMENT_RETRANSMIT_WINDOW)||(e.retransmits >= ZT_FRAGMENT_RETRANSMIT_MAX))
+				return;
+			++e.retransmits;
+
+			// Only count pieces that exist, since a NACK may ask for all possible ones
+			const unsigned int fragPayload = e.mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH;
+			const unsigned int pieces = (e.packet->size() > e.mtu) ? (1 + (((e.packet->size() - e.mtu) + fragPayload - 1) / fragPayload)) : 1;
+			resend = missing & ((pieces >= 32) ? 0xffffffff : ((((uint32_t)1) << pieces) - 1));
+			_fragmentsRetransmitted += (uint64_t)Utils::countBits(resend);
+			packet = e.packet;
+			mtu = e.mtu;
+			break;
+		}
+	}
+
+	// Recreate the original fragments exactly, since the receiver has the others
+	if (resend)
+		_send(peer,path,*packet,packet,mtu,resend,now);
+}
+
+void Switch::fragmentStats(uint64_t &lost,uint64_t &recovered,uint64_t &expired,uint64_t &retransmitted) const
+{
+	lost = recovered = expired = 0;
+	for(unsigned int shard=0;shard<_rxQueueShards;++shard) {
+		Mutex::Lock _l(_rxQueue_m[shard]);
+		lost += _rxCounters[shard].lost;
+		recovered += _rxCounters[shard].recovered;
+		expired += _rxCounters[shard].expired;
+	}
+	Mutex::Lock _l(_txFragmented_m);
+	retransmitted = _fragmentsRetransmitted;
+}
+
+bool Switch::_relayFast(const uint64_t now,const void *data,unsigned int len)
+{
+#ifdef ZT_ENABLE_CLUSTER
+	if (RR->cluster) // cluster relaying has its own rules, use the normal path
+		return false;
+#endif
+
+	const uint8_t *const d = reinterpret_cast<const uint8_t *>(data);
+	const Address destination(d + ZT_PACKET_IDX_DEST,ZT_ADDRESS_LENGTH);
+	if (destination == RR->identity.address())
+		return false;
+
+	unsigned int hopsIdx;
+	if (d[ZT_PACKET_FRAGMENT_IDX_FRAGMENT_INDICATOR] == ZT_PACKET_FRAGMENT_INDICATOR) {
+		if ((unsigned int)(d[ZT_PACKET_FRAGMENT_IDX_HOPS] & ZT_PROTO_MAX_HOPS) >= ZT_RELAY_MAX_HOPS)
+			return false;
+		hopsIdx = ZT_PACKET_FRAGMENT_IDX_HOPS;
+	} else {
+		if (len < ZT_PROTO_MIN_PACKET_LENGTH)
+			return false;
+		if ((unsigned int)(d[ZT_PACKET_IDX_FLAGS] & 0x07) >= ZT_RELAY_MAX_HOPS)
+			return false;
+		const Address source(d + ZT_PACKET_IDX_SOURCE,ZT_ADDRESS_LENGTH);
+		if (source == RR->identity.address())
+			return false;
+		// Let the normal path handle heads that are due for a RENDEZVOUS
+		if (_uniteDue(now,source,destination))
+			return false;
+		hopsIdx = ZT_PACKET_IDX_FLAGS;
+	}
+
+	InetAddress localAddr,remoteAddr;
+	if (!_relayTable.get(destination,now,localAddr,remoteAddr))
+		return false;
+
+	uint8_t buf[ZT_PROTO_MAX_PACKET_LENGTH];
+	memcpy(buf,data,len);
+	if (hopsIdx == ZT_PACKET_FRAGMENT_IDX_HOPS)
+		buf[hopsIdx] = (buf[hopsIdx] + 1) & ZT_PROTO_MAX_HOPS;
+	else buf[hopsIdx] = (buf[hopsIdx] & 0xf8) | ((buf[hopsIdx] + 1) & 0x07);
+
+	if (!RR->node->putPacket(localAddr,remoteAddr,buf,len)) {
+		_relayTable.erase(destination);
+		return false;
+	}
+
+	_relayTable.relayed(len);
+	return true;
+}
+
+void Switch::_relayed(const uint64_t now,const SharedPtr<Peer> &relayTo,unsigned int len)
+{
+	_relayTable.relayed(len);
+	if (RR->topology->amRoot()) {
+		const SharedPtr<Path> bp(relayTo->getBestPath(now,false));
+		if ((bp)&&(bp->alive(now)))
+			_relayTable.set(relayTo->address(),bp->localAddress(),bp->address(),now);
+	}
+}
+
 bool Switch::_shouldUnite(const uint64_t now,const Address &source,const Address &destination)
 {
 	Mutex::Lock _l(_lastUniteAttempt_m);
@@ -743,6 +1008,13 @@ bool Switch::_shouldUnite(const uint64_t now,const Address &source,const Address
 	return false;
 }
 
+bool Switch::_uniteDue(const uint64_t now,const Address &source,const Address &destination)
+{
+	Mutex::Lock _l(_lastUniteAttempt_m);
+	const uint64_t *const ts = _lastUniteAttempt.get(_LastUniteKey(source,destination));
+	return ((!ts)||((now - *ts) >= ZT_MIN_UNITE_INTERVAL));
+}
+
 Address Switch::_sendWhoisRequest(const Address &addr,const Address *peersAlreadyConsulted,unsigned int numPeersAlreadyConsulted)
 {
 	SharedPtr<Peer> upstream(RR->topology->getUpstreamPeer(peersAlreadyConsulted,numPeersAlreadyConsulted,false));
@@ -755,9 +1027,58 @@ Address Switch::_sendWhoisRequest(const Address &addr,const Address *peersAlread
 	return Address();
 }
 
-bool Switch::_trySend(Packet &packet,bool encrypt)
+uint64_t Switch::flowHash(unsigned int etherType,const void *data,unsigned int len)
+{
+	const uint8_t *const b = reinterpret_cast<const uint8_t *>(data);
+	const uint8_t *addrs;
+	unsigned int addrsLen,proto,l4;
+	if ((etherType == ZT_ETHERTYPE_IPV4)&&(len >= 20)&&((b[0] >> 4) == 4)) {
+		proto = b[9];
+		addrs = b + 12;
+		addrsLen = 8;
+		l4 = ((((unsigned int)b[6] & 0x3f) << 8) | (unsigned int)b[7]) ? 0 : ((unsigned int)(b[0] & 0xf) * 4); // no ports in any fragment (MF or offset) so all of a datagram's fragments hash alike
+	} else if ((etherType == ZT_ETHERTYPE_IPV6)&&(len >= 40)&&((b[0] >> 4) == 6)) {
+		proto = b[6];
+		addrs = b + 8;
+		addrsLen = 32;
+		l4 = 40;
+	} else {
+		return 0;
+	}
+
+	// FNV-1a over addresses, protocol, and (if present) ports
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(unsigned int i=0;i<addrsLen;++i) {
+		h ^= (uint64_t)addrs[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= (uint64_t)proto;
+	h *= 0x100000001b3ULL;
+	if ( ((proto == 6)||(proto == 17)||(proto == 132)) && (l4) && ((l4 + 4) <= len) ) {
+		for(unsigned int i=0;i<4;++i) {
+			h ^= (uint64_t)b[l4 + i];
+			h *= 0x100000001b3ULL;
+		}
+	}
+
+	return (h) ? h : 1ULL;
+}
+
+uint64_t Switch::_flowId(const Address &dest,unsigned int etherType,const void *data,unsigned int len)
+{
+	// Hashing every frame is wasted work unless there is more than one path to stripe over
+	if (!RR->node->multipathEnabled())
+		return 0;
+	const SharedPtr<Peer> peer(RR->topology->getPeerNoCache(dest));
+	if ((!peer)||(!peer->hasMultipleAlivePaths(RR->node->now())))
+		return 0;
+	return flowHash(etherType,data,len);
+}
+
+bool Switch::_trySend(Packet &packet,bool encrypt,uint64_t flowId)
 {
 	SharedPtr<Path> viaPath;
+	bool viaPathIsDirect = false;
 	const uint64_t now = RR->node->now();
 	const Address destination(packet.destination());
 
@@ -778,7 +1099,10 @@ bool Switch::_trySend(Packet &packet,bool encrypt)
 		 * to send heartbeats "down" and because we have to at least try to
 		 * go somewhere. */
 
-		viaPath = peer->getBestPath(now,false);
+		if ((flowId)&&(RR->node->multipathEnabled()))
+			viaPath = peer->getMultipathPath(now,flowId);
+		if (!viaPath)
+			viaPath = peer->getBestPath(now,false);
 		if ( (viaPath) && (!viaPath->alive(now)) && (!RR->topology->isUpstream(peer->identity())) ) {
 #ifdef ZT_ENABLE_CLUSTER
 			if ((clusterMostRecentMemberId < 0)||(viaPath->lastIn() > clusterMostRecentTs)) {
@@ -792,6 +1116,7 @@ bool Switch::_trySend(Packet &packet,bool encrypt)
 #endif
 			viaPath.zero();
 		}
+		viaPathIsDirect = (viaPath);
 
 #ifdef ZT_ENABLE_CLUSTER
 		if (clusterMostRecentMemberId >= 0) {
@@ -801,6 +1126,7 @@ bool Switch::_trySend(Packet &packet,bool encrypt)
 #else
 		if (!viaPath) {
 #endif
+			viaPathIsDirect = false;
 			peer->tryMemorizedPath(now); // periodically attempt memorized or statically defined paths, if any are known
 			const SharedPtr<Peer> relay(RR->topology->getUpstreamPeer());
 			if ( (!relay) || (!(viaPath = relay->getBestPath(now,false))) ) {
@@ -824,8 +1150,12 @@ bool Switch::_trySend(Packet &packet,bool encrypt)
 #endif
 	}
 
-	unsigned int chunkSize = std::min(packet.size(),(unsigned int)ZT_UDP_DEFAULT_PAYLOAD_MTU);
-	packet.setFragmented(chunkSize < packet.size());
+	// Direct paths may have discovered a larger MTU; relays and dead paths use the safe default
+	const unsigned int mtu = (viaPathIsDirect) ? viaPath->mtu() : (unsigned int)ZT_UDP_DEFAULT_PAYLOAD_MTU;
+	packet.setFragmented(packet.size() > mtu);
+
+	// Verb is encrypted by armor(), so check it now; parity itself is never covered by parity
+	const bool fecEligible = ((viaPathIsDirect)&&(packet.verb() != Packet::VERB_FEC_PARITY));
 
 #ifdef ZT_ENABLE_CLUSTER
 	const uint64_t trustedPathId = (viaPath) ? RR->topology->getOutboundPathTrust(viaPath->address()) : 0;
@@ -843,38 +1173,52 @@ bool Switch::_trySend(Packet &packet,bool encrypt)
 	}
 #endif
 
+	SharedPtr<PooledPacket> pooled; // copy made only if the packet is queued or kept for retransmission
 #ifdef ZT_ENABLE_CLUSTER
-	if ( ((viaPath)&&(viaPath->send(RR,packet.data(),chunkSize,now))) || ((clusterMostRecentMemberId >= 0)&&(RR->cluster->sendViaCluster(clusterMostRecentMemberId,destination,packet.data(),chunkSize))) ) {
+	_ClusterSender cs(RR,clusterMostRecentMemberId,destination);
+	if ( ((viaPath)&&(_send(destination,viaPath,packet,pooled,mtu,0xffffffff,now))) || ((clusterMostRecentMemberId >= 0)&&(packet.sendPieces(mtu,0xffffffff,cs))) ) {
 #else
-	if (viaPath->send(RR,packet.data(),chunkSize,now)) {
+	if (_send(destination,viaPath,packet,pooled,mtu,0xffffffff,now)) {
 #endif
-		if (chunkSize < packet.size()) {
-			// Too big for one packet, fragment the rest
-			unsigned int fragStart = chunkSize;
-			unsigned int remaining = packet.size() - chunkSize;
-			unsigned int fragsRemaining = (remaining / (ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_PROTO_MIN_FRAGMENT_LENGTH));
-			if ((fragsRemaining * (ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_PROTO_MIN_FRAGMENT_LENGTH)) < remaining)
-				++fragsRemaining;
-			const unsigned int totalFragments = fragsRemaining + 1;
-
-			for(unsigned int fno=1;fno<totalFragments;++fno) {
-				chunkSize = std::min(remaining,(unsigned int)(ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_PROTO_MIN_FRAGMENT_LENGTH));
-				Packet::Fragment frag(packet,fragStart,chunkSize,fno,totalFragments);
-#ifdef ZT_ENABLE_CLUSTER
-				if (viaPath)
-					viaPath->send(RR,frag.data(),frag.size(),now);
-				else if (clusterMostRecentMemberId >= 0)
-					RR->cluster->sendViaCluster(clusterMostRecentMemberId,destination,frag.data(),frag.size());
-#else
-				viaPath->send(RR,frag.data(),frag.size(),now);
-#endif
-				fragStart += chunkSize;
-				remaining -= chunkSize;
+		if (packet.fragmented()) {
+			if ((_fragmentRecovery)&&(viaPath)) {
+				if (!pooled)
+					pooled = PooledPacket::copy(packet);
+				Mutex::Lock _l(_txFragmented_m);
+				TXFragmentedEntry &e = _txFragmented[_txFragmentedPtr++ % ZT_FRAGMENT_RETRANSMIT_BUFFER_SIZE];
+				e.timestamp = now;
+				e.dest = destination;
+				e.mtu = mtu;
+				e.retransmits = 0;
+				e.packet.swap(pooled);
+			}
+		} else if ((fecEligible)&&(peer)) {
+			FecEncoder *const fec = peer->fecEncoder();
+			if ((fec)&&(fec->add(packet.packetId(),packet.data(),packet.size()))) {
+				Packet parity(destination,RR->identity.address(),Packet::VERB_FEC_PARITY);
+				fec->appendParity(parity);
+				if (_trySend(parity,true,0))
+					++_fecParitySent;
 			}
 		}
 	}
 
+	if (_sendQueue.enabled())
+		_sendQueue.drain(_QueueSender(RR,now),now);
+
 	return true;
 }
 
+void Switch::fecRecover(const SharedPtr<Path> &path,const Address &source,const void *parity,unsigned int len)
+{
+	uint8_t buf[ZT_FEC_MAX_PACKET_SIZE];
+	const uint64_t now = RR->node->now();
+	const unsigned int plen = _fecDecoder.recover(source,parity,len,buf,now);
+	if (plen >= ZT_PROTO_MIN_PACKET_LENGTH) {
+		// Rebuilt packet is still armored, so decode it like one that just arrived
+		IncomingPacket packet(buf,plen,path,now);
+		packet.tryDecode(RR);
+	}
+}
+
 } // namespace ZeroTier
@@ -29,6 +29,7 @@
 #include "MAC.hpp"
 #include "NonCopyable.hpp"
 #include "Packet.hpp"
+#include "PooledPacket.hpp"
 #include "Utils.hpp"
 #include "InetAddress.hpp"
 #include "Topology.hpp"
@@ -37,6 +38,9 @@
 #include "SharedPtr.hpp"
 #include "IncomingPacket.hpp"
 #include "Hashtable.hpp"
+#include "RelayTable.hpp"
+#include "SendQueue.hpp"
+#include "Fec.hpp"
 
 namespace ZeroTier {
 
@@ -55,6 +59,7 @@ class Switch : NonCopyable
 {
 public:
 	Switch(const RuntimeEnvironment *renv);
+	~Switch();
 
 	/**
 	 * Called when a packet is received from the real network
@@ -93,8 +98,10 @@ public:
 	 *
 	 * @param packet Packet to send (buffer may be modified)
 	 * @param encrypt Encrypt packet payload? (always true except for HELLO)
+	 * @param flowId Flow hash for multipath path selection or 0 for none
+	 * @param jumbo Packet carries an Ethernet frame larger than ZT_DEFAULT_MTU (checked again if queued)
 	 */
-	void send(Packet &packet,bool encrypt);
+	void send(Packet &packet,bool encrypt,uint64_t flowId = 0,bool jumbo = false);
 
 	/**
 	 * Request WHOIS on a given address
@@ -123,10 +130,233 @@ public:
 	 */
 	unsigned long doTimerTasks(uint64_t now);
 
+	/**
+	 * Drop any cached relay route to a peer
+	 *
+	 * Called when a peer's set of direct paths changes.
+	 *
+	 * @param addr Peer address
+	 */
+	inline void relayRouteChanged(const Address &addr) { _relayTable.erase(addr); }
+
+	/**
+	 * @return Total packets and fragments relayed for other peers
+	 */
+	inline uint64_t relayedPackets() const { return _relayTable.relayedPackets(); }
+
+	/**
+	 * @return Total bytes relayed for other peers
+	 */
+	inline uint64_t relayedBytes() const { return _relayTable.relayedBytes(); }
+
+	/**
+	 * Set transmit pacing rate and per-peer queue depth
+	 *
+	 * @param bytesPerSecond Pacing rate or 0 to send without pacing
+	 * @param maxQueueDepth Maximum packets queued per peer (0 for default)
+	 */
+	inline void setTxPacing(uint64_t bytesPerSecond,unsigned int maxQueueDepth) { _sendQueue.setPacing(bytesPerSecond,maxQueueDepth); }
+
+	/**
+	 * Send whatever transmit pacing currently allows
+	 *
+	 * @param now Current time
+	 * @return Milliseconds until this should be called again, or 0xffffffff if nothing is queued
+	 */
+	inline unsigned long drainTxQueue(uint64_t now) { return _sendQueue.drain(_QueueSender(RR,now),now); }
+
+	/**
+	 * Get transmit queue statistics for a peer
+	 *
+	 * @param peer Peer address
+	 * @param depth Result parameter: packets currently queued
+	 * @param drops Result parameter: packets dropped because the queue was full
+	 */
+	inline void txQueueStats(const Address &peer,unsigned int &depth,uint64_t &drops) const { _sendQueue.peerStats(peer,depth,drops); }
+
+	/**
+	 * @return Total packets currently queued by transmit pacing
+	 */
+	inline unsigned long txQueueDepth() const { return _sendQueue.depth(); }
+
+	/**
+	 * @return Total packets dropped by transmit pacing because a peer's queue was full
+	 */
+	inline uint64_t txQueueDrops() const { return _sendQueue.drops(); }
+
+	/**
+	 * Enable or disable fragment recovery
+	 *
+	 * When enabled, fragmented packets we send are kept briefly for
+	 * retransmission and missing fragments of packets we receive are NACKed.
+	 *
+	 * @param enabled True to enable
+	 */
+	inline void setFragmentRecovery(bool enabled) { _fragmentRecovery = enabled; }
+
+	/**
+	 * NACK missing fragments of incomplete packets that are due
+	 *
+	 * @param now Current time
+	 * @return Milliseconds until this should be called again, or 0xffffffff if nothing is pending
+	 */
+	unsigned long doFragmentRecovery(uint64_t now);
+
+	/**
+	 * @return Time at or after which doFragmentRecovery() may have work, or 0xffffffffffffffff if none
+	 */
+	inline uint64_t nextFragmentNack() const
+	{
+		Mutex::Lock _l(_nextFragmentNack_m);
+		return _nextFragmentNack;
+	}
+
+	/**
+	 * Get the pieces of a partly received packet to NACK
+	 *
+	 * @param totalFragments Total pieces if known from a fragment, or 0 if only the head has arrived
+	 * @param haveFragments Bit mask of pieces received (bit 0 is the head)
+	 * @return Bit mask of pieces to ask for (all possible ones if the total is unknown)
+	 */
+	static inline uint32_t fragmentsMissing(const unsigned int totalFragments,const uint32_t haveFragments)
+	{
+		const unsigned int total = (totalFragments) ? totalFragments : ZT_MAX_PACKET_FRAGMENTS;
+		return ((total >= 32) ? 0xffffffff : ((((uint32_t)1) << total) - 1)) & ~haveFragments;
+	}
+
+	/**
+	 * Resend fragments of a recently sent packet in response to a NACK
+	 *
+	 * @param peer Address of peer that sent the NACK (must be the packet's destination)
+	 * @param path Path the NACK arrived on
+	 * @param packetId Packet ID as sent on the wire
+	 * @param missing Bit mask of fragments to resend (bit 0 is the head)
+	 */
+	void retransmitFragments(const Address &peer,const SharedPtr<Path> &path,uint64_t packetId,uint32_t missing);
+
+	/**
+	 * Get fragment recovery statistics
+	 *
+	 * @param lost Result parameter: fragments found missing and NACKed
+	 * @param recovered Result parameter: NACKed fragments that then arrived
+	 * @param expired Result parameter: fragments never received before their packet was dropped
+	 * @param retransmitted Result parameter: fragments we resent in response to NACKs
+	 */
+	void fragmentStats(uint64_t &lost,uint64_t &recovered,uint64_t &expired,uint64_t &retransmitted) const;
+
+	/**
+	 * Rebuild and process a lost packet from forward error correction parity
+	 *
+	 * @param path Path parity arrived on
+	 * @param source Peer that sent the parity
+	 * @param parity Parity payload
+	 * @param len Length of parity payload
+	 */
+	void fecRecover(const SharedPtr<Path> &path,const Address &source,const void *parity,unsigned int len);
+
+	/**
+	 * @return Forward error correction parity packets sent
+	 */
+	inline uint64_t fecParitySent() const { return _fecParitySent; }
+
+	/**
+	 * @return Lost packets rebuilt from forward error correction parity
+	 */
+	inline uint64_t fecPacketsRecovered() const { return _fecDecoder.recovered(); }
+
+	/**
+	 * Compute a flow hash for an Ethernet payload
+	 *
+	 * IPv4 and IPv6 packets hash by addresses and protocol, plus ports for
+	 * TCP, UDP, and SCTP. Everything else (ARP, fragments after the first,
+	 * etc.) is not classified and gets 0.
+	 *
+	 * @param etherType Ethernet type
+	 * @param data Ethernet payload
+	 * @param len Length of payload
+	 * @return Nonzero flow hash or 0 if this is not a recognized flow
+	 */
+	static uint64_t flowHash(unsigned int etherType,const void *data,unsigned int len);
+
+	/**
+	 * Split the RX queue into independently locked shards
+	 *
+	 * This is for callers that run onRemotePacket() from several threads.
+	 * Each shard has a full ZT_RX_QUEUE_SIZE entries, so one busy sender has
+	 * as much reassembly room as with a single queue. The default is one
+	 * shard, which is the single shared queue. This reallocates the queue
+	 * and must be called before any packets are received.
+	 *
+	 * @param shards Number of shards (clamped to 1..ZT_RX_QUEUE_SHARDS)
+	 */
+	void setRxQueueShards(unsigned int shards);
+
+	/**
+	 * Get the RX queue shard for packets from a physical address
+	 *
+	 * Fragments carry no source ZeroTier address, so the sender's physical
+	 * address is what keeps all fragments of a packet together. Callers that
+	 * run onRemotePacket() from N threads should set N shards and steer each
+	 * sender to thread rxQueueShard() % N, so no two threads share a shard.
+	 *
+	 * @param fromAddr Physical source address
+	 * @return Shard index, 0 to ZT_RX_QUEUE_SHARDS-1
+	 */
+	static inline unsigned int rxQueueShard(const InetAddress &fromAddr)
+	{
+		unsigned long h = fromAddr.hashCode();
+		h ^= h >> 16;
+		h *= 0x45d9f3bUL;
+		h ^= h >> 16;
+		return (unsigned int)(h % ZT_RX_QUEUE_SHARDS);
+	}
+
 private:
+	bool _relayFast(const uint64_t now,const void *data,unsigned int len);
+	void _relayed(const uint64_t now,const SharedPtr<Peer> &relayTo,unsigned int len);
 	bool _shouldUnite(const uint64_t now,const Address &source,const Address &destination);
+	bool _uniteDue(const uint64_t now,const Address &source,const Address &destination);
 	Address _sendWhoisRequest(const Address &addr,const Address *peersAlreadyConsulted,unsigned int numPeersAlreadyConsulted);
-	bool _trySend(Packet &packet,bool encrypt); // packet is modified if return is true
+	bool _trySend(Packet &packet,bool encrypt,uint64_t flowId); // packet is modified if return is true
+	uint64_t _flowId(const Address &dest,unsigned int etherType,const void *data,unsigned int len); // flowHash() only if dest could be striped
+
+	// Sends pieces of a packet via one path (see Packet::sendPieces())
+	struct _PathSender
+	{
+		_PathSender(const RuntimeEnvironment *renv,const SharedPtr<Path> &p,uint64_t n) : RR(renv),path(p),now(n) {}
+		inline bool operator()(const void *data,unsigned int len) { return path->send(RR,data,len,now); }
+		const RuntimeEnvironment *RR;
+		const SharedPtr<Path> &path;
+		uint64_t now;
+	};
+
+	// Sends packets drained from the paced send queue
+	struct _QueueSender
+	{
+		_QueueSender(const RuntimeEnvironment *renv,uint64_t n) : RR(renv),now(n) {}
+		inline void operator()(const SharedPtr<Path> &path,const Packet &packet,unsigned int mtu,uint32_t pieces)
+		{
+			_PathSender ps(RR,path,now);
+			packet.sendPieces(mtu,pieces,ps);
+		}
+		const RuntimeEnvironment *RR;
+		uint64_t now;
+	};
+
+	/* Send an armored packet via path now, or via the paced send queue if
+	 * pacing is enabled. A queued packet is copied into pooled once, and the
+	 * caller may reuse that handle (e.g. to keep it for retransmission).
+	 * Returns false if the send failed or the peer's queue was full. */
+	inline bool _send(const Address &dest,const SharedPtr<Path> &path,const Packet &packet,SharedPtr<PooledPacket> &pooled,const unsigned int mtu,const uint32_t pieces,const uint64_t now)
+	{
+		if (_sendQueue.enabled()) {
+			if (!pooled)
+				pooled = PooledPacket::copy(packet);
+			return _sendQueue.enqueue(dest,path,pooled,mtu,pieces,now);
+		}
+		_PathSender ps(RR,path,now);
+		return packet.sendPieces(mtu,pieces,ps);
+	}
 
 	const RuntimeEnvironment *const RR;
 	uint64_t _lastBeaconResponse;
@@ -152,44 +382,105 @@ private:
 		Packet::Fragment frags[ZT_MAX_PACKET_FRAGMENTS - 1]; // later fragments (if any)
 		unsigned int totalFragments; // 0 if only frag0 received, waiting for frags
 		uint32_t haveFragments; // bit mask, LSB to MSB
+		uint32_t nackedFragments; // fragments we have sent NACKs for
+		uint64_t lastNack;
+		unsigned int nackCount;
 		bool complete; // if true, packet is complete
 	};
-	RXQueueEntry _rxQueue[ZT_RX_QUEUE_SIZE];
-	Mutex _rxQueue_m;
+	RXQueueEntry *_rxQueue; // _rxQueueShards shards of ZT_RX_QUEUE_SIZE entries
+	unsigned int _rxQueueShards;
+	Mutex _rxQueue_m[ZT_RX_QUEUE_SHARDS];
 
-	/* Returns the matching or oldest entry. Caller must check timestamp and
-	 * packet ID to determine which. */
-	inline RXQueueEntry *_findRXQueueEntry(uint64_t now,uint64_t packetId)
+	inline unsigned int _rxShard(const InetAddress &fromAddr) const { return (_rxQueueShards > 1) ? (rxQueueShard(fromAddr) % _rxQueueShards) : 0; }
+
+	/* Returns the matching or oldest entry in a shard. Caller must hold the
+	 * shard's lock and check timestamp and packet ID to determine which. */
+	inline RXQueueEntry *_findRXQueueEntry(unsigned int shard,uint64_t now,uint64_t packetId)
 	{
+		RXQueueEntry *const q = _rxQueue + (shard * ZT_RX_QUEUE_SIZE);
 		RXQueueEntry *rq;
-		RXQueueEntry *oldest = &(_rxQueue[ZT_RX_QUEUE_SIZE - 1]);
+		RXQueueEntry *oldest = &(q[ZT_RX_QUEUE_SIZE - 1]);
 		unsigned long i = ZT_RX_QUEUE_SIZE;
 		while (i) {
-			rq = &(_rxQueue[--i]);
+			rq = &(q[--i]);
 			if ((rq->packetId == packetId)&&(rq->timestamp))
 				return rq;
-			if ((now - rq->timestamp) >= ZT_RX_QUEUE_EXPIRE)
+			if ((rq->timestamp)&&((now - rq->timestamp) >= ZT_RX_QUEUE_EXPIRE)) {
+				_rxEntryDropped(shard,rq);
 				rq->timestamp = 0;
+			}
 			if (rq->timestamp < oldest->timestamp)
 				oldest = rq;
 		}
 		return oldest;
 	}
 
+	// Called with shard locked when an entry is about to be freed or reused
+	inline void _rxEntryDropped(unsigned int shard,const RXQueueEntry *rq)
+	{
+		if (!rq->complete) {
+			const unsigned int total = (rq->totalFragments) ? rq->totalFragments : (unsigned int)Utils::countBits(rq->haveFragments) + 1;
+			if (total > (unsigned int)Utils::countBits(rq->haveFragments))
+				_rxCounters[shard].expired += total - (unsigned int)Utils::countBits(rq->haveFragments);
+		}
+	}
+
+	// Called when an incomplete RX queue entry is created
+	inline void _fragmentNackNeeded(const uint64_t now)
+	{
+		if (_fragmentRecovery) {
+			const uint64_t t = now + ZT_FRAGMENT_NACK_DELAY;
+			Mutex::Lock _l(_nextFragmentNack_m);
+			if (t < _nextFragmentNack)
+				_nextFragmentNack = t;
+		}
+	}
+
+	// Fragment recovery counters, each guarded by the corresponding _rxQueue_m
+	struct RXQueueCounters
+	{
+		RXQueueCounters() : lost(0),recovered(0),expired(0) {}
+		uint64_t lost;
+		uint64_t recovered;
+		uint64_t expired;
+	};
+	RXQueueCounters _rxCounters[ZT_RX_QUEUE_SHARDS];
+
+	// Recently sent fragmented packets kept for fragment recovery
+	struct TXFragmentedEntry
+	{
+		TXFragmentedEntry() : timestamp(0) {}
+		uint64_t timestamp; // 0 if entry is not in use
+		Address dest;
+		unsigned int mtu; // fragmentation MTU used when sent
+		unsigned int retransmits;
+		SharedPtr<PooledPacket> packet; // armored packet exactly as sent
+	};
+	TXFragmentedEntry _txFragmented[ZT_FRAGMENT_RETRANSMIT_BUFFER_SIZE];
+	unsigned long _txFragmentedPtr;
+	uint64_t _fragmentsRetransmitted;
+	Mutex _txFragmented_m;
+
+	uint64_t _nextFragmentNack;
+	Mutex _nextFragmentNack_m; // taken after (never while waiting for) an _rxQueue_m
+	volatile bool _fragmentRecovery;
+
 	// ZeroTier-layer TX queue entry
 	struct TXQueueEntry
 	{
 		TXQueueEntry() {}
-		TXQueueEntry(Address d,uint64_t ct,const Packet &p,bool enc) :
+		TXQueueEntry(Address d,uint64_t ct,const SharedPtr<PooledPacket> &p,bool enc,bool j) :
 			dest(d),
 			creationTime(ct),
 			packet(p),
-			encrypt(enc) {}
+			encrypt(enc),
+			jumbo(j) {}
 
 		Address dest;
 		uint64_t creationTime;
-		Packet packet; // unencrypted/unMAC'd packet -- this is done at send time
+		SharedPtr<PooledPacket> packet; // unencrypted/unMAC'd packet -- this is done at send time
 		bool encrypt;
+		bool jumbo; // frame larger than ZT_DEFAULT_MTU, dropped if the peer turns out not to accept it
 	};
 	std::list< TXQueueEntry > _txQueue;
 	Mutex _txQueue_m;
@@ -214,6 +505,16 @@ private:
 	};
 	Hashtable< _LastUniteKey,uint64_t > _lastUniteAttempt; // key is always sorted in ascending order, for set-like behavior
 	Mutex _lastUniteAttempt_m;
+
+	// Cached destination -> physical endpoint routes for relaying (used on roots)
+	RelayTable _relayTable;
+
+	// Per-peer fair queues for paced sending (unused unless pacing is enabled)
+	SendQueue _sendQueue;
+
+	// Forward error correction receive history (unused unless FEC is enabled)
+	FecDecoder _fecDecoder;
+	volatile uint64_t _fecParitySent;
 };
 
 } // namespace ZeroTier
@@ -24,6 +24,13 @@
 #include "NetworkConfig.hpp"
 #include "Buffer.hpp"
 #include "Switch.hpp"
+#include "Salsa20.hpp"
+#include "Poly1305.hpp"
+#include "SHA512.hpp"
+
+// Sealed peer state: [8] magic, [8] IV, [16] Poly1305 MAC, then ciphertext
+#define ZT_TOPOLOGY_STATE_MAGIC "ZTPEERS1"
+#define ZT_TOPOLOGY_STATE_HEADER_SIZE 32
 
 namespace ZeroTier {
 
@@ -58,8 +65,12 @@ static const unsigned char ZT_DEFAULT_WORLD[ZT_DEFAULT_WORLD_LENGTH] = {0x01,0x0
 Topology::Topology(const RuntimeEnvironment *renv) :
 	RR(renv),
 	_trustedPathCount(0),
+	_savedStateFingerprint(0),
 	_amRoot(false)
 {
+	for(unsigned int c=0;c<ZT_PATH_CACHE_SIZE;++c)
+		_pathCache[c] = (Path *)0;
+
 	try {
 		World cachedPlanet;
 		std::string buf(RR->node->dataStoreGet("planet"));
@@ -405,14 +416,138 @@ void Topology::clean(uint64_t now)
 	}
 	{
 		Mutex::Lock _l(_paths_m);
+
+		// getPath() may have read a raw pointer from _pathCache just before we
+		// clear it, so unreferenced paths are held for one more cycle before
+		// they are actually deleted.
+		_pathGraveyard.clear();
+		for(unsigned int c=0;c<ZT_PATH_CACHE_SIZE;++c)
+			_pathCache[c] = (Path *)0;
+
 		Hashtable< Path::HashKey,SharedPtr<Path> >::Iterator i(_paths);
 		Path::HashKey *k = (Path::HashKey *)0;
 		SharedPtr<Path> *p = (SharedPtr<Path> *)0;
 		while (i.next(k,p)) {
-			if (p->reclaimIfWeak())
+			if (p->isOnlyReference()) {
+				_pathGraveyard.push_back(*p);
 				_paths.erase(*k);
+			}
+		}
+	}
+}
+
+bool Topology::saveState(const uint64_t now,const bool force)
+{
+	Mutex::Lock _sl(_state_m);
+
+	std::vector< SharedPtr<Peer> > peers;
+	const uint64_t fp = _stateFingerprint(&peers);
+	if ((fp == _savedStateFingerprint)&&(!force))
+		return false;
+
+	uint8_t iv[8];
+	Utils::getSecureRandom(iv,sizeof(iv));
+
+	std::string st;
+	st.reserve(ZT_TOPOLOGY_STATE_HEADER_SIZE + 8 + (peers.size() * 256));
+	st.append(ZT_TOPOLOGY_STATE_MAGIC,8);
+	st.append(reinterpret_cast<const char *>(iv),sizeof(iv));
+	st.append(16,(char)0); // MAC is filled in below
+
+	// Plaintext is a timestamp followed by peers, each prefixed by its length
+	Buffer<ZT_PEER_SUGGESTED_SERIALIZATION_BUFFER_SIZE> b;
+	b.append(now);
+	st.append(reinterpret_cast<const char *>(b.data()),b.size());
+	for(std::vector< SharedPtr<Peer> >::const_iterator p(peers.begin());p!=peers.end();++p) {
+		try {
+			b.clear();
+			b.addSize(2);
+			(*p)->serialize(b);
+			b.setAt(0,(uint16_t)(b.size() - 2));
+			st.append(reinterpret_cast<const char *>(b.data()),b.size());
+		} catch ( ... ) {} // peer too big? shouldn't happen, but skip if so
+	}
+	b.burn();
+
+	uint8_t key[32],macKey[32],mac[16];
+	_stateKey(key);
+	Salsa20 s20(key,256,iv);
+	memset(macKey,0,sizeof(macKey));
+	s20.crypt12(macKey,macKey,sizeof(macKey));
+	uint8_t *const ct = reinterpret_cast<uint8_t *>(&(st[ZT_TOPOLOGY_STATE_HEADER_SIZE]));
+	const unsigned int ctlen = (unsigned int)(st.length() - ZT_TOPOLOGY_STATE_HEADER_SIZE);
+	s20.crypt12(ct,ct,ctlen);
+	Poly1305::compute(mac,ct,ctlen,macKey);
+	memcpy(&(st[16]),mac,16);
+	Utils::burn(key,sizeof(key));
+	Utils::burn(macKey,sizeof(macKey));
+
+	if (RR->node->dataStorePut("peers.state",st,true))
+		_savedStateFingerprint = fp;
+	return true;
+}
+
+unsigned long Topology::loadState(const uint64_t now)
+{
+	std::string st(RR->node->dataStoreGet("peers.state"));
+	if ((st.length() < (ZT_TOPOLOGY_STATE_HEADER_SIZE + 8))||(memcmp(st.data(),ZT_TOPOLOGY_STATE_MAGIC,8) != 0))
+		return 0;
+
+	uint8_t key[32],macKey[32],mac[16];
+	_stateKey(key);
+	Salsa20 s20(key,256,st.data() + 8);
+	memset(macKey,0,sizeof(macKey));
+	s20.crypt12(macKey,macKey,sizeof(macKey));
+	uint8_t *const pt = reinterpret_cast<uint8_t *>(&(st[ZT_TOPOLOGY_STATE_HEADER_SIZE]));
+	const unsigned int ptlen = (unsigned int)(st.length() - ZT_TOPOLOGY_STATE_HEADER_SIZE);
+	Poly1305::compute(mac,pt,ptlen,macKey);
+	Utils::burn(key,sizeof(key));
+	Utils::burn(macKey,sizeof(macKey));
+	if (!Utils::secureEq(mac,st.data() + 16,16))
+		return 0; // corrupt, or saved under a different identity
+	s20.crypt12(pt,pt,ptlen);
+
+	// Every peer in memory at the time of the save counted as recently seen,
+	// and state is only rewritten when peers or paths change, so a peer's own
+	// last receive time may be older than the save.
+	uint64_t savedAt = 0;
+	for(unsigned int k=0;((k<8)&&(k<ptlen));++k)
+		savedAt = (savedAt << 8) | (uint64_t)pt[k];
+
+	std::vector< SharedPtr<Peer> > peers;
+	unsigned int p = 8;
+	while ((p + 2) <= ptlen) {
+		const unsigned int len = ((unsigned int)pt[p] << 8) | (unsigned int)pt[p + 1];
+		p += 2;
+		if ((len > ZT_PEER_SUGGESTED_SERIALIZATION_BUFFER_SIZE)||((p + len) > ptlen))
+			break;
+		try {
+			Buffer<ZT_PEER_SUGGESTED_SERIALIZATION_BUFFER_SIZE> b(pt + p,len);
+			unsigned int bp = 0;
+			const SharedPtr<Peer> np(Peer::deserializeNew(RR,RR->identity,b,bp));
+			b.burn();
+			if ((np->address() != RR->identity.address())&&(((now - std::max(np->lastReceive(),savedAt)) <= ZT_PEER_IN_MEMORY_EXPIRATION)||(isUpstream(np->identity()))))
+				peers.push_back(np);
+		} catch ( ... ) {} // skip invalid peers
+		p += len;
+	}
+	Utils::burn(pt,ptlen);
+
+	unsigned long count = 0;
+	{
+		Mutex::Lock _l(_peers_m);
+		for(std::vector< SharedPtr<Peer> >::const_iterator np(peers.begin());np!=peers.end();++np) {
+			SharedPtr<Peer> &hp = _peers[(*np)->address()];
+			if ((!hp)||(hp->identity() == (*np)->identity())) {
+				hp = *np;
+				++count;
+			}
 		}
 	}
+
+	Mutex::Lock _sl(_state_m);
+	_savedStateFingerprint = _stateFingerprint((std::vector< SharedPtr<Peer> > *)0); // what we just loaded needn't be saved again
+	return count;
 }
 
 Identity Topology::_getIdentity(const Address &zta)
@@ -428,6 +563,37 @@ Identity Topology::_getIdentity(const Address &zta)
 	return Identity();
 }
 
+uint64_t Topology::_stateFingerprint(std::vector< SharedPtr<Peer> > *peers)
+{
+	// Sum of per-peer hashes so that hash table order doesn't matter
+	uint64_t fp = 0;
+	Mutex::Lock _l(_peers_m);
+	if (peers)
+		peers->reserve(_peers.size());
+	Hashtable< Address,SharedPtr<Peer> >::Iterator i(_peers);
+	Address *a = (Address *)0;
+	SharedPtr<Peer> *p = (SharedPtr<Peer> *)0;
+	while (i.next(a,p)) {
+		fp += (*p)->stateFingerprint();
+		if (peers)
+			peers->push_back(*p);
+	}
+	return (fp + (uint64_t)_peers.size());
+}
+
+void Topology::_stateKey(uint8_t key[32]) const
+{
+	// Key agreement with ourselves needs our private key, so only we can derive this
+	uint8_t k[64];
+	RR->identity.agree(RR->identity,k,32);
+	memcpy(k + 32,"ZeroTier peer state at rest     ",32);
+	uint8_t h[64];
+	SHA512::hash(h,k,sizeof(k));
+	memcpy(key,h,32);
+	Utils::burn(k,sizeof(k));
+	Utils::burn(h,sizeof(h));
+}
+
 void Topology::_memoizeUpstreams()
 {
 	// assumes _upstreams_m and _peers_m are locked
@@ -99,10 +99,20 @@ public:
 	 */
 	inline SharedPtr<Path> getPath(const InetAddress &l,const InetAddress &r)
 	{
+		// This runs for every received packet, so recently used paths are
+		// looked up first in a direct-mapped cache without taking _paths_m.
+		// Cached pointers stay valid because clean() defers deletion.
+		const Path::HashKey k(l,r);
+		Path *volatile *const slot = &(_pathCache[k.hashCode() & (ZT_PATH_CACHE_SIZE - 1)]);
+		Path *const cp = *slot;
+		if ((cp)&&(cp->key() == k))
+			return SharedPtr<Path>(cp);
+
 		Mutex::Lock _l(_paths_m);
-		SharedPtr<Path> &p = _paths[Path::HashKey(l,r)];
+		SharedPtr<Path> &p = _paths[k];
 		if (!p)
 			p.setToUnsafe(new Path(l,r));
+		*slot = p.ptr();
 		return p;
 	}
 
@@ -296,6 +306,31 @@ public:
 	 */
 	void clean(uint64_t now);
 
+	/**
+	 * Save peers with their keys and path state for a warm restart
+	 *
+	 * State is sealed with Salsa20/12 and Poly1305 under a key derived from
+	 * this node's secret identity and stored as "peers.state". Unless forced,
+	 * nothing is written if peers, their versions, and their paths are the
+	 * same as at the last save or load.
+	 *
+	 * @param now Current time
+	 * @param force Save even if nothing has changed (e.g. on shutdown, to refresh the save time)
+	 * @return True if state was written
+	 */
+	bool saveState(const uint64_t now,const bool force = false);
+
+	/**
+	 * Restore peers saved by saveState(), skipping any silent for longer than ZT_PEER_IN_MEMORY_EXPIRATION unless upstream
+	 *
+	 * This must be called after RR->topology is set, and before any packets
+	 * are processed since existing upstream peers are replaced.
+	 *
+	 * @param now Current time
+	 * @return Number of peers restored
+	 */
+	unsigned long loadState(const uint64_t now);
+
 	/**
 	 * @param now Current time
 	 * @return Number of peers with active direct paths
@@ -421,6 +456,8 @@ public:
 
 private:
 	Identity _getIdentity(const Address &zta);
+	void _stateKey(uint8_t key[32]) const;
+	uint64_t _stateFingerprint(std::vector< SharedPtr<Peer> > *peers);
 	void _memoizeUpstreams();
 
 	const RuntimeEnvironment *const RR;
@@ -433,7 +470,12 @@ private:
 	Hashtable< Address,SharedPtr<Peer> > _peers;
 	Mutex _peers_m;
 
+	uint64_t _savedStateFingerprint; // of peers as of the last saveState() or loadState()
+	Mutex _state_m;
+
 	Hashtable< Path::HashKey,SharedPtr<Path> > _paths;
+	std::vector< SharedPtr<Path> > _pathGraveyard; // unreferenced paths awaiting deletion on next clean()
+	Path *volatile _pathCache[ZT_PATH_CACHE_SIZE];
 	Mutex _paths_m;
 
 	World _planet;
@@ -31,4 +31,5 @@ OBJS=\
 	osdep/Http.o \
 	osdep/OSUtils.o \
 	service/ClusterGeoIpService.o \
+	service/IdentityStore.o \
 	service/SoftwareUpdater.o
@@ -86,8 +86,8 @@ BSDEthernetTap::BSDEthernetTap(
 
 	Mutex::Lock _gl(globalTapCreateLock);
 
-	if (mtu > 2800)
-		throw std::runtime_error("max tap MTU is 2800");
+	if (mtu > ZT_MAX_MTU)
+		throw std::runtime_error("tap MTU exceeds ZT_MAX_MTU");
 
 #ifdef __FreeBSD__
 	/* FreeBSD allows long interface names and interface renaming */
@@ -313,14 +313,18 @@ std::vector<InetAddress> BSDEthernetTap::ips() const
 
 void BSDEthernetTap::put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len)
 {
-	char putBuf[4096];
 	if ((_fd > 0)&&(len <= _mtu)&&(_enabled)) {
-		to.copyTo(putBuf,6);
-		from.copyTo(putBuf + 6,6);
-		*((uint16_t *)(putBuf + 12)) = htons((uint16_t)etherType);
-		memcpy(putBuf + 14,data,len);
-		len += 14;
-		::write(_fd,putBuf,len);
+		// Header goes in its own iovec so frames up to ZT_MAX_MTU need no copy or large stack buffer
+		char hdr[14];
+		to.copyTo(hdr,6);
+		from.copyTo(hdr + 6,6);
+		*((uint16_t *)(hdr + 12)) = htons((uint16_t)etherType);
+		struct iovec iov[2];
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = 14;
+		iov[1].iov_base = const_cast<void *>(data);
+		iov[1].iov_len = len;
+		::writev(_fd,iov,2);
 	}
 }
 
@@ -333,6 +337,26 @@ void BSDEthernetTap::setFriendlyName(const char *friendlyName)
 {
 }
 
+void BSDEthernetTap::setMtu(unsigned int mtu)
+{
+	if (mtu > ZT_MAX_MTU)
+		return;
+	if ((mtu == _mtu)||(_fd <= 0))
+		return;
+	char mtustr[32];
+	Utils::snprintf(mtustr,sizeof(mtustr),"%u",mtu);
+	long cpid = (long)vfork();
+	if (cpid == 0) {
+		::execl("/sbin/ifconfig","/sbin/ifconfig",_dev.c_str(),"mtu",mtustr,(const char *)0);
+		::_exit(-1);
+	} else if (cpid > 0) {
+		int exitcode = -1;
+		::waitpid(cpid,&exitcode,0);
+		if (exitcode == 0)
+			_mtu = mtu;
+	}
+}
+
 void BSDEthernetTap::scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed)
 {
 	std::vector<MulticastGroup> newGroups;
@@ -423,7 +447,7 @@ void BSDEthernetTap::threadMain()
 	fd_set readfds,nullfds;
 	MAC to,from;
 	int n,nfds,r;
-	char getBuf[8194];
+	char getBuf[ZT_MAX_MTU + 64];
 
 	// Wait for a moment after startup -- wait for Network to finish
 	// constructing itself.
@@ -56,6 +56,7 @@ public:
 	void put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len);
 	std::string deviceName() const;
 	void setFriendlyName(const char *friendlyName);
+	void setMtu(unsigned int mtu);
 	void scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed);
 
 	void threadMain()
@@ -68,7 +69,7 @@ private:
 	Thread _thread;
 	std::string _dev;
 	std::vector<MulticastGroup> _multicastGroups;
-	unsigned int _mtu;
+	volatile unsigned int _mtu;
 	unsigned int _metric;
 	int _fd;
 	int _shutdownSignalPipe[2];
@@ -29,6 +29,8 @@
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <net/if_arp.h>
 #include <arpa/inet.h>
@@ -40,12 +42,16 @@
 
 #include <algorithm>
 #include <utility>
+#include <map>
+#include <mutex>
+#include <condition_variable>
 
 #include "../node/Constants.hpp"
 #include "../node/Utils.hpp"
 #include "../node/Mutex.hpp"
 #include "../node/Dictionary.hpp"
 #include "OSUtils.hpp"
+#include "BlockingQueue.hpp"
 #include "LinuxEthernetTap.hpp"
 
 // ff:ff:ff:ff:ff:ff with no ADI
@@ -55,6 +61,260 @@ namespace ZeroTier {
 
 static Mutex __tapCreateLock;
 
+// Maximum epoll events taken per wakeup by one reader thread
+#define ZT_TAP_ENGINE_MAX_EVENTS 8
+
+/*
+ * Shared reader pool for all taps
+ *
+ * Tap fds are registered EPOLLONESHOT so only one reader thread handles a
+ * given tap at a time (keeping its frames in order). That thread reads up
+ * to ZT_TAP_ENGINE_READ_BATCH frames and then re-arms the tap, so a busy
+ * tap can't starve the others. A single writer thread drains the transmit
+ * rings of taps that have frames waiting. Threads are started with the
+ * first tap and stopped when the last one goes away; a tap added while they
+ * are stopping waits for that to finish before starting new ones.
+ */
+class LinuxTapEngine
+{
+public:
+	LinuxTapEngine() :
+		_threadCount(ZT_TAP_ENGINE_DEFAULT_THREADS),
+		_txQueueDepth(ZT_TAP_TX_QUEUE_DEFAULT_DEPTH),
+		_epfd(-1),
+		_nextId(1),
+		_writer((_Writer *)0),
+		_stopping(false)
+	{
+		_shutdownPipe[0] = -1;
+		_shutdownPipe[1] = -1;
+	}
+
+	inline void setThreads(unsigned int n)
+	{
+		std::lock_guard<std::mutex> _l(_lock);
+		_threadCount = (n) ? std::min(n,(unsigned int)ZT_TAP_ENGINE_MAX_THREADS) : (unsigned int)ZT_TAP_ENGINE_DEFAULT_THREADS;
+	}
+
+	inline void setTxQueueDepth(unsigned int depth) { _txQueueDepth = std::min(depth,(unsigned int)ZT_TAP_TX_QUEUE_MAX_DEPTH); }
+	inline unsigned int txQueueDepth() const { return _txQueueDepth; }
+
+	// Called by put() when a tap's transmit ring goes from empty to non-empty
+	inline void txReady(const uint64_t id) { _txReady.post(id); }
+
+	inline bool add(LinuxEthernetTap *tap)
+	{
+		std::unique_lock<std::mutex> _l(_lock);
+		while (_stopping) // a new writer must not share _txReady with one that is being stopped
+			_idle.wait(_l);
+		if ((_epfd < 0)&&(!_start()))
+			return false;
+		tap->_engineId = _nextId++;
+		tap->_engineBusy = 0;
+		_taps[tap->_engineId] = tap;
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.u64 = tap->_engineId;
+		if (epoll_ctl(_epfd,EPOLL_CTL_ADD,tap->_fd,&ev) != 0) {
+			_taps.erase(tap->_engineId);
+			return false;
+		}
+		return true;
+	}
+
+	inline void remove(LinuxEthernetTap *tap)
+	{
+		std::unique_lock<std::mutex> _l(_lock);
+		_taps.erase(tap->_engineId);
+		if (_epfd >= 0)
+			epoll_ctl(_epfd,EPOLL_CTL_DEL,tap->_fd,(struct epoll_event *)0);
+		while (tap->_engineBusy) // no new thread can enter this tap now, so wait for any still inside it
+			_idle.wait(_l);
+
+		if ((!_taps.empty())||(_epfd < 0))
+			return;
+
+		// Last tap is gone, so shut down readers (outside the lock since they take it)
+		const int epfd = _epfd;
+		const int sp0 = _shutdownPipe[0],sp1 = _shutdownPipe[1];
+		std::vector<_Reader *> readers;
+		readers.swap(_readers);
+		_Writer *const writer = _writer;
+		_writer = (_Writer *)0;
+		_epfd = -1;
+		_shutdownPipe[0] = -1;
+		_shutdownPipe[1] = -1;
+		_stopping = true;
+		_l.unlock();
+
+		(void)::write(sp1,"\0",1); // level triggered, so wakes all readers
+		for(std::vector<_Reader *>::iterator r(readers.begin());r!=readers.end();++r) {
+			Thread::join((*r)->thread);
+			delete *r;
+		}
+		if (writer) {
+			_txReady.post(0);
+			Thread::join(writer->thread);
+			delete writer;
+		}
+		::close(epfd);
+		::close(sp0);
+		::close(sp1);
+
+		_l.lock();
+		_stopping = false;
+		_idle.notify_all(); // let any add() that arrived meanwhile start new threads
+	}
+
+	struct _Reader
+	{
+		_Reader(LinuxTapEngine *e,int fd) : engine(e),epfd(fd) {}
+		void threadMain()
+			throw()
+		{
+			engine->_readerMain(epfd);
+		}
+		LinuxTapEngine *engine;
+		int epfd;
+		Thread thread;
+	};
+
+	struct _Writer
+	{
+		_Writer(LinuxTapEngine *e) : engine(e) {}
+		void threadMain()
+			throw()
+		{
+			engine->_writerMain();
+		}
+		LinuxTapEngine *engine;
+		Thread thread;
+	};
+
+private:
+	inline bool _start()
+	{
+		_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (_epfd < 0)
+			return false;
+		if (::pipe(_shutdownPipe) != 0) {
+			::close(_epfd);
+			_epfd = -1;
+			return false;
+		}
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0; // tap IDs start at 1
+		epoll_ctl(_epfd,EPOLL_CTL_ADD,_shutdownPipe[0],&ev);
+		for(unsigned int i=0;i<_threadCount;++i) {
+			_Reader *const r = new _Reader(this,_epfd);
+			r->thread = Thread::start(r);
+			_readers.push_back(r);
+		}
+		_writer = new _Writer(this);
+		_writer->thread = Thread::start(_writer);
+		return true;
+	}
+
+	// Called with _lock held when a thread is done with a tap
+	inline void _leave(LinuxEthernetTap *tap)
+	{
+		if (--tap->_engineBusy == 0)
+			_idle.notify_all(); // remove() may be waiting for this tap to go quiet
+	}
+
+	inline void _writerMain()
+	{
+		for(;;) {
+			const uint64_t id = _txReady.get();
+			if (!id)
+				return;
+
+			LinuxEthernetTap *tap;
+			{
+				std::lock_guard<std::mutex> _l(_lock);
+				std::map<uint64_t,LinuxEthernetTap *>::iterator t(_taps.find(id));
+				if (t == _taps.end())
+					continue;
+				tap = t->second;
+				++tap->_engineBusy;
+			}
+
+			tap->_writeFrames();
+
+			std::lock_guard<std::mutex> _l(_lock);
+			_leave(tap);
+		}
+	}
+
+	inline void _readerMain(const int epfd)
+	{
+		struct epoll_event events[ZT_TAP_ENGINE_MAX_EVENTS];
+		for(;;) {
+			const int n = epoll_wait(epfd,events,ZT_TAP_ENGINE_MAX_EVENTS,-1);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return;
+			}
+			for(int i=0;i<n;++i) {
+				const uint64_t id = events[i].data.u64;
+				if (!id)
+					return; // shutdown pipe
+
+				LinuxEthernetTap *tap;
+				{
+					std::lock_guard<std::mutex> _l(_lock);
+					std::map<uint64_t,LinuxEthernetTap *>::iterator t(_taps.find(id));
+					if (t == _taps.end())
+						continue;
+					tap = t->second;
+					++tap->_engineBusy;
+				}
+
+				tap->_readFrames();
+
+				std::lock_guard<std::mutex> _l(_lock);
+				_leave(tap);
+				if (_taps.count(id)) {
+					struct epoll_event ev;
+					memset(&ev,0,sizeof(ev));
+					ev.events = EPOLLIN | EPOLLONESHOT;
+					ev.data.u64 = id;
+					epoll_ctl(epfd,EPOLL_CTL_MOD,tap->_fd,&ev);
+				}
+			}
+		}
+	}
+
+	unsigned int _threadCount;
+	volatile unsigned int _txQueueDepth;
+	int _epfd;
+	int _shutdownPipe[2];
+	uint64_t _nextId;
+	std::map<uint64_t,LinuxEthernetTap *> _taps;
+	std::vector<_Reader *> _readers;
+	_Writer *_writer;
+	bool _stopping; // threads for the last tap are being stopped, so add() waits
+	BlockingQueue<uint64_t> _txReady; // IDs of taps with frames to write, 0 to stop writer
+	std::mutex _lock;
+	std::condition_variable _idle; // signaled when a tap's _engineBusy drops to zero or a shutdown finishes
+};
+
+static LinuxTapEngine __tapEngine;
+
+void LinuxEthernetTap::setReaderThreads(unsigned int n)
+{
+	__tapEngine.setThreads(n);
+}
+
+void LinuxEthernetTap::setTxQueueDepth(unsigned int depth)
+{
+	__tapEngine.setTxQueueDepth(depth);
+}
+
 LinuxEthernetTap::LinuxEthernetTap(
 	const char *homePath,
 	const MAC &mac,
@@ -67,10 +327,18 @@ LinuxEthernetTap::LinuxEthernetTap(
 	_handler(handler),
 	_arg(arg),
 	_nwid(nwid),
+	_engineId(0),
+	_engineBusy(0),
+	_rxLen(0),
 	_homePath(homePath),
 	_mtu(mtu),
 	_fd(0),
-	_enabled(true)
+	_enabled(true),
+	_txRing(__tapEngine.txQueueDepth()),
+	_txHead(0),
+	_txCount(0),
+	_txDrops(0),
+	_txBackpressure(0)
 {
 	char procpath[128],nwids[32];
 	struct stat sbuf;
@@ -79,8 +347,8 @@ LinuxEthernetTap::LinuxEthernetTap(
 
 	Mutex::Lock _l(__tapCreateLock); // create only one tap at a time, globally
 
-	if (mtu > 2800)
-		throw std::runtime_error("max tap MTU is 2800");
+	if (mtu > ZT_MAX_MTU)
+		throw std::runtime_error("tap MTU exceeds ZT_MAX_MTU");
 
 	_fd = ::open("/dev/net/tun",O_RDWR);
 	if (_fd <= 0) {
@@ -154,7 +422,7 @@ LinuxEthernetTap::LinuxEthernetTap(
 		throw std::runtime_error("unable to configure TAP MTU");
 	}
 
-	if (fcntl(_fd,F_SETFL,fcntl(_fd,F_GETFL) & ~O_NONBLOCK) == -1) {
+	if (fcntl(_fd,F_SETFL,fcntl(_fd,F_GETFL) | O_NONBLOCK) == -1) {
 		::close(_fd);
 		throw std::runtime_error("unable to set flags on file descriptor for TAP device");
 	}
@@ -177,22 +445,20 @@ LinuxEthernetTap::LinuxEthernetTap(
 	// Set close-on-exec so that devices cannot persist if we fork/exec for update
 	::fcntl(_fd,F_SETFD,fcntl(_fd,F_GETFD) | FD_CLOEXEC);
 
-	(void)::pipe(_shutdownSignalPipe);
-
 	devmap.erase(nwids);
 	devmap.add(nwids,_dev.c_str());
 	OSUtils::writeFile((_homePath + ZT_PATH_SEPARATOR_S + "devicemap").c_str(),(const void *)devmap.data(),devmap.sizeBytes());
 
-	_thread = Thread::start(this);
+	if (!__tapEngine.add(this)) {
+		::close(_fd);
+		throw std::runtime_error("unable to add TAP to reader pool");
+	}
 }
 
 LinuxEthernetTap::~LinuxEthernetTap()
 {
-	(void)::write(_shutdownSignalPipe[1],"\0",1); // causes thread to exit
-	Thread::join(_thread);
+	__tapEngine.remove(this);
 	::close(_fd);
-	::close(_shutdownSignalPipe[0]);
-	::close(_shutdownSignalPipe[1]);
 }
 
 void LinuxEthernetTap::setEnabled(bool en)
@@ -359,14 +625,78 @@ std::vector<InetAddress> LinuxEthernetTap::ips() const
 
 void LinuxEthernetTap::put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len)
 {
-	char putBuf[8194];
 	if ((_fd > 0)&&(len <= _mtu)&&(_enabled)) {
-		to.copyTo(putBuf,6);
-		from.copyTo(putBuf + 6,6);
-		*((uint16_t *)(putBuf + 12)) = htons((uint16_t)etherType);
-		memcpy(putBuf + 14,data,len);
-		len += 14;
-		(void)::write(_fd,putBuf,len);
+		char hdr[14];
+		to.copyTo(hdr,6);
+		from.copyTo(hdr + 6,6);
+		*((uint16_t *)(hdr + 12)) = htons((uint16_t)etherType);
+
+		if (_txRing.empty()) {
+			if (!_writeFrame(hdr,data,len)) {
+				Mutex::Lock _l(_tx_m);
+				++_txBackpressure;
+			}
+			return;
+		}
+
+		bool wasEmpty;
+		{
+			Mutex::Lock _l(_tx_m);
+			if (_txCount >= _txRing.size()) {
+				++_txDrops;
+				return;
+			}
+			_TxFrame &f = _txRing[(_txHead + _txCount) % _txRing.size()];
+			memcpy(f.hdr,hdr,14);
+			f.data.assign(reinterpret_cast<const char *>(data),len); // keeps its capacity, so no allocation once warm
+			wasEmpty = (_txCount++ == 0);
+		}
+		if (wasEmpty)
+			__tapEngine.txReady(_engineId);
+	}
+}
+
+void LinuxEthernetTap::txStats(unsigned long &depth,uint64_t &drops,uint64_t &backpressure) const
+{
+	depth = _txCount;
+	drops = _txDrops;
+	backpressure = _txBackpressure;
+}
+
+bool LinuxEthernetTap::_writeFrame(const char *hdr,const void *data,unsigned int len)
+{
+	struct iovec iov[2];
+	iov[0].iov_base = const_cast<char *>(hdr);
+	iov[0].iov_len = 14;
+	iov[1].iov_base = const_cast<void *>(data);
+	iov[1].iov_len = len;
+	for(;;) {
+		if ((long)::writev(_fd,iov,2) >= 0)
+			return true;
+		if (errno != EINTR)
+			return false;
+	}
+}
+
+void LinuxEthernetTap::_writeFrames()
+{
+	// The frame at the head stays counted while we write it, so put() can't reuse its slot
+	for(;;) {
+		const _TxFrame *f;
+		{
+			Mutex::Lock _l(_tx_m);
+			if (!_txCount)
+				return;
+			f = &(_txRing[_txHead]);
+		}
+		const bool ok = _writeFrame(f->hdr,f->data.data(),(unsigned int)f->data.length());
+		{
+			Mutex::Lock _l(_tx_m);
+			if (!ok)
+				++_txBackpressure;
+			_txHead = (_txHead + 1) % _txRing.size();
+			--_txCount;
+		}
 	}
 }
 
@@ -379,6 +709,22 @@ void LinuxEthernetTap::setFriendlyName(const char *friendlyName)
 {
 }
 
+void LinuxEthernetTap::setMtu(unsigned int mtu)
+{
+	if ((mtu > ZT_MAX_MTU)||(mtu == _mtu))
+		return;
+	const int sock = socket(AF_INET,SOCK_DGRAM,0);
+	if (sock <= 0)
+		return;
+	struct ifreq ifr;
+	memset(&ifr,0,sizeof(ifr));
+	Utils::scopy(ifr.ifr_name,sizeof(ifr.ifr_name),_dev.c_str());
+	ifr.ifr_ifru.ifru_mtu = (int)mtu;
+	if (ioctl(sock,SIOCSIFMTU,(void *)&ifr) == 0)
+		_mtu = mtu;
+	::close(sock);
+}
+
 void LinuxEthernetTap::scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed)
 {
 	char *ptr,*ptr2;
@@ -428,54 +774,33 @@ void LinuxEthernetTap::scanMulticastGroups(std::vector<MulticastGroup> &added,st
 	_multicastGroups.swap(newGroups);
 }
 
-void LinuxEthernetTap::threadMain()
-	throw()
+void LinuxEthernetTap::_readFrames()
 {
-	fd_set readfds,nullfds;
 	MAC to,from;
-	int n,nfds,r;
-	char getBuf[8194];
-
-	Thread::sleep(500);
-
-	FD_ZERO(&readfds);
-	FD_ZERO(&nullfds);
-	nfds = (int)std::max(_shutdownSignalPipe[0],_fd) + 1;
-
-	r = 0;
-	for(;;) {
-		FD_SET(_shutdownSignalPipe[0],&readfds);
-		FD_SET(_fd,&readfds);
-		select(nfds,&readfds,&nullfds,&nullfds,(struct timeval *)0);
-
-		if (FD_ISSET(_shutdownSignalPipe[0],&readfds)) // writes to shutdown pipe terminate thread
-			break;
-
-		if (FD_ISSET(_fd,&readfds)) {
-			n = (int)::read(_fd,getBuf + r,sizeof(getBuf) - r);
-			if (n < 0) {
-				if ((errno != EINTR)&&(errno != ETIMEDOUT))
-					break;
-			} else {
-				// Some tap drivers like to send the ethernet frame and the
-				// payload in two chunks, so handle that by accumulating
-				// data until we have at least a frame.
-				r += n;
-				if (r > 14) {
-					if (r > ((int)_mtu + 14)) // sanity check for weird TAP behavior on some platforms
-						r = _mtu + 14;
-
-					if (_enabled) {
-						to.setTo(getBuf,6);
-						from.setTo(getBuf + 6,6);
-						unsigned int etherType = ntohs(((const uint16_t *)getBuf)[6]);
-						// TODO: VLAN support
-						_handler(_arg,_nwid,from,to,etherType,0,(const void *)(getBuf + 14),r - 14);
-					}
-
-					r = 0;
-				}
+	for(unsigned int k=0;k<ZT_TAP_ENGINE_READ_BATCH;++k) {
+		int n = (int)::read(_fd,_rxBuf + _rxLen,sizeof(_rxBuf) - _rxLen);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return; // EAGAIN: nothing more for now
+		}
+		// Some tap drivers like to send the ethernet frame and the
+		// payload in two chunks, so handle that by accumulating
+		// data until we have at least a frame.
+		_rxLen += n;
+		if (_rxLen > 14) {
+			if (_rxLen > ((int)_mtu + 14)) // sanity check for weird TAP behavior on some platforms
+				_rxLen = _mtu + 14;
+
+			if (_enabled) {
+				to.setTo(_rxBuf,6);
+				from.setTo(_rxBuf + 6,6);
+				unsigned int etherType = ntohs(((const uint16_t *)_rxBuf)[6]);
+				// TODO: VLAN support
+				_handler(_arg,_nwid,from,to,etherType,0,(const void *)(_rxBuf + 14),_rxLen - 14);
 			}
+
+			_rxLen = 0;
 		}
 	}
 }
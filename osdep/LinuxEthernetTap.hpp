@@ -27,16 +27,72 @@
 #include <stdexcept>
 
 #include "../node/MulticastGroup.hpp"
+#include "../node/Mutex.hpp"
 #include "Thread.hpp"
 
+/**
+ * Default number of threads reading from all taps
+ */
+#define ZT_TAP_ENGINE_DEFAULT_THREADS 2
+
+/**
+ * Maximum number of threads reading from all taps
+ */
+#define ZT_TAP_ENGINE_MAX_THREADS 16
+
+/**
+ * Maximum frames read from one tap per wakeup before moving on to others
+ */
+#define ZT_TAP_ENGINE_READ_BATCH 64
+
+/**
+ * Default size of each tap's transmit ring in frames
+ */
+#define ZT_TAP_TX_QUEUE_DEFAULT_DEPTH 512
+
+/**
+ * Maximum size of each tap's transmit ring in frames
+ */
+#define ZT_TAP_TX_QUEUE_MAX_DEPTH 8192
+
 namespace ZeroTier {
 
+class LinuxTapEngine;
+
 /**
  * Linux Ethernet tap using kernel tun/tap driver
+ *
+ * Taps don't have their own threads. All tap file descriptors are in one
+ * shared epoll set serviced by a small pool of reader threads, so hosts
+ * joined to many networks don't run a thread per network.
+ *
+ * Frames from put() go into a per-tap transmit ring and are written to the
+ * tap by a shared writer thread, so the packet processing thread that calls
+ * put() never blocks on the tap. Frames are dropped (and counted) if the
+ * ring is full.
  */
 class LinuxEthernetTap
 {
+	friend class LinuxTapEngine;
+
 public:
+	/**
+	 * Set number of shared tap reader threads
+	 *
+	 * This takes effect the next time the reader pool is started, which
+	 * happens when the first tap is created.
+	 *
+	 * @param n Number of threads (0 for default)
+	 */
+	static void setReaderThreads(unsigned int n);
+
+	/**
+	 * Set size of transmit ring for taps created after this call
+	 *
+	 * @param depth Ring size in frames, or 0 to write directly from put()
+	 */
+	static void setTxQueueDepth(unsigned int depth);
+
 	LinuxEthernetTap(
 		const char *homePath,
 		const MAC &mac,
@@ -60,23 +116,49 @@ public:
 	void put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len);
 	std::string deviceName() const;
 	void setFriendlyName(const char *friendlyName);
+	void setMtu(unsigned int mtu);
 	void scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed);
 
-	void threadMain()
-		throw();
+	/**
+	 * Get transmit ring statistics
+	 *
+	 * @param depth Result parameter: frames waiting to be written
+	 * @param drops Result parameter: frames dropped because the ring was full
+	 * @param backpressure Result parameter: frames the tap would not accept (EAGAIN/ENOBUFS)
+	 */
+	void txStats(unsigned long &depth,uint64_t &drops,uint64_t &backpressure) const;
 
 private:
+	void _readFrames();
+	void _writeFrames();
+	bool _writeFrame(const char *hdr,const void *data,unsigned int len);
+
+	struct _TxFrame
+	{
+		char hdr[14];
+		std::string data;
+	};
+
 	void (*_handler)(void *,uint64_t,const MAC &,const MAC &,unsigned int,unsigned int,const void *,unsigned int);
 	void *_arg;
 	uint64_t _nwid;
-	Thread _thread;
+	uint64_t _engineId; // key in reader pool's tap table
+	unsigned int _engineBusy; // pool threads currently in _readFrames() or _writeFrames(), guarded by pool lock
+	int _rxLen; // bytes of a partial frame in _rxBuf
+	char _rxBuf[ZT_MAX_MTU + 32]; // only one reader thread is in a tap at a time, so this can be per tap
 	std::string _homePath;
 	std::string _dev;
 	std::vector<MulticastGroup> _multicastGroups;
-	unsigned int _mtu;
+	volatile unsigned int _mtu;
 	int _fd;
-	int _shutdownSignalPipe[2];
 	volatile bool _enabled;
+
+	std::vector<_TxFrame> _txRing; // empty if put() writes directly
+	unsigned long _txHead;
+	volatile unsigned long _txCount;
+	volatile uint64_t _txDrops;
+	volatile uint64_t _txBackpressure;
+	Mutex _tx_m;
 };
 
 } // namespace ZeroTier
@@ -0,0 +1,333 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZT_LINUXNETLINK_HPP
+#define ZT_LINUXNETLINK_HPP
+
+#include "../node/Constants.hpp"
+
+/**
+ * Change flags returned by LinuxNetLinkMonitor::changes()
+ */
+#define ZT_NETLINK_CHANGED_LINK 0x01
+#define ZT_NETLINK_CHANGED_ADDRESS 0x02
+#define ZT_NETLINK_CHANGED_ROUTE 0x04
+#define ZT_NETLINK_CHANGED_MULTICAST 0x08
+#define ZT_NETLINK_CHANGED_ALL 0x0f
+
+/**
+ * Period of full rescans when change events are being received
+ *
+ * Netlink can't tell us about everything (e.g. link layer only multicast
+ * memberships), so we still rescan now and then as a safety net.
+ */
+#define ZT_NETLINK_FALLBACK_REFRESH_PERIOD 300000
+
+/**
+ * Delay after the first change event before the handler is told
+ *
+ * Events arriving in this window (e.g. a burst from a link coming up) are
+ * coalesced into a single rescan.
+ */
+#define ZT_NETLINK_DEBOUNCE 500
+
+#ifdef __LINUX__
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <set>
+
+#include "../node/NonCopyable.hpp"
+#include "../node/Mutex.hpp"
+
+#include "OSUtils.hpp"
+#include "Thread.hpp"
+
+// Newer kernels announce IP multicast membership changes; older headers lack these
+#ifndef RTM_NEWMULTICAST
+#define RTM_NEWMULTICAST 56
+#endif
+#ifndef RTM_DELMULTICAST
+#define RTM_DELMULTICAST 57
+#endif
+#define ZT_NETLINK_RTNLGRP_IPV4_MCADDR 37
+#define ZT_NETLINK_RTNLGRP_IPV6_MCADDR 38
+
+namespace ZeroTier {
+
+/**
+ * Watches rtnetlink for link, address, route, and multicast changes
+ *
+ * A background thread listens for kernel change notifications and records
+ * which kinds of things changed, then calls the handler's netLinkChanged()
+ * method (from that thread) so it can wake up its main loop. The main loop
+ * then calls changes() to find out what it needs to rescan instead of
+ * rescanning everything on a timer. Events are coalesced for
+ * ZT_NETLINK_DEBOUNCE ms before the handler is told.
+ *
+ * Changes we made ourselves are ignored: link and address events for our own
+ * interfaces, routes the kernel adds or removes on them as their addresses
+ * change, and route changes sent from our own netlink socket.
+ *
+ * @tparam HANDLER_PTR_TYPE Type of pointer to handler with netLinkChanged()
+ */
+template<typename HANDLER_PTR_TYPE>
+class LinuxNetLinkMonitor : NonCopyable
+{
+public:
+	LinuxNetLinkMonitor(HANDLER_PTR_TYPE handler) :
+		_handler(handler),
+		_fd(-1),
+		_run(false),
+		_multicastEvents(false),
+		_ownPortId(0),
+		_changes(0)
+	{
+	}
+
+	~LinuxNetLinkMonitor()
+	{
+		stop();
+	}
+
+	/**
+	 * Open netlink socket and start monitor thread
+	 *
+	 * @return True if monitoring is running
+	 */
+	inline bool start()
+	{
+		if (_fd >= 0)
+			return true;
+
+		const int fd = ::socket(AF_NETLINK,SOCK_RAW|SOCK_CLOEXEC,NETLINK_ROUTE);
+		if (fd < 0)
+			return false;
+		int bs = 1048576;
+		::setsockopt(fd,SOL_SOCKET,SO_RCVBUF,(const void *)&bs,sizeof(bs));
+
+		struct sockaddr_nl sa;
+		memset(&sa,0,sizeof(sa));
+		sa.nl_family = AF_NETLINK;
+		sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+		if (::bind(fd,(const struct sockaddr *)&sa,sizeof(sa)) != 0) {
+			::close(fd);
+			return false;
+		}
+
+		int g = ZT_NETLINK_RTNLGRP_IPV4_MCADDR;
+		const bool mc4 = (::setsockopt(fd,SOL_NETLINK,NETLINK_ADD_MEMBERSHIP,(const void *)&g,sizeof(g)) == 0);
+		g = ZT_NETLINK_RTNLGRP_IPV6_MCADDR;
+		const bool mc6 = (::setsockopt(fd,SOL_NETLINK,NETLINK_ADD_MEMBERSHIP,(const void *)&g,sizeof(g)) == 0);
+		_multicastEvents = ((mc4)&&(mc6));
+
+		_fd = fd;
+		_run = true;
+		try {
+			_thread = Thread::start(this);
+		} catch ( ... ) {
+			_run = false;
+			_fd = -1;
+			::close(fd);
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Stop monitor thread and close netlink socket
+	 */
+	inline void stop()
+	{
+		if (_fd < 0)
+			return;
+		_run = false;
+		Thread::join(_thread);
+		::close(_fd);
+		_fd = -1;
+	}
+
+	/**
+	 * @return True if monitoring is running
+	 */
+	inline bool running() const { return (_fd >= 0); }
+
+	/**
+	 * @return True if the kernel reports IP multicast membership changes
+	 */
+	inline bool multicastEvents() const { return _multicastEvents; }
+
+	/**
+	 * Ignore link and address changes to one of our own interfaces
+	 *
+	 * The interface is forgotten when the kernel reports it deleted.
+	 *
+	 * @param dev Device name
+	 */
+	inline void addOwnInterface(const char *dev)
+	{
+		const int ifindex = (int)if_nametoindex(dev);
+		if (ifindex > 0) {
+			Mutex::Lock _l(_own_m);
+			_ownInterfaces.insert(ifindex);
+		}
+	}
+
+	/**
+	 * Ignore route changes requested from this netlink port ID
+	 *
+	 * @param portId Port ID of our route programming socket or 0 for none
+	 */
+	inline void setOwnPortId(const uint32_t portId) { _ownPortId = portId; }
+
+	/**
+	 * Get and clear changes seen since the last call
+	 *
+	 * @return ZT_NETLINK_CHANGED_* flags
+	 */
+	inline unsigned int changes()
+	{
+		Mutex::Lock _l(_changes_m);
+		const unsigned int c = _changes;
+		_changes = 0;
+		return c;
+	}
+
+	void threadMain()
+		throw()
+	{
+		char buf[16384];
+		unsigned int pending = 0;
+		uint64_t due = 0;
+		while (_run) {
+			int timeout = 1000; // lets us notice stop()
+			if (pending) {
+				const uint64_t now = OSUtils::now();
+				timeout = (due > now) ? (int)(due - now) : 0;
+			}
+
+			struct pollfd pfd;
+			pfd.fd = _fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (::poll(&pfd,1,timeout) > 0) {
+				unsigned int c = 0;
+				for(;;) {
+					int n = (int)::recv(_fd,buf,sizeof(buf),MSG_DONTWAIT);
+					if (n < 0) {
+						if (errno == ENOBUFS)
+							c |= ZT_NETLINK_CHANGED_ALL; // kernel dropped events, so assume anything could have changed
+						else if (errno != EINTR)
+							break;
+						continue;
+					}
+					if (n == 0)
+						break;
+					for(const struct nlmsghdr *nh=(const struct nlmsghdr *)buf;NLMSG_OK(nh,n);nh=NLMSG_NEXT(nh,n))
+						c |= _change(nh);
+				}
+				if ((c)&&(!pending))
+					due = OSUtils::now() + ZT_NETLINK_DEBOUNCE;
+				pending |= c;
+			}
+
+			if ((pending)&&(OSUtils::now() >= due)) {
+				{
+					Mutex::Lock _l(_changes_m);
+					_changes |= pending;
+				}
+				pending = 0;
+				_handler->netLinkChanged();
+			}
+		}
+	}
+
+private:
+	inline bool _own(const int ifindex,const bool deleted = false)
+	{
+		Mutex::Lock _l(_own_m);
+		if (deleted)
+			return (_ownInterfaces.erase(ifindex) > 0);
+		return (_ownInterfaces.count(ifindex) > 0);
+	}
+
+	// Returns ZT_NETLINK_CHANGED_* flags for one message, or 0 if it is uninteresting or our own doing
+	inline unsigned int _change(const struct nlmsghdr *nh)
+	{
+		switch(nh->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				if ((nh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifinfomsg)))&&(_own(((const struct ifinfomsg *)NLMSG_DATA(nh))->ifi_index,(nh->nlmsg_type == RTM_DELLINK))))
+					return 0;
+				return ZT_NETLINK_CHANGED_LINK;
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				if ((nh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifaddrmsg)))&&(_own((int)((const struct ifaddrmsg *)NLMSG_DATA(nh))->ifa_index)))
+					return 0;
+				return ZT_NETLINK_CHANGED_ADDRESS;
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE: {
+				if ((_ownPortId)&&(nh->nlmsg_pid == _ownPortId))
+					return 0; // change we sent ourselves
+				if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg)))
+					return ZT_NETLINK_CHANGED_ROUTE;
+				const struct rtmsg *const rt = (const struct rtmsg *)NLMSG_DATA(nh);
+				if (rt->rtm_protocol == RTPROT_KERNEL) {
+					// Kernel adds and removes these as addresses come and go, e.g. when we configure our own interfaces
+					int alen = (int)RTM_PAYLOAD(nh);
+					for(const struct rtattr *rta=(const struct rtattr *)RTM_RTA(rt);RTA_OK(rta,alen);rta=RTA_NEXT(rta,alen)) {
+						if ((rta->rta_type == RTA_OIF)&&(RTA_PAYLOAD(rta) >= sizeof(int))&&(_own(*((const int *)RTA_DATA(rta)))))
+							return 0;
+					}
+				}
+				return ZT_NETLINK_CHANGED_ROUTE;
+			}
+			case RTM_NEWMULTICAST:
+			case RTM_DELMULTICAST:
+				return ZT_NETLINK_CHANGED_MULTICAST; // tap memberships are exactly what we want to hear about
+			default:
+				return 0;
+		}
+	}
+
+	HANDLER_PTR_TYPE _handler;
+	int _fd;
+	volatile bool _run;
+	volatile bool _multicastEvents;
+	volatile uint32_t _ownPortId;
+	Thread _thread;
+	std::set<int> _ownInterfaces;
+	Mutex _own_m;
+	unsigned int _changes;
+	Mutex _changes_m;
+};
+
+} // namespace ZeroTier
+
+#endif // __LINUX__
+
+#endif
@@ -47,15 +47,29 @@
 #include <ifaddrs.h>
 #endif
 
+#ifdef __LINUX__
+#include <poll.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
 #include <vector>
 #include <algorithm>
 #include <utility>
+#include <set>
+#include <string>
+
+#include "../node/Mutex.hpp"
 
 #include "ManagedRoute.hpp"
 
 #define ZT_BSD_ROUTE_CMD "/sbin/route"
-#define ZT_LINUX_IP_COMMAND "/sbin/ip"
-#define ZT_LINUX_IP_COMMAND_2 "/usr/sbin/ip"
+
+// Maximum bytes of route change messages sent to the kernel in one datagram
+#define ZT_LINUX_NETLINK_ROUTE_BATCH_MAX 32768
+
+// Timeout for kernel acknowledgements of route changes
+#define ZT_LINUX_NETLINK_ACK_TIMEOUT 2000
 
 // NOTE: BSD is mostly tested on Apple/Mac but is likely to work on other BSD too
 
@@ -270,24 +284,277 @@ static void _routeCmd(const char *op,const InetAddress &target,const InetAddress
 #ifdef __LINUX__ // ----------------------------------------------------------
 #define ZT_ROUTING_SUPPORT_FOUND 1
 
-static void _routeCmd(const char *op,const InetAddress &target,const InetAddress &via,const char *localInterface)
+// Route changes are queued here and sent to the kernel over rtnetlink
+class _LinuxRouteBatch
 {
-	long p = (long)fork();
-	if (p > 0) {
-		int exitcode = -1;
-		::waitpid(p,&exitcode,0);
-	} else if (p == 0) {
-		::close(STDOUT_FILENO);
-		::close(STDERR_FILENO);
+public:
+	_LinuxRouteBatch() : _fd(-1),_seq(0),_depth(0),_havePresent(false) {}
+	~_LinuxRouteBatch()
+	{
+		if (_fd >= 0)
+			::close(_fd);
+	}
+
+	inline void begin()
+	{
+		Mutex::Lock _l(_lock);
+		++_depth;
+	}
+
+	inline void end()
+	{
+		Mutex::Lock _l(_lock);
+		if ((_depth)&&(--_depth == 0))
+			_flush();
+	}
+
+	// Re-read the routing table; our own changes keep it current after that
+	inline void reread()
+	{
+		Mutex::Lock _l(_lock);
+		_havePresent = _dump();
+	}
+
+	// True if target is in our copy of the routing table (or if we have none)
+	inline bool present(const InetAddress &target)
+	{
+		Mutex::Lock _l(_lock);
+		return ((!_havePresent)||(_present.count(target) > 0));
+	}
+
+	// Port ID of our netlink socket, so our own changes can be told apart in route notifications
+	inline uint32_t portId()
+	{
+		Mutex::Lock _l(_lock);
+		if (!_open())
+			return 0;
+		struct sockaddr_nl sa;
+		memset(&sa,0,sizeof(sa));
+		socklen_t salen = sizeof(sa);
+		if (::getsockname(_fd,(struct sockaddr *)&sa,&salen) != 0)
+			return 0;
+		return sa.nl_pid;
+	}
+
+	// Equivalent of "ip route replace|del <target> [via <via>] [dev <localInterface>]"
+	inline void route(const bool del,const InetAddress &target,const InetAddress &via,const char *localInterface)
+	{
+		char m[256];
+		memset(m,0,sizeof(m));
+		struct nlmsghdr *const nh = (struct nlmsghdr *)m;
+		nh->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+		nh->nlmsg_type = (del) ? RTM_DELROUTE : RTM_NEWROUTE;
+		nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | ((del) ? 0 : (NLM_F_CREATE | NLM_F_REPLACE));
+
+		struct rtmsg *const rt = (struct rtmsg *)NLMSG_DATA(nh);
+		rt->rtm_family = (unsigned char)target.ss_family;
+		rt->rtm_dst_len = (unsigned char)target.netmaskBits();
+		rt->rtm_table = RT_TABLE_MAIN;
+		if (del) {
+			rt->rtm_scope = RT_SCOPE_NOWHERE;
+		} else {
+			rt->rtm_protocol = RTPROT_BOOT;
+			rt->rtm_scope = (via) ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+			rt->rtm_type = RTN_UNICAST;
+		}
+
+		const unsigned int alen = (target.ss_family == AF_INET6) ? 16 : 4;
+		_attr(nh,RTA_DST,target.rawIpData(),alen);
 		if (via) {
-			::execl(ZT_LINUX_IP_COMMAND,ZT_LINUX_IP_COMMAND,(target.ss_family == AF_INET6) ? "-6" : "-4","route",op,target.toString().c_str(),"via",via.toIpString().c_str(),(const char *)0);
-			::execl(ZT_LINUX_IP_COMMAND_2,ZT_LINUX_IP_COMMAND_2,(target.ss_family == AF_INET6) ? "-6" : "-4","route",op,target.toString().c_str(),"via",via.toIpString().c_str(),(const char *)0);
+			if (via.ss_family != target.ss_family)
+				return;
+			_attr(nh,RTA_GATEWAY,via.rawIpData(),alen);
 		} else if ((localInterface)&&(localInterface[0])) {
-			::execl(ZT_LINUX_IP_COMMAND,ZT_LINUX_IP_COMMAND,(target.ss_family == AF_INET6) ? "-6" : "-4","route",op,target.toString().c_str(),"dev",localInterface,(const char *)0);
-			::execl(ZT_LINUX_IP_COMMAND_2,ZT_LINUX_IP_COMMAND_2,(target.ss_family == AF_INET6) ? "-6" : "-4","route",op,target.toString().c_str(),"dev",localInterface,(const char *)0);
+			const int ifindex = (int)if_nametoindex(localInterface);
+			if (ifindex <= 0)
+				return; // device is gone
+			_attr(nh,RTA_OIF,&ifindex,sizeof(ifindex));
+		} else return;
+
+		Mutex::Lock _l(_lock);
+		if (_havePresent) {
+			if (del)
+				_present.erase(target);
+			else _present.insert(target);
 		}
-		::_exit(-1);
+		nh->nlmsg_seq = ++_seq;
+		_pending.push_back(std::string(m,nh->nlmsg_len));
+		if (!_depth)
+			_flush();
+	}
+
+private:
+	static inline void _attr(struct nlmsghdr *nh,const unsigned short type,const void *data,const unsigned int len)
+	{
+		struct rtattr *const rta = (struct rtattr *)(((char *)nh) + NLMSG_ALIGN(nh->nlmsg_len));
+		rta->rta_type = type;
+		rta->rta_len = (unsigned short)RTA_LENGTH(len);
+		memcpy(RTA_DATA(rta),data,len);
+		nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	}
+
+	inline bool _open()
+	{
+		if (_fd >= 0)
+			return true;
+		_fd = ::socket(AF_NETLINK,SOCK_RAW|SOCK_CLOEXEC,NETLINK_ROUTE);
+		if (_fd < 0)
+			return false;
+		struct sockaddr_nl sa;
+		memset(&sa,0,sizeof(sa));
+		sa.nl_family = AF_NETLINK;
+		if (::bind(_fd,(const struct sockaddr *)&sa,sizeof(sa)) != 0) {
+			::close(_fd);
+			_fd = -1;
+			return false;
+		}
+		return true;
+	}
+
+	inline bool _send(const void *data,const unsigned int len)
+	{
+		struct sockaddr_nl sa;
+		memset(&sa,0,sizeof(sa));
+		sa.nl_family = AF_NETLINK;
+		return ((long)::sendto(_fd,data,len,0,(const struct sockaddr *)&sa,sizeof(sa)) == (long)len);
+	}
+
+	// Read replies until 'done' says we have everything or we time out
+	template<typename F>
+	inline void _receive(F &done)
+	{
+		char buf[32768];
+		for(;;) {
+			struct pollfd pfd;
+			pfd.fd = _fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (::poll(&pfd,1,ZT_LINUX_NETLINK_ACK_TIMEOUT) <= 0)
+				return;
+			int n = (int)::recv(_fd,buf,sizeof(buf),0);
+			if (n <= 0)
+				return;
+			for(const struct nlmsghdr *nh=(const struct nlmsghdr *)buf;NLMSG_OK(nh,n);nh=NLMSG_NEXT(nh,n)) {
+				if (done(nh))
+					return;
+			}
+		}
+	}
+
+	struct _AckCounter
+	{
+		_AckCounter(uint32_t f,uint32_t l) : first(f),last(l),acked(0),expected(l - f + 1) {}
+		inline bool operator()(const struct nlmsghdr *nh)
+		{
+			// Errors (e.g. deleting a route that is already gone) are ignored, as with the ip command
+			if ((nh->nlmsg_type == NLMSG_ERROR)&&((nh->nlmsg_seq - first) <= (last - first)))
+				++acked;
+			return (acked >= expected);
+		}
+		uint32_t first,last,acked,expected;
+	};
+
+	struct _DumpReader
+	{
+		_DumpReader(std::set<InetAddress> &p,uint32_t s) : present(p),seq(s),ok(false) {}
+		inline bool operator()(const struct nlmsghdr *nh)
+		{
+			if (nh->nlmsg_seq != seq)
+				return false;
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				ok = true;
+				return true;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR)
+				return true;
+			if (nh->nlmsg_type != RTM_NEWROUTE)
+				return false;
+
+			const struct rtmsg *const rt = (const struct rtmsg *)NLMSG_DATA(nh);
+			if ((rt->rtm_family != AF_INET)&&(rt->rtm_family != AF_INET6))
+				return false;
+			unsigned int table = rt->rtm_table;
+			uint8_t dst[16];
+			memset(dst,0,sizeof(dst));
+			int alen = (int)RTM_PAYLOAD(nh);
+			for(const struct rtattr *rta=(const struct rtattr *)RTM_RTA(rt);RTA_OK(rta,alen);rta=RTA_NEXT(rta,alen)) {
+				if ((rta->rta_type == RTA_DST)&&(RTA_PAYLOAD(rta) <= sizeof(dst)))
+					memcpy(dst,RTA_DATA(rta),RTA_PAYLOAD(rta));
+				else if ((rta->rta_type == RTA_TABLE)&&(RTA_PAYLOAD(rta) >= sizeof(uint32_t)))
+					table = *((const uint32_t *)RTA_DATA(rta));
+			}
+			if (table == RT_TABLE_MAIN)
+				present.insert(InetAddress(dst,(rt->rtm_family == AF_INET6) ? 16 : 4,rt->rtm_dst_len));
+			return false;
+		}
+		std::set<InetAddress> &present;
+		uint32_t seq;
+		bool ok;
+	};
+
+	// Read all main table route targets with one dump
+	inline bool _dump()
+	{
+		_present.clear();
+		if (!_open())
+			return false;
+		struct {
+			struct nlmsghdr nh;
+			struct rtmsg rt;
+		} req;
+		memset(&req,0,sizeof(req));
+		req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+		req.nh.nlmsg_type = RTM_GETROUTE;
+		req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		req.nh.nlmsg_seq = ++_seq;
+		req.rt.rtm_family = AF_UNSPEC;
+		if (!_send(&req,req.nh.nlmsg_len))
+			return false;
+		_DumpReader r(_present,_seq);
+		_receive(r);
+		return r.ok;
 	}
+
+	// Send queued changes, packing as many into each datagram as will fit
+	inline void _flush()
+	{
+		if (_pending.empty())
+			return;
+		if (_open()) {
+			std::string buf;
+			std::vector<std::string>::const_iterator m(_pending.begin());
+			while (m != _pending.end()) {
+				buf.clear();
+				const uint32_t first = ((const struct nlmsghdr *)m->data())->nlmsg_seq;
+				uint32_t last = first;
+				while ((m != _pending.end())&&((buf.empty())||((buf.length() + m->length()) <= ZT_LINUX_NETLINK_ROUTE_BATCH_MAX))) {
+					last = ((const struct nlmsghdr *)m->data())->nlmsg_seq;
+					buf.append(*m);
+					++m;
+				}
+				if (_send(buf.data(),(unsigned int)buf.length())) {
+					_AckCounter acks(first,last);
+					_receive(acks);
+				}
+			}
+		}
+		_pending.clear();
+	}
+
+	int _fd;
+	uint32_t _seq;
+	unsigned int _depth;
+	bool _havePresent;
+	std::set<InetAddress> _present;
+	std::vector<std::string> _pending;
+	Mutex _lock;
+};
+
+static _LinuxRouteBatch _linuxRouteBatch;
+
+static void _routeCmd(const char *op,const InetAddress &target,const InetAddress &via,const char *localInterface)
+{
+	_linuxRouteBatch.route((strcmp(op,"del") == 0),target,via,localInterface);
 }
 
 #endif // __LINUX__ ----------------------------------------------------------
@@ -471,11 +738,12 @@ bool ManagedRoute::sync()
 
 #ifdef __LINUX__ // ----------------------------------------------------------
 
-	if (!_applied.count(leftt)) {
+	// Also re-apply routes that have disappeared from the table (if we have a dump from a Batch)
+	if ((!_applied.count(leftt))||(!_linuxRouteBatch.present(leftt))) {
 		_applied[leftt] = false; // boolean unused
 		_routeCmd("replace",leftt,_via,(_via) ? (const char *)0 : _device);
 	}
-	if ((rightt)&&(!_applied.count(rightt))) {
+	if ((rightt)&&((!_applied.count(rightt))||(!_linuxRouteBatch.present(rightt)))) {
 		_applied[rightt] = false; // boolean unused
 		_routeCmd("replace",rightt,_via,(_via) ? (const char *)0 : _device);
 	}
@@ -540,4 +808,34 @@ void ManagedRoute::remove()
 	_applied.clear();
 }
 
+uint32_t ManagedRoute::netlinkPortId()
+{
+#ifdef __LINUX__
+	return _linuxRouteBatch.portId();
+#else
+	return 0;
+#endif
+}
+
+void ManagedRoute::routeTableChanged()
+{
+#ifdef __LINUX__
+	_linuxRouteBatch.reread();
+#endif
+}
+
+void ManagedRoute::_beginBatch()
+{
+#ifdef __LINUX__
+	_linuxRouteBatch.begin();
+#endif
+}
+
+void ManagedRoute::_endBatch()
+{
+#ifdef __LINUX__
+	_linuxRouteBatch.end();
+#endif
+}
+
 } // namespace ZeroTier
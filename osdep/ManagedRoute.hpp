@@ -24,6 +24,36 @@ class ManagedRoute : NonCopyable
 	friend class SharedPtr<ManagedRoute>;
 
 public:
+	/**
+	 * Batches route changes made while it is in scope
+	 *
+	 * On Linux, route adds and deletes from sync() and remove() are queued
+	 * and sent to the kernel together in as few netlink messages as possible
+	 * when the outermost Batch goes out of scope. Batches nest and are shared
+	 * by all threads. Elsewhere this does nothing.
+	 */
+	class Batch : NonCopyable
+	{
+	public:
+		Batch() { ManagedRoute::_beginBatch(); }
+		~Batch() { ManagedRoute::_endBatch(); }
+	};
+
+	/**
+	 * Re-read the system routing table after it may have changed behind our back
+	 *
+	 * On Linux this reads the table with one netlink dump, which can take a
+	 * while, so call it without holding locks others are waiting on. Our own
+	 * changes keep the copy current, and sync() uses it to re-apply routes
+	 * that were removed by someone else. Elsewhere this does nothing.
+	 */
+	static void routeTableChanged();
+
+	/**
+	 * @return Port ID of the netlink socket routes are changed through (Linux), or 0
+	 */
+	static uint32_t netlinkPortId();
+
 	ManagedRoute(const InetAddress &target,const InetAddress &via,const char *device)
 	{
 		_target = target;
@@ -65,6 +95,9 @@ public:
 	inline const char *device() const { return _device; }
 
 private:
+	static void _beginBatch();
+	static void _endBatch();
+
 	InetAddress _target;
 	InetAddress _via;
 	InetAddress _systemVia; // for route overrides
@@ -33,6 +33,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <netdb.h>
 #endif
@@ -309,6 +310,48 @@ bool OSUtils::writeFile(const char *path,const void *buf,unsigned int len)
 	return false;
 }
 
+void *OSUtils::mapFile(const char *path,unsigned long &size)
+{
+	size = 0;
+#ifdef __UNIX_LIKE__
+	const int fd = ::open(path,O_RDONLY);
+	if (fd < 0)
+		return (void *)0;
+	struct stat st;
+	if ((::fstat(fd,&st) != 0)||(st.st_size <= 0)) {
+		::close(fd);
+		return (void *)0;
+	}
+	void *p = ::mmap((void *)0,(size_t)st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	::close(fd); // the mapping stays valid
+	if (p == MAP_FAILED)
+		return (void *)0;
+	size = (unsigned long)st.st_size;
+	return p;
+#else
+	std::string buf;
+	if ((!readFile(path,buf))||(buf.length() == 0))
+		return (void *)0;
+	void *p = ::malloc(buf.length());
+	if (!p)
+		return (void *)0;
+	memcpy(p,buf.data(),buf.length());
+	size = (unsigned long)buf.length();
+	return p;
+#endif
+}
+
+void OSUtils::unmapFile(void *p,unsigned long size)
+{
+	if (!p)
+		return;
+#ifdef __UNIX_LIKE__
+	::munmap(p,(size_t)size);
+#else
+	::free(p);
+#endif
+}
+
 std::vector<std::string> OSUtils::split(const char *s,const char *const sep,const char *esc,const char *quot)
 {
 	std::vector<std::string> fields;
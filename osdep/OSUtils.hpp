@@ -240,6 +240,27 @@ public:
 	 */
 	static bool writeFile(const char *path,const void *buf,unsigned int len);
 
+	/**
+	 * Map a file into memory read-only
+	 *
+	 * On platforms without mmap() the file is read into a heap buffer instead.
+	 * Either way the result must be released with unmapFile(). Files that are
+	 * mapped should be replaced via rename() rather than modified in place.
+	 *
+	 * @param path Path of file to map
+	 * @param size Set to size of file in bytes
+	 * @return Pointer to file contents or NULL on error or if file is empty
+	 */
+	static void *mapFile(const char *path,unsigned long &size);
+
+	/**
+	 * Release a file mapping from mapFile()
+	 *
+	 * @param p Pointer returned by mapFile()
+	 * @param size Size returned by mapFile()
+	 */
+	static void unmapFile(void *p,unsigned long size);
+
 	/**
 	 * Split a string by delimiter, with optional escape and quote characters
 	 *
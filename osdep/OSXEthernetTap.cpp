@@ -330,8 +330,9 @@ OSXEthernetTap::OSXEthernetTap(
 
 	Utils::snprintf(nwids,sizeof(nwids),"%.16llx",nwid);
 
-	if (mtu > 2800)
-		throw std::runtime_error("max tap MTU is 2800");
+	// The kext can't go above this, so bigger network MTUs are clamped
+	if (mtu > ZT_OSX_TAP_MAX_MTU)
+		_mtu = ZT_OSX_TAP_MAX_MTU;
 
 	Mutex::Lock _gl(globalTapCreateLock);
 
@@ -566,6 +567,26 @@ void OSXEthernetTap::setFriendlyName(const char *friendlyName)
 {
 }
 
+void OSXEthernetTap::setMtu(unsigned int mtu)
+{
+	if (mtu > ZT_OSX_TAP_MAX_MTU)
+		mtu = ZT_OSX_TAP_MAX_MTU;
+	if ((mtu == _mtu)||(_fd <= 0))
+		return;
+	char mtustr[32];
+	Utils::snprintf(mtustr,sizeof(mtustr),"%u",mtu);
+	long cpid = (long)vfork();
+	if (cpid == 0) {
+		::execl("/sbin/ifconfig","/sbin/ifconfig",_dev.c_str(),"mtu",mtustr,(const char *)0);
+		::_exit(-1);
+	} else if (cpid > 0) {
+		int exitcode = -1;
+		::waitpid(cpid,&exitcode,0);
+		if (exitcode == 0)
+			_mtu = mtu;
+	}
+}
+
 void OSXEthernetTap::scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed)
 {
 	std::vector<MulticastGroup> newGroups;
@@ -33,6 +33,11 @@
 
 #include "Thread.hpp"
 
+/**
+ * Largest MTU the tap kext supports (TAP_MTU in ext/tap-mac)
+ */
+#define ZT_OSX_TAP_MAX_MTU 2800
+
 namespace ZeroTier {
 
 /**
@@ -61,6 +66,7 @@ public:
 	void put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len);
 	std::string deviceName() const;
 	void setFriendlyName(const char *friendlyName);
+	void setMtu(unsigned int mtu);
 	void scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed);
 
 	void threadMain()
@@ -74,7 +80,7 @@ private:
 	std::string _homePath;
 	std::string _dev;
 	std::vector<MulticastGroup> _multicastGroups;
-	unsigned int _mtu;
+	volatile unsigned int _mtu;
 	unsigned int _metric;
 	int _fd;
 	int _shutdownSignalPipe[2];
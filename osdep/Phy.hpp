@@ -54,11 +54,27 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 
 #if defined(__linux__) || defined(linux) || defined(__LINUX__) || defined(__linux)
 #ifndef IPV6_DONTFRAG
 #define IPV6_DONTFRAG 62
 #endif
+#ifndef ZT_PHY_DISABLE_MMSG
+#define ZT_PHY_HAVE_MMSG 1
+#endif
+#endif
+
+#ifdef ZT_PHY_HAVE_MMSG
+/**
+ * Maximum number of datagrams moved per recvmmsg() call
+ */
+#define ZT_PHY_UDP_BATCH 32
+
+/**
+ * Size of each datagram slot in the receive batch buffer
+ */
+#define ZT_PHY_UDP_BATCH_SLOT_SIZE 16384
 #endif
 
 #define ZT_PHY_SOCKFD_TYPE int
@@ -123,7 +139,17 @@ typedef void PhySocket;
  * prevent recursion.
  *
  * This isn't thread-safe with the exception of whack(), which is safe to
- * call from another thread to abort poll().
+ * call from another thread to abort poll(), and udpSend() and
+ * udpSendWithOptions(), which may be called from other threads to send on an
+ * existing UDP socket. A send with a TTL or DF setting holds the socket
+ * options exclusively, so no other datagram goes out under them.
+ *
+ * On Linux UDP sockets are serviced in batches with recvmmsg(), so a busy
+ * socket costs one system call per batch of received datagrams instead of
+ * one per datagram. Sends always go out immediately, since callers act on
+ * whether each one succeeded. Define ZT_PHY_DISABLE_MMSG to build with the
+ * plain recvfrom() path; it is also used at runtime if the kernel lacks
+ * recvmmsg().
  */
 template <typename HANDLER_PTR_TYPE>
 class Phy
@@ -166,6 +192,109 @@ private:
 	bool _noDelay;
 	bool _noCheck;
 
+#if !(defined(_WIN32) || defined(_WIN64))
+	pthread_rwlock_t _udpOptionLock; // write-locked while a send holds TTL or DF on a socket, read-locked by other UDP sends
+#endif
+
+#ifdef ZT_PHY_HAVE_MMSG
+	bool _mmsg; // false if kernel lacks recvmmsg
+	char *_udpRxBuf; // ZT_PHY_UDP_BATCH slots, allocated on first use
+	struct mmsghdr _udpRxMsgs[ZT_PHY_UDP_BATCH];
+	struct iovec _udpRxIov[ZT_PHY_UDP_BATCH];
+	ZT_PHY_SOCKADDR_STORAGE_TYPE _udpRxFrom[ZT_PHY_UDP_BATCH];
+
+	// Returns false if batched receive is unavailable and recvfrom() should be used
+	inline bool _udpReceiveBatch(PhySocketImpl &sws)
+	{
+		if (!_udpRxBuf) {
+			_udpRxBuf = (char *)::malloc(ZT_PHY_UDP_BATCH * ZT_PHY_UDP_BATCH_SLOT_SIZE);
+			if (!_udpRxBuf)
+				return false;
+		}
+
+		for(;;) {
+			for(unsigned int i=0;i<ZT_PHY_UDP_BATCH;++i) {
+				_udpRxIov[i].iov_base = _udpRxBuf + (i * ZT_PHY_UDP_BATCH_SLOT_SIZE);
+				_udpRxIov[i].iov_len = ZT_PHY_UDP_BATCH_SLOT_SIZE;
+				memset(&(_udpRxMsgs[i]),0,sizeof(struct mmsghdr));
+				_udpRxMsgs[i].msg_hdr.msg_name = &(_udpRxFrom[i]);
+				_udpRxMsgs[i].msg_hdr.msg_namelen = sizeof(ZT_PHY_SOCKADDR_STORAGE_TYPE);
+				_udpRxMsgs[i].msg_hdr.msg_iov = &(_udpRxIov[i]);
+				_udpRxMsgs[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			const ZT_PHY_SOCKFD_TYPE sock = sws.sock;
+			const int n = ::recvmmsg(sock,_udpRxMsgs,ZT_PHY_UDP_BATCH,MSG_DONTWAIT,(struct timespec *)0);
+			if (n <= 0) {
+				if ((n < 0)&&(errno == ENOSYS)) {
+					_mmsg = false;
+					return false;
+				}
+				return true;
+			}
+
+			for(int i=0;i<n;++i) {
+				if ((_udpRxMsgs[i].msg_len > 0)&&((_udpRxMsgs[i].msg_hdr.msg_flags & MSG_TRUNC) == 0)) {
+					try {
+						_handler->phyOnDatagram((PhySocket *)&sws,&(sws.uptr),(const struct sockaddr *)&(sws.saddr),(const struct sockaddr *)&(_udpRxFrom[i]),(void *)_udpRxIov[i].iov_base,(unsigned long)_udpRxMsgs[i].msg_len);
+					} catch ( ... ) {}
+				}
+				if (sws.type == ZT_PHY_SOCKET_CLOSED)
+					break;
+			}
+
+			if ((n < ZT_PHY_UDP_BATCH)||(sws.type == ZT_PHY_SOCKET_CLOSED))
+				return true;
+		}
+	}
+#endif // ZT_PHY_HAVE_MMSG
+
+
+	// Socket option changes for udpSendWithOptions(), which holds _udpOptionLock exclusively around them
+	inline bool _setIp4UdpTtl(PhySocketImpl &sws,unsigned int ttl)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		DWORD tmp = ((ttl == 0)||(ttl > 255)) ? 255 : (DWORD)ttl;
+		return (::setsockopt(sws.sock,IPPROTO_IP,IP_TTL,(const char *)&tmp,sizeof(tmp)) == 0);
+#else
+		int tmp = ((ttl == 0)||(ttl > 255)) ? 255 : (int)ttl;
+		return (::setsockopt(sws.sock,IPPROTO_IP,IP_TTL,(void *)&tmp,sizeof(tmp)) == 0);
+#endif
+	}
+
+	// With DF set, datagrams larger than the local interface MTU fail to send instead of being fragmented locally
+	inline bool _setIpDontFragment(PhySocketImpl &sws,bool df)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		DWORD f = (df) ? 1 : 0;
+		if (sws.saddr.ss_family == AF_INET6)
+			return (::setsockopt(sws.sock,IPPROTO_IPV6,IPV6_DONTFRAG,(const char *)&f,sizeof(f)) == 0);
+		return (::setsockopt(sws.sock,IPPROTO_IP,IP_DONTFRAGMENT,(const char *)&f,sizeof(f)) == 0);
+#else
+		int f;
+		if (sws.saddr.ss_family == AF_INET6) {
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+			f = (df) ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_DONT;
+			return (::setsockopt(sws.sock,IPPROTO_IPV6,IPV6_MTU_DISCOVER,&f,sizeof(f)) == 0);
+#elif defined(IPV6_DONTFRAG)
+			f = (df) ? 1 : 0;
+			return (::setsockopt(sws.sock,IPPROTO_IPV6,IPV6_DONTFRAG,&f,sizeof(f)) == 0);
+#else
+			return false;
+#endif
+		}
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+		f = (df) ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+		return (::setsockopt(sws.sock,IPPROTO_IP,IP_MTU_DISCOVER,&f,sizeof(f)) == 0);
+#elif defined(IP_DONTFRAG)
+		f = (df) ? 1 : 0;
+		return (::setsockopt(sws.sock,IPPROTO_IP,IP_DONTFRAG,&f,sizeof(f)) == 0);
+#else
+		return false;
+#endif
+#endif
+	}
+
 public:
 	/**
 	 * @param handler Pointer of type HANDLER_PTR_TYPE to handler
@@ -215,8 +344,17 @@ public:
 		_nfds = (pipes[0] > pipes[1]) ? (long)pipes[0] : (long)pipes[1];
 		_whackReceiveSocket = pipes[0];
 		_whackSendSocket = pipes[1];
+		FD_SET(_whackReceiveSocket,&_readfds); // or whack() can't wake select()
 		_noDelay = noDelay;
 		_noCheck = noCheck;
+#if !(defined(_WIN32) || defined(_WIN64))
+		pthread_rwlock_init(&_udpOptionLock,(const pthread_rwlockattr_t *)0);
+#endif
+
+#ifdef ZT_PHY_HAVE_MMSG
+		_mmsg = true;
+		_udpRxBuf = (char *)0;
+#endif
 	}
 
 	~Phy()
@@ -227,6 +365,12 @@ public:
 		}
 		ZT_PHY_CLOSE_SOCKET(_whackReceiveSocket);
 		ZT_PHY_CLOSE_SOCKET(_whackSendSocket);
+#ifdef ZT_PHY_HAVE_MMSG
+		::free(_udpRxBuf);
+#endif
+#if !(defined(_WIN32) || defined(_WIN64))
+		pthread_rwlock_destroy(&_udpOptionLock);
+#endif
 	}
 
 	/**
@@ -415,39 +559,75 @@ public:
 	}
 
 	/**
-	 * Set the IP TTL for the next outgoing packet (for IPv4 UDP sockets only)
+	 * Send a UDP packet
 	 *
-	 * @param ttl New TTL (0 or >255 will set it to 255)
-	 * @return True on success
+	 * @param sock UDP socket
+	 * @param remoteAddress Destination address (must be correct type for socket)
+	 * @param data Data to send
+	 * @param len Length of packet
+	 * @return True if packet appears to have been sent successfully
 	 */
-	inline bool setIp4UdpTtl(PhySocket *sock,unsigned int ttl)
+	inline bool udpSend(PhySocket *sock,const struct sockaddr *remoteAddress,const void *data,unsigned long len)
 	{
 		PhySocketImpl &sws = *(reinterpret_cast<PhySocketImpl *>(sock));
 #if defined(_WIN32) || defined(_WIN64)
-		DWORD tmp = ((ttl == 0)||(ttl > 255)) ? 255 : (DWORD)ttl;
-		return (::setsockopt(sws.sock,IPPROTO_IP,IP_TTL,(const char *)&tmp,sizeof(tmp)) == 0);
+		return ((long)::sendto(sws.sock,reinterpret_cast<const char *>(data),len,0,remoteAddress,(remoteAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == (long)len);
 #else
-		int tmp = ((ttl == 0)||(ttl > 255)) ? 255 : (int)ttl;
-		return (::setsockopt(sws.sock,IPPROTO_IP,IP_TTL,(void *)&tmp,sizeof(tmp)) == 0);
+		pthread_rwlock_rdlock(&_udpOptionLock);
+		const bool sent = ((long)::sendto(sws.sock,data,len,0,remoteAddress,(remoteAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == (long)len);
+		pthread_rwlock_unlock(&_udpOptionLock);
+		return sent;
 #endif
 	}
 
 	/**
-	 * Send a UDP packet
+	 * Send a UDP packet with a one-off IPv4 TTL and/or the IP "don't fragment" bit
+	 *
+	 * The options apply only to this datagram: they are set, the datagram is
+	 * sent, and they are restored, all while other senders on this Phy are
+	 * held off. Without a TTL or DF this is
+	 * the same as udpSend().
 	 *
 	 * @param sock UDP socket
 	 * @param remoteAddress Destination address (must be correct type for socket)
 	 * @param data Data to send
 	 * @param len Length of packet
+	 * @param v4ttl If nonzero, IPv4 TTL for this datagram (ignored for IPv6)
+	 * @param dontFragment If true, send with DF set or fail if that is not possible
 	 * @return True if packet appears to have been sent successfully
 	 */
-	inline bool udpSend(PhySocket *sock,const struct sockaddr *remoteAddress,const void *data,unsigned long len)
+	inline bool udpSendWithOptions(PhySocket *sock,const struct sockaddr *remoteAddress,const void *data,unsigned long len,unsigned int v4ttl,bool dontFragment)
 	{
+		if ((!dontFragment)&&((!v4ttl)||(remoteAddress->sa_family != AF_INET)))
+			return udpSend(sock,remoteAddress,data,len);
 		PhySocketImpl &sws = *(reinterpret_cast<PhySocketImpl *>(sock));
+		const bool ttl = ((v4ttl)&&(remoteAddress->sa_family == AF_INET));
 #if defined(_WIN32) || defined(_WIN64)
-		return ((long)::sendto(sws.sock,reinterpret_cast<const char *>(data),len,0,remoteAddress,(remoteAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == (long)len);
+		if ((dontFragment)&&(!_setIpDontFragment(sws,true)))
+			return false;
+		if (ttl)
+			_setIp4UdpTtl(sws,v4ttl);
+		const bool sent = ((long)::sendto(sws.sock,reinterpret_cast<const char *>(data),len,0,remoteAddress,(remoteAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == (long)len);
+		if (ttl)
+			_setIp4UdpTtl(sws,255);
+		if (dontFragment)
+			_setIpDontFragment(sws,false);
+		return sent;
 #else
-		return ((long)::sendto(sws.sock,data,len,0,remoteAddress,(remoteAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == (long)len);
+		pthread_rwlock_wrlock(&_udpOptionLock);
+		if ((dontFragment)&&(!_setIpDontFragment(sws,true))) {
+			pthread_rwlock_unlock(&_udpOptionLock);
+			return false;
+		}
+		if (ttl)
+			_setIp4UdpTtl(sws,v4ttl);
+		const bool sent = ((long)::sendto(sws.sock,data,len,0,remoteAddress,(remoteAddress->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == (long)len);
+		if (ttl)
+			_setIp4UdpTtl(sws,255);
+		if (dontFragment)
+			_setIpDontFragment(sws,false);
+		pthread_rwlock_unlock(&_udpOptionLock);
+		return sent;
 #endif
 	}
 
@@ -512,11 +692,16 @@ public:
 	/**
 	 * Bind a local listen socket to listen for new TCP connections
 	 *
+	 * With reusePort set (and where SO_REUSEPORT exists) several Phy
+	 * instances, e.g. one per thread, can each listen on the same port and
+	 * have the kernel spread incoming connections across them.
+	 *
 	 * @param localAddress Local address and port
 	 * @param uptr Initial value of uptr for new socket (default: NULL)
+	 * @param reusePort If true, set SO_REUSEPORT so other listeners may share this port (default: false)
 	 * @return Socket or NULL on failure to bind
 	 */
-	inline PhySocket *tcpListen(const struct sockaddr *localAddress,void *uptr = (void *)0)
+	inline PhySocket *tcpListen(const struct sockaddr *localAddress,void *uptr = (void *)0,bool reusePort = false)
 	{
 		if (_socks.size() >= ZT_PHY_MAX_SOCKETS)
 			return (PhySocket *)0;
@@ -540,6 +725,11 @@ public:
 			f = 1; ::setsockopt(s,IPPROTO_IPV6,IPV6_V6ONLY,(void *)&f,sizeof(f));
 			f = 1; ::setsockopt(s,SOL_SOCKET,SO_REUSEADDR,(void *)&f,sizeof(f));
 			f = (_noDelay ? 1 : 0); setsockopt(s,IPPROTO_TCP,TCP_NODELAY,(char *)&f,sizeof(f));
+#ifdef SO_REUSEPORT
+			if (reusePort) {
+				f = 1; ::setsockopt(s,SOL_SOCKET,SO_REUSEPORT,(void *)&f,sizeof(f));
+			}
+#endif
 			fcntl(s,F_SETFL,O_NONBLOCK);
 		}
 #endif
@@ -957,6 +1147,10 @@ public:
 
 				case ZT_PHY_SOCKET_UDP:
 					if (FD_ISSET(s->sock,&rfds)) {
+#ifdef ZT_PHY_HAVE_MMSG
+						if ((_mmsg)&&(_udpReceiveBatch(*s)))
+							break;
+#endif
 						for(;;) {
 							memset(&ss,0,sizeof(ss));
 							socklen_t slen = sizeof(ss);
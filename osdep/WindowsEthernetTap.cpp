@@ -465,6 +465,7 @@ WindowsEthernetTap::WindowsEthernetTap(
 	_tap(INVALID_HANDLE_VALUE),
 	_injectSemaphore(INVALID_HANDLE_VALUE),
 	_pathToHelpers(hp),
+	_mtu(mtu),
 	_run(true),
 	_initialized(false),
 	_enabled(true)
@@ -475,8 +476,9 @@ WindowsEthernetTap::WindowsEthernetTap(
 	char tag[24];
 	std::string mySubkeyName;
 
-	if (mtu > 2800)
-		throw std::runtime_error("MTU too large.");
+	// The driver can't go above this, so bigger network MTUs are clamped
+	if (mtu > ZT_WINDOWS_TAP_MAX_MTU)
+		_mtu = mtu = ZT_WINDOWS_TAP_MAX_MTU;
 
 	// We "tag" registry entries with the network ID to identify persistent devices
 	Utils::snprintf(tag,sizeof(tag),"%.16llx",(unsigned long long)nwid);
@@ -601,6 +603,7 @@ WindowsEthernetTap::WindowsEthernetTap(
 		RegSetKeyValueA(nwAdapters,mySubkeyName.c_str(),"MAC",REG_SZ,tmps,tmpsl);
         tmpsl = Utils::snprintf(tmps, sizeof(tmps), "%d", mtu);
 		RegSetKeyValueA(nwAdapters,mySubkeyName.c_str(),"MTU",REG_SZ,tmps,tmpsl);
+		_adapterSubkeyName = mySubkeyName;
 
 		DWORD tmp = 0;
 		RegSetKeyValueA(nwAdapters,mySubkeyName.c_str(),"*NdisDeviceType",REG_DWORD,(LPCVOID)&tmp,sizeof(tmp));
@@ -784,11 +787,11 @@ std::vector<InetAddress> WindowsEthernetTap::ips() const
 
 void WindowsEthernetTap::put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len)
 {
-	if ((!_initialized)||(!_enabled)||(_tap == INVALID_HANDLE_VALUE)||(len > (ZT_IF_MTU)))
+	if ((!_initialized)||(!_enabled)||(_tap == INVALID_HANDLE_VALUE)||(len > _mtu))
 		return;
 
 	Mutex::Lock _l(_injectPending_m);
-	_injectPending.push( std::pair<Array<char,ZT_IF_MTU + 32>,unsigned int>(Array<char,ZT_IF_MTU + 32>(),len + 14) );
+	_injectPending.push( std::pair<Array<char,ZT_WINDOWS_TAP_MAX_MTU + 32>,unsigned int>(Array<char,ZT_WINDOWS_TAP_MAX_MTU + 32>(),len + 14) );
 	char *d = _injectPending.back().first.data;
 	to.copyTo(d,6);
 	from.copyTo(d + 6,6);
@@ -818,6 +821,40 @@ void WindowsEthernetTap::setFriendlyName(const char *dn)
 	}
 }
 
+void WindowsEthernetTap::setMtu(unsigned int mtu)
+{
+	if (mtu > ZT_WINDOWS_TAP_MAX_MTU)
+		mtu = ZT_WINDOWS_TAP_MAX_MTU;
+	if ((!_initialized)||(mtu == _mtu))
+		return;
+	_mtu = mtu;
+
+	if (_adapterSubkeyName.length() > 0) {
+		HKEY nwAdapters;
+		if (RegOpenKeyExA(HKEY_LOCAL_MACHINE,"SYSTEM\\CurrentControlSet\\Control\\Class\\{4D36E972-E325-11CE-BFC1-08002BE10318}",0,KEY_READ|KEY_WRITE,&nwAdapters) == ERROR_SUCCESS) {
+			char tmps[64];
+			const unsigned int tmpsl = Utils::snprintf(tmps,sizeof(tmps),"%u",mtu) + 1;
+			RegSetKeyValueA(nwAdapters,_adapterSubkeyName.c_str(),"MTU",REG_SZ,tmps,tmpsl); // so it sticks across adapter restarts
+			RegCloseKey(nwAdapters);
+		}
+	}
+
+	// Apply now to the IP stacks, which is what path MTU and MSS come from
+	const ADDRESS_FAMILY families[2] = { AF_INET,AF_INET6 };
+	for(unsigned int i=0;i<2;++i) {
+		MIB_IPINTERFACE_ROW ifr;
+		InitializeIpInterfaceEntry(&ifr);
+		ifr.Family = families[i];
+		ifr.InterfaceLuid = _deviceLuid;
+		if (GetIpInterfaceEntry(&ifr) == NO_ERROR) {
+			if (ifr.Family == AF_INET)
+				ifr.SitePrefixLength = 0; // SetIpInterfaceEntry() rejects IPv4 rows unless this is zero
+			ifr.NlMtu = mtu;
+			SetIpInterfaceEntry(&ifr);
+		}
+	}
+}
+
 void WindowsEthernetTap::scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed)
 {
 	if (!_initialized)
@@ -878,7 +915,7 @@ NET_IFINDEX WindowsEthernetTap::interfaceIndex() const
 void WindowsEthernetTap::threadMain()
 	throw()
 {
-	char tapReadBuf[ZT_IF_MTU + 32];
+	char tapReadBuf[ZT_WINDOWS_TAP_MAX_MTU + 32];
 	char tapPath[128];
 	HANDLE wait4[3];
 	OVERLAPPED tapOvlRead,tapOvlWrite;
@@ -1063,7 +1100,7 @@ void WindowsEthernetTap::threadMain()
 							} catch ( ... ) {} // handlers should not throw
 						}
 					}
-					ReadFile(_tap,tapReadBuf,ZT_IF_MTU + 32,NULL,&tapOvlRead);
+					ReadFile(_tap,tapReadBuf,ZT_WINDOWS_TAP_MAX_MTU + 32,NULL,&tapOvlRead);
 				}
 
 				if (writeInProgress) {
@@ -35,6 +35,11 @@
 #include "../node/InetAddress.hpp"
 #include "../osdep/Thread.hpp"
 
+/**
+ * Largest MTU the Windows tap driver supports (ETHERNET_MTU in TapDriver6)
+ */
+#define ZT_WINDOWS_TAP_MAX_MTU 2800
+
 namespace ZeroTier {
 
 class WindowsEthernetTap
@@ -100,6 +105,7 @@ public:
 	void put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,unsigned int len);
 	std::string deviceName() const;
 	void setFriendlyName(const char *friendlyName);
+	void setMtu(unsigned int mtu);
 	void scanMulticastGroups(std::vector<MulticastGroup> &added,std::vector<MulticastGroup> &removed);
 
 	inline const NET_LUID &luid() const { return _deviceLuid; }
@@ -131,17 +137,19 @@ private:
 	NET_LUID _deviceLuid;
 	std::string _netCfgInstanceId;
 	std::string _deviceInstanceId;
+	std::string _adapterSubkeyName; // under the network adapter class key
 
 	std::vector<InetAddress> _assignedIps; // IPs assigned with addIp
 	Mutex _assignedIps_m;
 
 	std::vector<MulticastGroup> _multicastGroups;
 
-	std::queue< std::pair< Array<char,ZT_IF_MTU + 32>,unsigned int > > _injectPending;
+	std::queue< std::pair< Array<char,ZT_WINDOWS_TAP_MAX_MTU + 32>,unsigned int > > _injectPending;
 	Mutex _injectPending_m;
 
 	std::string _pathToHelpers;
 
+	volatile unsigned int _mtu;
 	volatile bool _run;
 	volatile bool _initialized;
 	volatile bool _enabled;
@@ -34,6 +34,7 @@
 #include "node/Identity.hpp"
 #include "node/Buffer.hpp"
 #include "node/Packet.hpp"
+#include "node/PooledPacket.hpp"
 #include "node/Salsa20.hpp"
 #include "node/MAC.hpp"
 #include "node/NetworkConfig.hpp"
@@ -45,6 +46,11 @@
 #include "node/CertificateOfMembership.hpp"
 #include "node/Node.hpp"
 #include "node/IncomingPacket.hpp"
+#include "node/RelayTable.hpp"
+#include "node/Switch.hpp"
+#include "node/SendQueue.hpp"
+#include "node/Fec.hpp"
+#include "node/Topology.hpp"
 
 #include "osdep/OSUtils.hpp"
 #include "osdep/Phy.hpp"
@@ -54,6 +60,8 @@
 
 #include "controller/JSONDB.hpp"
 
+#include "service/IdentityStore.hpp"
+
 #ifdef __WINDOWS__
 #include <tchar.h>
 #endif
@@ -376,6 +384,30 @@ static int testCrypto()
 	return 0;
 }
 
+// In-memory data store for tests that need a Node (uptr is a std::map<std::string,std::string>)
+static long _testDataStoreGet(ZT_Node *node,void *uptr,const char *name,void *buf,unsigned long bufSize,unsigned long readIndex,unsigned long *totalSize)
+{
+	const std::map<std::string,std::string> &st = *reinterpret_cast<const std::map<std::string,std::string> *>(uptr);
+	std::map<std::string,std::string>::const_iterator o(st.find(name));
+	if (o == st.end())
+		return -1;
+	*totalSize = (unsigned long)o->second.length();
+	if (readIndex >= (unsigned long)o->second.length())
+		return 0;
+	const unsigned long n = std::min(bufSize,(unsigned long)o->second.length() - readIndex);
+	memcpy(buf,o->second.data() + readIndex,n);
+	return (long)n;
+}
+static int _testDataStorePut(ZT_Node *node,void *uptr,const char *name,const void *data,unsigned long len,int secure)
+{
+	std::map<std::string,std::string> &st = *reinterpret_cast<std::map<std::string,std::string> *>(uptr);
+	if (data)
+		st[name].assign(reinterpret_cast<const char *>(data),len);
+	else st.erase(name);
+	return 0;
+}
+static void _testEventCallback(ZT_Node *node,void *uptr,enum ZT_Event event,const void *metaData) {}
+
 static int testIdentity()
 {
 	Identity id;
@@ -474,6 +506,75 @@ static int testIdentity()
 		}
 	}
 
+	{
+		std::cout << "[identity] Testing saved peer state (warm restart)... "; std::cout.flush();
+		std::map<std::string,std::string> store;
+		store["identity.secret"] = id.toString(true);
+		ZT_Node_Callbacks cb;
+		memset(&cb,0,sizeof(cb));
+		cb.version = ZT_NODE_CALLBACKS_VERSION;
+		cb.dataStoreGetFunction = &_testDataStoreGet;
+		cb.dataStorePutFunction = &_testDataStorePut;
+		cb.eventCallback = &_testEventCallback;
+		const uint64_t now = OSUtils::now();
+		Node *const node = new Node((void *)&store,&cb,now); // provides the data store for the topologies below
+
+		Identity peerIds[2];
+		peerIds[0].fromString(KNOWN_GOOD_IDENTITY);
+		peerIds[1].generate();
+		RuntimeEnvironment rr(node);
+		rr.identity = id;
+		Topology *t = new Topology(&rr);
+		for(unsigned int i=0;i<2;++i)
+			t->addPeer(SharedPtr<Peer>(new Peer(&rr,id,Identity(peerIds[i].toString(false)))))->setRemoteVersion(9,1,2,i);
+		store.erase("peers.state");
+
+		if ((!t->saveState(now))||(store.find("peers.state") == store.end())) {
+			std::cout << "FAIL (not saved)" << std::endl;
+			return -1;
+		}
+		if (t->saveState(now)) {
+			std::cout << "FAIL (saved again with nothing changed)" << std::endl;
+			return -1;
+		}
+		t->getPeer(peerIds[1].address())->setRemoteVersion(9,1,2,7);
+		if (!t->saveState(now)) {
+			std::cout << "FAIL (change not saved)" << std::endl;
+			return -1;
+		}
+
+		RuntimeEnvironment rr2(node);
+		rr2.identity = id;
+		Topology *t2 = new Topology(&rr2);
+		t2->loadState(now);
+		for(unsigned int i=0;i<2;++i) {
+			const SharedPtr<Peer> a(t->getPeer(peerIds[i].address())),b(t2->getPeer(peerIds[i].address()));
+			if ((!b)||(b->identity() != a->identity())||(memcmp(b->key(),a->key(),ZT_PEER_SECRET_KEY_LENGTH) != 0)||(b->remoteVersionRevision() != a->remoteVersionRevision())) {
+				std::cout << "FAIL (peer " << peerIds[i].address().toString() << " not restored)" << std::endl;
+				return -1;
+			}
+		}
+		if (t2->saveState(now)) {
+			std::cout << "FAIL (saved again right after load)" << std::endl;
+			return -1;
+		}
+
+		store["peers.state"][store["peers.state"].length() - 1] ^= 1;
+		RuntimeEnvironment rr3(node);
+		rr3.identity = id;
+		Topology *t3 = new Topology(&rr3);
+		if (t3->loadState(now) != 0) {
+			std::cout << "FAIL (tampered state loaded)" << std::endl;
+			return -1;
+		}
+
+		delete t3;
+		delete t2;
+		delete t;
+		delete node;
+		std::cout << "PASS" << std::endl;
+	}
+
 	return 0;
 }
 
@@ -539,6 +640,43 @@ static int testCertificate()
 	return 0;
 }
 
+typedef std::vector<const Path *> _TestSendLog;
+struct _TestSendQueueSender
+{
+	_TestSendQueueSender(_TestSendLog &l,SendQueue *rq = (SendQueue *)0) : log(l),requeue(rq) {}
+	inline void operator()(const SharedPtr<Path> &path,const Packet &packet,unsigned int mtu,uint32_t pieces)
+	{
+		log.push_back(path.ptr());
+		if (requeue) // the queue must be unlocked while sending, or this deadlocks
+			requeue->enqueue(Address((uint64_t)0xc),path,PooledPacket::copy(packet),mtu,pieces,1000);
+	}
+	_TestSendLog &log;
+	SendQueue *requeue;
+};
+
+// Stands in for a second sending thread: drains the queue while a drain is already running
+struct _TestNestedDrainSender
+{
+	_TestNestedDrainSender(_TestSendLog &l,SendQueue &q,unsigned long &w) : log(l),sq(q),nestedWait(w) {}
+	inline void operator()(const SharedPtr<Path> &path,const Packet &packet,unsigned int mtu,uint32_t pieces)
+	{
+		log.push_back(path.ptr());
+		if (log.size() == 1) {
+			sq.enqueue(Address((uint64_t)0xd),path,PooledPacket::copy(packet),mtu,pieces,1000);
+			nestedWait = sq.drain(_TestSendQueueSender(log),1000);
+		}
+	}
+	_TestSendLog &log;
+	SendQueue &sq;
+	unsigned long &nestedWait;
+};
+
+struct _TestPieceCollector
+{
+	inline bool operator()(const void *data,unsigned int len) { pieces.push_back(std::string(reinterpret_cast<const char *>(data),len)); return true; }
+	std::vector<std::string> pieces;
+};
+
 static int testPacket()
 {
 	unsigned char salsaKey[32];
@@ -579,6 +717,489 @@ static int testPacket()
 	}
 
 	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Testing RelayTable... "; std::cout.flush();
+	{
+		RelayTable rt;
+		InetAddress la,ra;
+		rt.set(Address(0x0102030405ULL),InetAddress("10.0.0.1/9993"),InetAddress("192.168.1.2/9993"),1000);
+		if ((!rt.get(Address(0x0102030405ULL),1000 + ZT_RELAY_ROUTE_EXPIRATION - 1,la,ra))||(ra != InetAddress("192.168.1.2/9993"))) {
+			std::cout << "FAIL (get)" << std::endl;
+			return -1;
+		}
+		if (rt.get(Address(0x0102030405ULL),1000 + ZT_RELAY_ROUTE_EXPIRATION,la,ra)) {
+			std::cout << "FAIL (expiration)" << std::endl;
+			return -1;
+		}
+		rt.clean(1000 + ZT_RELAY_ROUTE_EXPIRATION);
+		if (rt.size() != 0) {
+			std::cout << "FAIL (clean)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Testing PooledPacket... "; std::cout.flush();
+	{
+		const PooledPacket::Stats before(PooledPacket::stats());
+		SharedPtr<PooledPacket> p1(PooledPacket::copy(b));
+		SharedPtr<PooledPacket> p2(p1); // handle copy, not a packet copy
+		if ((*p2 != b)||(p2.ptr() != p1.ptr())) {
+			std::cout << "FAIL (copy)" << std::endl;
+			return -1;
+		}
+		SharedPtr<PooledPacket> p3(std::move(p2));
+		if ((p2)||(p3.ptr() != p1.ptr())) {
+			std::cout << "FAIL (move)" << std::endl;
+			return -1;
+		}
+		const PooledPacket *const first = p1.ptr();
+		p1.zero();
+		p3.zero();
+		SharedPtr<PooledPacket> p4(PooledPacket::copy(b));
+		const PooledPacket::Stats after(PooledPacket::stats());
+		if ((p4.ptr() != first)||((after.allocated - before.allocated) + (after.reused - before.reused) != 2)||(after.reused == before.reused)) {
+			std::cout << "FAIL (reuse)" << std::endl;
+			return -1;
+		}
+		if (((after.copies - before.copies) != 2)||((after.bytesCopied - before.bytesCopied) != (uint64_t)(b.size() * 2))) {
+			std::cout << "FAIL (copy count)" << std::endl;
+			return -1;
+		}
+		std::cout << "(copied " << (after.bytesCopied - before.bytesCopied) << " bytes for 2 copies of a " << b.size() << " byte packet) ";
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Testing path MTU discovery... "; std::cout.flush();
+	{
+		// Simulate paths that pass packets up to a given size and drop larger ones
+		const unsigned int pathMtus[3] = { 1400,1472,9000 };
+		for(unsigned int k=0;k<3;++k) {
+			Path p(InetAddress("10.0.0.1/9993"),InetAddress("10.0.0.2/9993"));
+			uint64_t now = ZT_PATH_MTU_DISCOVERY_INTERVAL;
+			for(unsigned int steps=0;steps<64;++steps) {
+				const unsigned int ps = p.nextMtuProbe(now);
+				if (ps) {
+					if (ps <= pathMtus[k])
+						p.mtuProbeReplied(ps);
+				}
+				now += ZT_PATH_MTU_PROBE_TIMEOUT;
+			}
+			const unsigned int expect = std::max(std::min(pathMtus[k],(unsigned int)ZT_PATH_MTU_PROBE_MAX),(unsigned int)ZT_UDP_DEFAULT_PAYLOAD_MTU);
+			if ((p.mtu() > expect)||((expect - p.mtu()) > ZT_PATH_MTU_PROBE_GRANULARITY)) {
+				std::cout << "FAIL (path MTU " << pathMtus[k] << " discovered as " << p.mtu() << ")" << std::endl;
+				return -1;
+			}
+			std::cout << pathMtus[k] << "->" << p.mtu() << " ";
+		}
+
+		// The reply to the largest probe, built as _doECHO builds it, must fit in an older peer's packet
+		Packet probe(Address(),Address(),Packet::VERB_ECHO);
+		probe.append((unsigned char)0,ZT_PATH_MTU_PROBE_MAX - probe.size());
+		Packet reply(Address(),Address(),Packet::VERB_OK);
+		reply.append((unsigned char)Packet::VERB_ECHO);
+		reply.append(probe.packetId());
+		reply.append(reinterpret_cast<const unsigned char *>(probe.data()) + ZT_PACKET_IDX_PAYLOAD,probe.size() - ZT_PACKET_IDX_PAYLOAD);
+		if (reply.size() > ZT_PROTO_MAX_COMPAT_PACKET_LENGTH) {
+			std::cout << "FAIL (reply to largest probe is " << reply.size() << " bytes)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Testing path latency/loss estimators... "; std::cout.flush();
+	{
+		// 100 probes, RTT alternating 20/40ms, every 10th probe lost
+		Path p(InetAddress("10.0.0.1/9993"),InetAddress("10.0.0.2/9993"));
+		uint64_t now = ZT_PATH_QOS_PROBE_INTERVAL;
+		for(unsigned int i=0;i<100;++i) {
+			if (!p.qosProbeDue(now)) {
+				std::cout << "FAIL (probe not due)" << std::endl;
+				return -1;
+			}
+			p.qosProbeSent(now);
+			if ((i % 10) != 9)
+				p.qosProbeReplied(now,now + ((i & 1) ? 40 : 20));
+			now += ZT_PATH_QOS_PROBE_INTERVAL;
+		}
+		p.qosProbeSent(now);
+		const int l = p.latency(),j = p.jitter(),l50 = p.latencyPercentile(50),l95 = p.latencyPercentile(95);
+		const unsigned int loss = p.packetLoss();
+		std::cout << "latency " << l << "ms jitter " << j << "ms p50 " << l50 << "ms p95 " << l95 << "ms loss " << loss << "/1000 ";
+		if ((l < 25)||(l > 35)||(j < 15)||(j > 20)||(l50 < 20)||(l50 > 40)||(l95 != 40)||(loss < 90)||(loss > 110)||(p.qualityPenalty() == 0)) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+
+		// Saved state must restore the same estimates (warm restart)
+		p.received(now,100);
+		Buffer<1024> sb;
+		p.serializeState(sb);
+		Path p2(InetAddress("10.0.0.1/9993"),InetAddress("10.0.0.2/9993"));
+		if ((p2.deserializeState(sb,0) != sb.size())||(p2.latency() != l)||(p2.jitter() != j)||(p2.latencyPercentile(95) != l95)||(p2.packetLoss() != p.packetLoss())||(p2.lastIn() != now)||(p2.mtu() != p.mtu())) {
+			std::cout << "FAIL (state restore)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Testing multipath flow hash... "; std::cout.flush();
+	{
+		// Minimal IPv4/UDP header: same 5-tuple must hash the same, other ports differently
+		unsigned char ip[28];
+		memset(ip,0,sizeof(ip));
+		ip[0] = 0x45; ip[9] = 17;
+		ip[12] = 10; ip[15] = 1; ip[16] = 10; ip[19] = 2;
+		ip[20] = 0x30; ip[21] = 0x39; ip[22] = 0x00; ip[23] = 0x35;
+		const uint64_t h1 = Switch::flowHash(ZT_ETHERTYPE_IPV4,ip,sizeof(ip));
+		ip[27] = 0xff; // payload change, same flow
+		const uint64_t h2 = Switch::flowHash(ZT_ETHERTYPE_IPV4,ip,sizeof(ip));
+		ip[21] = 0x3a; // different source port
+		const uint64_t h3 = Switch::flowHash(ZT_ETHERTYPE_IPV4,ip,sizeof(ip));
+		if ((!h1)||(h1 != h2)||(h1 == h3)||(Switch::flowHash(ZT_ETHERTYPE_ARP,ip,sizeof(ip)) != 0)||(Switch::flowHash(ZT_ETHERTYPE_IPV4,ip,12) != 0)) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		// First fragment (MF set) and a later one (offset 185) of the same datagram must hash alike
+		ip[6] = 0x20; ip[7] = 0x00;
+		const uint64_t f1 = Switch::flowHash(ZT_ETHERTYPE_IPV4,ip,sizeof(ip));
+		ip[6] = 0x00; ip[7] = 0xb9;
+		memset(ip + 20,0xaa,8); // later fragments carry payload where the ports would be
+		const uint64_t f2 = Switch::flowHash(ZT_ETHERTYPE_IPV4,ip,sizeof(ip));
+		if ((!f1)||(f1 != f2)) {
+			std::cout << "FAIL (fragments)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Testing RX queue shard steering... "; std::cout.flush();
+	{
+		// Same sender must always land on the same shard; many senders should use all of them
+		unsigned int counts[ZT_RX_QUEUE_SHARDS];
+		memset(counts,0,sizeof(counts));
+		char tmp[64];
+		for(unsigned int i=0;i<1024;++i) {
+			Utils::snprintf(tmp,sizeof(tmp),"10.%u.%u.1/%u",(i >> 8) & 0xff,i & 0xff,9993 + (i % 3));
+			const InetAddress a(tmp);
+			const unsigned int shard = Switch::rxQueueShard(a);
+			if ((shard >= ZT_RX_QUEUE_SHARDS)||(shard != Switch::rxQueueShard(InetAddress(tmp)))) {
+				std::cout << "FAIL (range)" << std::endl;
+				return -1;
+			}
+			++counts[shard];
+		}
+		for(unsigned int i=0;i<ZT_RX_QUEUE_SHARDS;++i) {
+			if (counts[i] < (1024 / ZT_RX_QUEUE_SHARDS / 2)) {
+				std::cout << "FAIL (shard " << i << " only got " << counts[i] << ")" << std::endl;
+				return -1;
+			}
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Testing paced fair send queue... "; std::cout.flush();
+	{
+		SendQueue sq;
+		_TestSendLog log;
+		SharedPtr<Path> pa(new Path(InetAddress("10.0.0.1/9993"),InetAddress("192.168.1.2/9993")));
+		SharedPtr<Path> pb(new Path(InetAddress("10.0.0.1/9993"),InetAddress("192.168.1.3/9993")));
+		Packet pkt1000(Address(),Address(),Packet::VERB_NOP);
+		pkt1000.append((unsigned char)0,1000 - pkt1000.size());
+		const SharedPtr<PooledPacket> pkt(PooledPacket::copy(pkt1000));
+
+		// Peer A is backlogged and overflows its queue, B sends one packet: B must not wait behind A
+		sq.setPacing(1000000,4);
+		for(unsigned int i=0;i<5;++i)
+			sq.enqueue(Address((uint64_t)0xa),pa,pkt,ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff,1);
+		sq.enqueue(Address((uint64_t)0xb),pb,pkt,ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff,1);
+		unsigned int depth = 0;
+		uint64_t drops = 0;
+		sq.peerStats(Address((uint64_t)0xa),depth,drops);
+		const unsigned long wait1 = sq.drain(_TestSendQueueSender(log),1000);
+		if ((depth != 4)||(drops != 1)||(sq.drops() != 1)||(sq.depth() != 0)||(wait1 != 0xffffffff)||(log.size() != 5)||(log[0] != pa.ptr())||(log[1] != pb.ptr())) {
+			std::cout << "FAIL (fairness)" << std::endl;
+			return -1;
+		}
+
+		// At 100KB/sec only what is left in the bucket goes out now
+		log.clear();
+		sq.setPacing(100000,0);
+		for(unsigned int i=0;i<30;++i)
+			sq.enqueue(Address((uint64_t)0xa),pa,pkt,ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff,1000);
+		const unsigned long wait2 = sq.drain(_TestSendQueueSender(log),1000);
+		if ((log.empty())||(log.size() >= 30)||(sq.depth() != (30 - log.size()))||(wait2 < 1)||(wait2 > 10)) {
+			std::cout << "FAIL (pacing)" << std::endl;
+			return -1;
+		}
+
+		// A fragmented packet is admitted or dropped whole, and paced by its total size on the wire
+		SendQueue sq2;
+		sq2.setPacing(1000000,1);
+		Packet big(Address(),Address(),Packet::VERB_NOP);
+		big.append((unsigned char)0,(ZT_PROTO_MAX_PACKET_LENGTH - (ZT_MAX_PACKET_FRAGMENTS * ZT_PROTO_MIN_FRAGMENT_LENGTH)) - big.size());
+		const SharedPtr<PooledPacket> bigp(PooledPacket::copy(big));
+		const bool q1 = sq2.enqueue(Address((uint64_t)0xa),pa,bigp,ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff,1000);
+		const bool q2 = sq2.enqueue(Address((uint64_t)0xa),pa,bigp,ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff,1000);
+		log.clear();
+		sq2.drain(_TestSendQueueSender(log),1000);
+		if ((!q1)||(q2)||(sq2.drops() != 1)||(log.size() != 1)||(big.wireLength(ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff) != (big.size() + ((ZT_MAX_PACKET_FRAGMENTS - 1) * ZT_PROTO_MIN_FRAGMENT_LENGTH)))) {
+			std::cout << "FAIL (whole packet admission)" << std::endl;
+			return -1;
+		}
+
+		// The send function may queue more, since it runs with the queue unlocked
+		sq2.setPacing(0,0);
+		sq2.enqueue(Address((uint64_t)0xa),pa,pkt,ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff,1000);
+		log.clear();
+		sq2.drain(_TestSendQueueSender(log,&sq2),1000);
+		if ((log.size() != 1)||(sq2.depth() != 1)) {
+			std::cout << "FAIL (send with queue unlocked)" << std::endl;
+			return -1;
+		}
+
+		// A drain that starts while another is running sends nothing itself, and the running drain picks up its packets
+		SendQueue sq3;
+		sq3.setPacing(1000000,0);
+		sq3.enqueue(Address((uint64_t)0xd),pa,pkt,ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff,1000);
+		log.clear();
+		unsigned long nestedWait = 0;
+		const unsigned long wait3 = sq3.drain(_TestNestedDrainSender(log,sq3,nestedWait),1000);
+		if ((nestedWait != 1)||(wait3 != 0xffffffff)||(log.size() != 2)||(sq3.depth() != 0)) {
+			std::cout << "FAIL (single drainer)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Testing fragment NACK and retransmit... "; std::cout.flush();
+	{
+		unsigned char key[32];
+		Utils::getSecureRandom(key,sizeof(key));
+		Packet outp(Address(0x0102030405ULL),Address(0x0a0b0c0d0eULL),Packet::VERB_FRAME);
+		outp.append((unsigned char)0x55,5000);
+		outp.setFragmented(true);
+		outp.armor(key,true,0);
+		const SharedPtr<PooledPacket> kept(PooledPacket::copy(outp)); // as Switch keeps it for retransmission
+
+		_TestPieceCollector sent;
+		outp.sendPieces(ZT_UDP_DEFAULT_PAYLOAD_MTU,0xffffffff,sent);
+		const unsigned int total = (unsigned int)sent.pieces.size();
+		if ((total < 4)||(total > ZT_MAX_PACKET_FRAGMENTS)) {
+			std::cout << "FAIL (sent as " << total << " pieces)" << std::endl;
+			return -1;
+		}
+
+		// The receiver got everything but fragment 2 and the last fragment
+		const uint32_t lost = (((uint32_t)1) << 2) | (((uint32_t)1) << (total - 1));
+		const uint32_t nack = Switch::fragmentsMissing(total,((((uint32_t)1) << total) - 1) & ~lost);
+		if ((nack != lost)||(Switch::fragmentsMissing(0,1) != ((((uint32_t)1) << ZT_MAX_PACKET_FRAGMENTS) - 2))) {
+			std::cout << "FAIL (NACK mask " << nack << ")" << std::endl;
+			return -1;
+		}
+
+		_TestPieceCollector resent;
+		kept->sendPieces(ZT_UDP_DEFAULT_PAYLOAD_MTU,nack,resent);
+		if ((resent.pieces.size() != 2)||(resent.pieces[0] != sent.pieces[2])||(resent.pieces[1] != sent.pieces[total - 1])) {
+			std::cout << "FAIL (retransmitted fragments differ from originals)" << std::endl;
+			return -1;
+		}
+
+		// Reassemble from what arrived the first time plus what was resent
+		Packet inp(sent.pieces[0].data(),(unsigned int)sent.pieces[0].length());
+		for(unsigned int f=1;f<total;++f) {
+			const std::string &fs = (f == 2) ? resent.pieces[0] : ((f == (total - 1)) ? resent.pieces[1] : sent.pieces[f]);
+			Packet::Fragment frag(fs.data(),(unsigned int)fs.length());
+			inp.append(frag.payload(),frag.payloadLength());
+		}
+		if ((!inp.dearmor(key))||(inp.size() != (ZT_PACKET_IDX_PAYLOAD + 5000))||(inp[ZT_PACKET_IDX_PAYLOAD + 4999] != 0x55)) {
+			std::cout << "FAIL (reassembly after retransmit)" << std::endl;
+			return -1;
+		}
+		std::cout << "(" << total << " pieces, resent " << resent.pieces.size() << ") ";
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[packet] Benchmarking relay forwarding table (single core)... "; std::cout.flush();
+	{
+		// Mirrors Switch's relay fast path minus the actual send: route lookup,
+		// copy with hop increment, and counter update for 1400 byte packets.
+		RelayTable rt;
+		const unsigned int naddrs = 10000;
+		for(unsigned int i=0;i<naddrs;++i)
+			rt.set(Address((uint64_t)i + 1),InetAddress("10.0.0.1/9993"),InetAddress("192.168.1.2/9993"),0);
+		unsigned char pkt[1400],out[1400];
+		for(unsigned int i=0;i<sizeof(pkt);++i)
+			pkt[i] = (unsigned char)i;
+		InetAddress la,ra;
+		unsigned long found = 0;
+		const unsigned int npkts = 5000000;
+		const uint64_t start = OSUtils::now();
+		for(unsigned int i=0;i<npkts;++i) {
+			if (rt.get(Address((uint64_t)(i % naddrs) + 1),1,la,ra)) {
+				memcpy(out,pkt,sizeof(pkt));
+				out[ZT_PACKET_IDX_FLAGS] = (out[ZT_PACKET_IDX_FLAGS] & 0xf8) | ((out[ZT_PACKET_IDX_FLAGS] + 1) & 0x07);
+				rt.relayed(sizeof(out));
+				++found;
+			}
+		}
+		const uint64_t end = OSUtils::now();
+		if ((found != npkts)||(rt.relayedPackets() != npkts)) {
+			std::cout << "FAIL (lookup)" << std::endl;
+			return -1;
+		}
+		std::cout << ((double)npkts / ((double)(end - start) / 1000.0)) << " packets/second" << std::endl;
+	}
+
+	std::cout << "[packet] Benchmarking XOR parity FEC vs loss..." << std::endl;
+	{
+		// Simulated link: data and parity are each lost independently at the
+		// given rate, and delivery with FEC counts packets rebuilt from parity.
+		static const unsigned int lossRates[5] = { 0,10,20,30,50 }; // per mille
+		const unsigned int npkts = 20000;
+		uint64_t prng = 0x1234567890abcdefULL;
+		for(unsigned int lr=0;lr<5;++lr) {
+			FecEncoder enc;
+			FecDecoder dec;
+			const Address src((uint64_t)0x1122334455ULL);
+			const uint64_t now = 1000000;
+			std::vector<std::string> group;
+			std::vector<bool> groupLost;
+			unsigned long delivered = 0,rebuilt = 0;
+			uint64_t bytesSent = 0,bytesDelivered = 0;
+			unsigned char pkt[1400],out[ZT_FEC_MAX_PACKET_SIZE];
+			for(unsigned int i=0;i<npkts;++i) {
+				prng = (prng * 6364136223846793005ULL) + 1442695040888963407ULL;
+				const unsigned int len = 64 + (unsigned int)((prng >> 33) % (sizeof(pkt) - 64));
+				const uint64_t packetId = (uint64_t)i + 1;
+				for(unsigned int k=0;k<8;++k)
+					pkt[k] = (unsigned char)(packetId >> (56 - (k * 8)));
+				for(unsigned int k=8;k<len;++k)
+					pkt[k] = (unsigned char)(prng >> (k & 31));
+				group.push_back(std::string((const char *)pkt,len));
+				bytesSent += len;
+
+				prng = (prng * 6364136223846793005ULL) + 1442695040888963407ULL;
+				const bool lost = (((prng >> 33) % 1000) < lossRates[lr]);
+				groupLost.push_back(lost);
+				if (!lost) {
+					dec.received(src,packetId,pkt,len,now);
+					++delivered;
+					bytesDelivered += len;
+				}
+
+				if (enc.add(packetId,pkt,len)) {
+					Buffer<ZT_PROTO_MAX_PACKET_LENGTH> parity;
+					enc.appendParity(parity);
+					bytesSent += parity.size() + ZT_PACKET_IDX_PAYLOAD;
+					prng = (prng * 6364136223846793005ULL) + 1442695040888963407ULL;
+					if ((((prng >> 33) % 1000) >= lossRates[lr])) {
+						const unsigned int rlen = dec.recover(src,parity.data(),parity.size(),out,now);
+						if (rlen) {
+							unsigned int missing = 0;
+							while ((missing < groupLost.size())&&(!groupLost[missing]))
+								++missing;
+							if ((missing >= group.size())||(group[missing] != std::string((const char *)out,rlen))) {
+								std::cout << "  FAIL (rebuilt packet does not match original)" << std::endl;
+								return -1;
+							}
+							if (dec.received(src,((uint64_t)i + 1) - (group.size() - 1) + missing,out,rlen,now)) {
+								std::cout << "  FAIL (late duplicate of rebuilt packet not detected)" << std::endl;
+								return -1;
+							}
+							++rebuilt;
+							bytesDelivered += rlen;
+						}
+					}
+					group.clear();
+					groupLost.clear();
+				}
+			}
+			if ((dec.recovered() != rebuilt)||((lossRates[lr])&&(!rebuilt))) {
+				std::cout << "  FAIL (no packets rebuilt at " << lossRates[lr] << " per mille loss)" << std::endl;
+				return -1;
+			}
+			{
+				// Packets from a source that has not sent parity are not kept
+				const Address other((uint64_t)0x5544332211ULL);
+				FecEncoder oenc;
+				memset(pkt,0x5a,sizeof(pkt));
+				dec.received(other,1,pkt,100,now);
+				oenc.add(1,pkt,100);
+				oenc.add(2,pkt,200);
+				Buffer<ZT_PROTO_MAX_PACKET_LENGTH> parity;
+				oenc.appendParity(parity);
+				if (dec.recover(other,parity.data(),parity.size(),out,now)) {
+					std::cout << "  FAIL (kept packet from source that had not sent parity)" << std::endl;
+					return -1;
+				}
+			}
+			std::cout << "  " << ((double)lossRates[lr] / 10.0) << "% loss: delivered " << ((double)(delivered * 100) / (double)npkts) << "% without FEC, " << ((double)((delivered + rebuilt) * 100) / (double)npkts) << "% with FEC, goodput " << ((double)(bytesDelivered * 100) / (double)bytesSent) << "% of bytes sent" << std::endl;
+		}
+	}
+
+	std::cout << "[packet] Benchmarking frame throughput vs virtual MTU (single core)..." << std::endl;
+	{
+		// Mirrors the unicast frame path minus filters and I/O: build, compress,
+		// armor, and fragment at the default UDP MTU, then reassemble, dearmor,
+		// and decompress. These per-frame costs are what a bigger MTU amortizes.
+		static const unsigned int mtus[4] = { ZT_MIN_MTU,ZT_DEFAULT_MTU,9000,ZT_MAX_MTU };
+		const unsigned int fragPayload = ZT_UDP_DEFAULT_PAYLOAD_MTU - ZT_PROTO_MIN_FRAGMENT_LENGTH;
+
+		// Largest frame plus a generous allowance for multicast headers and an inline COM must fit
+		const unsigned int worst = ZT_MAX_MTU + 512;
+		if ((1 + (((worst - ZT_UDP_DEFAULT_PAYLOAD_MTU) + (fragPayload - 1)) / fragPayload)) > ZT_MAX_PACKET_FRAGMENTS) {
+			std::cout << "  FAIL (ZT_MAX_MTU frame needs more than ZT_MAX_PACKET_FRAGMENTS fragments)" << std::endl;
+			return -1;
+		}
+
+		unsigned char key[32];
+		Utils::getSecureRandom(key,sizeof(key));
+		uint8_t *const frame = new uint8_t[ZT_MAX_MTU];
+		Utils::getSecureRandom(frame,ZT_MAX_MTU);
+		for(unsigned int m=0;m<4;++m) {
+			const unsigned int mtu = mtus[m];
+			const unsigned int nframes = (32 * 1048576) / mtu;
+			unsigned int maxFragments = 0;
+			const uint64_t start = OSUtils::now();
+			for(unsigned int i=0;i<nframes;++i) {
+				Packet outp(Address(0x0102030405ULL),Address(0x0a0b0c0d0eULL),Packet::VERB_FRAME);
+				outp.append((uint64_t)0x8056c2e21c000001ULL);
+				outp.append((uint16_t)0x0800);
+				outp.append(frame,mtu);
+				outp.compress();
+				const unsigned int chunkSize = std::min(outp.size(),(unsigned int)ZT_UDP_DEFAULT_PAYLOAD_MTU);
+				const unsigned int totalFragments = 1 + (((outp.size() - chunkSize) + (fragPayload - 1)) / fragPayload);
+				outp.setFragmented(totalFragments > 1);
+				outp.armor(key,true,0);
+
+				Packet inp(outp.data(),chunkSize);
+				for(unsigned int fno=1,fragStart=chunkSize;fno<totalFragments;++fno) {
+					const unsigned int fragLen = std::min(outp.size() - fragStart,fragPayload);
+					Packet::Fragment frag(outp,fragStart,fragLen,fno,totalFragments);
+					inp.append(frag.payload(),frag.payloadLength());
+					fragStart += fragLen;
+				}
+				if ((!inp.dearmor(key))||(!inp.uncompress())||(inp.size() != (ZT_PROTO_VERB_FRAME_IDX_PAYLOAD + mtu))||(memcmp(inp.field(ZT_PROTO_VERB_FRAME_IDX_PAYLOAD,mtu),frame,mtu) != 0)) {
+					std::cout << "  FAIL (MTU " << mtu << " frame did not survive fragmentation)" << std::endl;
+					delete [] frame;
+					return -1;
+				}
+				if (totalFragments > maxFragments)
+					maxFragments = totalFragments;
+			}
+			const uint64_t end = OSUtils::now();
+			if ((maxFragments > ZT_MAX_PACKET_FRAGMENTS)||((mtu <= ZT_DEFAULT_MTU)&&(maxFragments > ZT_MAX_PACKET_FRAGMENTS_COMPAT))) {
+				std::cout << "  FAIL (MTU " << mtu << " frame took " << maxFragments << " fragments)" << std::endl;
+				delete [] frame;
+				return -1;
+			}
+			const double secs = (double)((end > start) ? (end - start) : 1) / 1000.0;
+			std::cout << "  MTU " << mtu << ": " << maxFragments << " UDP packets per frame, " << (((double)nframes * (double)mtu) / 1048576.0) / secs << " MiB/second, " << (double)nframes / secs << " frames/second" << std::endl;
+		}
+		delete [] frame;
+	}
+
 	return 0;
 }
 
@@ -774,6 +1395,31 @@ static int testOther()
 	}
 	std::cout << "PASS" << std::endl;
 
+	std::cout << "[other] Testing Path::HashKey distribution... "; std::cout.flush();
+	{
+		// Many ports on a few hosts behind one NAT is the common worst case
+		unsigned int slots[ZT_PATH_CACHE_SIZE];
+		memset(slots,0,sizeof(slots));
+		const InetAddress local("10.0.0.1/9993");
+		unsigned int n = 0,worst = 0;
+		for(unsigned int host=1;host<=4;++host) {
+			for(unsigned int port=20000;port<21024;++port) {
+				char tmp[64];
+				Utils::snprintf(tmp,sizeof(tmp),"203.0.113.%u/%u",host,port);
+				const unsigned int s = ++slots[Path::HashKey(local,InetAddress(tmp)).hashCode() & (ZT_PATH_CACHE_SIZE - 1)];
+				if (s > worst)
+					worst = s;
+				++n;
+			}
+		}
+		std::cout << n << " keys, worst slot " << worst << " ";
+		if (worst > ((n / ZT_PATH_CACHE_SIZE) * 4)) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
 	std::cout << "[other] Testing hex encode/decode... "; std::cout.flush();
 	for(unsigned int k=0;k<1000;++k) {
 		unsigned int flen = (rand() % 8194) + 1;
@@ -849,6 +1495,63 @@ static int testOther()
 	}
 	std::cout << "PASS (junk value to prevent optimization-out of test: " << foo << ")" << std::endl;
 
+	std::cout << "[other] Testing service/IdentityStore... "; std::cout.flush();
+	{
+		const char *const dbp = "identitystore-test.db";
+		OSUtils::rm(dbp);
+		std::map<uint64_t,std::string> ref;
+		IdentityStore ids;
+		if (!ids.open(dbp)) {
+			std::cout << "FAILED (open)" << std::endl;
+			return -1;
+		}
+		for(unsigned int i=0;i<20000;++i) {
+			const uint64_t a = (uint64_t)(rand() % 5000);
+			if ((i % 7) == 0) {
+				ids.erase(a,1000 + i);
+				ref.erase(a);
+			} else {
+				char tmp[64];
+				Utils::snprintf(tmp,sizeof(tmp),"%.10llx:0:%x",(unsigned long long)a,(unsigned int)rand());
+				ids.put(a,tmp,(unsigned int)strlen(tmp),(a < 2500) ? 1000 : 1000 + ZT_IDENTITYSTORE_TOUCH_INTERVAL + i);
+				ref[a] = tmp;
+			}
+		}
+		for(unsigned int pass=0;pass<3;++pass) {
+			if (pass == 1) {
+				ids.close();
+				FILE *f = fopen(dbp,"ab");
+				fwrite("\x01\x00torn",1,6,f); // simulated partial write
+				fclose(f);
+				if (!ids.open(dbp)) {
+					std::cout << "FAILED (reopen)" << std::endl;
+					return -1;
+				}
+			} else if (pass == 2) {
+				ids.clean(1000 + ZT_IDENTITYSTORE_TOUCH_INTERVAL);
+				for(std::map<uint64_t,std::string>::iterator r(ref.begin());r!=ref.end();) {
+					if (r->first < 2500)
+						ref.erase(r++);
+					else ++r;
+				}
+			}
+			std::string tmp;
+			if (ids.size() != ref.size()) {
+				std::cout << "FAILED (size " << ids.size() << " != " << ref.size() << ", pass " << pass << ")" << std::endl;
+				return -1;
+			}
+			for(std::map<uint64_t,std::string>::iterator r(ref.begin());r!=ref.end();++r) {
+				if ((!ids.get(r->first,tmp))||(tmp != r->second)) {
+					std::cout << "FAILED (get " << r->first << ", pass " << pass << ")" << std::endl;
+					return -1;
+				}
+			}
+		}
+		ids.close();
+		OSUtils::rm(dbp);
+	}
+	std::cout << "PASS" << std::endl;
+
 	/*
 	std::cout << "[other] Testing controller/JSONDB..."; std::cout.flush();
 	{
@@ -900,6 +1603,12 @@ static unsigned long phyTestTcpByteCount = 0;
 static unsigned long phyTestTcpConnectSuccessCount = 0;
 static unsigned long phyTestTcpConnectFailCount = 0;
 static unsigned long phyTestTcpAcceptCount = 0;
+#define ZT_TEST_PHY_UDP_BATCH_PACKETS 256
+static unsigned char phyTestUdpBatchSeen[ZT_TEST_PHY_UDP_BATCH_PACKETS];
+static unsigned long phyTestUdpBatchBad = 0;
+static unsigned long phyTestUdpBatchReplies = 0;
+static unsigned long phyTestUdpBatchReplySendsOk = 0;
+static unsigned long phyTestUdpBatchBogusSendsFailed = 0;
 struct TestPhyHandlers;
 static Phy<TestPhyHandlers *> *testPhyInstance = (Phy<TestPhyHandlers *> *)0;
 struct TestPhyHandlers
@@ -907,6 +1616,30 @@ struct TestPhyHandlers
 	inline void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len)
 	{
 		++phyTestUdpPacketCount;
+
+		// Batch test: 0xbb datagrams carry an index and a length/content pattern, and get a 0xcc reply
+		const unsigned char *const b = reinterpret_cast<const unsigned char *>(data);
+		if ((len >= 3)&&(b[0] == 0xbb)) {
+			const unsigned int idx = ((unsigned int)b[1] << 8) | (unsigned int)b[2];
+			bool ok = ((idx < ZT_TEST_PHY_UDP_BATCH_PACKETS)&&(len == (64 + idx))&&(!phyTestUdpBatchSeen[idx]));
+			for(unsigned long i=3;((ok)&&(i<len));++i)
+				ok = (b[i] == (unsigned char)(idx + i));
+			if (!ok) {
+				++phyTestUdpBatchBad;
+				return;
+			}
+			phyTestUdpBatchSeen[idx] = 1;
+
+			// Sends from inside the receive batch must report their real result
+			unsigned char reply[3] = { 0xcc,b[1],b[2] };
+			if (testPhyInstance->udpSend(sock,from,reply,sizeof(reply)))
+				++phyTestUdpBatchReplySendsOk;
+			const InetAddress v6("::1/60003"); // wrong family for this IPv4 socket, so the send fails
+			if (!testPhyInstance->udpSend(sock,reinterpret_cast<const struct sockaddr *>(&v6),reply,sizeof(reply)))
+				++phyTestUdpBatchBogusSendsFailed;
+		} else if ((len == 3)&&(b[0] == 0xcc)) {
+			++phyTestUdpBatchReplies;
+		}
 	}
 
 	inline void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
@@ -962,6 +1695,12 @@ static int testPhy()
 	char udpTestPayload[ZT_TEST_PHY_UDP_PACKET_SIZE];
 	memset(udpTestPayload,0xff,sizeof(udpTestPayload));
 
+#ifdef ZT_PHY_HAVE_MMSG
+	std::cout << "[phy] Batched UDP receive (recvmmsg): ENABLED" << std::endl;
+#else
+	std::cout << "[phy] Batched UDP receive (recvmmsg): DISABLED" << std::endl;
+#endif
+
 	struct sockaddr_in bindaddr;
 	memset(&bindaddr,0,sizeof(bindaddr));
 	bindaddr.sin_family = AF_INET;
@@ -1010,6 +1749,51 @@ static int testPhy()
 	}
 	std::cout << "got " << phyTestUdpPacketCount << " packets, OK" << std::endl;
 
+	std::cout << "[phy] Testing UDP batch send/receive over loopback... "; std::cout.flush();
+	{
+		struct sockaddr_in peeraddr;
+		memset(&peeraddr,0,sizeof(peeraddr));
+		peeraddr.sin_family = AF_INET;
+		peeraddr.sin_port = Utils::hton((uint16_t)60003);
+		peeraddr.sin_addr.s_addr = Utils::hton((uint32_t)0x7f000001);
+		PhySocket *const udpPeerSock = testPhyInstance->udpBind((const struct sockaddr *)&peeraddr);
+		if (!udpPeerSock) {
+			std::cout << "FAILED (bind)" << std::endl;
+			return -1;
+		}
+
+		// Queue bursts in the kernel before polling so they are read back in recvmmsg() batches
+		memset(phyTestUdpBatchSeen,0,sizeof(phyTestUdpBatchSeen));
+		unsigned char pkt[64 + ZT_TEST_PHY_UDP_BATCH_PACKETS];
+		timeoutAt = OSUtils::now() + ZT_TEST_PHY_TIMEOUT_MS;
+		for(unsigned int idx=0;idx<ZT_TEST_PHY_UDP_BATCH_PACKETS;) {
+			const unsigned int burstEnd = std::min(idx + 16,(unsigned int)ZT_TEST_PHY_UDP_BATCH_PACKETS);
+			for(;idx<burstEnd;++idx) {
+				pkt[0] = 0xbb;
+				pkt[1] = (unsigned char)(idx >> 8);
+				pkt[2] = (unsigned char)idx;
+				for(unsigned int i=3;i<(64 + idx);++i)
+					pkt[i] = (unsigned char)(idx + i);
+				if (!testPhyInstance->udpSend(udpPeerSock,(const struct sockaddr *)&bindaddr,pkt,64 + idx)) {
+					std::cout << "FAILED (send " << idx << ")" << std::endl;
+					return -1;
+				}
+			}
+			while ((OSUtils::now() < timeoutAt)&&(phyTestUdpBatchReplies < idx))
+				testPhyInstance->poll(100);
+		}
+		testPhyInstance->close(udpPeerSock,true);
+
+		unsigned int seen = 0;
+		for(unsigned int idx=0;idx<ZT_TEST_PHY_UDP_BATCH_PACKETS;++idx)
+			seen += phyTestUdpBatchSeen[idx];
+		if ((seen != ZT_TEST_PHY_UDP_BATCH_PACKETS)||(phyTestUdpBatchBad)||(phyTestUdpBatchReplies != ZT_TEST_PHY_UDP_BATCH_PACKETS)||(phyTestUdpBatchReplySendsOk != ZT_TEST_PHY_UDP_BATCH_PACKETS)||(phyTestUdpBatchBogusSendsFailed != ZT_TEST_PHY_UDP_BATCH_PACKETS)) {
+			std::cout << "FAILED (received " << seen << " intact, " << phyTestUdpBatchBad << " bad, " << phyTestUdpBatchReplies << " replies, " << phyTestUdpBatchReplySendsOk << " reply sends ok, " << phyTestUdpBatchBogusSendsFailed << " bad sends reported)" << std::endl;
+			return -1;
+		}
+		std::cout << "got " << seen << " datagrams and " << phyTestUdpBatchReplies << " replies, OK" << std::endl;
+	}
+
 	std::cout << "[phy] Testing TCP... "; std::cout.flush();
 	timeoutAt = OSUtils::now() + ZT_TEST_PHY_TIMEOUT_MS;
 	while ((OSUtils::now() < timeoutAt)&&(phyTestTcpByteCount < (ZT_TEST_PHY_NUM_VALID_TCP_CONNECTS * ZT_TEST_PHY_TCP_MESSAGE_SIZE))) {
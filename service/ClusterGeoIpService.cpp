@@ -29,17 +29,25 @@
 
 #define ZT_CLUSTERGEOIPSERVICE_FILE_MODIFICATION_CHECK_EVERY 10000
 
+// Binary database magic, byte order mark, and header size
+#define ZT_CLUSTERGEOIPSERVICE_MAGIC "ZTGEOIP1"
+#define ZT_CLUSTERGEOIPSERVICE_BOM 0x01020304
+#define ZT_CLUSTERGEOIPSERVICE_HEADER_SIZE 24
+
+// Entries in each /16 index (one per prefix plus an end marker)
+#define ZT_CLUSTERGEOIPSERVICE_INDEX_SIZE 65537
+
 namespace ZeroTier {
 
 ClusterGeoIpService::ClusterGeoIpService() :
-	_pathToCsv(),
+	_path(),
 	_ipStartColumn(-1),
 	_ipEndColumn(-1),
 	_latitudeColumn(-1),
 	_longitudeColumn(-1),
 	_lastFileCheckTime(0),
-	_csvModificationTime(0),
-	_csvFileSize(0)
+	_fileModificationTime(0),
+	_fileSize(0)
 {
 }
 
@@ -47,58 +55,201 @@ ClusterGeoIpService::~ClusterGeoIpService()
 {
 }
 
-bool ClusterGeoIpService::locate(const InetAddress &ip,int &x,int &y,int &z)
+long ClusterGeoIpService::load(const char *path,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn)
 {
+	const uint64_t mtime = OSUtils::getLastModified(path);
+	const int64_t fsize = OSUtils::getFileSize(path);
+	if (fsize < 0)
+		return -1;
+
+	SharedPtr<_Db> db(_load(path,ipStartColumn,ipEndColumn,latitudeColumn,longitudeColumn));
+	if (!db)
+		return -1;
+	const long n = (long)db->v4Count + (long)db->v6Count;
+	if (n <= 0)
+		return 0;
+
 	Mutex::Lock _l(_lock);
+	_path = path;
+	_ipStartColumn = ipStartColumn;
+	_ipEndColumn = ipEndColumn;
+	_latitudeColumn = latitudeColumn;
+	_longitudeColumn = longitudeColumn;
+	_lastFileCheckTime = OSUtils::now();
+	_fileModificationTime = mtime;
+	_fileSize = fsize;
+	_db = db;
+	return n;
+}
 
-	if ((_pathToCsv.length() > 0)&&((OSUtils::now() - _lastFileCheckTime) > ZT_CLUSTERGEOIPSERVICE_FILE_MODIFICATION_CHECK_EVERY)) {
-		_lastFileCheckTime = OSUtils::now();
-		if ((_csvFileSize != OSUtils::getFileSize(_pathToCsv.c_str()))||(_csvModificationTime != OSUtils::getLastModified(_pathToCsv.c_str())))
-			_load(_pathToCsv.c_str(),_ipStartColumn,_ipEndColumn,_latitudeColumn,_longitudeColumn);
+bool ClusterGeoIpService::locate(const InetAddress &ip,int &x,int &y,int &z)
+{
+	SharedPtr<_Db> db;
+	bool reload = false;
+	{
+		Mutex::Lock _l(_lock);
+		db = _db;
+		if ((_path.length() > 0)&&((OSUtils::now() - _lastFileCheckTime) > ZT_CLUSTERGEOIPSERVICE_FILE_MODIFICATION_CHECK_EVERY)) {
+			_lastFileCheckTime = OSUtils::now();
+			reload = ((_fileSize != OSUtils::getFileSize(_path.c_str()))||(_fileModificationTime != OSUtils::getLastModified(_path.c_str())));
+		}
+	}
+
+	if (reload) {
+		// Only the caller that noticed the change gets here; others keep using the old database meanwhile
+		std::string path;
+		int c0,c1,c2,c3;
+		{
+			Mutex::Lock _l(_lock);
+			path = _path;
+			c0 = _ipStartColumn;
+			c1 = _ipEndColumn;
+			c2 = _latitudeColumn;
+			c3 = _longitudeColumn;
+		}
+		this->load(path.c_str(),c0,c1,c2,c3);
+		Mutex::Lock _l(_lock);
+		db = _db;
 	}
 
-	/* We search by looking up the upper bound of the sorted vXdb vectors
-	 * and then iterating down for a matching IP range. We stop when we hit
-	 * the beginning or an entry whose start and end are before the IP we
-	 * are searching. */
-
-	if ((ip.ss_family == AF_INET)&&(_v4db.size() > 0)) {
-		_V4E key;
-		key.start = Utils::ntoh((uint32_t)(reinterpret_cast<const struct sockaddr_in *>(&ip)->sin_addr.s_addr));
-		std::vector<_V4E>::const_iterator i(std::upper_bound(_v4db.begin(),_v4db.end(),key));
-		while (i != _v4db.begin()) {
-			--i;
-			if ((key.start >= i->start)&&(key.start <= i->end)) {
-				x = i->x;
-				y = i->y;
-				z = i->z;
-				//printf("%s : %f,%f %d,%d,%d\n",ip.toIpString().c_str(),i->lat,i->lon,x,y,z);
+	if (!db)
+		return false;
+
+	/* The /16 index gives the slice of the sorted range starts that can hold
+	 * the upper bound for this IP. From there we iterate down for a matching
+	 * IP range, stopping when we hit the beginning or an entry whose start
+	 * and end are before the IP we are searching. */
+
+	if ((ip.ss_family == AF_INET)&&(db->v4Count > 0)) {
+		const uint32_t k = Utils::ntoh((uint32_t)(reinterpret_cast<const struct sockaddr_in *>(&ip)->sin_addr.s_addr));
+		const uint32_t *const st = db->v4Start;
+		unsigned long lo = db->v4Index[k >> 16],hi = db->v4Index[(k >> 16) + 1];
+		while (lo < hi) {
+			const unsigned long mid = lo + ((hi - lo) / 2);
+			if (k < st[mid])
+				hi = mid;
+			else lo = mid + 1;
+		}
+		while (lo > 0) {
+			--lo;
+			const _V4R &r = db->v4Rec[lo];
+			if (k <= r.end) {
+				x = r.x;
+				y = r.y;
+				z = r.z;
 				return true;
-			} else if ((key.start > i->start)&&(key.start > i->end))
+			} else if (k > st[lo]) {
 				break;
+			}
+		}
+	} else if ((ip.ss_family == AF_INET6)&&(db->v6Count > 0)) {
+		const uint8_t *const a = reinterpret_cast<const uint8_t *>(reinterpret_cast<const struct sockaddr_in6 *>(&ip)->sin6_addr.s6_addr);
+		uint64_t k0 = 0,k1 = 0;
+		for(unsigned int i=0;i<8;++i) {
+			k0 = (k0 << 8) | (uint64_t)a[i];
+			k1 = (k1 << 8) | (uint64_t)a[i + 8];
+		}
+		const uint64_t *const st = db->v6Start;
+		unsigned long lo = db->v6Index[k0 >> 48],hi = db->v6Index[(k0 >> 48) + 1];
+		while (lo < hi) {
+			const unsigned long mid = lo + ((hi - lo) / 2);
+			if ((k0 < st[mid * 2])||((k0 == st[mid * 2])&&(k1 < st[(mid * 2) + 1])))
+				hi = mid;
+			else lo = mid + 1;
 		}
-	} else if ((ip.ss_family == AF_INET6)&&(_v6db.size() > 0)) {
-		_V6E key;
-		memcpy(key.start,reinterpret_cast<const struct sockaddr_in6 *>(&ip)->sin6_addr.s6_addr,16);
-		std::vector<_V6E>::const_iterator i(std::upper_bound(_v6db.begin(),_v6db.end(),key));
-		while (i != _v6db.begin()) {
-			--i;
-			const int s_vs_s = memcmp(key.start,i->start,16);
-			const int s_vs_e = memcmp(key.start,i->end,16);
-			if ((s_vs_s >= 0)&&(s_vs_e <= 0)) {
-				x = i->x;
-				y = i->y;
-				z = i->z;
-				//printf("%s : %f,%f %d,%d,%d\n",ip.toIpString().c_str(),i->lat,i->lon,x,y,z);
+		while (lo > 0) {
+			--lo;
+			const _V6R &r = db->v6Rec[lo];
+			if ((k0 < r.end[0])||((k0 == r.end[0])&&(k1 <= r.end[1]))) {
+				x = r.x;
+				y = r.y;
+				z = r.z;
 				return true;
-			} else if ((s_vs_s > 0)&&(s_vs_e > 0))
+			} else if ((k0 != st[lo * 2])||(k1 != st[(lo * 2) + 1])) {
 				break;
+			}
 		}
 	}
 
 	return false;
 }
 
+long ClusterGeoIpService::convert(const char *pathToCsv,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn,const char *pathToBinary)
+{
+	SharedPtr<_Db> db(_loadCsv(pathToCsv,ipStartColumn,ipEndColumn,latitudeColumn,longitudeColumn));
+	if (!db)
+		return -1;
+
+	std::string tmp(pathToBinary);
+	tmp.append(".tmp");
+	FILE *f = fopen(tmp.c_str(),"wb");
+	if (!f)
+		return -1;
+	const bool ok = (fwrite(db->_data,1,db->_size,f) == db->_size);
+	if ((fclose(f) != 0)||(!ok)) {
+		OSUtils::rm(tmp.c_str());
+		return -1;
+	}
+	OSUtils::rm(pathToBinary); // Windows rename() won't replace
+	if (rename(tmp.c_str(),pathToBinary) != 0) {
+		OSUtils::rm(tmp.c_str());
+		return -1;
+	}
+
+	return (long)db->v4Count + (long)db->v6Count;
+}
+
+ClusterGeoIpService::_Db::_Db(void *data,unsigned long size,bool mapped) :
+	v4Count(0),
+	v6Count(0),
+	v4Index((const uint32_t *)0),
+	v4Start((const uint32_t *)0),
+	v4Rec((const _V4R *)0),
+	v6Index((const uint32_t *)0),
+	v6Start((const uint64_t *)0),
+	v6Rec((const _V6R *)0),
+	_data(data),
+	_size(size),
+	_mapped(mapped)
+{
+	const uint8_t *const d = reinterpret_cast<const uint8_t *>(data);
+	if ((!d)||(size < ZT_CLUSTERGEOIPSERVICE_HEADER_SIZE)||(memcmp(d,ZT_CLUSTERGEOIPSERVICE_MAGIC,8) != 0))
+		return;
+	const uint32_t *const h = reinterpret_cast<const uint32_t *>(d + 8);
+	if (h[0] != ZT_CLUSTERGEOIPSERVICE_BOM)
+		return;
+
+	unsigned long o[6];
+	if (_layout(h[1],h[2],o) != size)
+		return;
+
+	// Check indexes so that a corrupt file can't send lookups out of bounds
+	const uint32_t *const i4 = reinterpret_cast<const uint32_t *>(d + o[0]);
+	const uint32_t *const i6 = reinterpret_cast<const uint32_t *>(d + o[3]);
+	for(unsigned int i=1;i<ZT_CLUSTERGEOIPSERVICE_INDEX_SIZE;++i) {
+		if ((i4[i] < i4[i - 1])||(i6[i] < i6[i - 1]))
+			return;
+	}
+	if ((i4[ZT_CLUSTERGEOIPSERVICE_INDEX_SIZE - 1] != h[1])||(i6[ZT_CLUSTERGEOIPSERVICE_INDEX_SIZE - 1] != h[2]))
+		return;
+
+	v4Count = h[1];
+	v6Count = h[2];
+	v4Index = i4;
+	v4Rec = reinterpret_cast<const _V4R *>(d + o[2]);
+	v6Index = i6;
+	v6Start = reinterpret_cast<const uint64_t *>(d + o[4]);
+	v6Rec = reinterpret_cast<const _V6R *>(d + o[5]);
+	v4Start = reinterpret_cast<const uint32_t *>(d + o[1]); // set last since valid() checks it
+}
+
+ClusterGeoIpService::_Db::~_Db()
+{
+	if (_mapped)
+		OSUtils::unmapFile(_data,_size);
+	else free(_data);
+}
+
 void ClusterGeoIpService::_parseLine(const char *line,std::vector<_V4E> &v4db,std::vector<_V6E> &v6db,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn)
 {
 	std::vector<std::string> ls(OSUtils::split(line,",\t","\\","\"'"));
@@ -123,39 +274,52 @@ void ClusterGeoIpService::_parseLine(const char *line,std::vector<_V4E> &v4db,st
 				v4db.push_back(_V4E());
 				v4db.back().start = Utils::ntoh((uint32_t)(reinterpret_cast<const struct sockaddr_in *>(&ipStart)->sin_addr.s_addr));
 				v4db.back().end = Utils::ntoh((uint32_t)(reinterpret_cast<const struct sockaddr_in *>(&ipEnd)->sin_addr.s_addr));
-				v4db.back().lat = (float)lat;
-				v4db.back().lon = (float)lon;
 				v4db.back().x = x;
 				v4db.back().y = y;
 				v4db.back().z = z;
 				//printf("%s - %s : %d,%d,%d\n",ipStart.toIpString().c_str(),ipEnd.toIpString().c_str(),x,y,z);
 			} else if (ipStart.ss_family == AF_INET6) {
+				const uint8_t *const s = reinterpret_cast<const uint8_t *>(reinterpret_cast<const struct sockaddr_in6 *>(&ipStart)->sin6_addr.s6_addr);
+				const uint8_t *const e = reinterpret_cast<const uint8_t *>(reinterpret_cast<const struct sockaddr_in6 *>(&ipEnd)->sin6_addr.s6_addr);
 				v6db.push_back(_V6E());
-				memcpy(v6db.back().start,reinterpret_cast<const struct sockaddr_in6 *>(&ipStart)->sin6_addr.s6_addr,16);
-				memcpy(v6db.back().end,reinterpret_cast<const struct sockaddr_in6 *>(&ipEnd)->sin6_addr.s6_addr,16);
-				v6db.back().lat = (float)lat;
-				v6db.back().lon = (float)lon;
-				v6db.back().x = x;
-				v6db.back().y = y;
-				v6db.back().z = z;
+				_V6E &v = v6db.back();
+				v.start[0] = v.start[1] = v.end[0] = v.end[1] = 0;
+				for(unsigned int i=0;i<8;++i) {
+					v.start[0] = (v.start[0] << 8) | (uint64_t)s[i];
+					v.start[1] = (v.start[1] << 8) | (uint64_t)s[i + 8];
+					v.end[0] = (v.end[0] << 8) | (uint64_t)e[i];
+					v.end[1] = (v.end[1] << 8) | (uint64_t)e[i + 8];
+				}
+				v.x = x;
+				v.y = y;
+				v.z = z;
 				//printf("%s - %s : %d,%d,%d\n",ipStart.toIpString().c_str(),ipEnd.toIpString().c_str(),x,y,z);
 			}
 		}
 	}
 }
 
-long ClusterGeoIpService::_load(const char *pathToCsv,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn)
+unsigned long ClusterGeoIpService::_layout(uint32_t v4Count,uint32_t v6Count,unsigned long offsets[6])
 {
-	// assumes _lock is locked
+	offsets[0] = ZT_CLUSTERGEOIPSERVICE_HEADER_SIZE;
+	offsets[1] = offsets[0] + (4 * ZT_CLUSTERGEOIPSERVICE_INDEX_SIZE);
+	offsets[2] = offsets[1] + (4 * (unsigned long)v4Count);
+	offsets[3] = offsets[2] + (sizeof(_V4R) * (unsigned long)v4Count);
+	offsets[4] = (offsets[3] + (4 * ZT_CLUSTERGEOIPSERVICE_INDEX_SIZE) + 7) & ~((unsigned long)7);
+	offsets[5] = offsets[4] + (16 * (unsigned long)v6Count);
+	return (offsets[5] + (sizeof(_V6R) * (unsigned long)v6Count));
+}
 
+SharedPtr<ClusterGeoIpService::_Db> ClusterGeoIpService::_loadCsv(const char *pathToCsv,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn)
+{
 	FILE *f = fopen(pathToCsv,"rb");
 	if (!f)
-		return -1;
+		return SharedPtr<_Db>();
 
 	std::vector<_V4E> v4db;
 	std::vector<_V6E> v6db;
-	v4db.reserve(16777216);
-	v6db.reserve(16777216);
+	v4db.reserve(1048576);
+	v6db.reserve(1048576);
 
 	char buf[4096];
 	char linebuf[1024];
@@ -171,7 +335,7 @@ long ClusterGeoIpService::_load(const char *pathToCsv,int ipStartColumn,int ipEn
 					_parseLine(linebuf,v4db,v6db,ipStartColumn,ipEndColumn,latitudeColumn,longitudeColumn);
 				}
 				lineptr = 0;
-			} else if (lineptr < (unsigned int)sizeof(linebuf))
+			} else if (lineptr < (unsigned int)(sizeof(linebuf) - 1))
 				linebuf[lineptr++] = buf[i];
 		}
 	}
@@ -182,54 +346,164 @@ long ClusterGeoIpService::_load(const char *pathToCsv,int ipStartColumn,int ipEn
 
 	fclose(f);
 
-	if ((v4db.size() > 0)||(v6db.size() > 0)) {
-		std::sort(v4db.begin(),v4db.end());
-		std::sort(v6db.begin(),v6db.end());
-
-		_pathToCsv = pathToCsv;
-		_ipStartColumn = ipStartColumn;
-		_ipEndColumn = ipEndColumn;
-		_latitudeColumn = latitudeColumn;
-		_longitudeColumn = longitudeColumn;
+	std::sort(v4db.begin(),v4db.end());
+	std::sort(v6db.begin(),v6db.end());
+
+	// Build the same image a binary file contains
+	unsigned long o[6];
+	const unsigned long size = _layout((uint32_t)v4db.size(),(uint32_t)v6db.size(),o);
+	uint8_t *const d = reinterpret_cast<uint8_t *>(calloc(1,size));
+	if (!d)
+		return SharedPtr<_Db>();
+
+	memcpy(d,ZT_CLUSTERGEOIPSERVICE_MAGIC,8);
+	uint32_t *const h = reinterpret_cast<uint32_t *>(d + 8);
+	h[0] = ZT_CLUSTERGEOIPSERVICE_BOM;
+	h[1] = (uint32_t)v4db.size();
+	h[2] = (uint32_t)v6db.size();
+
+	uint32_t *const i4 = reinterpret_cast<uint32_t *>(d + o[0]);
+	uint32_t *const s4 = reinterpret_cast<uint32_t *>(d + o[1]);
+	_V4R *const r4 = reinterpret_cast<_V4R *>(d + o[2]);
+	unsigned long b = 0;
+	for(unsigned long i=0;i<v4db.size();++i) {
+		while (b <= (unsigned long)(v4db[i].start >> 16))
+			i4[b++] = (uint32_t)i;
+		s4[i] = v4db[i].start;
+		r4[i].end = v4db[i].end;
+		r4[i].x = v4db[i].x;
+		r4[i].y = v4db[i].y;
+		r4[i].z = v4db[i].z;
+	}
+	while (b < ZT_CLUSTERGEOIPSERVICE_INDEX_SIZE)
+		i4[b++] = (uint32_t)v4db.size();
+
+	uint32_t *const i6 = reinterpret_cast<uint32_t *>(d + o[3]);
+	uint64_t *const s6 = reinterpret_cast<uint64_t *>(d + o[4]);
+	_V6R *const r6 = reinterpret_cast<_V6R *>(d + o[5]);
+	b = 0;
+	for(unsigned long i=0;i<v6db.size();++i) {
+		while (b <= (unsigned long)(v6db[i].start[0] >> 48))
+			i6[b++] = (uint32_t)i;
+		s6[i * 2] = v6db[i].start[0];
+		s6[(i * 2) + 1] = v6db[i].start[1];
+		r6[i].end[0] = v6db[i].end[0];
+		r6[i].end[1] = v6db[i].end[1];
+		r6[i].x = v6db[i].x;
+		r6[i].y = v6db[i].y;
+		r6[i].z = v6db[i].z;
+	}
+	while (b < ZT_CLUSTERGEOIPSERVICE_INDEX_SIZE)
+		i6[b++] = (uint32_t)v6db.size();
 
-		_lastFileCheckTime = OSUtils::now();
-		_csvModificationTime = OSUtils::getLastModified(pathToCsv);
-		_csvFileSize = OSUtils::getFileSize(pathToCsv);
+	SharedPtr<_Db> db(new _Db(d,size,false));
+	return ((db->valid()) ? db : SharedPtr<_Db>());
+}
 
-		_v4db.swap(v4db);
-		_v6db.swap(v6db);
+SharedPtr<ClusterGeoIpService::_Db> ClusterGeoIpService::_loadBinary(const char *path)
+{
+	unsigned long size = 0;
+	void *const d = OSUtils::mapFile(path,size);
+	if (!d)
+		return SharedPtr<_Db>();
+	SharedPtr<_Db> db(new _Db(d,size,true));
+	return ((db->valid()) ? db : SharedPtr<_Db>());
+}
 
-		return (long)(_v4db.size() + _v6db.size());
-	} else {
-		return 0;
-	}
+SharedPtr<ClusterGeoIpService::_Db> ClusterGeoIpService::_load(const char *path,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn)
+{
+	char magic[8];
+	FILE *f = fopen(path,"rb");
+	if (!f)
+		return SharedPtr<_Db>();
+	const bool binary = ((fread(magic,1,8,f) == 8)&&(memcmp(magic,ZT_CLUSTERGEOIPSERVICE_MAGIC,8) == 0));
+	fclose(f);
+	return ((binary) ? _loadBinary(path) : _loadCsv(path,ipStartColumn,ipEndColumn,latitudeColumn,longitudeColumn));
 }
 
 } // namespace ZeroTier
 
-#endif // ZT_ENABLE_CLUSTER
+#ifdef ZT_CLUSTERGEOIPSERVICE_TOOL
 
 /*
+ * Stand-alone tool to convert, query, and benchmark GeoIP databases.
+ * Build with: make -f make-linux.mk zerotier-geoip
+ */
+
+using namespace ZeroTier;
+
+static void _geoIpToolHelp(const char *pn)
+{
+	printf("Usage: %s <command> [<args>]" ZT_EOL_S,pn);
+	printf("  convert <csv> <ip start col> <ip end col> <lat col> <lon col> <output>" ZT_EOL_S);
+	printf("  lookup <database> <ip> [<ip> ...]" ZT_EOL_S);
+	printf("  bench <database> [<lookups>]" ZT_EOL_S);
+}
+
 int main(int argc,char **argv)
 {
-	char buf[1024];
-
-	ZeroTier::ClusterGeoIpService gip;
-	printf("loading...\n");
-	gip.load("/Users/api/Code/ZeroTier/Infrastructure/root-servers/zerotier-one/cluster-geoip.csv",0,1,5,6);
-	printf("... done!\n"); fflush(stdout);
-
-	while (gets(buf)) { // unsafe, testing only
-		ZeroTier::InetAddress addr(buf,0);
-		printf("looking up: %s\n",addr.toString().c_str()); fflush(stdout);
-		int x = 0,y = 0,z = 0;
-		if (gip.locate(addr,x,y,z)) {
-			//printf("%s: %d,%d,%d\n",addr.toString().c_str(),x,y,z); fflush(stdout);
-		} else {
-			printf("%s: not found!\n",addr.toString().c_str()); fflush(stdout);
+	if (argc < 3) {
+		_geoIpToolHelp(argv[0]);
+		return 1;
+	}
+
+	if (!strcmp(argv[1],"convert")) {
+		if (argc < 8) {
+			_geoIpToolHelp(argv[0]);
+			return 1;
+		}
+		const uint64_t start = OSUtils::now();
+		const long n = ClusterGeoIpService::convert(argv[2],Utils::strToInt(argv[3]),Utils::strToInt(argv[4]),Utils::strToInt(argv[5]),Utils::strToInt(argv[6]),argv[7]);
+		if (n < 0) {
+			fprintf(stderr,"%s: unable to convert %s to %s" ZT_EOL_S,argv[0],argv[2],argv[7]);
+			return 1;
+		}
+		printf("wrote %ld ranges to %s in %llums" ZT_EOL_S,n,argv[7],(unsigned long long)(OSUtils::now() - start));
+		return 0;
+	}
+
+	ClusterGeoIpService gip;
+	const uint64_t loadStart = OSUtils::now();
+	const long n = gip.load(argv[2],0,1,5,6); // columns only matter for CSV and match db-ip.com's layout
+	if (n <= 0) {
+		fprintf(stderr,"%s: unable to load %s" ZT_EOL_S,argv[0],argv[2]);
+		return 1;
+	}
+	const uint64_t loadTime = OSUtils::now() - loadStart;
+
+	if (!strcmp(argv[1],"lookup")) {
+		for(int i=3;i<argc;++i) {
+			const InetAddress addr(argv[i],0);
+			int x = 0,y = 0,z = 0;
+			if (gip.locate(addr,x,y,z))
+				printf("%s %d,%d,%d" ZT_EOL_S,argv[i],x,y,z);
+			else printf("%s not found" ZT_EOL_S,argv[i]);
+		}
+	} else if (!strcmp(argv[1],"bench")) {
+		const unsigned long lookups = (argc >= 4) ? strtoul(argv[3],(char **)0,10) : 10000000;
+		uint64_t r = 0x9e3779b97f4a7c15ULL ^ OSUtils::now();
+		unsigned long found = 0;
+		InetAddress addr;
+		const uint64_t start = OSUtils::now();
+		for(unsigned long i=0;i<lookups;++i) {
+			r ^= r << 13; r ^= r >> 7; r ^= r << 17; // xorshift64
+			const uint32_t ip = (uint32_t)r;
+			addr.set(&ip,4,0);
+			int x,y,z;
+			if (gip.locate(addr,x,y,z))
+				++found;
 		}
+		const uint64_t t = OSUtils::now() - start;
+		printf("loaded %ld ranges in %llums" ZT_EOL_S,n,(unsigned long long)loadTime);
+		printf("%lu random IPv4 lookups (%lu found) in %llums, %.1fns/lookup" ZT_EOL_S,lookups,found,(unsigned long long)t,(lookups) ? (((double)t * 1000000.0) / (double)lookups) : 0.0);
+	} else {
+		_geoIpToolHelp(argv[0]);
+		return 1;
 	}
 
 	return 0;
 }
-*/
+
+#endif // ZT_CLUSTERGEOIPSERVICE_TOOL
+
+#endif // ZT_ENABLE_CLUSTER
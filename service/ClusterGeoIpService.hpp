@@ -34,18 +34,41 @@
 #include "../node/Mutex.hpp"
 #include "../node/NonCopyable.hpp"
 #include "../node/InetAddress.hpp"
+#include "../node/SharedPtr.hpp"
+#include "../node/AtomicCounter.hpp"
 
 namespace ZeroTier {
 
 /**
- * Loads a GeoIP CSV into memory for fast lookup, reloading as needed
+ * Loads a GeoIP database for fast lookup, reloading as needed
  *
  * This was designed around the CSV from https://db-ip.com but can be used
  * with any similar GeoIP CSV database that is presented in the form of an
  * IP range and lat/long coordinates.
  *
- * It loads the whole database into memory, which can be kind of large. If
- * the CSV file changes, the changes are loaded automatically.
+ * CSVs are parsed into an in-memory image of the binary format below. A
+ * binary file made with convert() is instead mmapped as-is, so it loads
+ * instantly and its pages are shared by every process using it. If the file
+ * changes, the new data is loaded and swapped in without blocking lookups.
+ * To update a binary database replace it via rename() rather than writing
+ * it in place, since lookups read the old mapping until the swap.
+ *
+ * Binary format (native byte order, checked via the byte order mark):
+ *   <[8] "ZTGEOIP1">
+ *   <[4] byte order mark 0x01020304>
+ *   <[4] IPv4 range count>
+ *   <[4] IPv6 range count>
+ *   <[4] reserved (0)>
+ *   <[4] * 65537 index of first IPv4 range starting at or after each /16>
+ *   <[4] * count sorted IPv4 range starts>
+ *   <[12] * count IPv4 records: [4] end, [2] x, [2] y, [2] z, [2] pad>
+ *   <[4] * 65537 index of first IPv6 range starting at or after each /16>
+ *   <[0-4] pad to 8-byte alignment>
+ *   <[16] * count sorted IPv6 range starts as two 64-bit integers, high first>
+ *   <[24] * count IPv6 records: [16] end as above, [2] x, [2] y, [2] z, [2] pad>
+ *
+ * The /16 index narrows each lookup to a binary search over a few ranges,
+ * so a lookup costs a handful of cache misses regardless of database size.
  */
 class ClusterGeoIpService : NonCopyable
 {
@@ -54,24 +77,21 @@ public:
 	~ClusterGeoIpService();
 
 	/**
-	 * Load or reload CSV file
+	 * Load or reload a CSV or binary database file
 	 *
 	 * CSV column indexes start at zero. CSVs can be quoted with single or
 	 * double quotes. Whitespace before or after commas is ignored. Backslash
-	 * may be used for escaping whitespace as well.
+	 * may be used for escaping whitespace as well. Column arguments are
+	 * ignored if the file is in binary format.
 	 *
-	 * @param pathToCsv Path to (uncompressed) CSV file
+	 * @param path Path to (uncompressed) CSV file or binary database
 	 * @param ipStartColumn Column with IP range start
 	 * @param ipEndColumn Column with IP range end (inclusive)
 	 * @param latitudeColumn Column with latitude
 	 * @param longitudeColumn Column with longitude
 	 * @return Number of valid records loaded or -1 on error (invalid file, not found, etc.)
 	 */
-	inline long load(const char *pathToCsv,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn)
-	{
-		Mutex::Lock _l(_lock);
-		return _load(pathToCsv,ipStartColumn,ipEndColumn,latitudeColumn,longitudeColumn);
-	}
+	long load(const char *path,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn);
 
 	/**
 	 * Attempt to locate an IP
@@ -93,15 +113,26 @@ public:
 	inline bool available() const
 	{
 		Mutex::Lock _l(_lock);
-		return ((_v4db.size() + _v6db.size()) > 0);
+		return ((_db)&&((_db->v4Count + _db->v6Count) > 0));
 	}
 
+	/**
+	 * Convert a CSV database to binary format
+	 *
+	 * The output is written to a temporary file and then renamed into place,
+	 * so it's safe to run against a file that services have mapped.
+	 *
+	 * @param pathToCsv Path to CSV file (columns as in load())
+	 * @param pathToBinary Path to write binary database
+	 * @return Number of records written or -1 on error
+	 */
+	static long convert(const char *pathToCsv,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn,const char *pathToBinary);
+
 private:
 	struct _V4E
 	{
 		uint32_t start;
 		uint32_t end;
-		float lat,lon;
 		int16_t x,y,z;
 
 		inline bool operator<(const _V4E &e) const { return (start < e.start); }
@@ -109,29 +140,81 @@ private:
 
 	struct _V6E
 	{
-		uint8_t start[16];
-		uint8_t end[16];
-		float lat,lon;
+		uint64_t start[2];
+		uint64_t end[2];
 		int16_t x,y,z;
 
-		inline bool operator<(const _V6E &e) const { return (memcmp(start,e.start,16) < 0); }
+		inline bool operator<(const _V6E &e) const { return ((start[0] < e.start[0])||((start[0] == e.start[0])&&(start[1] < e.start[1]))); }
+	};
+
+	struct _V4R
+	{
+		uint32_t end;
+		int16_t x,y,z,pad;
+	};
+
+	struct _V6R
+	{
+		uint64_t end[2];
+		int16_t x,y,z,pad;
+	};
+
+	/**
+	 * A loaded database image, either mmapped or in memory
+	 */
+	class _Db
+	{
+		friend class SharedPtr<_Db>;
+		friend class ClusterGeoIpService;
+
+	public:
+		/**
+		 * @param data Image data (taken over by this object)
+		 * @param size Image size in bytes
+		 * @param mapped If true data is from OSUtils::mapFile(), otherwise it was malloc'd
+		 */
+		_Db(void *data,unsigned long size,bool mapped);
+
+		/**
+		 * @return True if the image is valid and its pointers below are set
+		 */
+		inline bool valid() const { return (v4Start != (const uint32_t *)0); }
+
+		uint32_t v4Count;
+		uint32_t v6Count;
+		const uint32_t *v4Index;
+		const uint32_t *v4Start;
+		const _V4R *v4Rec;
+		const uint32_t *v6Index;
+		const uint64_t *v6Start;
+		const _V6R *v6Rec;
+
+	private:
+		~_Db();
+
+		void *_data;
+		unsigned long _size;
+		bool _mapped;
+		AtomicCounter __refCount;
 	};
 
 	static void _parseLine(const char *line,std::vector<_V4E> &v4db,std::vector<_V6E> &v6db,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn);
-	long _load(const char *pathToCsv,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn);
+	static unsigned long _layout(uint32_t v4Count,uint32_t v6Count,unsigned long offsets[6]);
+	static SharedPtr<_Db> _loadCsv(const char *pathToCsv,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn);
+	static SharedPtr<_Db> _loadBinary(const char *path);
+	static SharedPtr<_Db> _load(const char *path,int ipStartColumn,int ipEndColumn,int latitudeColumn,int longitudeColumn);
 
-	std::string _pathToCsv;
+	std::string _path;
 	int _ipStartColumn;
 	int _ipEndColumn;
 	int _latitudeColumn;
 	int _longitudeColumn;
 
 	uint64_t _lastFileCheckTime;
-	uint64_t _csvModificationTime;
-	int64_t _csvFileSize;
+	uint64_t _fileModificationTime;
+	int64_t _fileSize;
 
-	std::vector<_V4E> _v4db;
-	std::vector<_V6E> _v6db;
+	SharedPtr<_Db> _db;
 
 	Mutex _lock;
 };
@@ -0,0 +1,373 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <vector>
+#include <utility>
+
+#include "IdentityStore.hpp"
+
+#include "../node/Utils.hpp"
+#include "../osdep/OSUtils.hpp"
+
+// File magic and record layout
+#define ZT_IDENTITYSTORE_MAGIC "ZTIDDB01"
+#define ZT_IDENTITYSTORE_HEADER_SIZE 8
+#define ZT_IDENTITYSTORE_RECORD_HEADER_SIZE 16
+#define ZT_IDENTITYSTORE_RECORD_OVERHEAD 20
+
+#define ZT_IDENTITYSTORE_RECORD_STORE 1
+#define ZT_IDENTITYSTORE_RECORD_DELETE 2
+
+namespace ZeroTier {
+
+static inline uint32_t _fnv1a(const uint8_t *p,unsigned int len)
+{
+	uint32_t h = 0x811c9dc5;
+	for(unsigned int i=0;i<len;++i) {
+		h ^= (uint32_t)p[i];
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+IdentityStore::IdentityStore() :
+	_f((FILE *)0),
+	_map((void *)0),
+	_mapSize(0),
+	_fileSize(0),
+	_liveBytes(0)
+{
+}
+
+IdentityStore::~IdentityStore()
+{
+	close();
+}
+
+bool IdentityStore::open(const char *path)
+{
+	Mutex::Lock _l(_lock);
+
+	if (_f) {
+		fclose(_f);
+		_f = (FILE *)0;
+	}
+	_unmap();
+	_index.clear();
+	_tail.clear();
+	_fileSize = 0;
+	_liveBytes = 0;
+	_path = path;
+
+	_map = OSUtils::mapFile(path,_mapSize);
+	const uint8_t *const m = reinterpret_cast<const uint8_t *>(_map);
+	bool rewrite = true;
+	if ((m)&&(_mapSize >= ZT_IDENTITYSTORE_HEADER_SIZE)&&(!memcmp(m,ZT_IDENTITYSTORE_MAGIC,ZT_IDENTITYSTORE_HEADER_SIZE))) {
+		unsigned long p = ZT_IDENTITYSTORE_HEADER_SIZE;
+		while ((p + ZT_IDENTITYSTORE_RECORD_OVERHEAD) <= _mapSize) {
+			const uint8_t *const r = m + p;
+			const unsigned int type = r[0];
+			const uint64_t address = ((uint64_t)r[1] << 32) | ((uint64_t)r[2] << 24) | ((uint64_t)r[3] << 16) | ((uint64_t)r[4] << 8) | (uint64_t)r[5];
+			uint64_t ts = 0;
+			for(unsigned int k=6;k<14;++k)
+				ts = (ts << 8) | (uint64_t)r[k];
+			const unsigned int len = ((unsigned int)r[14] << 8) | (unsigned int)r[15];
+			if (((type != ZT_IDENTITYSTORE_RECORD_STORE)&&(type != ZT_IDENTITYSTORE_RECORD_DELETE))||(len > ZT_IDENTITYSTORE_MAX_RECORD_SIZE)||((p + ZT_IDENTITYSTORE_RECORD_OVERHEAD + len) > _mapSize))
+				break;
+			const uint8_t *const c = r + ZT_IDENTITYSTORE_RECORD_HEADER_SIZE + len;
+			if (_fnv1a(r,ZT_IDENTITYSTORE_RECORD_HEADER_SIZE + len) != (((uint32_t)c[0] << 24) | ((uint32_t)c[1] << 16) | ((uint32_t)c[2] << 8) | (uint32_t)c[3]))
+				break;
+
+			_Entry *const old = _index.get(address);
+			if (old)
+				_liveBytes -= ZT_IDENTITYSTORE_RECORD_OVERHEAD + old->len;
+			if ((type == ZT_IDENTITYSTORE_RECORD_STORE)&&(len > 0)) {
+				_Entry &e = _index[address];
+				e.ts = ts;
+				e.offset = p + ZT_IDENTITYSTORE_RECORD_HEADER_SIZE;
+				e.len = len;
+				_liveBytes += ZT_IDENTITYSTORE_RECORD_OVERHEAD + len;
+			} else if (old) {
+				_index.erase(address);
+			}
+
+			p += ZT_IDENTITYSTORE_RECORD_OVERHEAD + len;
+		}
+		_fileSize = p;
+		rewrite = (p != _mapSize); // torn or corrupt tail
+	} else {
+		_index.clear();
+		_liveBytes = 0;
+	}
+
+	if (rewrite) {
+		// Writes out what we could read (possibly nothing) and maps the result
+		unsigned long expired = 0;
+		return _compact(0,expired);
+	}
+
+	_f = fopen(path,"ab");
+	return (_f != (FILE *)0);
+}
+
+void IdentityStore::close()
+{
+	Mutex::Lock _l(_lock);
+	if (_f) {
+		fclose(_f);
+		_f = (FILE *)0;
+	}
+	_unmap();
+	_index.clear();
+	_tail.clear();
+	_fileSize = 0;
+	_liveBytes = 0;
+}
+
+unsigned long IdentityStore::importDirectory(const char *path)
+{
+	unsigned long count = 0;
+	bool failed = false;
+	std::vector<std::string> files(OSUtils::listDirectory(path));
+	const uint64_t now = OSUtils::now();
+	std::string buf,tmp;
+	for(std::vector<std::string>::iterator f(files.begin());f!=files.end();++f) {
+		if (f->length() != ZT_ADDRESS_LENGTH_HEX)
+			continue;
+		const std::string fp(std::string(path) + ZT_PATH_SEPARATOR_S + *f);
+		if ((!OSUtils::readFile(fp.c_str(),buf))||(buf.length() == 0)||(buf.length() > ZT_IDENTITYSTORE_MAX_RECORD_SIZE))
+			continue;
+		const uint64_t address = Utils::hexStrToU64(f->c_str());
+		if (get(address,tmp))
+			continue;
+		uint64_t ts = OSUtils::getLastModified(fp.c_str());
+		if ((ts == 0)||(ts > now))
+			ts = now;
+		Mutex::Lock _l(_lock);
+		if (_append(ZT_IDENTITYSTORE_RECORD_STORE,address,ts,buf.data(),(unsigned int)buf.length())) {
+			_Entry &e = _index[address];
+			e.ts = ts;
+			e.offset = _fileSize - (ZT_IDENTITYSTORE_RECORD_OVERHEAD - ZT_IDENTITYSTORE_RECORD_HEADER_SIZE) - buf.length();
+			e.len = (unsigned int)buf.length();
+			_liveBytes += ZT_IDENTITYSTORE_RECORD_OVERHEAD + buf.length();
+			++count;
+		} else {
+			failed = true; // can't write, so leave iddb.d alone and try again next time
+			break;
+		}
+	}
+	if ((!failed)&&(OSUtils::fileExists(path)))
+		OSUtils::rmDashRf(path);
+	return count;
+}
+
+bool IdentityStore::get(const uint64_t address,std::string &id) const
+{
+	Mutex::Lock _l(_lock);
+	const _Entry *const e = _index.get(address);
+	if (!e)
+		return false;
+	id.assign(_data(*e),e->len);
+	return true;
+}
+
+bool IdentityStore::put(const uint64_t address,const void *data,const unsigned int len,const uint64_t now)
+{
+	if ((len == 0)||(len > ZT_IDENTITYSTORE_MAX_RECORD_SIZE))
+		return false;
+
+	Mutex::Lock _l(_lock);
+
+	_Entry *e = _index.get(address);
+	if ((e)&&(e->len == len)&&(now >= e->ts)&&((now - e->ts) < ZT_IDENTITYSTORE_TOUCH_INTERVAL)&&(!memcmp(_data(*e),data,len)))
+		return true;
+
+	if (!_append(ZT_IDENTITYSTORE_RECORD_STORE,address,now,data,len))
+		return false;
+	if (e)
+		_liveBytes -= ZT_IDENTITYSTORE_RECORD_OVERHEAD + e->len;
+	else e = &(_index[address]);
+	e->ts = now;
+	e->offset = _fileSize - (ZT_IDENTITYSTORE_RECORD_OVERHEAD - ZT_IDENTITYSTORE_RECORD_HEADER_SIZE) - len;
+	e->len = len;
+	_liveBytes += ZT_IDENTITYSTORE_RECORD_OVERHEAD + len;
+
+	if ((_fileSize >= ZT_IDENTITYSTORE_COMPACT_MIN_SIZE)&&((_fileSize - _liveBytes) > (_fileSize / ZT_IDENTITYSTORE_COMPACT_RATIO))) {
+		unsigned long expired = 0;
+		_compact(0,expired);
+	}
+
+	return true;
+}
+
+void IdentityStore::erase(const uint64_t address,const uint64_t now)
+{
+	Mutex::Lock _l(_lock);
+	const _Entry *const e = _index.get(address);
+	if (!e)
+		return;
+	if (_append(ZT_IDENTITYSTORE_RECORD_DELETE,address,now,(const void *)0,0)) {
+		_liveBytes -= ZT_IDENTITYSTORE_RECORD_OVERHEAD + e->len;
+		_index.erase(address);
+	}
+}
+
+unsigned long IdentityStore::clean(const uint64_t olderThan)
+{
+	Mutex::Lock _l(_lock);
+	unsigned long expired = 0;
+	if (_f)
+		_compact(olderThan,expired);
+	return expired;
+}
+
+bool IdentityStore::_append(const unsigned int type,const uint64_t address,const uint64_t ts,const void *data,const unsigned int len)
+{
+	if (!_f)
+		return false;
+
+	uint8_t r[ZT_IDENTITYSTORE_RECORD_OVERHEAD + ZT_IDENTITYSTORE_MAX_RECORD_SIZE];
+	r[0] = (uint8_t)type;
+	for(unsigned int k=0;k<5;++k)
+		r[1 + k] = (uint8_t)(address >> (32 - (k * 8)));
+	for(unsigned int k=0;k<8;++k)
+		r[6 + k] = (uint8_t)(ts >> (56 - (k * 8)));
+	r[14] = (uint8_t)(len >> 8);
+	r[15] = (uint8_t)len;
+	if (len)
+		memcpy(r + ZT_IDENTITYSTORE_RECORD_HEADER_SIZE,data,len);
+	const uint32_t c = _fnv1a(r,ZT_IDENTITYSTORE_RECORD_HEADER_SIZE + len);
+	uint8_t *const cp = r + ZT_IDENTITYSTORE_RECORD_HEADER_SIZE + len;
+	cp[0] = (uint8_t)(c >> 24);
+	cp[1] = (uint8_t)(c >> 16);
+	cp[2] = (uint8_t)(c >> 8);
+	cp[3] = (uint8_t)c;
+
+	const unsigned int rl = ZT_IDENTITYSTORE_RECORD_OVERHEAD + len;
+	if ((fwrite(r,1,rl,_f) != rl)||(fflush(_f) != 0)) {
+		// Part of a record may have been written, so rewrite the file from what we know
+		unsigned long expired = 0;
+		_compact(0,expired);
+		return false;
+	}
+	_tail.append(reinterpret_cast<const char *>(r),rl);
+	_fileSize += rl;
+
+	if (_tail.length() >= ZT_IDENTITYSTORE_MAX_UNMAPPED)
+		_remap();
+
+	return true;
+}
+
+bool IdentityStore::_remap()
+{
+	unsigned long s = 0;
+	void *const m = OSUtils::mapFile(_path.c_str(),s);
+	if ((!m)||(s != _fileSize)) {
+		OSUtils::unmapFile(m,s);
+		return false; // keep reading appended bytes from _tail
+	}
+	_unmap();
+	_map = m;
+	_mapSize = s;
+	_tail.clear();
+	return true;
+}
+
+bool IdentityStore::_compact(const uint64_t olderThan,unsigned long &expired)
+{
+	const std::string tmp(_path + ".tmp");
+	FILE *o = fopen(tmp.c_str(),"wb");
+	if (!o)
+		return false;
+
+	bool ok = (fwrite(ZT_IDENTITYSTORE_MAGIC,1,ZT_IDENTITYSTORE_HEADER_SIZE,o) == ZT_IDENTITYSTORE_HEADER_SIZE);
+	uint64_t size = ZT_IDENTITYSTORE_HEADER_SIZE;
+	std::vector< std::pair<uint64_t,uint64_t> > moved;
+	std::vector<uint64_t> dropped;
+	moved.reserve(_index.size());
+	{
+		uint8_t hdr[ZT_IDENTITYSTORE_RECORD_HEADER_SIZE];
+		uint64_t *a = (uint64_t *)0;
+		_Entry *e = (_Entry *)0;
+		Hashtable< uint64_t,_Entry >::Iterator i(_index);
+		while ((ok)&&(i.next(a,e))) {
+			if (e->ts < olderThan) {
+				dropped.push_back(*a);
+				continue;
+			}
+			// Stored records are rewritten byte for byte, checksum included
+			const uint8_t *const d = reinterpret_cast<const uint8_t *>(_data(*e));
+			memcpy(hdr,d - ZT_IDENTITYSTORE_RECORD_HEADER_SIZE,ZT_IDENTITYSTORE_RECORD_HEADER_SIZE);
+			ok = ((fwrite(hdr,1,ZT_IDENTITYSTORE_RECORD_HEADER_SIZE,o) == ZT_IDENTITYSTORE_RECORD_HEADER_SIZE)&&(fwrite(d,1,e->len + 4,o) == (e->len + 4)));
+			moved.push_back(std::pair<uint64_t,uint64_t>(*a,size + ZT_IDENTITYSTORE_RECORD_HEADER_SIZE));
+			size += ZT_IDENTITYSTORE_RECORD_OVERHEAD + e->len;
+		}
+	}
+	if (fclose(o) != 0)
+		ok = false;
+
+	if (_f) {
+		fclose(_f);
+		_f = (FILE *)0;
+	}
+	if (ok) {
+#ifdef __WINDOWS__
+		OSUtils::rm(_path.c_str()); // Windows rename() won't replace
+#endif
+		ok = (rename(tmp.c_str(),_path.c_str()) == 0);
+	}
+	if (!ok) {
+		OSUtils::rm(tmp.c_str());
+		_f = fopen(_path.c_str(),"ab");
+		return false;
+	}
+
+	_unmap();
+	_tail.clear();
+	_fileSize = size;
+	_map = OSUtils::mapFile(_path.c_str(),_mapSize);
+	if ((!_map)||(_mapSize != size)) {
+		// Can't read the new file, so forget what it holds and carry on appending
+		_unmap();
+		_mapSize = (unsigned long)size;
+		_index.clear();
+		_liveBytes = 0;
+	} else {
+		for(std::vector< std::pair<uint64_t,uint64_t> >::const_iterator m(moved.begin());m!=moved.end();++m)
+			_index.get(m->first)->offset = m->second;
+		for(std::vector<uint64_t>::const_iterator d(dropped.begin());d!=dropped.end();++d)
+			_index.erase(*d);
+		_liveBytes = size - ZT_IDENTITYSTORE_HEADER_SIZE;
+		expired += (unsigned long)dropped.size();
+	}
+
+	_f = fopen(_path.c_str(),"ab");
+	return (_f != (FILE *)0);
+}
+
+void IdentityStore::_unmap()
+{
+	OSUtils::unmapFile(_map,_mapSize);
+	_map = (void *)0;
+	_mapSize = 0;
+}
+
+} // namespace ZeroTier
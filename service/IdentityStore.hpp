@@ -0,0 +1,201 @@
+/*
+ * ZeroTier One - Network Virtualization Everywhere
+ * Copyright (C) 2011-2016  ZeroTier, Inc.  https://www.zerotier.com/
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZT_IDENTITYSTORE_HPP
+#define ZT_IDENTITYSTORE_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#include "../node/Constants.hpp"
+#include "../node/Mutex.hpp"
+#include "../node/NonCopyable.hpp"
+#include "../node/Hashtable.hpp"
+
+/**
+ * Maximum size of a stored identity (public identities are about 141 bytes)
+ */
+#define ZT_IDENTITYSTORE_MAX_RECORD_SIZE 1024
+
+/**
+ * Re-append an unchanged identity if its record is older than this
+ *
+ * This keeps its age fresh for expiry, like rewriting an iddb.d file did,
+ * without appending a record every time a peer is re-learned.
+ */
+#define ZT_IDENTITYSTORE_TOUCH_INTERVAL 86400000ULL
+
+/**
+ * Remap the file once this many bytes have been appended since the last map
+ */
+#define ZT_IDENTITYSTORE_MAX_UNMAPPED 262144
+
+/**
+ * Compact once dead records take up more than this fraction (1/N) of the file...
+ */
+#define ZT_IDENTITYSTORE_COMPACT_RATIO 2
+
+/**
+ * ...and the file is at least this big
+ */
+#define ZT_IDENTITYSTORE_COMPACT_MIN_SIZE 1048576
+
+namespace ZeroTier {
+
+/**
+ * Append-only, hash-indexed store of peer identities
+ *
+ * This replaces one file per identity under iddb.d. All identities live in a
+ * single log file that is mmapped and indexed in memory by address, so a
+ * lookup is a hash probe and a copy instead of a file open. Writes append a
+ * record; bytes appended since the file was last mapped are mirrored in
+ * memory until the next remap. Superseded and expired records are dropped
+ * by compaction, which rewrites the file and renames it into place.
+ *
+ * File format (all integers big-endian):
+ *   <[8] "ZTIDDB01">
+ *   records:
+ *     <[1] type: 1 to store, 2 to delete>
+ *     <[5] ZeroTier address>
+ *     <[8] timestamp (ms) of last store>
+ *     <[2] length of identity>
+ *     <[...] identity in string form>
+ *     <[4] FNV-1a checksum of the above>
+ *
+ * Loading stops at the first bad record, so a torn write at the end of the
+ * log loses only that record. Since identities can always be re-fetched via
+ * WHOIS, an unreadable file is simply started over.
+ */
+class IdentityStore : NonCopyable
+{
+public:
+	IdentityStore();
+	~IdentityStore();
+
+	/**
+	 * Open or create a store, closing any previously open one
+	 *
+	 * @param path Path to store file
+	 * @return True if store is open
+	 */
+	bool open(const char *path);
+
+	/**
+	 * Close store (flushes nothing; every write is already in the file)
+	 */
+	void close();
+
+	/**
+	 * Move identities from a legacy iddb.d directory into this store
+	 *
+	 * Each file's modification time becomes its record's timestamp. Imported
+	 * files and then the directory itself are removed.
+	 *
+	 * @param path Path to iddb.d
+	 * @return Number of identities imported
+	 */
+	unsigned long importDirectory(const char *path);
+
+	/**
+	 * Look up an identity
+	 *
+	 * @param address ZeroTier address
+	 * @param id Set to identity in string form if found
+	 * @return True if found
+	 */
+	bool get(const uint64_t address,std::string &id) const;
+
+	/**
+	 * Store an identity
+	 *
+	 * @param address ZeroTier address
+	 * @param data Identity in string form
+	 * @param len Length of data
+	 * @param now Current time
+	 * @return True if stored (or already stored and recent)
+	 */
+	bool put(const uint64_t address,const void *data,const unsigned int len,const uint64_t now);
+
+	/**
+	 * Delete an identity
+	 *
+	 * @param address ZeroTier address
+	 * @param now Current time
+	 */
+	void erase(const uint64_t address,const uint64_t now);
+
+	/**
+	 * Expire identities not stored since a given time and compact the file
+	 *
+	 * @param olderThan Drop identities whose last store is before this time
+	 * @return Number of identities expired
+	 */
+	unsigned long clean(const uint64_t olderThan);
+
+	/**
+	 * @return Number of identities in store
+	 */
+	inline unsigned long size() const
+	{
+		Mutex::Lock _l(_lock);
+		return _index.size();
+	}
+
+	/**
+	 * @return Size of store file in bytes
+	 */
+	inline uint64_t fileSize() const
+	{
+		Mutex::Lock _l(_lock);
+		return _fileSize;
+	}
+
+private:
+	struct _Entry
+	{
+		uint64_t ts;
+		uint64_t offset; // of identity data in file
+		unsigned int len;
+	};
+
+	inline const char *_data(const _Entry &e) const
+	{
+		return ((e.offset >= _mapSize) ? (_tail.data() + (e.offset - _mapSize)) : (reinterpret_cast<const char *>(_map) + e.offset));
+	}
+
+	bool _append(const unsigned int type,const uint64_t address,const uint64_t ts,const void *data,const unsigned int len);
+	bool _remap();
+	bool _compact(const uint64_t olderThan,unsigned long &expired);
+	void _unmap();
+
+	std::string _path;
+	FILE *_f; // opened for append
+	void *_map;
+	unsigned long _mapSize;
+	std::string _tail; // bytes appended to file after _mapSize
+	uint64_t _fileSize;
+	uint64_t _liveBytes; // bytes of records still referenced by _index
+	Hashtable< uint64_t,_Entry > _index;
+	Mutex _lock;
+};
+
+} // namespace ZeroTier
+
+#endif
@@ -39,6 +39,8 @@
 #include "../node/MAC.hpp"
 #include "../node/Identity.hpp"
 #include "../node/World.hpp"
+#include "../node/AtomicCounter.hpp"
+#include "../node/SharedPtr.hpp"
 
 #include "../osdep/Phy.hpp"
 #include "../osdep/Thread.hpp"
@@ -47,11 +49,14 @@
 #include "../osdep/PortMapper.hpp"
 #include "../osdep/Binder.hpp"
 #include "../osdep/ManagedRoute.hpp"
+#include "../osdep/BlockingQueue.hpp"
+#include "../osdep/LinuxNetLink.hpp"
 
 #include "OneService.hpp"
 #include "ClusterGeoIpService.hpp"
 #include "ClusterDefinition.hpp"
 #include "SoftwareUpdater.hpp"
+#include "IdentityStore.hpp"
 
 #ifdef __WINDOWS__
 #include <WinSock2.h>
@@ -63,6 +68,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <errno.h>
 #include <unistd.h>
 #include <ifaddrs.h>
 #endif
@@ -125,6 +131,24 @@ namespace ZeroTier { typedef BSDEthernetTap EthernetTap; }
 #define ZT_MAX_HTTP_MESSAGE_SIZE (1024 * 1024 * 64)
 #define ZT_MAX_HTTP_CONNECTIONS 64
 
+// Close kept-alive control plane connections idle for this long
+#define ZT_HTTP_KEEPALIVE_TIMEOUT 30000
+
+// Maximum control plane (HTTP) worker threads
+#define ZT_HTTP_MAX_WORKER_THREADS 8
+
+// Default control plane worker threads (0 handles requests on the I/O thread)
+#define ZT_HTTP_DEFAULT_WORKER_THREADS 2
+
+// How long a peer list snapshot (and responses rendered from it) is reused for /peer requests
+#define ZT_PEER_LIST_CACHE_TTL 2000
+
+// Maximum distinct /peer queries whose rendered responses are cached per snapshot
+#define ZT_PEER_LIST_CACHE_MAX_QUERIES 16
+
+// Maximum total bytes of rendered /peer responses cached per snapshot
+#define ZT_PEER_LIST_CACHE_MAX_BYTES 4194304
+
 // Interface metric for ZeroTier taps -- this ensures that if we are on WiFi and also
 // bridged via ZeroTier to the same LAN traffic will (if the OS is sane) prefer WiFi.
 #define ZT_IF_METRIC 5000
@@ -144,12 +168,29 @@ namespace ZeroTier { typedef BSDEthernetTap EthernetTap; }
 // Attempt to engage TCP fallback after this many ms of no reply to packets sent to global-scope IPs
 #define ZT_TCP_FALLBACK_AFTER 60000
 
+// Default and maximum number of parallel TCP fallback tunnel streams
+#define ZT_TCP_FALLBACK_DEFAULT_STREAMS 4
+#define ZT_TCP_FALLBACK_MAX_STREAMS 16
+
+// Default and maximum bytes queued per TCP fallback stream before new packets are dropped
+#define ZT_TCP_FALLBACK_DEFAULT_QUEUE_BYTES 262144
+#define ZT_TCP_FALLBACK_MAX_QUEUE_BYTES 16777216
+
+// Retry a TCP fallback stream that failed or closed after this many ms while others are up
+#define ZT_TCP_FALLBACK_STREAM_RETRY 15000
+
 // How often to check for local interface addresses
 #define ZT_LOCAL_INTERFACE_CHECK_INTERVAL 60000
 
-// Clean files from iddb.d that are older than this (60 days)
+// Expire identities not stored for this long (60 days)
 #define ZT_IDDB_CLEANUP_AGE 5184000000ULL
 
+// Packets waiting for a receive worker beyond this are dropped
+#define ZT_RX_WORKER_QUEUE_MAX 4096
+
+// How often to save peer state for warm restarts (only written if peers or paths changed)
+#define ZT_PEER_STATE_SAVE_INTERVAL 1800000
+
 namespace ZeroTier {
 
 namespace {
@@ -250,6 +291,9 @@ static void _peerToJson(nlohmann::json &pj,const ZT_Peer *peer)
 	pj["version"] = tmp;
 	pj["latency"] = peer->latency;
 	pj["role"] = prole;
+	pj["txQueueDepth"] = peer->txQueueDepth;
+	pj["txQueueDrops"] = peer->txQueueDrops;
+	pj["fecActive"] = (peer->fecActive != 0);
 
 	nlohmann::json pa = nlohmann::json::array();
 	for(unsigned int i=0;i<peer->pathCount;++i) {
@@ -262,11 +306,196 @@ static void _peerToJson(nlohmann::json &pj,const ZT_Peer *peer)
 		j["active"] = (bool)(peer->paths[i].expired == 0);
 		j["expired"] = (bool)(peer->paths[i].expired != 0);
 		j["preferred"] = (bool)(peer->paths[i].preferred != 0);
+		j["mtu"] = peer->paths[i].mtu;
+		j["packetsSent"] = peer->paths[i].packetsSent;
+		j["bytesSent"] = peer->paths[i].bytesSent;
+		j["packetsReceived"] = peer->paths[i].packetsReceived;
+		j["bytesReceived"] = peer->paths[i].bytesReceived;
+		j["latency"] = peer->paths[i].latency;
+		j["jitter"] = peer->paths[i].jitter;
+		j["latencyMedian"] = peer->paths[i].latencyMedian;
+		j["latency95"] = peer->paths[i].latency95;
+		j["packetLoss"] = peer->paths[i].packetLoss;
 		pa.push_back(j);
 	}
 	pj["paths"] = pa;
 }
 
+// Index of the first peer with an address >= a (peer lists are sorted by address)
+static unsigned long _peerLowerBound(const ZT_PeerList *pl,const uint64_t a)
+{
+	unsigned long lo = 0,hi = pl->peerCount;
+	while (lo < hi) {
+		const unsigned long mid = lo + ((hi - lo) / 2);
+		if (pl->peers[mid].address < a)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Render a /peer listing filtered and paginated by URL arguments:
+ *   role=LEAF|MOON|PLANET, active=true|false (has a live path), prefix=<hex>,
+ *   after=<address> (cursor), limit=<n>, paths=false, format=ndjson
+ * Returns false if an argument is invalid.
+ */
+static bool _peerListToBody(const ZT_PeerList *pl,const std::map<std::string,std::string> &args,std::string &body,std::string &contentType)
+{
+	std::map<std::string,std::string>::const_iterator a;
+
+	int role = -1;
+	if ((a = args.find("role")) != args.end()) {
+		if (a->second == "LEAF") role = ZT_PEER_ROLE_LEAF;
+		else if (a->second == "MOON") role = ZT_PEER_ROLE_MOON;
+		else if (a->second == "PLANET") role = ZT_PEER_ROLE_PLANET;
+		else return false;
+	}
+	int active = -1;
+	if ((a = args.find("active")) != args.end())
+		active = ((a->second == "true")||(a->second == "1")) ? 1 : 0;
+	const bool paths = (((a = args.find("paths")) == args.end())||((a->second != "false")&&(a->second != "0")));
+	const bool ndjson = (((a = args.find("format")) != args.end())&&(a->second == "ndjson"));
+	const unsigned long limit = ((a = args.find("limit")) != args.end()) ? strtoul(a->second.c_str(),(char **)0,10) : 0;
+
+	// A hex prefix of the 10-digit address is a contiguous range of the sorted list
+	uint64_t lo = 0,hi = 0xffffffffffULL;
+	if ((a = args.find("prefix")) != args.end()) {
+		if (a->second.length() > 10)
+			return false;
+		std::string l(a->second),h(a->second);
+		for(std::string::const_iterator c(a->second.begin());c!=a->second.end();++c) {
+			if (!(((*c >= '0')&&(*c <= '9'))||((*c >= 'a')&&(*c <= 'f'))||((*c >= 'A')&&(*c <= 'F'))))
+				return false;
+		}
+		l.append(10 - l.length(),'0');
+		h.append(10 - h.length(),'f');
+		lo = Utils::hexStrToU64(l.c_str());
+		hi = Utils::hexStrToU64(h.c_str());
+	}
+	const bool paged = ((limit > 0)||(args.find("after") != args.end()));
+	if ((a = args.find("after")) != args.end())
+		lo = std::max(lo,(uint64_t)(Utils::hexStrToU64(a->second.c_str()) + 1));
+
+	if (ndjson) {
+		contentType = "application/x-ndjson";
+	} else {
+		contentType = "application/json";
+		body = (paged) ? "{\"peers\":[" : "[";
+	}
+
+	unsigned long n = 0;
+	uint64_t last = 0,next = 0;
+	for(unsigned long i=_peerLowerBound(pl,lo);((i<pl->peerCount)&&(pl->peers[i].address <= hi));++i) {
+		const ZT_Peer &p = pl->peers[i];
+		if ((role >= 0)&&((int)p.role != role))
+			continue;
+		if (active >= 0) {
+			bool live = false;
+			for(unsigned int k=0;k<p.pathCount;++k) {
+				if (!p.paths[k].expired) {
+					live = true;
+					break;
+				}
+			}
+			if ((int)live != active)
+				continue;
+		}
+
+		if ((limit)&&(n >= limit)) {
+			next = last; // there's more, so continue after the last one listed
+			break;
+		}
+
+		nlohmann::json pj;
+		_peerToJson(pj,&p);
+		if (!paths)
+			pj.erase("paths");
+		if (ndjson) {
+			body.append(pj.dump());
+			body.push_back('\n');
+		} else {
+			if (n)
+				body.push_back(',');
+			body.append(OSUtils::jsonDump(pj));
+		}
+		last = p.address;
+		++n;
+	}
+
+	char tmp[64];
+	if (ndjson) {
+		if (next) {
+			Utils::snprintf(tmp,sizeof(tmp),"{\"next\":\"%.10llx\"}\n",next);
+			body.append(tmp);
+		}
+	} else if (paged) {
+		if (next)
+			Utils::snprintf(tmp,sizeof(tmp),"],\"next\":\"%.10llx\"}",next);
+		else Utils::snprintf(tmp,sizeof(tmp),"],\"next\":null}");
+		body.append(tmp);
+	} else {
+		body.push_back(']');
+	}
+	return true;
+}
+
+#ifdef __SYNOLOGY__
+// Ask Synology's auth cgi whether a web session is valid (true if it names a user)
+//
+// The session is passed in the cgi's environment, which is built for the
+// child alone so concurrent requests on HTTP workers can't see each other's.
+static bool _synologyAuthenticate(const std::string &cookie,const std::string &synoToken,const std::string &remoteAddr)
+{
+	std::vector<std::string> env;
+	for(char **e=environ;((e)&&(*e));++e) {
+		if ((strncmp(*e,"HTTP_COOKIE=",12) != 0)&&(strncmp(*e,"HTTP_X_SYNO_TOKEN=",18) != 0)&&(strncmp(*e,"REMOTE_ADDR=",12) != 0))
+			env.push_back(*e);
+	}
+	env.push_back(std::string("HTTP_COOKIE=") + cookie);
+	env.push_back(std::string("HTTP_X_SYNO_TOKEN=") + synoToken);
+	env.push_back(std::string("REMOTE_ADDR=") + remoteAddr);
+	std::vector<char *> envp;
+	for(std::vector<std::string>::iterator e(env.begin());e!=env.end();++e)
+		envp.push_back(const_cast<char *>(e->c_str()));
+	envp.push_back((char *)0);
+
+	// Built before fork() since the child may only make async-signal-safe calls
+	static const char *const cgi = "/usr/syno/synoman/webman/modules/authenticate.cgi";
+	char *const argv[2] = { const_cast<char *>(cgi),(char *)0 };
+
+	int pfd[2];
+	if (::pipe(pfd) != 0)
+		return false;
+	const long p = (long)::fork();
+	if (p < 0) {
+		::close(pfd[0]);
+		::close(pfd[1]);
+		return false;
+	}
+	if (p == 0) {
+		::close(pfd[0]);
+		::dup2(pfd[1],STDOUT_FILENO);
+		::close(pfd[1]);
+		::execve(cgi,argv,&(envp[0]));
+		::_exit(-1);
+	}
+	::close(pfd[1]);
+
+	char buf[1024];
+	long n = 0;
+	for(;;) {
+		n = (long)::read(pfd[0],buf,sizeof(buf));
+		if ((n >= 0)||(errno != EINTR))
+			break;
+	}
+	::close(pfd[0]);
+	int exitcode = -1;
+	::waitpid(p,&exitcode,0);
+	return ((n > 0)&&(buf[0] != 0)); // cgi prints the user name if the session is valid
+}
+#endif
+
 static void _moonToJson(nlohmann::json &mj,const World &world)
 {
 	char tmp[64];
@@ -296,6 +525,7 @@ static void SnodeEventCallback(ZT_Node *node,void *uptr,enum ZT_Event event,cons
 static long SnodeDataStoreGetFunction(ZT_Node *node,void *uptr,const char *name,void *buf,unsigned long bufSize,unsigned long readIndex,unsigned long *totalSize);
 static int SnodeDataStorePutFunction(ZT_Node *node,void *uptr,const char *name,const void *data,unsigned long len,int secure);
 static int SnodeWirePacketSendFunction(ZT_Node *node,void *uptr,const struct sockaddr_storage *localAddr,const struct sockaddr_storage *addr,const void *data,unsigned int len,unsigned int ttl);
+static int SnodeWirePacketSendDontFragmentFunction(ZT_Node *node,void *uptr,const struct sockaddr_storage *localAddr,const struct sockaddr_storage *addr,const void *data,unsigned int len,unsigned int ttl);
 static void SnodeVirtualNetworkFrameFunction(ZT_Node *node,void *uptr,uint64_t nwid,void **nuptr,uint64_t sourceMac,uint64_t destMac,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len);
 static int SnodePathCheckFunction(ZT_Node *node,void *uptr,uint64_t ztaddr,const struct sockaddr_storage *localAddr,const struct sockaddr_storage *remoteAddr);
 static int SnodePathLookupFunction(ZT_Node *node,void *uptr,uint64_t ztaddr,int family,struct sockaddr_storage *result);
@@ -343,6 +573,59 @@ static const struct http_parser_settings HTTP_PARSER_SETTINGS = {
 };
 #endif
 
+// Bounded byte ring for one TCP fallback tunnel stream; whole records are queued or dropped
+struct TcpTunnelQueue
+{
+	TcpTunnelQueue() : head(0),size(0),drops(0) {}
+
+	// Queue a header and payload as one record, or count a drop if they don't fit
+	inline bool push(const void *hdr,unsigned long hlen,const void *data,unsigned long len)
+	{
+		if ((size + hlen + len) > buf.size()) {
+			++drops;
+			return false;
+		}
+		_put(hdr,hlen);
+		_put(data,len);
+		return true;
+	}
+
+	// Get the contiguous run of queued bytes at the head (a wrapped ring has two)
+	inline unsigned long peek(const char *&p) const
+	{
+		if (!size)
+			return 0;
+		p = &(buf[head]);
+		return std::min(size,(unsigned long)buf.size() - head);
+	}
+
+	inline void consume(unsigned long n)
+	{
+		size -= n;
+		head = (size) ? ((head + n) % (unsigned long)buf.size()) : 0;
+	}
+
+	inline void _put(const void *d,unsigned long n)
+	{
+		if (!n)
+			return; // d may be NULL (e.g. a header-only push)
+		const unsigned long cap = (unsigned long)buf.size();
+		const unsigned long tail = (head + size) % cap;
+		const unsigned long first = std::min(n,cap - tail);
+		memcpy(&(buf[tail]),d,first);
+		if (n > first)
+			memcpy(&(buf[0]),reinterpret_cast<const char *>(d) + first,n - first);
+		size += n;
+	}
+
+	std::vector<char> buf;
+	unsigned long head;
+	unsigned long size;
+	uint64_t drops;
+};
+
+struct HttpWorkerRequest;
+
 struct TcpConnection
 {
 	enum {
@@ -369,6 +652,136 @@ struct TcpConnection
 
 	std::string writeBuf;
 	Mutex writeBuf_m;
+
+	// TCP_TUNNEL_OUTGOING only; guarded by OneServiceImpl::_tcpFallback_m
+	unsigned int tunnelStream;
+	TcpTunnelQueue tunnelQueue;
+
+	// TCP_HTTP_INCOMING only; a request is out with an HTTP worker, and later ones wait in order
+	uint64_t id;
+	bool httpBusy;
+	std::list< HttpWorkerRequest * > httpPending;
+};
+
+// Control plane request handed from the I/O thread to an HTTP worker and back
+struct HttpWorkerRequest
+{
+	TcpConnection *tc; // only touched on the I/O thread, and only if tc is still open with this connId
+	uint64_t connId;
+	InetAddress from;
+	unsigned int method;
+	bool keepAlive;
+	uint64_t received;
+	std::string url;
+	std::map< std::string,std::string > headers;
+	std::string body;
+
+	unsigned int scode;
+	std::string responseBody;
+	std::string responseContentType;
+};
+
+// Result of Node::peers() shared by /peer requests for ZT_PEER_LIST_CACHE_TTL
+class PeerListSnapshot
+{
+	friend class SharedPtr<PeerListSnapshot>;
+
+public:
+	PeerListSnapshot(Node *n,ZT_PeerList *p,const uint64_t t) : node(n),pl(p),timestamp(t),bodiesBytes(0) {}
+
+	Node *const node;
+	ZT_PeerList *const pl;
+	const uint64_t timestamp;
+	std::map< std::string,std::string > bodies; // rendered /peer responses by query
+	unsigned long bodiesBytes; // total length of bodies
+	Mutex bodies_m;
+
+private:
+	~PeerListSnapshot() { node->freeQueryResult((void *)pl); }
+
+	AtomicCounter __refCount;
+};
+
+// Control plane HTTP worker thread; all workers take requests from one queue
+struct HttpWorker
+{
+	HttpWorker() : parent((OneServiceImpl *)0) {}
+
+	void threadMain()
+		throw();
+
+	OneServiceImpl *parent;
+	Thread thread;
+};
+
+// Saves peer state for warm restarts when the main loop asks, so the I/O thread never does it
+struct StateSaver
+{
+	StateSaver() : parent((OneServiceImpl *)0) {}
+
+	void threadMain()
+		throw();
+
+	OneServiceImpl *parent;
+	Thread thread;
+	BlockingQueue<bool> queue; // true to save, false to exit
+};
+
+// Request count and latency (request complete to response ready) for a control plane endpoint
+struct HttpEndpointStats
+{
+	HttpEndpointStats() : requests(0),totalLatency(0),maxLatency(0) {}
+	uint64_t requests;
+	uint64_t totalLatency;
+	uint64_t maxLatency;
+};
+
+// Datagram handed from the I/O thread to a receive worker
+struct RxWorkerPacket
+{
+	InetAddress localAddr;
+	InetAddress from;
+	std::string data;
+};
+
+// Receive worker thread: all packets from a given sender go to the same one
+struct RxWorker
+{
+	RxWorker() : parent((OneServiceImpl *)0),packets(0),bytes(0),drops(0) {}
+	~RxWorker()
+	{
+		for(std::vector<RxWorkerPacket *>::iterator p(pool.begin());p!=pool.end();++p)
+			delete *p;
+	}
+
+	void threadMain()
+		throw();
+
+	inline RxWorkerPacket *getPacket()
+	{
+		Mutex::Lock _l(pool_m);
+		if (pool.empty())
+			return new RxWorkerPacket();
+		RxWorkerPacket *const p = pool.back();
+		pool.pop_back();
+		return p;
+	}
+
+	inline void putPacket(RxWorkerPacket *p)
+	{
+		Mutex::Lock _l(pool_m);
+		pool.push_back(p);
+	}
+
+	OneServiceImpl *parent;
+	Thread thread;
+	BlockingQueue<RxWorkerPacket *> queue; // null entry tells worker to exit
+	AtomicCounter depth; // packets in queue
+	volatile uint64_t packets; // packets and bytes are only written by the worker thread
+	volatile uint64_t bytes;
+	volatile uint64_t drops; // only written by the I/O thread
+	std::vector<RxWorkerPacket *> pool; // recycled packets (their strings keep capacity)
+	Mutex pool_m;
 };
 
 // Used to pseudo-randomize local source port picking
@@ -384,6 +797,7 @@ public:
 	EmbeddedNetworkController *_controller;
 	Phy<OneServiceImpl *> _phy;
 	Node *_node;
+	IdentityStore _identities; // backs iddb.d/<address> in the data store
 	SoftwareUpdater *_updater;
 	bool _updateAutoApply;
 	unsigned int _primaryPort;
@@ -431,6 +845,31 @@ public:
 	// Deadline for the next background task service function
 	volatile uint64_t _nextBackgroundTaskDeadline;
 
+	// Receive workers (none if packets are processed on the I/O thread)
+	RxWorker _rxWorkers[ZT_RX_QUEUE_SHARDS];
+	unsigned int _rxWorkerCount;
+	unsigned int _rxWorkerThreads; // local.conf setting, applied at startup
+
+	// Control plane HTTP workers (none if requests are handled on the I/O thread)
+	HttpWorker _httpWorkers[ZT_HTTP_MAX_WORKER_THREADS];
+	unsigned int _httpWorkerCount;
+	unsigned int _httpWorkerThreads; // local.conf setting, applied at startup
+	BlockingQueue<HttpWorkerRequest *> _httpQueue; // null entry tells a worker to exit
+
+	StateSaver _stateSaver;
+	std::vector<HttpWorkerRequest *> _httpDone; // finished requests for the I/O thread to answer
+	Mutex _httpDone_m;
+	uint64_t _httpConnectionCounter;
+	std::map< std::string,HttpEndpointStats > _httpStats;
+	Mutex _httpStats_m;
+	SharedPtr<PeerListSnapshot> _peerListSnapshot;
+	Mutex _peerListSnapshot_m;
+
+#ifdef __LINUX__
+	// Kernel interface/address/route change notifications (replaces most periodic rescans)
+	LinuxNetLinkMonitor<OneServiceImpl *> _netLinkMonitor;
+#endif
+
 	// Configured networks
 	struct NetworkState
 	{
@@ -454,7 +893,15 @@ public:
 
 	// Active TCP/IP connections
 	std::set< TcpConnection * > _tcpConnections; // no mutex for this since it's done in the main loop thread only
-	TcpConnection *_tcpFallbackTunnel;
+
+	// TCP fallback tunnel streams, locked since packets may be sent from any thread
+	TcpConnection *_tcpFallbackTunnels[ZT_TCP_FALLBACK_MAX_STREAMS];
+	uint64_t _tcpFallbackLastConnect[ZT_TCP_FALLBACK_MAX_STREAMS];
+	unsigned int _tcpFallbackStreams; // local.conf settings
+	unsigned long _tcpFallbackQueueBytes;
+	uint32_t _tcpFallbackPendingWrite; // streams with newly queued data, bit per stream; Phy is only touched on the I/O thread
+	uint32_t _tcpFallbackPendingConnect; // streams to (re)connect, bit per stream
+	Mutex _tcpFallback_m;
 
 	// Termination status information
 	ReasonForTermination _termReason;
@@ -496,7 +943,18 @@ public:
 #endif
 		,_lastRestart(0)
 		,_nextBackgroundTaskDeadline(0)
-		,_tcpFallbackTunnel((TcpConnection *)0)
+		,_rxWorkerCount(0)
+		,_rxWorkerThreads(0)
+		,_httpWorkerCount(0)
+		,_httpWorkerThreads(ZT_HTTP_DEFAULT_WORKER_THREADS)
+		,_httpConnectionCounter(0)
+#ifdef __LINUX__
+		,_netLinkMonitor(this)
+#endif
+		,_tcpFallbackStreams(ZT_TCP_FALLBACK_DEFAULT_STREAMS)
+		,_tcpFallbackQueueBytes(ZT_TCP_FALLBACK_DEFAULT_QUEUE_BYTES)
+		,_tcpFallbackPendingWrite(0)
+		,_tcpFallbackPendingConnect(0)
 		,_termReason(ONE_STILL_RUNNING)
 		,_portMappingEnabled(true)
 #ifdef ZT_USE_MINIUPNPC
@@ -512,6 +970,10 @@ public:
 		_ports[0] = 0;
 		_ports[1] = 0;
 		_ports[2] = 0;
+		for(unsigned int i=0;i<ZT_TCP_FALLBACK_MAX_STREAMS;++i) {
+			_tcpFallbackTunnels[i] = (TcpConnection *)0;
+			_tcpFallbackLastConnect[i] = 0;
+		}
 	}
 
 	virtual ~OneServiceImpl()
@@ -562,9 +1024,13 @@ public:
 			OSUtils::rm((_homePath + ZT_PATH_SEPARATOR_S "peers.save").c_str());
 			OSUtils::rm((_homePath + ZT_PATH_SEPARATOR_S "world").c_str());
 
+			// Open identity store and move any identities from iddb.d into it
+			if (_identities.open((_homePath + ZT_PATH_SEPARATOR_S "identities.db").c_str()))
+				_identities.importDirectory((_homePath + ZT_PATH_SEPARATOR_S "iddb.d").c_str());
+
 			{
 				struct ZT_Node_Callbacks cb;
-				cb.version = 0;
+				cb.version = ZT_NODE_CALLBACKS_VERSION;
 				cb.dataStoreGetFunction = SnodeDataStoreGetFunction;
 				cb.dataStorePutFunction = SnodeDataStorePutFunction;
 				cb.wirePacketSendFunction = SnodeWirePacketSendFunction;
@@ -573,6 +1039,7 @@ public:
 				cb.eventCallback = SnodeEventCallback;
 				cb.pathCheckFunction = SnodePathCheckFunction;
 				cb.pathLookupFunction = SnodePathLookupFunction;
+				cb.wirePacketSendDontFragmentFunction = SnodeWirePacketSendDontFragmentFunction;
 				_node = new Node(this,&cb,OSUtils::now());
 			}
 
@@ -648,6 +1115,31 @@ public:
 			}
 			applyLocalConfig();
 
+			// Start receive workers, each with its own RX queue shard; the count can't change without a restart
+			if (_rxWorkerThreads > 1)
+				_node->setRxQueueShards(_rxWorkerThreads);
+			for(unsigned int i=0;i<_rxWorkerThreads;++i) {
+				_rxWorkers[i].parent = this;
+				_rxWorkers[i].thread = Thread::start(&(_rxWorkers[i]));
+			}
+			_rxWorkerCount = _rxWorkerThreads;
+
+			// Start control plane workers so slow API requests can't stall the I/O thread
+			for(unsigned int i=0;i<_httpWorkerThreads;++i) {
+				_httpWorkers[i].parent = this;
+				_httpWorkers[i].thread = Thread::start(&(_httpWorkers[i]));
+			}
+			_httpWorkerCount = _httpWorkerThreads;
+
+			_stateSaver.parent = this;
+			_stateSaver.thread = Thread::start(&_stateSaver);
+
+#ifdef __LINUX__
+			// If this fails we just fall back to rescanning periodically
+			if (_netLinkMonitor.start())
+				_netLinkMonitor.setOwnPortId(ManagedRoute::netlinkPortId());
+#endif
+
 			// Bind TCP control socket
 			const int portTrials = (_primaryPort == 0) ? 256 : 1; // if port is 0, pick random
 			for(int k=0;k<portTrials;++k) {
@@ -824,6 +1316,8 @@ public:
 			uint64_t lastUpdateCheck = clockShouldBe;
 			uint64_t lastLocalInterfaceAddressCheck = (clockShouldBe - ZT_LOCAL_INTERFACE_CHECK_INTERVAL) + 15000; // do this in 15s to give portmapper time to configure and other things time to settle
 			uint64_t lastCleanedIddb = 0;
+			uint64_t lastHttpIdleCheck = 0;
+			uint64_t lastStateSave = clockShouldBe;
 			for(;;) {
 				_run_m.lock();
 				if (!_run) {
@@ -838,10 +1332,16 @@ public:
 
 				const uint64_t now = OSUtils::now();
 
-				// Clean iddb.d on start and every 24 hours
+				// Expire old identities and compact identity store on start and every 24 hours
 				if ((now - lastCleanedIddb) > 86400000) {
 					lastCleanedIddb = now;
-					OSUtils::cleanDirectory((_homePath + ZT_PATH_SEPARATOR_S "iddb.d").c_str(),now - ZT_IDDB_CLEANUP_AGE);
+					_identities.clean(now - ZT_IDDB_CLEANUP_AGE);
+				}
+
+				// Peer state is serialized and encrypted by the state saver thread, which skips it if nothing changed
+				if ((now - lastStateSave) >= ZT_PEER_STATE_SAVE_INTERVAL) {
+					lastStateSave = now;
+					_stateSaver.queue.post(true);
 				}
 
 				// Attempt to detect sleep/wake events by detecting delay overruns
@@ -858,16 +1358,36 @@ public:
 						_updater->apply();
 				}
 
+				// With netlink monitoring we only rescan when the kernel says something changed
+				unsigned int netChanges = 0;
+				uint64_t bindRefreshPeriod = ZT_BINDER_REFRESH_PERIOD;
+				uint64_t tapMulticastCheckInterval = ZT_TAP_CHECK_MULTICAST_INTERVAL;
+#ifdef __LINUX__
+				if (_netLinkMonitor.running()) {
+					netChanges = _netLinkMonitor.changes();
+					bindRefreshPeriod = ZT_NETLINK_FALLBACK_REFRESH_PERIOD;
+					if (_netLinkMonitor.multicastEvents())
+						tapMulticastCheckInterval = ZT_NETLINK_FALLBACK_REFRESH_PERIOD;
+				}
+#endif
+
 				// Refresh bindings in case device's interfaces have changed, and also sync routes to update any shadow routes (e.g. shadow default)
-				if (((now - lastBindRefresh) >= ZT_BINDER_REFRESH_PERIOD)||(restarted)) {
-					lastBindRefresh = now;
-					for(int i=0;i<3;++i) {
-						if (_ports[i]) {
-							_bindings[i].refresh(_phy,_ports[i],*this);
+				const bool bindRefreshDue = (((now - lastBindRefresh) >= bindRefreshPeriod)||(restarted));
+				if ((bindRefreshDue)||((netChanges & (ZT_NETLINK_CHANGED_LINK | ZT_NETLINK_CHANGED_ADDRESS | ZT_NETLINK_CHANGED_ROUTE)) != 0)) {
+					if ((bindRefreshDue)||((netChanges & (ZT_NETLINK_CHANGED_LINK | ZT_NETLINK_CHANGED_ADDRESS)) != 0)) {
+						lastBindRefresh = now;
+						for(int i=0;i<3;++i) {
+							if (_ports[i]) {
+								_bindings[i].refresh(_phy,_ports[i],*this);
+							}
 						}
+						if (!bindRefreshDue)
+							lastLocalInterfaceAddressCheck = 0; // addresses changed, so re-announce them too
 					}
+					ManagedRoute::routeTableChanged(); // before taking _nets_m since this can block
 					{
 						Mutex::Lock _l(_nets_m);
+						ManagedRoute::Batch _rb;
 						for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n) {
 							if (n->second.tap)
 								syncManagedStuff(n->second,false,true);
@@ -881,10 +1401,20 @@ public:
 					dl = _nextBackgroundTaskDeadline;
 				}
 
-				if ((_tcpFallbackTunnel)&&((now - _lastDirectReceiveFromGlobal) < (ZT_TCP_FALLBACK_AFTER / 2)))
-					_phy.close(_tcpFallbackTunnel->sock);
+				if ((now - _lastDirectReceiveFromGlobal) < (ZT_TCP_FALLBACK_AFTER / 2)) {
+					std::vector<PhySocket *> tunnelSocks;
+					{
+						Mutex::Lock _l(_tcpFallback_m);
+						for(unsigned int i=0;i<ZT_TCP_FALLBACK_MAX_STREAMS;++i) {
+							if (_tcpFallbackTunnels[i])
+								tunnelSocks.push_back(_tcpFallbackTunnels[i]->sock);
+						}
+					}
+					for(std::vector<PhySocket *>::iterator ts(tunnelSocks.begin());ts!=tunnelSocks.end();++ts)
+						_phy.close(*ts); // close handler takes _tcpFallback_m
+				}
 
-				if ((now - lastTapMulticastGroupCheck) >= ZT_TAP_CHECK_MULTICAST_INTERVAL) {
+				if (((now - lastTapMulticastGroupCheck) >= tapMulticastCheckInterval)||((netChanges & (ZT_NETLINK_CHANGED_LINK | ZT_NETLINK_CHANGED_ADDRESS | ZT_NETLINK_CHANGED_MULTICAST)) != 0)) {
 					lastTapMulticastGroupCheck = now;
 					Mutex::Lock _l(_nets_m);
 					for(std::map<uint64_t,NetworkState>::const_iterator n(_nets.begin());n!=_nets.end();++n) {
@@ -917,9 +1447,22 @@ public:
 						_node->addLocalInterfaceAddress(reinterpret_cast<const struct sockaddr_storage *>(&(*i)));
 				}
 
+				if ((now - lastHttpIdleCheck) >= (ZT_HTTP_KEEPALIVE_TIMEOUT / 4)) {
+					lastHttpIdleCheck = now;
+					std::vector<PhySocket *> idle;
+					for(std::set<TcpConnection *>::const_iterator c(_tcpConnections.begin());c!=_tcpConnections.end();++c) {
+						if (((*c)->type == TcpConnection::TCP_HTTP_INCOMING)&&(!(*c)->httpBusy)&&((now - (*c)->lastActivity) > ZT_HTTP_KEEPALIVE_TIMEOUT))
+							idle.push_back((*c)->sock);
+					}
+					for(std::vector<PhySocket *>::iterator i(idle.begin());i!=idle.end();++i)
+						_phy.close(*i);
+				}
+
 				const unsigned long delay = (dl > now) ? (unsigned long)(dl - now) : 100;
 				clockShouldBe = now + (uint64_t)delay;
 				_phy.poll(delay);
+				deliverHttpResponses();
+				tcpFallbackFlush();
 			}
 		} catch (std::exception &exc) {
 			Mutex::Lock _l(_termReason_m);
@@ -931,6 +1474,29 @@ public:
 			_fatalErrorMessage = "unexpected exception in main thread";
 		}
 
+#ifdef __LINUX__
+		_netLinkMonitor.stop();
+#endif
+
+		for(unsigned int i=0;i<_rxWorkerCount;++i) {
+			_rxWorkers[i].queue.post((RxWorkerPacket *)0);
+			Thread::join(_rxWorkers[i].thread);
+		}
+		_rxWorkerCount = 0;
+
+		for(unsigned int i=0;i<_httpWorkerCount;++i)
+			_httpQueue.post((HttpWorkerRequest *)0);
+		for(unsigned int i=0;i<_httpWorkerCount;++i)
+			Thread::join(_httpWorkers[i].thread);
+		_httpWorkerCount = 0;
+		deliverHttpResponses();
+
+		if (_stateSaver.parent) {
+			_stateSaver.queue.post(false);
+			Thread::join(_stateSaver.thread);
+			_stateSaver.parent = (OneServiceImpl *)0;
+		}
+
 		try {
 			while (!_tcpConnections.empty())
 				_phy.close((*_tcpConnections.begin())->sock);
@@ -938,6 +1504,7 @@ public:
 
 		{
 			Mutex::Lock _l(_nets_m);
+			ManagedRoute::Batch _rb;
 			for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n)
 				delete n->second.tap;
 			_nets.clear();
@@ -945,8 +1512,13 @@ public:
 
 		delete _updater;
 		_updater = (SoftwareUpdater *)0;
+		{
+			Mutex::Lock _l(_peerListSnapshot_m);
+			_peerListSnapshot.zero(); // frees its peer list via _node
+		}
 		delete _node;
 		_node = (Node *)0;
+		_identities.close();
 
 		return _termReason;
 	}
@@ -972,6 +1544,23 @@ public:
 		else return std::string();
 	}
 
+	// Add tap transmit ring statistics to a network's JSON (if the tap has them)
+	inline void tapStatsToJson(uint64_t nwid,nlohmann::json &nj) const
+	{
+#if defined(__LINUX__) && !defined(ZT_SERVICE_NETCON)
+		Mutex::Lock _l(_nets_m);
+		std::map<uint64_t,NetworkState>::const_iterator n(_nets.find(nwid));
+		if ((n != _nets.end())&&(n->second.tap)) {
+			unsigned long depth = 0;
+			uint64_t drops = 0,backpressure = 0;
+			n->second.tap->txStats(depth,drops,backpressure);
+			nj["tapTxQueueDepth"] = (uint64_t)depth;
+			nj["tapTxDrops"] = drops;
+			nj["tapTxBackpressure"] = backpressure;
+		}
+#endif
+	}
+
 	virtual void terminate()
 	{
 		_run_m.lock();
@@ -1083,30 +1672,8 @@ public:
 				std::string synotoken = path.substr(synotoken_pos);
 				std::string cookie_val = cookie.substr(cookie.find("=")+1);
 				std::string synotoken_val = synotoken.substr(synotoken.find("=")+1);
-				// Set necessary env for auth script
 				std::map<std::string,std::string>::const_iterator ah2(headers.find("x-forwarded-for"));
-				setenv("HTTP_COOKIE", cookie_val.c_str(), true);
-				setenv("HTTP_X_SYNO_TOKEN", synotoken_val.c_str(), true);
-				setenv("REMOTE_ADDR", ah2->second.c_str(),true);
-					//fprintf(stderr, "HTTP_COOKIE: %s\n",std::getenv ("HTTP_COOKIE"));
-					//fprintf(stderr, "HTTP_X_SYNO_TOKEN: %s\n",std::getenv ("HTTP_X_SYNO_TOKEN"));
-					//fprintf(stderr, "REMOTE_ADDR: %s\n",std::getenv ("REMOTE_ADDR"));
-				// check synology web auth
-				char user[256], buf[1024];
-				FILE *fp = NULL;
-				bzero(user, 256);
-				fp = popen("/usr/syno/synoman/webman/modules/authenticate.cgi", "r");
-				if(!fp)
-					isAuth = false;
-				else {
-					bzero(buf, sizeof(buf));
-					fread(buf, 1024, 1, fp);
-					if(strlen(buf) > 0) {
-						snprintf(user, 256, "%s", buf);
-						isAuth = true;
-					}
-				}
-				pclose(fp);
+				isAuth = _synologyAuthenticate(cookie_val,synotoken_val,(ah2 != headers.end()) ? ah2->second : std::string());
 			}
 		}
 #endif
@@ -1121,7 +1688,61 @@ public:
 					res["address"] = tmp;
 					res["publicIdentity"] = status.publicIdentity;
 					res["online"] = (bool)(status.online != 0);
-					res["tcpFallbackActive"] = (_tcpFallbackTunnel != (TcpConnection *)0);
+					res["txQueueDepth"] = (uint64_t)status.txQueueDepth;
+					res["txQueueDrops"] = status.txQueueDrops;
+					res["fragmentsLost"] = status.fragmentsLost;
+					res["fragmentsRecovered"] = status.fragmentsRecovered;
+					res["fragmentsExpired"] = status.fragmentsExpired;
+					res["fragmentsRetransmitted"] = status.fragmentsRetransmitted;
+					res["fecParitySent"] = status.fecParitySent;
+					res["fecPacketsRecovered"] = status.fecPacketsRecovered;
+					json pool;
+					pool["allocated"] = status.packetPoolAllocated;
+					pool["reused"] = status.packetPoolReused;
+					pool["copies"] = status.packetPoolCopies;
+					pool["bytesCopied"] = status.packetPoolBytesCopied;
+					pool["free"] = (uint64_t)status.packetPoolFree;
+					res["packetPool"] = pool;
+					res["relayedPackets"] = status.relayedPackets;
+					res["relayedBytes"] = status.relayedBytes;
+					json rxw = json::array();
+					for(unsigned int i=0;i<_rxWorkerCount;++i) {
+						json w;
+						w["packets"] = (uint64_t)_rxWorkers[i].packets;
+						w["bytes"] = (uint64_t)_rxWorkers[i].bytes;
+						w["drops"] = (uint64_t)_rxWorkers[i].drops;
+						rxw.push_back(w);
+					}
+					res["rxWorkers"] = rxw;
+					{
+						json tunnels = json::array();
+						Mutex::Lock _l(_tcpFallback_m);
+						for(unsigned int i=0;i<ZT_TCP_FALLBACK_MAX_STREAMS;++i) {
+							const TcpConnection *const tc = _tcpFallbackTunnels[i];
+							if (tc) {
+								json t;
+								t["stream"] = i;
+								t["queueBytes"] = (uint64_t)tc->tunnelQueue.size;
+								t["queueDrops"] = tc->tunnelQueue.drops;
+								t["rtt"] = _tcpRtt(tc->sock);
+								tunnels.push_back(t);
+							}
+						}
+						res["tcpFallbackActive"] = (tunnels.size() > 0);
+						res["tcpFallbackStreams"] = tunnels;
+					}
+					{
+						json eps = json::object();
+						Mutex::Lock _l(_httpStats_m);
+						for(std::map< std::string,HttpEndpointStats >::const_iterator e(_httpStats.begin());e!=_httpStats.end();++e) {
+							json ep;
+							ep["requests"] = e->second.requests;
+							ep["avgLatency"] = (e->second.requests) ? (e->second.totalLatency / e->second.requests) : 0ULL;
+							ep["maxLatency"] = e->second.maxLatency;
+							eps[e->first] = ep;
+						}
+						res["httpEndpoints"] = eps;
+					}
 					res["versionMajor"] = ZEROTIER_ONE_VERSION_MAJOR;
 					res["versionMinor"] = ZEROTIER_ONE_VERSION_MINOR;
 					res["versionRev"] = ZEROTIER_ONE_VERSION_REVISION;
@@ -1140,6 +1761,20 @@ public:
 					settings["portMappingEnabled"] = OSUtils::jsonBool(settings["portMappingEnabled"],true);
 #else
 					settings["portMappingEnabled"] = false; // not supported in build
+#endif
+					settings["multipath"] = OSUtils::jsonBool(settings["multipath"],false);
+					settings["txPacingRate"] = OSUtils::jsonInt(settings["txPacingRate"],0ULL);
+					settings["txQueueDepth"] = OSUtils::jsonInt(settings["txQueueDepth"],(uint64_t)ZT_SEND_QUEUE_DEFAULT_DEPTH);
+					settings["rxWorkerThreads"] = OSUtils::jsonInt(settings["rxWorkerThreads"],0ULL);
+					settings["httpWorkerThreads"] = OSUtils::jsonInt(settings["httpWorkerThreads"],(uint64_t)ZT_HTTP_DEFAULT_WORKER_THREADS);
+					settings["tcpFallbackStreams"] = OSUtils::jsonInt(settings["tcpFallbackStreams"],(uint64_t)ZT_TCP_FALLBACK_DEFAULT_STREAMS);
+					settings["tcpFallbackQueueBytes"] = OSUtils::jsonInt(settings["tcpFallbackQueueBytes"],(uint64_t)ZT_TCP_FALLBACK_DEFAULT_QUEUE_BYTES);
+					settings["fragmentRecovery"] = OSUtils::jsonBool(settings["fragmentRecovery"],false);
+					settings["fec"] = OSUtils::jsonBool(settings["fec"],false);
+					settings["fecLossThreshold"] = OSUtils::jsonInt(settings["fecLossThreshold"],(uint64_t)ZT_FEC_DEFAULT_LOSS_THRESHOLD);
+#if defined(__LINUX__) && !defined(ZT_SERVICE_NETCON)
+					settings["tapReaderThreads"] = OSUtils::jsonInt(settings["tapReaderThreads"],(uint64_t)ZT_TAP_ENGINE_DEFAULT_THREADS);
+					settings["tapTxQueueDepth"] = OSUtils::jsonInt(settings["tapTxQueueDepth"],(uint64_t)ZT_TAP_TX_QUEUE_DEFAULT_DEPTH);
 #endif
 					settings["softwareUpdate"] = OSUtils::jsonString(settings["softwareUpdate"],ZT_SOFTWARE_UPDATE_DEFAULT);
 					settings["softwareUpdateChannel"] = OSUtils::jsonString(settings["softwareUpdateChannel"],ZT_SOFTWARE_UPDATE_DEFAULT_CHANNEL);
@@ -1214,6 +1849,7 @@ public:
 								getNetworkSettings(nws->networks[i].nwid,localSettings);
 								nlohmann::json nj;
 								_networkToJson(nj,&(nws->networks[i]),portDeviceName(nws->networks[i].nwid),localSettings);
+								tapStatsToJson(nws->networks[i].nwid,nj);
 								res.push_back(nj);
 							}
 
@@ -1227,6 +1863,7 @@ public:
 									OneService::NetworkSettings localSettings;
 									getNetworkSettings(nws->networks[i].nwid,localSettings);
 									_networkToJson(res,&(nws->networks[i]),portDeviceName(nws->networks[i].nwid),localSettings);
+									tapStatsToJson(nws->networks[i].nwid,res);
 									scode = 200;
 									break;
 								}
@@ -1236,33 +1873,52 @@ public:
 						_node->freeQueryResult((void *)nws);
 					} else scode = 500;
 				} else if (ps[0] == "peer") {
-					ZT_PeerList *pl = _node->peers();
-					if (pl) {
+					SharedPtr<PeerListSnapshot> snap(getPeerListSnapshot());
+					if (snap) {
+						const ZT_PeerList *const pl = snap->pl;
 						if (ps.size() == 1) {
-							// Return [array] of all peers
-
-							res = nlohmann::json::array();
-							for(unsigned long i=0;i<pl->peerCount;++i) {
-								nlohmann::json pj;
-								_peerToJson(pj,&(pl->peers[i]));
-								res.push_back(pj);
+							// Return [array] of peers, filtered and paginated by URL arguments
+
+							std::string q;
+							for(std::map<std::string,std::string>::const_iterator a(urlArgs.begin());a!=urlArgs.end();++a) {
+								if ((a->first != "auth")&&(a->first != "jsonp")) {
+									q.append(a->first);
+									q.push_back('=');
+									q.append(a->second);
+									q.push_back('&');
+								}
 							}
 
-							scode = 200;
+							bool cached = false;
+							{
+								Mutex::Lock _l(snap->bodies_m);
+								std::map<std::string,std::string>::const_iterator b(snap->bodies.find(q));
+								if (b != snap->bodies.end()) {
+									responseBody = b->second;
+									cached = true;
+								}
+							}
+							if (cached) {
+								std::map<std::string,std::string>::const_iterator f(urlArgs.find("format"));
+								responseContentType = ((f != urlArgs.end())&&(f->second == "ndjson")) ? "application/x-ndjson" : "application/json";
+								scode = 200;
+							} else if (_peerListToBody(pl,urlArgs,responseBody,responseContentType)) { // rendered unlocked; a concurrent identical query may render it too
+								Mutex::Lock _l(snap->bodies_m);
+								if ((snap->bodies.size() < ZT_PEER_LIST_CACHE_MAX_QUERIES)&&((snap->bodiesBytes + responseBody.length()) <= ZT_PEER_LIST_CACHE_MAX_BYTES)&&(snap->bodies.insert(std::pair<std::string,std::string>(q,responseBody)).second))
+									snap->bodiesBytes += (unsigned long)responseBody.length();
+								scode = 200;
+							} else scode = 400;
 						} else if (ps.size() == 2) {
 							// Return a single peer by ID or 404 if not found
 
-							uint64_t wantp = Utils::hexStrToU64(ps[1].c_str());
-							for(unsigned long i=0;i<pl->peerCount;++i) {
-								if (pl->peers[i].address == wantp) {
-									_peerToJson(res,&(pl->peers[i]));
-									scode = 200;
-									break;
-								}
+							const uint64_t wantp = Utils::hexStrToU64(ps[1].c_str());
+							const unsigned long i = _peerLowerBound(pl,wantp);
+							if ((i < pl->peerCount)&&(pl->peers[i].address == wantp)) {
+								_peerToJson(res,&(pl->peers[i]));
+								scode = 200;
 							}
 
 						} else scode = 404;
-						_node->freeQueryResult((void *)pl);
 					} else scode = 500;
 				} else {
 					if (_controller) {
@@ -1339,6 +1995,7 @@ public:
 
 									setNetworkSettings(nws->networks[i].nwid,localSettings);
 									_networkToJson(res,&(nws->networks[i]),portDeviceName(nws->networks[i].nwid),localSettings);
+									tapStatsToJson(nws->networks[i].nwid,res);
 
 									scode = 200;
 									break;
@@ -1391,7 +2048,7 @@ public:
 			scode = 400;
 		}
 
-		if (responseBody.length() == 0) {
+		if ((responseBody.length() == 0)&&(responseContentType != "application/x-ndjson")) { // empty ndjson is zero records, not an error
 			if ((res.is_object())||(res.is_array()))
 				responseBody = OSUtils::jsonDump(res);
 			else responseBody = "{}";
@@ -1411,6 +2068,20 @@ public:
 		return scode;
 	}
 
+	// Get the current peer list snapshot, taking a new one if it's too old (any thread)
+	inline SharedPtr<PeerListSnapshot> getPeerListSnapshot()
+	{
+		const uint64_t now = OSUtils::now();
+		Mutex::Lock _l(_peerListSnapshot_m); // also keeps concurrent scrapes from each copying the list
+		if ((!_peerListSnapshot)||((now - _peerListSnapshot->timestamp) >= ZT_PEER_LIST_CACHE_TTL)) {
+			ZT_PeerList *const pl = _node->peers();
+			if (!pl)
+				return SharedPtr<PeerListSnapshot>();
+			_peerListSnapshot = new PeerListSnapshot(_node,pl,now);
+		}
+		return _peerListSnapshot;
+	}
+
 	// Must be called after _localConfig is read or modified
 	void applyLocalConfig()
 	{
@@ -1490,6 +2161,22 @@ public:
 
 		_primaryPort = (unsigned int)OSUtils::jsonInt(settings["primaryPort"],(uint64_t)_primaryPort) & 0xffff;
 		_portMappingEnabled = OSUtils::jsonBool(settings["portMappingEnabled"],true);
+		_node->setMultipathMode(OSUtils::jsonBool(settings["multipath"],false) ? 1 : 0);
+		_node->setTxPacing(OSUtils::jsonInt(settings["txPacingRate"],0ULL) * 125ULL,(unsigned int)OSUtils::jsonInt(settings["txQueueDepth"],0ULL)); // kbps -> bytes/sec
+		_node->setFragmentRecovery(OSUtils::jsonBool(settings["fragmentRecovery"],false) ? 1 : 0);
+		_node->setFecMode(OSUtils::jsonBool(settings["fec"],false) ? 1 : 0,(unsigned int)OSUtils::jsonInt(settings["fecLossThreshold"],0ULL));
+
+#if defined(__LINUX__) && !defined(ZT_SERVICE_NETCON)
+		EthernetTap::setReaderThreads((unsigned int)OSUtils::jsonInt(settings["tapReaderThreads"],0ULL));
+		EthernetTap::setTxQueueDepth((unsigned int)OSUtils::jsonInt(settings["tapTxQueueDepth"],(uint64_t)ZT_TAP_TX_QUEUE_DEFAULT_DEPTH));
+#endif
+		_rxWorkerThreads = std::min((unsigned int)OSUtils::jsonInt(settings["rxWorkerThreads"],0ULL),(unsigned int)ZT_RX_QUEUE_SHARDS);
+		_httpWorkerThreads = std::min((unsigned int)OSUtils::jsonInt(settings["httpWorkerThreads"],(uint64_t)ZT_HTTP_DEFAULT_WORKER_THREADS),(unsigned int)ZT_HTTP_MAX_WORKER_THREADS);
+		{
+			Mutex::Lock _l(_tcpFallback_m);
+			_tcpFallbackStreams = std::max(std::min((unsigned int)OSUtils::jsonInt(settings["tcpFallbackStreams"],(uint64_t)ZT_TCP_FALLBACK_DEFAULT_STREAMS),(unsigned int)ZT_TCP_FALLBACK_MAX_STREAMS),1U);
+			_tcpFallbackQueueBytes = std::max(std::min((unsigned long)OSUtils::jsonInt(settings["tcpFallbackQueueBytes"],(uint64_t)ZT_TCP_FALLBACK_DEFAULT_QUEUE_BYTES),(unsigned long)ZT_TCP_FALLBACK_MAX_QUEUE_BYTES),4096UL);
+		}
 
 		const std::string up(OSUtils::jsonString(settings["softwareUpdate"],ZT_SOFTWARE_UPDATE_DEFAULT));
 		const bool udist = OSUtils::jsonBool(settings["softwareUpdateDist"],false);
@@ -1602,6 +2289,7 @@ public:
 		}
 
 		if (syncRoutes) {
+			ManagedRoute::Batch _rb; // one kernel transaction for all changes
 			char tapdev[64];
 #ifdef __WINDOWS__
 			Utils::snprintf(tapdev,sizeof(tapdev),"%.16llx",(unsigned long long)n.tap->luid().Value);
@@ -1692,6 +2380,28 @@ public:
 		if ((len >= 16)&&(reinterpret_cast<const InetAddress *>(from)->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
 			_lastDirectReceiveFromGlobal = OSUtils::now();
 
+		if (_rxWorkerCount) {
+			// Steer by sender so each peer's paths and RX queue shard stay on one core
+			RxWorker &w = _rxWorkers[Node::rxQueueShard(reinterpret_cast<const struct sockaddr_storage *>(from)) % _rxWorkerCount];
+			if ((++w.depth) > ZT_RX_WORKER_QUEUE_MAX) {
+				--w.depth;
+				++w.drops;
+				return;
+			}
+			RxWorkerPacket *const p = w.getPacket();
+			p->localAddr = *(reinterpret_cast<const InetAddress *>(localAddr));
+			p->from = *(reinterpret_cast<const InetAddress *>(from));
+			p->data.assign(reinterpret_cast<const char *>(data),len);
+			w.queue.post(p);
+			return;
+		}
+
+		processWirePacket(localAddr,from,data,len);
+	}
+
+	// Called from phyOnDatagram() or a receive worker thread
+	inline void processWirePacket(const struct sockaddr *localAddr,const struct sockaddr *from,const void *data,unsigned long len)
+	{
 		const ZT_ResultCode rc = _node->processWirePacket(
 			OSUtils::now(),
 			reinterpret_cast<const struct sockaddr_storage *>(localAddr),
@@ -1709,12 +2419,46 @@ public:
 		}
 	}
 
+	// Hash a TCP fallback flow: relay address and port plus the ZeroTier destination in the packet header
+	static inline unsigned int _tcpFallbackFlowHash(const struct sockaddr_in *addr,const void *data,unsigned int len)
+	{
+		uint32_t h = (uint32_t)addr->sin_addr.s_addr ^ ((uint32_t)addr->sin_port << 16);
+		for(unsigned int i=8;((i<13)&&(i<len));++i) // destination address, same spot in packets and fragments
+			h = (h * 31) + (uint32_t)reinterpret_cast<const uint8_t *>(data)[i];
+		h ^= h >> 16;
+		h *= 0x45d9f3b;
+		h ^= h >> 16;
+		return (unsigned int)h;
+	}
+
+	// Smoothed round trip time of a TCP connection in milliseconds, or -1 if unknown
+	inline double _tcpRtt(PhySocket *sock) const
+	{
+#if defined(__LINUX__) && defined(TCP_INFO)
+		struct tcp_info ti;
+		socklen_t tl = sizeof(ti);
+		memset(&ti,0,sizeof(ti));
+		if (getsockopt(Phy<OneServiceImpl *>::getDescriptor(sock),IPPROTO_TCP,TCP_INFO,(void *)&ti,&tl) == 0)
+			return ((double)ti.tcpi_rtt / 1000.0);
+#endif
+		return -1.0;
+	}
+
 	inline void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
 	{
 		if (!success)
 			return;
 
-		// Outgoing TCP connections are always TCP fallback tunnel connections.
+		// Outgoing TCP connections are always TCP fallback tunnel connections, and
+		// uptr starts out as the stream number plus one.
+
+		const unsigned int stream = (unsigned int)((uintptr_t)*uptr);
+		*uptr = (void *)0;
+		Mutex::Lock _l(_tcpFallback_m);
+		if ((stream < 1)||(stream > ZT_TCP_FALLBACK_MAX_STREAMS)||(_tcpFallbackTunnels[stream - 1])) {
+			_phy.close(sock,false);
+			return;
+		}
 
 		TcpConnection *tc = new TcpConnection();
 		_tcpConnections.insert(tc);
@@ -1728,21 +2472,25 @@ public:
 		tc->lastActivity = OSUtils::now();
 		// HTTP stuff is not used
 		tc->writeBuf = "";
+		tc->tunnelStream = stream - 1;
+		tc->id = ++_httpConnectionCounter;
+		tc->httpBusy = false;
+		tc->tunnelQueue.buf.resize(_tcpFallbackQueueBytes);
 		*uptr = (void *)tc;
 
 		// Send "hello" message
-		tc->writeBuf.push_back((char)0x17);
-		tc->writeBuf.push_back((char)0x03);
-		tc->writeBuf.push_back((char)0x03); // fake TLS 1.2 header
-		tc->writeBuf.push_back((char)0x00);
-		tc->writeBuf.push_back((char)0x04); // mlen == 4
-		tc->writeBuf.push_back((char)ZEROTIER_ONE_VERSION_MAJOR);
-		tc->writeBuf.push_back((char)ZEROTIER_ONE_VERSION_MINOR);
-		tc->writeBuf.push_back((char)((ZEROTIER_ONE_VERSION_REVISION >> 8) & 0xff));
-		tc->writeBuf.push_back((char)(ZEROTIER_ONE_VERSION_REVISION & 0xff));
+		const char hello[9] = {
+			(char)0x17,(char)0x03,(char)0x03, // fake TLS 1.2 header
+			(char)0x00,(char)0x04, // mlen == 4
+			(char)ZEROTIER_ONE_VERSION_MAJOR,
+			(char)ZEROTIER_ONE_VERSION_MINOR,
+			(char)((ZEROTIER_ONE_VERSION_REVISION >> 8) & 0xff),
+			(char)(ZEROTIER_ONE_VERSION_REVISION & 0xff)
+		};
+		tc->tunnelQueue.push(hello,sizeof(hello),(const void *)0,0);
 		_phy.setNotifyWritable(sock,true);
 
-		_tcpFallbackTunnel = tc;
+		_tcpFallbackTunnels[stream - 1] = tc;
 	}
 
 	inline void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from)
@@ -1769,6 +2517,8 @@ public:
 			tc->headers.clear();
 			tc->body = "";
 			tc->writeBuf = "";
+			tc->id = ++_httpConnectionCounter;
+			tc->httpBusy = false;
 			*uptrN = (void *)tc;
 		}
 	}
@@ -1777,10 +2527,16 @@ public:
 	{
 		TcpConnection *tc = (TcpConnection *)*uptr;
 		if (tc) {
-			if (tc == _tcpFallbackTunnel)
-				_tcpFallbackTunnel = (TcpConnection *)0;
+			if (tc->type == TcpConnection::TCP_TUNNEL_OUTGOING) {
+				Mutex::Lock _l(_tcpFallback_m);
+				if (_tcpFallbackTunnels[tc->tunnelStream] == tc)
+					_tcpFallbackTunnels[tc->tunnelStream] = (TcpConnection *)0;
+			}
+			for(std::list<HttpWorkerRequest *>::iterator r(tc->httpPending.begin());r!=tc->httpPending.end();++r)
+				delete *r; // a request out with a worker is dropped when it comes back
 			_tcpConnections.erase(tc);
 			delete tc;
+			*uptr = (void *)0;
 		}
 	}
 
@@ -1877,6 +2633,33 @@ public:
 	inline void phyOnTcpWritable(PhySocket *sock,void **uptr)
 	{
 		TcpConnection *tc = reinterpret_cast<TcpConnection *>(*uptr);
+		if (tc->type == TcpConnection::TCP_TUNNEL_OUTGOING) {
+			bool closed = false;
+			{
+				Mutex::Lock _l(_tcpFallback_m);
+				const char *p = (const char *)0;
+				unsigned long n;
+				while ((n = tc->tunnelQueue.peek(p)) > 0) {
+					const long sent = (long)_phy.streamSend(sock,p,n,false); // close handler would need _tcpFallback_m
+					if (sent < 0) {
+						closed = true;
+						break;
+					}
+					if (sent == 0)
+						break;
+					tc->lastActivity = OSUtils::now();
+					tc->tunnelQueue.consume((unsigned long)sent);
+					if ((unsigned long)sent < n)
+						break;
+				}
+				if ((!closed)&&(!tc->tunnelQueue.size))
+					_phy.setNotifyWritable(sock,false);
+			}
+			if (closed)
+				phyOnTcpClose(sock,uptr);
+			return;
+		}
+
 		Mutex::Lock _l(tc->writeBuf_m);
 		if (tc->writeBuf.length() > 0) {
 			long sent = (long)_phy.streamSend(sock,tc->writeBuf.data(),(unsigned long)tc->writeBuf.length(),true);
@@ -1897,6 +2680,9 @@ public:
 	}
 
 	inline void phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable) {}
+
+	// Called from the netlink monitor thread; the main loop picks up what changed
+	inline void netLinkChanged() { _phy.whack(); }
 	inline void phyOnUnixAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN) {}
 	inline void phyOnUnixClose(PhySocket *sock,void **uptr) {}
 	inline void phyOnUnixData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
@@ -1924,6 +2710,9 @@ public:
 							StapFrameHandler,
 							(void *)this);
 						*nuptr = (void *)&n;
+#ifdef __LINUX__
+						_netLinkMonitor.addOwnInterface(n.tap->deviceName().c_str());
+#endif
 
 						char nlcpath[256];
 						Utils::snprintf(nlcpath,sizeof(nlcpath),"%s" ZT_PATH_SEPARATOR_S "networks.d" ZT_PATH_SEPARATOR_S "%.16llx.local.conf",_homePath.c_str(),nwid);
@@ -1988,6 +2777,9 @@ public:
                     for (int i = 0; !n.tap->isInitialized() && i < MAX_SLEEP_COUNT; i++) {
                         Sleep(10);
                     }
+#endif
+#ifndef ZT_SERVICE_NETCON
+					n.tap->setMtu(nwc->mtu); // controller may have changed it
 #endif
 					syncManagedStuff(n,true,true);
 				} else {
@@ -2054,6 +2846,19 @@ public:
 
 	inline long nodeDataStoreGetFunction(const char *name,void *buf,unsigned long bufSize,unsigned long readIndex,unsigned long *totalSize)
 	{
+		uint64_t idAddress = 0;
+		if (_isIdentityStoreName(name,idAddress)) {
+			std::string id;
+			if (!_identities.get(idAddress,id))
+				return -1;
+			*totalSize = (unsigned long)id.length();
+			if (readIndex >= (unsigned long)id.length())
+				return 0;
+			const unsigned long n = std::min(bufSize,(unsigned long)id.length() - readIndex);
+			memcpy(buf,id.data() + readIndex,n);
+			return (long)n;
+		}
+
 		std::string p(_dataStorePrepPath(name));
 		if (!p.length())
 			return -2;
@@ -2082,6 +2887,15 @@ public:
 
 	inline int nodeDataStorePutFunction(const char *name,const void *data,unsigned long len,int secure)
 	{
+		uint64_t idAddress = 0;
+		if (_isIdentityStoreName(name,idAddress)) {
+			if (!data) {
+				_identities.erase(idAddress,OSUtils::now());
+				return 0;
+			}
+			return ((len <= 0xffff)&&(_identities.put(idAddress,data,(unsigned int)len,OSUtils::now()))) ? 0 : -1;
+		}
+
 		std::string p(_dataStorePrepPath(name));
 		if (!p.length())
 			return -2;
@@ -2106,7 +2920,7 @@ public:
 		}
 	}
 
-	inline int nodeWirePacketSendFunction(const struct sockaddr_storage *localAddr,const struct sockaddr_storage *addr,const void *data,unsigned int len,unsigned int ttl)
+	inline int nodeWirePacketSendFunction(const struct sockaddr_storage *localAddr,const struct sockaddr_storage *addr,const void *data,unsigned int len,unsigned int ttl,bool dontFragment)
 	{
 		unsigned int fromBindingNo = 0;
 
@@ -2126,32 +2940,66 @@ public:
 			}
 
 #ifdef ZT_TCP_FALLBACK_RELAY
-			// TCP fallback tunnel support, currently IPv4 only
-			if ((len >= 16)&&(reinterpret_cast<const InetAddress *>(addr)->ipScope() == InetAddress::IP_SCOPE_GLOBAL)) {
+			// TCP fallback tunnel support, currently IPv4 only (not for DF probes, which must test the UDP path)
+			if ((!dontFragment)&&(len >= 16)&&(reinterpret_cast<const InetAddress *>(addr)->ipScope() == InetAddress::IP_SCOPE_GLOBAL)) {
 				// Engage TCP tunnel fallback if we haven't received anything valid from a global
 				// IP address in ZT_TCP_FALLBACK_AFTER milliseconds. If we do start getting
 				// valid direct traffic we'll stop using it and close the socket after a while.
 				const uint64_t now = OSUtils::now();
 				if (((now - _lastDirectReceiveFromGlobal) > ZT_TCP_FALLBACK_AFTER)&&((now - _lastRestart) > ZT_TCP_FALLBACK_AFTER)) {
-					if (_tcpFallbackTunnel) {
-						Mutex::Lock _l(_tcpFallbackTunnel->writeBuf_m);
-						if (!_tcpFallbackTunnel->writeBuf.length())
-							_phy.setNotifyWritable(_tcpFallbackTunnel->sock,true);
-						unsigned long mlen = len + 7;
-						_tcpFallbackTunnel->writeBuf.push_back((char)0x17);
-						_tcpFallbackTunnel->writeBuf.push_back((char)0x03);
-						_tcpFallbackTunnel->writeBuf.push_back((char)0x03); // fake TLS 1.2 header
-						_tcpFallbackTunnel->writeBuf.push_back((char)((mlen >> 8) & 0xff));
-						_tcpFallbackTunnel->writeBuf.push_back((char)(mlen & 0xff));
-						_tcpFallbackTunnel->writeBuf.push_back((char)4); // IPv4
-						_tcpFallbackTunnel->writeBuf.append(reinterpret_cast<const char *>(reinterpret_cast<const void *>(&(reinterpret_cast<const struct sockaddr_in *>(addr)->sin_addr.s_addr))),4);
-						_tcpFallbackTunnel->writeBuf.append(reinterpret_cast<const char *>(reinterpret_cast<const void *>(&(reinterpret_cast<const struct sockaddr_in *>(addr)->sin_port))),2);
-						_tcpFallbackTunnel->writeBuf.append((const char *)data,len);
-					} else if (((now - _lastSendToGlobalV4) < ZT_TCP_FALLBACK_AFTER)&&((now - _lastSendToGlobalV4) > (ZT_PING_CHECK_INVERVAL / 2))) {
-						bool connected = false;
-						const InetAddress addr(ZT_TCP_FALLBACK_RELAY);
-						_phy.tcpConnect(reinterpret_cast<const struct sockaddr *>(&addr),connected);
+					// This runs on RX worker and tap threads too, so socket changes are left to tcpFallbackFlush() on the I/O thread
+					bool wake = false;
+					{
+						Mutex::Lock _l(_tcpFallback_m);
+
+						// Spread flows (relay address plus ZeroTier destination) across streams so
+						// one stalled TCP connection only blocks the flows hashed onto it.
+						const unsigned int streams = _tcpFallbackStreams;
+						const unsigned int h = _tcpFallbackFlowHash(reinterpret_cast<const struct sockaddr_in *>(addr),data,len);
+						TcpConnection *tc = (TcpConnection *)0;
+						unsigned int stream = 0;
+						for(unsigned int i=0;i<streams;++i) {
+							stream = (h + i) % streams;
+							if ((tc = _tcpFallbackTunnels[stream]))
+								break;
+						}
+
+						const uint32_t pendingConnect = _tcpFallbackPendingConnect;
+						if (tc) {
+							char hdr[12];
+							const unsigned long mlen = len + 7;
+							hdr[0] = (char)0x17;
+							hdr[1] = (char)0x03;
+							hdr[2] = (char)0x03; // fake TLS 1.2 header
+							hdr[3] = (char)((mlen >> 8) & 0xff);
+							hdr[4] = (char)(mlen & 0xff);
+							hdr[5] = (char)4; // IPv4
+							memcpy(hdr + 6,&(reinterpret_cast<const struct sockaddr_in *>(addr)->sin_addr.s_addr),4);
+							memcpy(hdr + 10,&(reinterpret_cast<const struct sockaddr_in *>(addr)->sin_port),2);
+							const bool wasEmpty = (tc->tunnelQueue.size == 0);
+							if ((tc->tunnelQueue.push(hdr,sizeof(hdr),data,len))&&(wasEmpty)&&((_tcpFallbackPendingWrite & (1UL << stream)) == 0)) {
+								_tcpFallbackPendingWrite |= (uint32_t)(1UL << stream);
+								wake = true;
+							}
+
+							// Bring back any streams that closed or failed
+							for(unsigned int i=0;i<streams;++i) {
+								if ((!_tcpFallbackTunnels[i])&&((now - _tcpFallbackLastConnect[i]) > ZT_TCP_FALLBACK_STREAM_RETRY)) {
+									_tcpFallbackLastConnect[i] = now;
+									_tcpFallbackPendingConnect |= (uint32_t)(1UL << i);
+								}
+							}
+						} else if (((now - _lastSendToGlobalV4) < ZT_TCP_FALLBACK_AFTER)&&((now - _lastSendToGlobalV4) > (ZT_PING_CHECK_INVERVAL / 2))) {
+							for(unsigned int i=0;i<streams;++i) {
+								_tcpFallbackLastConnect[i] = now;
+								_tcpFallbackPendingConnect |= (uint32_t)(1UL << i);
+							}
+						}
+						if (_tcpFallbackPendingConnect != pendingConnect)
+							wake = true;
 					}
+					if (wake)
+						_phy.whack();
 				}
 				_lastSendToGlobalV4 = now;
 			}
@@ -2173,7 +3021,38 @@ public:
 			return 0; // silently break UDP
 #endif
 
-		return (_bindings[fromBindingNo].udpSend(_phy,*(reinterpret_cast<const InetAddress *>(localAddr)),*(reinterpret_cast<const InetAddress *>(addr)),data,len,ttl)) ? 0 : -1;
+		return (_bindings[fromBindingNo].udpSend(_phy,*(reinterpret_cast<const InetAddress *>(localAddr)),*(reinterpret_cast<const InetAddress *>(addr)),data,len,ttl,dontFragment)) ? 0 : -1;
+	}
+
+	// Apply TCP fallback socket work queued by nodeWirePacketSendFunction() (I/O thread only)
+	inline void tcpFallbackFlush()
+	{
+		PhySocket *writable[ZT_TCP_FALLBACK_MAX_STREAMS];
+		unsigned int writableCount = 0;
+		uint32_t connect;
+		{
+			Mutex::Lock _l(_tcpFallback_m);
+			for(unsigned int i=0;i<ZT_TCP_FALLBACK_MAX_STREAMS;++i) {
+				if (((_tcpFallbackPendingWrite & (1UL << i)) != 0)&&(_tcpFallbackTunnels[i]))
+					writable[writableCount++] = _tcpFallbackTunnels[i]->sock;
+			}
+			_tcpFallbackPendingWrite = 0;
+			connect = _tcpFallbackPendingConnect;
+			_tcpFallbackPendingConnect = 0;
+		}
+
+		// Outside the lock since a connect can complete (and call its handler) immediately
+		for(unsigned int i=0;i<writableCount;++i)
+			_phy.setNotifyWritable(writable[i],true);
+		if (connect) {
+			const InetAddress relay(ZT_TCP_FALLBACK_RELAY);
+			for(unsigned int i=0;i<ZT_TCP_FALLBACK_MAX_STREAMS;++i) {
+				if ((connect & (1UL << i)) != 0) {
+					bool connected = false;
+					_phy.tcpConnect(reinterpret_cast<const struct sockaddr *>(&relay),connected,(void *)((uintptr_t)i + 1));
+				}
+			}
+		}
 	}
 
 	inline void nodeVirtualNetworkFrameFunction(uint64_t nwid,void **nuptr,uint64_t sourceMac,uint64_t destMac,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
@@ -2254,25 +3133,56 @@ public:
 
 	inline void tapFrameHandler(uint64_t nwid,const MAC &from,const MAC &to,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
 	{
+		const uint64_t dl = _nextBackgroundTaskDeadline;
 		_node->processVirtualNetworkFrame(OSUtils::now(),nwid,from.toInt(),to.toInt(),etherType,vlanId,data,len,&_nextBackgroundTaskDeadline);
+		if (_nextBackgroundTaskDeadline < dl) // paced sends are waiting, wake the main loop to drain them on time
+			_phy.whack();
 	}
 
 	inline void onHttpRequestToServer(TcpConnection *tc)
 	{
-		char tmpn[256];
-		std::string data;
-		std::string contentType("text/plain"); // default if not changed in handleRequest()
-		unsigned int scode = 404;
+		HttpWorkerRequest *const r = new HttpWorkerRequest();
+		r->tc = tc;
+		r->connId = tc->id;
+		r->from = tc->from;
+		r->method = tc->parser.method;
+		r->keepAlive = tc->shouldKeepAlive;
+		r->received = tc->lastActivity;
+		r->url.swap(tc->url);
+		r->headers.swap(tc->headers);
+		r->body.swap(tc->body);
+		r->scode = 404;
+
+		if (tc->httpBusy)
+			tc->httpPending.push_back(r); // pipelined behind one still out with a worker
+		else dispatchHttpRequest(r);
+	}
 
+	// I/O thread: hand a request to a worker, or handle it here if there are none
+	inline void dispatchHttpRequest(HttpWorkerRequest *r)
+	{
+		if (_httpWorkerCount) {
+			r->tc->httpBusy = true;
+			_phy.setNotifyReadable(r->tc->sock,false); // read more once this is answered
+			_httpQueue.post(r);
+		} else {
+			processHttpRequest(*r);
+			answerHttpRequest(r);
+		}
+	}
+
+	// Any thread: run a control plane request and record its latency
+	inline void processHttpRequest(HttpWorkerRequest &r)
+	{
 		bool allow;
 		{
 			Mutex::Lock _l(_localConfig_m);
 			if (_allowManagementFrom.size() == 0) {
-				allow = (tc->from.ipScope() == InetAddress::IP_SCOPE_LOOPBACK);
+				allow = (r.from.ipScope() == InetAddress::IP_SCOPE_LOOPBACK);
 			} else {
 				allow = false;
 				for(std::vector<InetAddress>::const_iterator i(_allowManagementFrom.begin());i!=_allowManagementFrom.end();++i) {
-					if (i->containsAddress(tc->from)) {
+					if (i->containsAddress(r.from)) {
 						allow = true;
 						break;
 					}
@@ -2280,22 +3190,50 @@ public:
 			}
 		}
 
+		r.responseContentType = "text/plain"; // default if not changed in handleRequest()
 		if (allow) {
 			try {
-				scode = handleControlPlaneHttpRequest(tc->from,tc->parser.method,tc->url,tc->headers,tc->body,data,contentType);
+				r.scode = handleControlPlaneHttpRequest(r.from,r.method,r.url,r.headers,r.body,r.responseBody,r.responseContentType);
 			} catch (std::exception &exc) {
 				fprintf(stderr,"WARNING: unexpected exception processing control HTTP request: %s" ZT_EOL_S,exc.what());
-				scode = 500;
+				r.scode = 500;
 			} catch ( ... ) {
 				fprintf(stderr,"WARNING: unexpected exception processing control HTTP request: unknown exceptino" ZT_EOL_S);
-				scode = 500;
+				r.scode = 500;
 			}
 		} else {
-			scode = 401;
+			r.scode = 401;
+		}
+
+		// Stats are kept per top level endpoint so the table can't grow without bound
+		std::string ep(r.url.substr(0,r.url.find('?')));
+		ep = ep.substr(0,ep.find('/',1));
+		if (ep.length() > 5) {
+			if (ep.substr(ep.length() - 5) == ".json")
+				ep = ep.substr(0,ep.length() - 5);
+		}
+		if ((ep != "/status")&&(ep != "/config")&&(ep != "/network")&&(ep != "/peer")&&(ep != "/moon")&&(ep != "/controller"))
+			ep = "/other";
+		const uint64_t latency = OSUtils::now() - r.received;
+		Mutex::Lock _l(_httpStats_m);
+		HttpEndpointStats &st = _httpStats[ep];
+		++st.requests;
+		st.totalLatency += latency;
+		if (latency > st.maxLatency)
+			st.maxLatency = latency;
+	}
+
+	// I/O thread: write the response if the connection is still there, then start on the next request
+	inline void answerHttpRequest(HttpWorkerRequest *r)
+	{
+		TcpConnection *const tc = r->tc;
+		if ((!_tcpConnections.count(tc))||(tc->id != r->connId)) {
+			delete r; // connection closed while the request was being handled
+			return;
 		}
 
 		const char *scodestr;
-		switch(scode) {
+		switch(r->scode) {
 			case 200: scodestr = "OK"; break;
 			case 400: scodestr = "Bad Request"; break;
 			case 401: scodestr = "Unauthorized"; break;
@@ -2307,22 +3245,49 @@ public:
 			default: scodestr = "Error"; break;
 		}
 
-		Utils::snprintf(tmpn,sizeof(tmpn),"HTTP/1.1 %.3u %s\r\nCache-Control: no-cache\r\nPragma: no-cache\r\n",scode,scodestr);
+		char tmpn[256];
+		Utils::snprintf(tmpn,sizeof(tmpn),"HTTP/1.1 %.3u %s\r\nCache-Control: no-cache\r\nPragma: no-cache\r\n",r->scode,scodestr);
 		{
 			Mutex::Lock _l(tc->writeBuf_m);
-			tc->writeBuf.assign(tmpn);
+			tc->writeBuf.append(tmpn); // append, since an earlier pipelined response may still be going out
 			tc->writeBuf.append("Content-Type: ");
-			tc->writeBuf.append(contentType);
-			Utils::snprintf(tmpn,sizeof(tmpn),"\r\nContent-Length: %lu\r\n",(unsigned long)data.length());
+			tc->writeBuf.append(r->responseContentType);
+			Utils::snprintf(tmpn,sizeof(tmpn),"\r\nContent-Length: %lu\r\n",(unsigned long)r->responseBody.length());
 			tc->writeBuf.append(tmpn);
-			if (!tc->shouldKeepAlive)
-				tc->writeBuf.append("Connection: close\r\n");
+			tc->writeBuf.append((r->keepAlive) ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
 			tc->writeBuf.append("\r\n");
-			if (tc->parser.method != HTTP_HEAD)
-				tc->writeBuf.append(data);
+			if (r->method != HTTP_HEAD)
+				tc->writeBuf.append(r->responseBody);
 		}
-
+		tc->shouldKeepAlive = r->keepAlive;
+		tc->lastActivity = OSUtils::now();
+		tc->httpBusy = false;
 		_phy.setNotifyWritable(tc->sock,true);
+		delete r;
+
+		if (!tc->shouldKeepAlive) {
+			for(std::list<HttpWorkerRequest *>::iterator p(tc->httpPending.begin());p!=tc->httpPending.end();++p)
+				delete *p;
+			tc->httpPending.clear();
+		} else if (!tc->httpPending.empty()) {
+			HttpWorkerRequest *const next = tc->httpPending.front();
+			tc->httpPending.pop_front();
+			dispatchHttpRequest(next);
+		} else if (_httpWorkerCount) {
+			_phy.setNotifyReadable(tc->sock,true);
+		}
+	}
+
+	// I/O thread: answer requests that workers have finished
+	inline void deliverHttpResponses()
+	{
+		std::vector<HttpWorkerRequest *> done;
+		{
+			Mutex::Lock _l(_httpDone_m);
+			done.swap(_httpDone);
+		}
+		for(std::vector<HttpWorkerRequest *>::iterator r(done.begin());r!=done.end();++r)
+			answerHttpRequest(*r);
 	}
 
 	inline void onHttpResponseFromClient(TcpConnection *tc)
@@ -2372,6 +3337,22 @@ public:
 		return true;
 	}
 
+	// True for iddb.d/<address>, which is kept in _identities instead of a file
+	static inline bool _isIdentityStoreName(const char *name,uint64_t &address)
+	{
+		if (strncmp(name,"iddb.d/",7) != 0)
+			return false;
+		name += 7;
+		if (strlen(name) != ZT_ADDRESS_LENGTH_HEX)
+			return false;
+		for(const char *n=name;(*n);++n) {
+			if (!(((*n >= '0')&&(*n <= '9'))||((*n >= 'a')&&(*n <= 'f'))||((*n >= 'A')&&(*n <= 'F'))))
+				return false;
+		}
+		address = Utils::hexStrToU64(name);
+		return true;
+	}
+
 	std::string _dataStorePrepPath(const char *name) const
 	{
 		std::string p(_homePath);
@@ -2434,7 +3415,9 @@ static long SnodeDataStoreGetFunction(ZT_Node *node,void *uptr,const char *name,
 static int SnodeDataStorePutFunction(ZT_Node *node,void *uptr,const char *name,const void *data,unsigned long len,int secure)
 { return reinterpret_cast<OneServiceImpl *>(uptr)->nodeDataStorePutFunction(name,data,len,secure); }
 static int SnodeWirePacketSendFunction(ZT_Node *node,void *uptr,const struct sockaddr_storage *localAddr,const struct sockaddr_storage *addr,const void *data,unsigned int len,unsigned int ttl)
-{ return reinterpret_cast<OneServiceImpl *>(uptr)->nodeWirePacketSendFunction(localAddr,addr,data,len,ttl); }
+{ return reinterpret_cast<OneServiceImpl *>(uptr)->nodeWirePacketSendFunction(localAddr,addr,data,len,ttl,false); }
+static int SnodeWirePacketSendDontFragmentFunction(ZT_Node *node,void *uptr,const struct sockaddr_storage *localAddr,const struct sockaddr_storage *addr,const void *data,unsigned int len,unsigned int ttl)
+{ return reinterpret_cast<OneServiceImpl *>(uptr)->nodeWirePacketSendFunction(localAddr,addr,data,len,ttl,true); }
 static void SnodeVirtualNetworkFrameFunction(ZT_Node *node,void *uptr,uint64_t nwid,void **nuptr,uint64_t sourceMac,uint64_t destMac,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
 { reinterpret_cast<OneServiceImpl *>(uptr)->nodeVirtualNetworkFrameFunction(nwid,nuptr,sourceMac,destMac,etherType,vlanId,data,len); }
 static int SnodePathCheckFunction(ZT_Node *node,void *uptr,uint64_t ztaddr,const struct sockaddr_storage *localAddr,const struct sockaddr_storage *remoteAddr)
@@ -2460,6 +3443,50 @@ static int SclusterGeoIpFunction(void *uptr,const struct sockaddr_storage *addr,
 static void StapFrameHandler(void *uptr,uint64_t nwid,const MAC &from,const MAC &to,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
 { reinterpret_cast<OneServiceImpl *>(uptr)->tapFrameHandler(nwid,from,to,etherType,vlanId,data,len); }
 
+void HttpWorker::threadMain()
+	throw()
+{
+	for(;;) {
+		HttpWorkerRequest *const r = parent->_httpQueue.get();
+		if (!r)
+			break;
+		parent->processHttpRequest(*r);
+		{
+			Mutex::Lock _l(parent->_httpDone_m);
+			parent->_httpDone.push_back(r);
+		}
+		parent->_phy.whack();
+	}
+}
+
+void StateSaver::threadMain()
+	throw()
+{
+	while (queue.get()) {
+		try {
+			parent->_node->saveState();
+		} catch ( ... ) {}
+	}
+}
+
+void RxWorker::threadMain()
+	throw()
+{
+	for(;;) {
+		RxWorkerPacket *const p = queue.get();
+		if (!p)
+			break;
+		--depth;
+		++packets;
+		bytes += p->data.length();
+		const uint64_t dl = parent->_nextBackgroundTaskDeadline;
+		parent->processWirePacket(reinterpret_cast<const struct sockaddr *>(&(p->localAddr)),reinterpret_cast<const struct sockaddr *>(&(p->from)),p->data.data(),(unsigned long)p->data.length());
+		if (parent->_nextBackgroundTaskDeadline < dl) // e.g. paced sends are waiting
+			parent->_phy.whack();
+		putPacket(p);
+	}
+}
+
 static int ShttpOnMessageBegin(http_parser *parser)
 {
 	TcpConnection *tc = reinterpret_cast<TcpConnection *>(parser->data);
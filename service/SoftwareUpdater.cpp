@@ -56,20 +56,29 @@ SoftwareUpdater::SoftwareUpdater(Node &node,const std::string &homePath) :
 	_channel(ZT_SOFTWARE_UPDATE_DEFAULT_CHANNEL),
 	_distLog((FILE *)0),
 	_latestValid(false),
-	_downloadLength(0)
+	_downloadFile((FILE *)0),
+	_downloadChunksFile((FILE *)0),
+	_downloadLength(0),
+	_downloadChunkCount(0),
+	_downloadChunksHave(0),
+	_downloadNext(0)
 {
+	// A partial download is kept and resumed if the service offers the same update again
 	OSUtils::rm((_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_BIN_FILENAME).c_str());
 }
 
 SoftwareUpdater::~SoftwareUpdater()
 {
+	_stopDownload(false);
+	_clearDist();
 	if (_distLog)
 		fclose(_distLog);
 }
 
 void SoftwareUpdater::setUpdateDistribution(bool distribute)
 {
-	_dist.clear();
+	Mutex::Lock _l(_lock);
+	_clearDist();
 	if (distribute) {
 		_distLog = fopen((_homePath + ZT_PATH_SEPARATOR_S "update-dist.log").c_str(),"a");
 
@@ -88,18 +97,24 @@ void SoftwareUpdater::setUpdateDistribution(bool distribute)
 						// If update meta is called e.g. foo.exe.json, then foo.exe is the update itself
 						const std::string binPath(udd + ZT_PATH_SEPARATOR_S + u->substr(0,u->length() - 5));
 						const std::string metaHash(OSUtils::jsonBinFromHex(d.meta[ZT_SOFTWARE_UPDATE_JSON_UPDATE_HASH]));
-						if ((metaHash.length() == ZT_SHA512_DIGEST_LEN)&&(OSUtils::readFile(binPath.c_str(),d.bin))) {
+						d.size = 0;
+						d.bin = (metaHash.length() == ZT_SHA512_DIGEST_LEN) ? reinterpret_cast<const uint8_t *>(OSUtils::mapFile(binPath.c_str(),d.size)) : (const uint8_t *)0;
+						if ((d.bin)&&(d.size <= ZT_SOFTWARE_UPDATE_MAX_SIZE)) {
+							// Served straight from the mapping, so pages are shared with the page cache instead of held on the heap
 							uint8_t sha512[ZT_SHA512_DIGEST_LEN];
-							SHA512::hash(sha512,d.bin.data(),(unsigned int)d.bin.length());
-							if (!memcmp(sha512,metaHash.data(),ZT_SHA512_DIGEST_LEN)) { // double check that hash in JSON is correct
-								d.meta[ZT_SOFTWARE_UPDATE_JSON_UPDATE_SIZE] = d.bin.length(); // override with correct value -- setting this in meta json is optional
-								_dist[Array<uint8_t,16>(sha512)] = d;
+							SHA512::hash(sha512,d.bin,(unsigned int)d.size);
+							const Array<uint8_t,16> key(sha512);
+							if ((!memcmp(sha512,metaHash.data(),ZT_SHA512_DIGEST_LEN))&&(_dist.find(key) == _dist.end())) { // double check that hash in JSON is correct
+								d.meta[ZT_SOFTWARE_UPDATE_JSON_UPDATE_SIZE] = d.size; // override with correct value -- setting this in meta json is optional
+								_dist[key] = d;
 								if (_distLog) {
-									fprintf(_distLog,".......... INIT: DISTRIBUTING %s (%u bytes)" ZT_EOL_S,binPath.c_str(),(unsigned int)d.bin.length());
+									fprintf(_distLog,".......... INIT: DISTRIBUTING %s (%u bytes)" ZT_EOL_S,binPath.c_str(),(unsigned int)d.size);
 									fflush(_distLog);
 								}
+								d.bin = (const uint8_t *)0;
 							}
 						}
+						OSUtils::unmapFile(const_cast<uint8_t *>(d.bin),d.size);
 					} catch ( ... ) {} // ignore bad meta JSON, etc.
 				}
 
@@ -116,6 +131,7 @@ void SoftwareUpdater::setUpdateDistribution(bool distribute)
 void SoftwareUpdater::handleSoftwareUpdateUserMessage(uint64_t origin,const void *data,unsigned int len)
 {
 	if (!len) return;
+	Mutex::Lock _l(_lock);
 	const MessageVerb v = (MessageVerb)reinterpret_cast<const uint8_t *>(data)[0];
 	try {
 		switch(v) {
@@ -191,23 +207,14 @@ void SoftwareUpdater::handleSoftwareUpdateUserMessage(uint64_t origin,const void
 							const unsigned long len = (unsigned long)OSUtils::jsonInt(req[ZT_SOFTWARE_UPDATE_JSON_UPDATE_SIZE],0);
 							const std::string hash = OSUtils::jsonBinFromHex(req[ZT_SOFTWARE_UPDATE_JSON_UPDATE_HASH]);
 							if ((len <= ZT_SOFTWARE_UPDATE_MAX_SIZE)&&(hash.length() >= 16)) {
-								if (_latestMeta != req) {
+								if ((_latestMeta != req)||((!_latestValid)&&(!_downloadFile))) {
 									_latestMeta = req;
 									_latestValid = false;
 									OSUtils::rm((_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_BIN_FILENAME).c_str());
-									_download = std::string();
-									memcpy(_downloadHashPrefix.data,hash.data(),16);
-									_downloadLength = len;
+									_startDownload(hash,len);
 								}
 
-								if ((_downloadLength > 0)&&(_download.length() < _downloadLength)) {
-									Buffer<128> gd;
-									gd.append((uint8_t)VERB_GET_DATA);
-									gd.append(_downloadHashPrefix.data,16);
-									gd.append((uint32_t)_download.length());
-									_node.sendUserMessage(ZT_SOFTWARE_UPDATE_SERVICE,ZT_SOFTWARE_UPDATE_USER_MESSAGE_TYPE,gd.data(),gd.size());
-									//printf(">> GET_DATA @%u\n",(unsigned int)_download.length());
-								}
+								_requestChunks(OSUtils::now());
 							}
 						}
 					}
@@ -223,12 +230,12 @@ void SoftwareUpdater::handleSoftwareUpdateUserMessage(uint64_t origin,const void
 					idx |= (unsigned long)*(reinterpret_cast<const uint8_t *>(data) + 20);
 					//printf("<< GET_DATA @%u from %.10llx for %s\n",(unsigned int)idx,origin,Utils::hex(reinterpret_cast<const uint8_t *>(data) + 1,16).c_str());
 					std::map< Array<uint8_t,16>,_D >::iterator d(_dist.find(Array<uint8_t,16>(reinterpret_cast<const uint8_t *>(data) + 1)));
-					if ((d != _dist.end())&&(idx < (unsigned long)d->second.bin.length())) {
+					if ((d != _dist.end())&&(idx < d->second.size)) {
 						Buffer<ZT_SOFTWARE_UPDATE_CHUNK_SIZE + 128> buf;
 						buf.append((uint8_t)VERB_DATA);
 						buf.append(reinterpret_cast<const uint8_t *>(data) + 1,16);
 						buf.append((uint32_t)idx);
-						buf.append(d->second.bin.data() + idx,std::min((unsigned long)ZT_SOFTWARE_UPDATE_CHUNK_SIZE,(unsigned long)(d->second.bin.length() - idx)));
+						buf.append(d->second.bin + idx,std::min((unsigned long)ZT_SOFTWARE_UPDATE_CHUNK_SIZE,(unsigned long)(d->second.size - idx)));
 						_node.sendUserMessage(origin,ZT_SOFTWARE_UPDATE_USER_MESSAGE_TYPE,buf.data(),buf.size());
 						//printf(">> DATA @%u\n",(unsigned int)idx);
 					}
@@ -241,16 +248,24 @@ void SoftwareUpdater::handleSoftwareUpdateUserMessage(uint64_t origin,const void
 					idx |= (unsigned long)*(reinterpret_cast<const uint8_t *>(data) + 18) << 16;
 					idx |= (unsigned long)*(reinterpret_cast<const uint8_t *>(data) + 19) << 8;
 					idx |= (unsigned long)*(reinterpret_cast<const uint8_t *>(data) + 20);
-					//printf("<< DATA @%u / %u bytes (we now have %u bytes)\n",(unsigned int)idx,(unsigned int)(len - 21),(unsigned int)_download.length());
-					if (idx == (unsigned long)_download.length()) {
-						_download.append(reinterpret_cast<const char *>(data) + 21,len - 21);
-						if (_download.length() < _downloadLength) {
-							Buffer<128> gd;
-							gd.append((uint8_t)VERB_GET_DATA);
-							gd.append(_downloadHashPrefix.data,16);
-							gd.append((uint32_t)_download.length());
-							_node.sendUserMessage(ZT_SOFTWARE_UPDATE_SERVICE,ZT_SOFTWARE_UPDATE_USER_MESSAGE_TYPE,gd.data(),gd.size());
-							//printf(">> GET_DATA @%u\n",(unsigned int)_download.length());
+					//printf("<< DATA @%u / %u bytes (we now have %u chunks)\n",(unsigned int)idx,(unsigned int)(len - 21),(unsigned int)_downloadChunksHave);
+					const unsigned long ci = idx / ZT_SOFTWARE_UPDATE_CHUNK_SIZE;
+					if ((_downloadFile)&&((idx % ZT_SOFTWARE_UPDATE_CHUNK_SIZE) == 0)&&(ci < _downloadChunkCount)&&(!_chunkHave[ci])&&
+					    ((unsigned long)(len - 21) == std::min((unsigned long)ZT_SOFTWARE_UPDATE_CHUNK_SIZE,_downloadLength - idx))) {
+						const uint8_t *const chunk = reinterpret_cast<const uint8_t *>(data) + 21;
+
+						// Data first, then its hash, so a hash in the chunks file means the data was written
+						uint8_t sha512[ZT_SHA512_DIGEST_LEN];
+						SHA512::hash(sha512,chunk,len - 21);
+						if ( (fseek(_downloadFile,(long)idx,SEEK_SET) == 0)&&
+						     (fwrite(chunk,1,len - 21,_downloadFile) == (size_t)(len - 21))&&
+						     (fflush(_downloadFile) == 0)&&
+						     (fseek(_downloadChunksFile,(long)(72 + (ci * 16)),SEEK_SET) == 0)&&
+						     (fwrite(sha512,1,16,_downloadChunksFile) == 16)&&
+						     (fflush(_downloadChunksFile) == 0) ) {
+							_chunkHave[ci] = true;
+							++_downloadChunksHave;
+							_requestChunks(OSUtils::now());
 						}
 					}
 				}
@@ -273,6 +288,8 @@ void SoftwareUpdater::handleSoftwareUpdateUserMessage(uint64_t origin,const void
 
 bool SoftwareUpdater::check(const uint64_t now)
 {
+	Mutex::Lock _l(_lock);
+
 	if ((now - _lastCheckTime) >= ZT_SOFTWARE_UPDATE_CHECK_PERIOD) {
 		_lastCheckTime = now;
 		char tmp[512];
@@ -304,28 +321,32 @@ bool SoftwareUpdater::check(const uint64_t now)
 		return true;
 
 	if (_downloadLength > 0) {
-		if (_download.length() >= _downloadLength) {
+		if (_downloadChunksHave >= _downloadChunkCount) {
 			// This is the very important security validation part that makes sure
 			// this software update doesn't have cooties.
 
 			const std::string binPath(_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_BIN_FILENAME);
+			const std::string partPath(_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_PARTIAL_FILENAME);
+			_stopDownload(false);
 			try {
-				// (1) Check the hash itself to make sure the image is basically okay
-				uint8_t sha512[ZT_SHA512_DIGEST_LEN];
-				SHA512::hash(sha512,_download.data(),(unsigned int)_download.length());
-				if (Utils::hex(sha512,ZT_SHA512_DIGEST_LEN) == OSUtils::jsonString(_latestMeta[ZT_SOFTWARE_UPDATE_JSON_UPDATE_HASH],"")) {
-					// (2) Check signature by signing authority
-					const std::string sig(OSUtils::jsonBinFromHex(_latestMeta[ZT_SOFTWARE_UPDATE_JSON_UPDATE_SIGNATURE]));
-					if (Identity(ZT_SOFTWARE_UPDATE_SIGNING_AUTHORITY).verify(_download.data(),(unsigned int)_download.length(),sig.data(),(unsigned int)sig.length())) {
-						// (3) Try to save file, and if so we are good.
-						OSUtils::rm(binPath.c_str());
-						if (OSUtils::writeFile(binPath.c_str(),_download)) {
-							OSUtils::lockDownFile(binPath.c_str(),false);
-							_latestValid = true;
-							//printf("VALID UPDATE\n%s\n",OSUtils::jsonDump(_latestMeta).c_str());
-							_download = std::string();
-							_downloadLength = 0;
-							return true;
+				std::string download;
+				if ((OSUtils::readFile(partPath.c_str(),download))&&(download.length() == _downloadLength)) {
+					// (1) Check the hash itself to make sure the image is basically okay
+					uint8_t sha512[ZT_SHA512_DIGEST_LEN];
+					SHA512::hash(sha512,download.data(),(unsigned int)download.length());
+					if (Utils::hex(sha512,ZT_SHA512_DIGEST_LEN) == OSUtils::jsonString(_latestMeta[ZT_SOFTWARE_UPDATE_JSON_UPDATE_HASH],"")) {
+						// (2) Check signature by signing authority
+						const std::string sig(OSUtils::jsonBinFromHex(_latestMeta[ZT_SOFTWARE_UPDATE_JSON_UPDATE_SIGNATURE]));
+						if (Identity(ZT_SOFTWARE_UPDATE_SIGNING_AUTHORITY).verify(download.data(),(unsigned int)download.length(),sig.data(),(unsigned int)sig.length())) {
+							// (3) Try to move file into place, and if so we are good.
+							OSUtils::rm(binPath.c_str());
+							if (rename(partPath.c_str(),binPath.c_str()) == 0) {
+								OSUtils::lockDownFile(binPath.c_str(),false);
+								_latestValid = true;
+								//printf("VALID UPDATE\n%s\n",OSUtils::jsonDump(_latestMeta).c_str());
+								_stopDownload(true);
+								return true;
+							}
 						}
 					}
 				}
@@ -336,21 +357,150 @@ bool SoftwareUpdater::check(const uint64_t now)
 			OSUtils::rm(binPath.c_str());
 			_latestMeta = nlohmann::json();
 			_latestValid = false;
-			_download = std::string();
-			_downloadLength = 0;
+			_stopDownload(true);
 		} else {
-			Buffer<128> gd;
-			gd.append((uint8_t)VERB_GET_DATA);
-			gd.append(_downloadHashPrefix.data,16);
-			gd.append((uint32_t)_download.length());
-			_node.sendUserMessage(ZT_SOFTWARE_UPDATE_SERVICE,ZT_SOFTWARE_UPDATE_USER_MESSAGE_TYPE,gd.data(),gd.size());
-			//printf(">> GET_DATA @%u\n",(unsigned int)_download.length());
+			_requestChunks(now);
 		}
 	}
 
 	return false;
 }
 
+void SoftwareUpdater::_clearDist()
+{
+	for(std::map< Array<uint8_t,16>,_D >::iterator d(_dist.begin());d!=_dist.end();++d)
+		OSUtils::unmapFile(const_cast<uint8_t *>(d->second.bin),d->second.size);
+	_dist.clear();
+}
+
+void SoftwareUpdater::_startDownload(const std::string &hash,unsigned long len)
+{
+	if ((len == 0)||(hash.length() < 16)) {
+		_stopDownload(true);
+		return;
+	}
+	_stopDownload(false); // keep files, since this may be the same update as before a restart
+
+	const std::string partPath(_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_PARTIAL_FILENAME);
+	const std::string chunksPath(_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_CHUNKS_FILENAME);
+
+	_downloadHash = hash;
+	_downloadHash.resize(ZT_SHA512_DIGEST_LEN,(char)0);
+	memcpy(_downloadHashPrefix.data,hash.data(),16);
+	_downloadLength = len;
+	_downloadChunkCount = (len + ZT_SOFTWARE_UPDATE_CHUNK_SIZE - 1) / ZT_SOFTWARE_UPDATE_CHUNK_SIZE;
+	_downloadChunksHave = 0;
+	_downloadNext = 0;
+	_chunkHave.assign(_downloadChunkCount,false);
+	_chunkRequested.assign(_downloadChunkCount,0);
+
+	uint8_t hdr[72];
+	memcpy(hdr,_downloadHash.data(),64);
+	for(unsigned int i=0;i<8;++i)
+		hdr[64 + i] = (uint8_t)(((uint64_t)len) >> (56 - (i * 8)));
+
+	// Resume if the chunk table on disk is for this same update
+	std::string chunks;
+	if ((OSUtils::readFile(chunksPath.c_str(),chunks))&&(chunks.length() == (72 + (_downloadChunkCount * 16)))&&(!memcmp(chunks.data(),hdr,72))) {
+		_downloadFile = fopen(partPath.c_str(),"r+b");
+		_downloadChunksFile = fopen(chunksPath.c_str(),"r+b");
+		if ((_downloadFile)&&(_downloadChunksFile)) {
+			// Only trust chunks whose data on disk still matches the recorded hash
+			static const uint8_t zero16[16] = { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0 };
+			uint8_t *const buf = new uint8_t[ZT_SOFTWARE_UPDATE_CHUNK_SIZE];
+			for(unsigned long ci=0;ci<_downloadChunkCount;++ci) {
+				const uint8_t *const h = reinterpret_cast<const uint8_t *>(chunks.data()) + 72 + (ci * 16);
+				if (!memcmp(h,zero16,16))
+					continue;
+				const unsigned long cl = std::min((unsigned long)ZT_SOFTWARE_UPDATE_CHUNK_SIZE,len - (ci * ZT_SOFTWARE_UPDATE_CHUNK_SIZE));
+				uint8_t sha512[ZT_SHA512_DIGEST_LEN];
+				if ( (fseek(_downloadFile,(long)(ci * ZT_SOFTWARE_UPDATE_CHUNK_SIZE),SEEK_SET) == 0)&&
+				     (fread(buf,1,cl,_downloadFile) == cl) ) {
+					SHA512::hash(sha512,buf,(unsigned int)cl);
+					if (!memcmp(sha512,h,16)) {
+						_chunkHave[ci] = true;
+						++_downloadChunksHave;
+						continue;
+					}
+				}
+				if (fseek(_downloadChunksFile,(long)(72 + (ci * 16)),SEEK_SET) == 0)
+					fwrite(zero16,1,16,_downloadChunksFile);
+			}
+			delete [] buf;
+			fflush(_downloadChunksFile);
+			while ((_downloadNext < _downloadChunkCount)&&(_chunkHave[_downloadNext]))
+				++_downloadNext;
+			return;
+		}
+		_stopDownload(false);
+	}
+
+	// Otherwise start over with an empty partial file and chunk table
+	_downloadFile = fopen(partPath.c_str(),"w+b");
+	_downloadChunksFile = fopen(chunksPath.c_str(),"w+b");
+	bool ok = ((_downloadFile)&&(_downloadChunksFile)&&(fwrite(hdr,1,72,_downloadChunksFile) == 72));
+	if (ok) {
+		const uint8_t zero[1024] = { 0 };
+		unsigned long remaining = _downloadChunkCount * 16;
+		while ((ok)&&(remaining)) {
+			const unsigned long n = std::min(remaining,(unsigned long)sizeof(zero));
+			ok = (fwrite(zero,1,n,_downloadChunksFile) == n);
+			remaining -= n;
+		}
+		ok = ((ok)&&(fflush(_downloadChunksFile) == 0));
+	}
+	if (!ok)
+		_stopDownload(true);
+	else OSUtils::lockDownFile(partPath.c_str(),false);
+}
+
+void SoftwareUpdater::_stopDownload(bool remove)
+{
+	if (_downloadFile) {
+		fclose(_downloadFile);
+		_downloadFile = (FILE *)0;
+	}
+	if (_downloadChunksFile) {
+		fclose(_downloadChunksFile);
+		_downloadChunksFile = (FILE *)0;
+	}
+	if (remove) {
+		OSUtils::rm((_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_PARTIAL_FILENAME).c_str());
+		OSUtils::rm((_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_CHUNKS_FILENAME).c_str());
+		_downloadHash = std::string();
+		_downloadLength = 0;
+		_downloadChunkCount = 0;
+		_downloadChunksHave = 0;
+		_downloadNext = 0;
+		_chunkHave.clear();
+		_chunkRequested.clear();
+	}
+}
+
+void SoftwareUpdater::_requestChunks(const uint64_t now)
+{
+	// Keep up to ZT_SOFTWARE_UPDATE_DOWNLOAD_WINDOW of the lowest missing chunks requested
+	if (!_downloadFile)
+		return;
+	while ((_downloadNext < _downloadChunkCount)&&(_chunkHave[_downloadNext]))
+		++_downloadNext;
+	unsigned int inFlight = 0;
+	for(unsigned long ci=_downloadNext;((ci<_downloadChunkCount)&&(inFlight < ZT_SOFTWARE_UPDATE_DOWNLOAD_WINDOW));++ci) {
+		if (_chunkHave[ci])
+			continue;
+		++inFlight;
+		if ((_chunkRequested[ci])&&((now - _chunkRequested[ci]) < ZT_SOFTWARE_UPDATE_CHUNK_TIMEOUT))
+			continue;
+		_chunkRequested[ci] = now;
+		Buffer<128> gd;
+		gd.append((uint8_t)VERB_GET_DATA);
+		gd.append(_downloadHashPrefix.data,16);
+		gd.append((uint32_t)(ci * ZT_SOFTWARE_UPDATE_CHUNK_SIZE));
+		_node.sendUserMessage(ZT_SOFTWARE_UPDATE_SERVICE,ZT_SOFTWARE_UPDATE_USER_MESSAGE_TYPE,gd.data(),gd.size());
+		//printf(">> GET_DATA @%u\n",(unsigned int)(ci * ZT_SOFTWARE_UPDATE_CHUNK_SIZE));
+	}
+}
+
 void SoftwareUpdater::apply()
 {
 	std::string updatePath(_homePath + ZT_PATH_SEPARATOR_S ZT_SOFTWARE_UPDATE_BIN_FILENAME);
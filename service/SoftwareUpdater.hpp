@@ -31,6 +31,7 @@
 #include "../node/Identity.hpp"
 #include "../node/Array.hpp"
 #include "../node/Packet.hpp"
+#include "../node/Mutex.hpp"
 
 #include "../ext/json/json.hpp"
 
@@ -54,7 +55,17 @@
 /**
  * Chunk size for in-band downloads (can be changed, designed to always fit in one UDP packet easily)
  */
-#define ZT_SOFTWARE_UPDATE_CHUNK_SIZE (ZT_PROTO_MAX_PACKET_LENGTH - 128)
+#define ZT_SOFTWARE_UPDATE_CHUNK_SIZE (ZT_PROTO_MAX_COMPAT_PACKET_LENGTH - 128)
+
+/**
+ * Number of chunk requests kept in flight while downloading
+ */
+#define ZT_SOFTWARE_UPDATE_DOWNLOAD_WINDOW 32
+
+/**
+ * Time (ms) after which an unanswered chunk request is sent again
+ */
+#define ZT_SOFTWARE_UPDATE_CHUNK_TIMEOUT 3000
 
 /**
  * Sanity limit for the size of an update binary image
@@ -76,6 +87,24 @@
  */
 #define ZT_SOFTWARE_UPDATE_BIN_FILENAME "latest-update.exe"
 
+/**
+ * Filename for an update's binary image while it is being downloaded
+ */
+#define ZT_SOFTWARE_UPDATE_PARTIAL_FILENAME "latest-update.exe.part"
+
+/**
+ * Filename for the chunk table of a download in progress
+ *
+ * Format:
+ *   <[64] SHA512 hash of complete update image from its meta-data>
+ *   <[8] size of update image (big-endian)>
+ *   <[16] first 128 bits of SHA512 of each chunk or all zero if not received> * chunk count
+ *
+ * Chunk hashes let an interrupted download resume after a restart without
+ * trusting partial file contents that may not have made it to disk.
+ */
+#define ZT_SOFTWARE_UPDATE_CHUNKS_FILENAME "latest-update.exe.chunks"
+
 #define ZT_SOFTWARE_UPDATE_JSON_VERSION_MAJOR "vMajor"
 #define ZT_SOFTWARE_UPDATE_JSON_VERSION_MINOR "vMinor"
 #define ZT_SOFTWARE_UPDATE_JSON_VERSION_REVISION "vRev"
@@ -121,6 +150,9 @@ public:
 		 * Payload:
 		 *   <[16] first 128 bits of hash of data object>
 		 *   <[4] 32-bit index of chunk to get>
+		 *
+		 * The index is a byte offset. Downloaders keep several of these in flight
+		 * at offsets that are multiples of ZT_SOFTWARE_UPDATE_CHUNK_SIZE.
 		 */
 		VERB_GET_DATA = 3,
 
@@ -188,20 +220,36 @@ private:
 	std::string _channel;
 	FILE *_distLog;
 
+	void _clearDist();
+	void _startDownload(const std::string &hash,unsigned long len);
+	void _stopDownload(bool remove);
+	void _requestChunks(const uint64_t now);
+
 	// Offered software updates if we are an update host (we have update-dist.d and update hosting is enabled)
 	struct _D
 	{
 		nlohmann::json meta;
-		std::string bin;
+		const uint8_t *bin; // from OSUtils::mapFile()
+		unsigned long size;
 	};
 	std::map< Array<uint8_t,16>,_D > _dist; // key is first 16 bytes of hash
 
 	nlohmann::json _latestMeta;
 	bool _latestValid;
 
-	std::string _download;
+	// Download in progress, written chunk by chunk to the partial and chunks files
+	FILE *_downloadFile;
+	FILE *_downloadChunksFile;
+	std::string _downloadHash;
 	Array<uint8_t,16> _downloadHashPrefix;
 	unsigned long _downloadLength;
+	unsigned long _downloadChunkCount;
+	unsigned long _downloadChunksHave;
+	unsigned long _downloadNext; // all chunks before this one are here
+	std::vector<bool> _chunkHave;
+	std::vector<uint64_t> _chunkRequested; // time of last request or 0 if never
+
+	Mutex _lock;
 };
 
 } // namespace ZeroTier
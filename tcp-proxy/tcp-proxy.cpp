@@ -36,17 +36,17 @@
 #include <signal.h>
 
 #include <map>
-#include <set>
 #include <string>
 #include <algorithm>
 #include <vector>
 
-#include "../osdep/Phy.hpp"
-
-#define ZT_TCP_PROXY_CONNECTION_TIMEOUT_SECONDS 300
-#define ZT_TCP_PROXY_TCP_PORT 443
+#include <sys/time.h>
+#include <sys/resource.h>
 
-using namespace ZeroTier;
+#include "../node/Constants.hpp"
+#include "../node/Hashtable.hpp"
+#include "../osdep/Phy.hpp"
+#include "../osdep/Thread.hpp"
 
 /*
  * ZeroTier TCP Proxy Server
@@ -85,80 +85,507 @@ using namespace ZeroTier;
  * as long as such nodes appear to be in the wild.
  */
 
-struct TcpProxyService;
+/*
+ * Scaling:
+ *
+ * The proxy runs one worker per thread. Each worker has its own Phy loop,
+ * its own listening socket on the TCP port (the kernel spreads accepts
+ * across them with SO_REUSEPORT), and its own clients, so workers share
+ * nothing and need no locks.
+ *
+ * Each worker keeps a table of UDP sockets that its clients send from.
+ * Every client owns a "home" socket, and anything that arrives on it from
+ * an address no other client has sent to is forwarded to its owner. This
+ * keeps the full-cone behavior of a socket per client, which peers rely on
+ * to reach a client at the address they learned from someone else. Sockets
+ * of closed clients are reused for new ones instead of being closed.
+ *
+ * Only when a worker reaches ZT_TCP_PROXY_MAX_UDP_SOCKETS do new clients
+ * share home sockets. Then the table of shared socket (local port) and
+ * remote IP and port picks the outbound socket, so that no two clients send
+ * to the same destination from the same socket, and matches replies back to
+ * clients.
+ *
+ * TCP buffers come from a per-worker pool in power of two size classes.
+ * Buffers are only held while there's a partial record to read or unsent
+ * data to write, so idle clients use no buffer memory at all.
+ */
+
+/**
+ * Seconds of inactivity after which a client is disconnected
+ */
+#define ZT_TCP_PROXY_CONNECTION_TIMEOUT_SECONDS 300
+
+/**
+ * Default TCP port to listen on
+ */
+#define ZT_TCP_PROXY_TCP_PORT 443
+
+/**
+ * Maximum number of worker threads
+ */
+#define ZT_TCP_PROXY_MAX_THREADS 64
+
+/**
+ * UDP sockets each worker binds at startup (handed out to the first clients)
+ */
+#define ZT_TCP_PROXY_INITIAL_UDP_SOCKETS 4
+
+/**
+ * Maximum UDP sockets per worker (must fit in 16 bits of a route key)
+ */
+#define ZT_TCP_PROXY_MAX_UDP_SOCKETS 4096
+
+/**
+ * Receive buffer size for UDP sockets
+ */
+#define ZT_TCP_PROXY_UDP_BUFFER_SIZE 4194304
+
+/**
+ * Maximum number of distinct destinations a single client may send to
+ */
+#define ZT_TCP_PROXY_MAX_CLIENT_ROUTES 4096
+
+/**
+ * Smallest pooled buffer size class
+ */
+#define ZT_TCP_PROXY_BUF_MIN_SIZE 4096
+
+/**
+ * Largest pooled buffer, which bounds memory per client per direction
+ */
+#define ZT_TCP_PROXY_BUF_MAX_SIZE 131072
+
+/**
+ * Number of buffer size classes (4K, 8K, ... up to ZT_TCP_PROXY_BUF_MAX_SIZE)
+ */
+#define ZT_TCP_PROXY_BUF_CLASSES 6
+
+/**
+ * Maximum bytes of free buffers a worker's pool keeps for reuse
+ */
+#define ZT_TCP_PROXY_POOL_MAX_FREE_BYTES 16777216
+
+/**
+ * Packets each load generator client keeps in flight
+ */
+#define ZT_TCP_PROXY_BENCH_WINDOW 4
+
+/**
+ * Size of load generator test packets (not counting the address header)
+ */
+#define ZT_TCP_PROXY_BENCH_PACKET_SIZE 128
+
+using namespace ZeroTier;
+
+/**
+ * A growable buffer whose memory comes from a ProxyBufferPool
+ *
+ * Data lives between start and end so partial sends can be consumed
+ * without moving what's left.
+ */
+struct ProxyBuffer
+{
+	ProxyBuffer() : b((char *)0),size(0),start(0),end(0) {}
+
+	inline unsigned long length() const { return (end - start); }
+	inline const char *data() const { return (b + start); }
+
+	char *b;
+	unsigned long size;
+	unsigned long start;
+	unsigned long end;
+};
+
+/**
+ * Per-worker pool of buffers in power of two size classes
+ *
+ * This is not thread safe; each worker has its own.
+ */
+class ProxyBufferPool
+{
+public:
+	ProxyBufferPool() : _freeBytes(0),_inUseBytes(0) {}
+
+	~ProxyBufferPool()
+	{
+		for(unsigned int c=0;c<ZT_TCP_PROXY_BUF_CLASSES;++c) {
+			for(std::vector<char *>::iterator b(_free[c].begin());b!=_free[c].end();++b)
+				::free(*b);
+		}
+	}
+
+	/**
+	 * Make room for n more bytes at the end of a buffer
+	 *
+	 * @param pb Buffer
+	 * @param n Number of bytes
+	 * @return False if this would exceed ZT_TCP_PROXY_BUF_MAX_SIZE or memory is exhausted
+	 */
+	inline bool reserve(ProxyBuffer &pb,const unsigned long n)
+	{
+		if ((pb.end + n) <= pb.size)
+			return true;
+		const unsigned long len = pb.length();
+		const unsigned long need = len + n;
+		if (need > ZT_TCP_PROXY_BUF_MAX_SIZE)
+			return false;
+		if (need <= pb.size) {
+			memmove(pb.b,pb.b + pb.start,len);
+			pb.start = 0;
+			pb.end = len;
+			return true;
+		}
+
+		unsigned int c = 0;
+		while ((ZT_TCP_PROXY_BUF_MIN_SIZE << c) < need)
+			++c;
+		char *const nb = _get(c);
+		if (!nb)
+			return false;
+		if (pb.b) {
+			memcpy(nb,pb.b + pb.start,len);
+			_put(pb.b,pb.size);
+		}
+		pb.b = nb;
+		pb.size = ZT_TCP_PROXY_BUF_MIN_SIZE << c;
+		pb.start = 0;
+		pb.end = len;
+		return true;
+	}
+
+	/**
+	 * Append to a buffer after reserve() has succeeded
+	 */
+	inline void append(ProxyBuffer &pb,const void *data,const unsigned long len)
+	{
+		memcpy(pb.b + pb.end,data,len);
+		pb.end += len;
+	}
+
+	/**
+	 * Return a buffer's memory to the pool and reset it to empty
+	 */
+	inline void release(ProxyBuffer &pb)
+	{
+		if (pb.b)
+			_put(pb.b,pb.size);
+		pb = ProxyBuffer();
+	}
+
+	/**
+	 * @return Bytes currently held by buffers
+	 */
+	inline unsigned long inUseBytes() const { return _inUseBytes; }
+
+	/**
+	 * @return Bytes of free buffers held for reuse
+	 */
+	inline unsigned long freeBytes() const { return _freeBytes; }
+
+private:
+	inline char *_get(const unsigned int c)
+	{
+		const unsigned long size = ZT_TCP_PROXY_BUF_MIN_SIZE << c;
+		char *b;
+		if (_free[c].empty()) {
+			b = (char *)::malloc(size);
+			if (!b)
+				return (char *)0;
+		} else {
+			b = _free[c].back();
+			_free[c].pop_back();
+			_freeBytes -= size;
+		}
+		_inUseBytes += size;
+		return b;
+	}
+
+	inline void _put(char *b,const unsigned long size)
+	{
+		_inUseBytes -= size;
+		if ((_freeBytes + size) <= ZT_TCP_PROXY_POOL_MAX_FREE_BYTES) {
+			unsigned int c = 0;
+			while ((ZT_TCP_PROXY_BUF_MIN_SIZE << c) < size)
+				++c;
+			try {
+				_free[c].push_back(b);
+				_freeBytes += size;
+				return;
+			} catch ( ... ) {}
+		}
+		::free(b);
+	}
+
+	std::vector<char *> _free[ZT_TCP_PROXY_BUF_CLASSES];
+	unsigned long _freeBytes;
+	unsigned long _inUseBytes;
+};
+
+// Length of the payload of a record whose 5-byte header starts at p
+static inline unsigned long _recordLength(const char *p)
+{
+	return ( ((((unsigned long)p[3]) & 0xff) << 8) | (((unsigned long)p[4]) & 0xff) );
+}
+
+// Fill in a TLS-like record header for a payload of mlen bytes
+static inline void _recordHeader(char *p,const unsigned long mlen)
+{
+	p[0] = 0x17; // look like TLS data
+	p[1] = 0x03; // look like TLS 1.2
+	p[2] = 0x03; // look like TLS 1.2
+	p[3] = (char)((mlen >> 8) & 0xff);
+	p[4] = (char)(mlen & 0xff);
+}
+
+// Route key: shared UDP socket index, remote IPv4 address, remote port
+static inline uint64_t _routeKey(const unsigned long sockIdx,const struct sockaddr_in *remote)
+{
+	return ( ((uint64_t)sockIdx << 48) | ((uint64_t)ntohl(remote->sin_addr.s_addr) << 16) | (uint64_t)ntohs(remote->sin_port) );
+}
+
+/**
+ * One proxy worker: a Phy loop with its own listener, clients, and UDP sockets
+ */
 struct TcpProxyService
 {
-	Phy<TcpProxyService *> *phy;
-	int udpPortCounter;
 	struct Client
 	{
-		char tcpReadBuf[131072];
-		char tcpWriteBuf[131072];
-		unsigned long tcpWritePtr;
-		unsigned long tcpReadPtr;
+		ProxyBuffer in;
+		ProxyBuffer out;
 		PhySocket *tcp;
-		PhySocket *udp;
 		time_t lastActivity;
+		unsigned long home;
 		bool newVersion;
+		std::vector<uint64_t> routes;
 	};
-	std::map< PhySocket *,Client > clients;
-
-	PhySocket *getUnusedUdp(void *uptr)
-	{
-		for(int i=0;i<65535;++i) {
-			++udpPortCounter;
-			if (udpPortCounter > 0xfffe)
-				udpPortCounter = 1024;
-			struct sockaddr_in laddr;
-			memset(&laddr,0,sizeof(struct sockaddr_in));
-			laddr.sin_family = AF_INET;
-			laddr.sin_port = htons((uint16_t)udpPortCounter);
-			PhySocket *udp = phy->udpBind(reinterpret_cast<struct sockaddr *>(&laddr),uptr);
-			if (udp)
-				return udp;
+
+	TcpProxyService() :
+		listener((PhySocket *)0),
+		nextHome(0),
+		dropped(0),
+		run(false)
+	{
+		phy = new Phy<TcpProxyService *>(this,false,true);
+	}
+
+	~TcpProxyService()
+	{
+		stop();
+		delete phy; // closes everything, which frees clients via phyOnTcpClose()
+	}
+
+	/**
+	 * Start listening and launch this worker's thread
+	 *
+	 * @param listenAddress TCP address to listen on (shared with other workers)
+	 * @return True on success
+	 */
+	inline bool start(const struct sockaddr_in &listenAddress)
+	{
+		listener = phy->tcpListen((const struct sockaddr *)&listenAddress,(void *)0,true);
+		if (!listener)
+			return false;
+		for(unsigned int i=0;i<ZT_TCP_PROXY_INITIAL_UDP_SOCKETS;++i) {
+			if (!addUdp())
+				return false;
+			freeHomes.push_back((unsigned long)i);
 		}
-		return (PhySocket *)0;
+		run = true;
+		thread = Thread::start(this);
+		return true;
 	}
 
-	void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len)
+	/**
+	 * Stop this worker's thread if it's running
+	 */
+	inline void stop()
 	{
-		if (!*uptr)
+		if (run) {
+			run = false;
+			phy->whack();
+			Thread::join(thread);
+		}
+	}
+
+	/**
+	 * @return Local port this worker is listening on
+	 */
+	inline unsigned int listenPort() const
+	{
+		struct sockaddr_in sa;
+		socklen_t sl = sizeof(sa);
+		memset(&sa,0,sizeof(sa));
+		if ((!listener)||(getsockname(Phy<TcpProxyService *>::getDescriptor(listener),(struct sockaddr *)&sa,&sl) != 0))
+			return 0;
+		return (unsigned int)ntohs(sa.sin_port);
+	}
+
+	PhySocket *addUdp()
+	{
+		if (udp.size() >= ZT_TCP_PROXY_MAX_UDP_SOCKETS)
+			return (PhySocket *)0;
+		struct sockaddr_in laddr;
+		memset(&laddr,0,sizeof(struct sockaddr_in));
+		laddr.sin_family = AF_INET; // port 0 lets the OS pick
+		PhySocket *s = phy->udpBind(reinterpret_cast<struct sockaddr *>(&laddr),(void *)((uintptr_t)udp.size() + 1),ZT_TCP_PROXY_UDP_BUFFER_SIZE);
+		if (s) {
+			udp.push_back(s);
+			owners.push_back((Client *)0);
+		}
+		return s;
+	}
+
+	/**
+	 * Give a new client a home socket of its own, or a shared one if we are out of sockets
+	 */
+	void claimHome(Client &c)
+	{
+		if ((freeHomes.empty())&&(addUdp()))
+			freeHomes.push_back((unsigned long)udp.size() - 1);
+		if (freeHomes.empty()) {
+			c.home = nextHome++ % (unsigned long)udp.size();
+		} else {
+			c.home = freeHomes.back();
+			freeHomes.pop_back();
+			owners[c.home] = &c;
+		}
+	}
+
+	/**
+	 * Find or claim a shared UDP socket for a client to send to a destination
+	 *
+	 * @return Socket or NULL if none can be had
+	 */
+	PhySocket *route(Client &c,const struct sockaddr_in *dest)
+	{
+		const unsigned long n = (unsigned long)udp.size();
+		long firstFree = -1;
+		for(unsigned long i=0;i<n;++i) {
+			const unsigned long idx = (c.home + i) % n;
+			Client **const owner = routes.get(_routeKey(idx,dest));
+			if (!owner) {
+				if (firstFree < 0)
+					firstFree = (long)idx;
+			} else if (*owner == &c) {
+				return udp[idx];
+			}
+		}
+
+		if (c.routes.size() >= ZT_TCP_PROXY_MAX_CLIENT_ROUTES)
+			return (PhySocket *)0;
+		if (firstFree < 0) {
+			// Every shared socket already carries another client's traffic to this destination
+			if (!addUdp())
+				return (PhySocket *)0;
+			firstFree = (long)n;
+		}
+		const uint64_t k = _routeKey((unsigned long)firstFree,dest);
+		routes.set(k,&c);
+		c.routes.push_back(k);
+		return udp[firstFree];
+	}
+
+	// Frame and send or queue a packet to a client; the client may be gone on return
+	void sendToClient(Client &c,const struct sockaddr_in *from,const void *data,unsigned long len)
+	{
+		char rec[5 + 7 + 2048];
+		unsigned long mlen = len;
+		if (c.newVersion)
+			mlen += 7; // new clients get IP info
+		_recordHeader(rec,mlen);
+		unsigned long rlen = 5;
+		if (c.newVersion) {
+			rec[rlen++] = (char)4; // IPv4
+			memcpy(rec + rlen,&(from->sin_addr.s_addr),4);
+			rlen += 4;
+			memcpy(rec + rlen,&(from->sin_port),2);
+			rlen += 2;
+		}
+		memcpy(rec + rlen,data,len);
+		rlen += len;
+
+		unsigned long sent = 0;
+		if (!c.out.length()) {
+			// Nothing queued, so try to hand it straight to the kernel
+			const long n = phy->streamSend(c.tcp,rec,rlen);
+			if (n < 0)
+				return; // closed
+			sent = (unsigned long)n;
+			if (sent >= rlen)
+				return;
+		}
+
+		if (!pool.reserve(c.out,rlen - sent)) {
+			if (sent) {
+				phy->close(c.tcp); // can't drop half a record
+			} else {
+				++dropped;
+			}
 			return;
-		if ((from->sa_family == AF_INET)&&(len >= 16)&&(len < 2048)) {
-			Client &c = *((Client *)*uptr);
-			c.lastActivity = time((time_t *)0);
-
-			unsigned long mlen = len;
-			if (c.newVersion)
-				mlen += 7; // new clients get IP info
-
-			if ((c.tcpWritePtr + 5 + mlen) <= sizeof(c.tcpWriteBuf)) {
-				if (!c.tcpWritePtr)
-					phy->setNotifyWritable(c.tcp,true);
-
-				c.tcpWriteBuf[c.tcpWritePtr++] = 0x17; // look like TLS data
-				c.tcpWriteBuf[c.tcpWritePtr++] = 0x03; // look like TLS 1.2
-				c.tcpWriteBuf[c.tcpWritePtr++] = 0x03; // look like TLS 1.2
-
-				c.tcpWriteBuf[c.tcpWritePtr++] = (char)((mlen >> 8) & 0xff);
-				c.tcpWriteBuf[c.tcpWritePtr++] = (char)(mlen & 0xff);
-
-				if (c.newVersion) {
-					c.tcpWriteBuf[c.tcpWritePtr++] = (char)4; // IPv4
-					*((uint32_t *)(c.tcpWriteBuf + c.tcpWritePtr)) = ((const struct sockaddr_in *)from)->sin_addr.s_addr;
-					c.tcpWritePtr += 4;
-					*((uint16_t *)(c.tcpWriteBuf + c.tcpWritePtr)) = ((const struct sockaddr_in *)from)->sin_port;
-					c.tcpWritePtr += 2;
-				}
+		}
+		const bool wasEmpty = (c.out.length() == 0);
+		pool.append(c.out,rec + sent,rlen - sent);
+		if (wasEmpty)
+			phy->setNotifyWritable(c.tcp,true);
+	}
 
-				for(unsigned long i=0;i<len;++i)
-					c.tcpWriteBuf[c.tcpWritePtr++] = ((const char *)data)[i];
+	// Handle one complete record from a client (p is the payload after the header)
+	void handleRecord(Client &c,const char *p,const unsigned long mlen)
+	{
+		if (mlen == 4) {
+			// Right now just sending this means the client is 'new enough' for the IP header
+			c.newVersion = true;
+		} else if (mlen >= 7) {
+			const char *payload = p;
+			unsigned long payloadLen = mlen;
+
+			struct sockaddr_in dest;
+			memset(&dest,0,sizeof(dest));
+			if (c.newVersion) {
+				if (*payload == (char)4) {
+					// New clients tell us where their packets go.
+					++payload;
+					dest.sin_family = AF_INET;
+					memcpy(&(dest.sin_addr.s_addr),payload,4);
+					payload += 4;
+					memcpy(&(dest.sin_port),payload,2); // will be in network byte order already
+					payload += 2;
+					payloadLen -= 7;
+				}
+			} else {
+				// For old clients we will just proxy everything to a local ZT instance. The
+				// fact that this will come from 127.0.0.1 will in turn prevent that instance
+				// from doing unite() with us. It'll just forward. There will not be many of
+				// these.
+				dest.sin_family = AF_INET;
+				dest.sin_addr.s_addr = htonl(0x7f000001); // 127.0.0.1
+				dest.sin_port = htons(9993);
 			}
 
-			//printf("<< UDP %s:%d -> %.16llx\n",inet_ntoa(reinterpret_cast<const struct sockaddr_in *>(from)->sin_addr),(int)ntohs(reinterpret_cast<const struct sockaddr_in *>(from)->sin_port),(unsigned long long)&c);
+			// Note: we do not relay to privileged ports... just an abuse prevention rule.
+			if ((ntohs(dest.sin_port) > 1024)&&(payloadLen >= 16)) {
+				PhySocket *const s = route(c,&dest);
+				if (s)
+					phy->udpSend(s,(const struct sockaddr *)&dest,payload,payloadLen);
+				else ++dropped;
+			}
 		}
 	}
 
+	void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len)
+	{
+		if ((!*uptr)||(from->sa_family != AF_INET)||(len < 16)||(len >= 2048))
+			return;
+		const unsigned long idx = (unsigned long)((uintptr_t)*uptr - 1);
+		Client **const r = routes.get(_routeKey(idx,(const struct sockaddr_in *)from));
+		Client *const c = (r) ? *r : owners[idx]; // unknown sources go to the socket's owner (full cone)
+		if (!c)
+			return; // shared socket and no client has sent to this address from it
+		c->lastActivity = time((time_t *)0);
+		sendToClient(*c,(const struct sockaddr_in *)from,data,len);
+	}
+
 	void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
 	{
 		// unused, we don't initiate outbound connections
@@ -166,32 +593,37 @@ struct TcpProxyService
 
 	void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from)
 	{
-		Client &c = clients[sockN];
-		PhySocket *udp = getUnusedUdp((void *)&c);
-		if (!udp) {
-			phy->close(sockN);
-			clients.erase(sockN);
-			//printf("** TCP rejected, no more UDP ports to assign\n");
+		Client *c;
+		try {
+			c = new Client();
+			clients[sockN] = c;
+		} catch ( ... ) {
+			phy->close(sockN,false);
 			return;
 		}
-		c.tcpWritePtr = 0;
-		c.tcpReadPtr = 0;
-		c.tcp = sockN;
-		c.udp = udp;
-		c.lastActivity = time((time_t *)0);
-		c.newVersion = false;
-		*uptrN = (void *)&c;
-		//printf("<< TCP from %s -> %.16llx\n",inet_ntoa(reinterpret_cast<const struct sockaddr_in *>(from)->sin_addr),(unsigned long long)&c);
+		c->tcp = sockN;
+		c->lastActivity = time((time_t *)0);
+		claimHome(*c);
+		c->newVersion = false;
+		*uptrN = (void *)c;
 	}
 
 	void phyOnTcpClose(PhySocket *sock,void **uptr)
 	{
 		if (!*uptr)
 			return;
-		Client &c = *((Client *)*uptr);
-		phy->close(c.udp);
+		Client *const c = (Client *)*uptr;
+		for(std::vector<uint64_t>::const_iterator r(c->routes.begin());r!=c->routes.end();++r)
+			routes.erase(*r);
+		if (owners[c->home] == c) {
+			owners[c->home] = (Client *)0;
+			freeHomes.push_back(c->home);
+		}
+		pool.release(c->in);
+		pool.release(c->out);
 		clients.erase(sock);
-		//printf("** TCP %.16llx closed\n",(unsigned long long)*uptr);
+		delete c;
+		*uptr = (void *)0;
 	}
 
 	void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len)
@@ -199,119 +631,386 @@ struct TcpProxyService
 		Client &c = *((Client *)*uptr);
 		c.lastActivity = time((time_t *)0);
 
-		for(unsigned long i=0;i<len;++i) {
-			if (c.tcpReadPtr >= sizeof(c.tcpReadBuf)) {
+		const char *p = (const char *)data;
+		unsigned long n = len;
+
+		// Finish any record left over from last time
+		while (c.in.length()) {
+			const unsigned long have = c.in.length();
+			const unsigned long want = (have < 5) ? 5 : (5 + _recordLength(c.in.data()));
+			if (have >= want) {
+				handleRecord(c,c.in.data() + 5,want - 5);
+				pool.release(c.in);
+				break;
+			}
+			if (!n)
+				return;
+			const unsigned long take = std::min(want - have,n);
+			if (!pool.reserve(c.in,take)) {
 				phy->close(sock);
 				return;
 			}
-			c.tcpReadBuf[c.tcpReadPtr++] = ((const char *)data)[i];
-
-			if (c.tcpReadPtr >= 5) {
-				unsigned long mlen = ( ((((unsigned long)c.tcpReadBuf[3]) & 0xff) << 8) | (((unsigned long)c.tcpReadBuf[4]) & 0xff) );
-				if (c.tcpReadPtr >= (mlen + 5)) {
-					if (mlen == 4) {
-						// Right now just sending this means the client is 'new enough' for the IP header
-						c.newVersion = true;
-						//printf("<< TCP %.16llx HELLO\n",(unsigned long long)*uptr);
-					} else if (mlen >= 7) {
-						char *payload = c.tcpReadBuf + 5;
-						unsigned long payloadLen = mlen;
-
-						struct sockaddr_in dest;
-						memset(&dest,0,sizeof(dest));
-						if (c.newVersion) {
-							if (*payload == (char)4) {
-								// New clients tell us where their packets go.
-								++payload;
-								dest.sin_family = AF_INET;
-								dest.sin_addr.s_addr = *((uint32_t *)payload);
-								payload += 4;
-								dest.sin_port = *((uint16_t *)payload); // will be in network byte order already
-								payload += 2;
-								payloadLen -= 7;
-							}
-						} else {
-							// For old clients we will just proxy everything to a local ZT instance. The
-							// fact that this will come from 127.0.0.1 will in turn prevent that instance
-							// from doing unite() with us. It'll just forward. There will not be many of
-							// these.
-							dest.sin_family = AF_INET;
-							dest.sin_addr.s_addr = htonl(0x7f000001); // 127.0.0.1
-							dest.sin_port = htons(9993);
-						}
-
-						// Note: we do not relay to privileged ports... just an abuse prevention rule.
-						if ((ntohs(dest.sin_port) > 1024)&&(payloadLen >= 16)) {
-							phy->udpSend(c.udp,(const struct sockaddr *)&dest,payload,payloadLen);
-							//printf(">> TCP %.16llx to %s:%d\n",(unsigned long long)*uptr,inet_ntoa(dest.sin_addr),(int)ntohs(dest.sin_port));
-						}
-					}
-
-					memmove(c.tcpReadBuf,c.tcpReadBuf + (mlen + 5),c.tcpReadPtr -= (mlen + 5));
-				}
+			pool.append(c.in,p,take);
+			p += take;
+			n -= take;
+		}
+
+		// Handle complete records in place
+		while (n >= 5) {
+			const unsigned long mlen = _recordLength(p);
+			if (n < (mlen + 5))
+				break;
+			handleRecord(c,p + 5,mlen);
+			p += mlen + 5;
+			n -= mlen + 5;
+		}
+
+		if (n) {
+			if (!pool.reserve(c.in,n)) {
+				phy->close(sock);
+				return;
 			}
+			pool.append(c.in,p,n);
 		}
 	}
 
 	void phyOnTcpWritable(PhySocket *sock,void **uptr)
 	{
 		Client &c = *((Client *)*uptr);
-		if (c.tcpWritePtr) {
-			long n = phy->streamSend(sock,c.tcpWriteBuf,c.tcpWritePtr);
+		if (c.out.length()) {
+			const long n = phy->streamSend(sock,c.out.data(),c.out.length());
 			if (n > 0) {
-				memmove(c.tcpWriteBuf,c.tcpWriteBuf + n,c.tcpWritePtr -= (unsigned long)n);
-				if (!c.tcpWritePtr)
+				c.out.start += (unsigned long)n;
+				if (!c.out.length()) {
+					pool.release(c.out);
 					phy->setNotifyWritable(sock,false);
+				}
 			}
 		} else phy->setNotifyWritable(sock,false);
 	}
 
+	void phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable) {}
+	void phyOnUnixAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN) {}
+	void phyOnUnixClose(PhySocket *sock,void **uptr) {}
+	void phyOnUnixData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
+	void phyOnUnixWritable(PhySocket *sock,void **uptr,bool lwip_invoked) {}
+
 	void doHousekeeping()
 	{
 		std::vector<PhySocket *> toClose;
 		time_t now = time((time_t *)0);
-		for(std::map< PhySocket *,Client >::iterator c(clients.begin());c!=clients.end();++c) {
-			if ((now - c->second.lastActivity) >= ZT_TCP_PROXY_CONNECTION_TIMEOUT_SECONDS) {
+		for(std::map< PhySocket *,Client * >::iterator c(clients.begin());c!=clients.end();++c) {
+			if ((now - c->second->lastActivity) >= ZT_TCP_PROXY_CONNECTION_TIMEOUT_SECONDS)
 				toClose.push_back(c->first);
-				toClose.push_back(c->second.udp);
-			}
 		}
 		for(std::vector<PhySocket *>::iterator s(toClose.begin());s!=toClose.end();++s)
 			phy->close(*s);
 	}
+
+	void threadMain()
+		throw()
+	{
+		time_t lastDidHousekeeping = time((time_t *)0);
+		while (run) {
+			phy->poll(120000);
+			time_t now = time((time_t *)0);
+			if ((now - lastDidHousekeeping) > 120) {
+				lastDidHousekeeping = now;
+				doHousekeeping();
+			}
+		}
+	}
+
+	Phy<TcpProxyService *> *phy;
+	PhySocket *listener;
+	std::vector<PhySocket *> udp;
+	std::vector<Client *> owners; // client whose home each UDP socket is, or NULL if shared or free
+	std::vector<unsigned long> freeHomes; // indexes of UDP sockets with no owner and no traffic
+	Hashtable< uint64_t,Client * > routes;
+	std::map< PhySocket *,Client * > clients;
+	ProxyBufferPool pool;
+	unsigned long nextHome;
+	volatile unsigned long dropped;
+	volatile bool run;
+	Thread thread;
+};
+
+/**
+ * Load generator for benchmarking a proxy with many concurrent clients
+ *
+ * Each client connects, says hello, and keeps ZT_TCP_PROXY_BENCH_WINDOW
+ * packets in flight to a local UDP echo socket through the proxy. Replies
+ * carry the sending client's ID, so any that reach the wrong client show up
+ * as misrouted.
+ */
+struct TcpProxyLoadGenerator
+{
+	struct Conn
+	{
+		Conn() : tcp((PhySocket *)0),id(0),connected(false) {}
+		PhySocket *tcp;
+		uint32_t id;
+		bool connected;
+		std::string in;
+	};
+
+	TcpProxyLoadGenerator() :
+		echo((PhySocket *)0),
+		connected(0),
+		closed(0),
+		roundTrips(0),
+		misrouted(0)
+	{
+		phy = new Phy<TcpProxyLoadGenerator *>(this,true,false);
+	}
+
+	~TcpProxyLoadGenerator()
+	{
+		delete phy;
+	}
+
+	bool start(unsigned int proxyPort,unsigned int clients)
+	{
+		memset(&echoAddr,0,sizeof(echoAddr));
+		echoAddr.sin_family = AF_INET;
+		echoAddr.sin_addr.s_addr = htonl(0x7f000001);
+		echo = phy->udpBind((const struct sockaddr *)&echoAddr,(void *)0,ZT_TCP_PROXY_UDP_BUFFER_SIZE);
+		if (!echo)
+			return false;
+		socklen_t sl = sizeof(echoAddr);
+		if (getsockname(Phy<TcpProxyLoadGenerator *>::getDescriptor(echo),(struct sockaddr *)&echoAddr,&sl) != 0)
+			return false;
+
+		struct sockaddr_in proxyAddr;
+		memset(&proxyAddr,0,sizeof(proxyAddr));
+		proxyAddr.sin_family = AF_INET;
+		proxyAddr.sin_addr.s_addr = htonl(0x7f000001);
+		proxyAddr.sin_port = htons((uint16_t)proxyPort);
+
+		conns.resize(clients);
+		for(unsigned int i=0;i<clients;++i) {
+			conns[i].id = i;
+			bool instant = false;
+			conns[i].tcp = phy->tcpConnect((const struct sockaddr *)&proxyAddr,instant,(void *)&(conns[i]),true);
+			if (!conns[i].tcp)
+				return false;
+		}
+		return true;
+	}
+
+	void sendPacket(Conn &c)
+	{
+		char rec[5 + 7 + ZT_TCP_PROXY_BENCH_PACKET_SIZE];
+		memset(rec,0,sizeof(rec));
+		_recordHeader(rec,7 + ZT_TCP_PROXY_BENCH_PACKET_SIZE);
+		rec[5] = (char)4;
+		memcpy(rec + 6,&(echoAddr.sin_addr.s_addr),4);
+		memcpy(rec + 10,&(echoAddr.sin_port),2);
+		memcpy(rec + 12,&(c.id),4);
+		phy->streamSend(c.tcp,rec,sizeof(rec));
+	}
+
+	void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *localAddr,const struct sockaddr *from,void *data,unsigned long len)
+	{
+		phy->udpSend(sock,from,data,len); // echo
+	}
+
+	void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success)
+	{
+		Conn &c = *((Conn *)*uptr);
+		if (!success) {
+			++closed;
+			return;
+		}
+		c.connected = true;
+		++connected;
+		char hello[9];
+		_recordHeader(hello,4);
+		hello[5] = 1; hello[6] = 2; hello[7] = 0; hello[8] = 0;
+		phy->streamSend(sock,hello,sizeof(hello));
+		for(unsigned int i=0;i<ZT_TCP_PROXY_BENCH_WINDOW;++i)
+			sendPacket(c);
+	}
+
+	void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from) {}
+
+	void phyOnTcpClose(PhySocket *sock,void **uptr)
+	{
+		Conn &c = *((Conn *)*uptr);
+		if (c.connected) {
+			c.connected = false;
+			--connected;
+		}
+		++closed;
+	}
+
+	void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len)
+	{
+		Conn &c = *((Conn *)*uptr);
+		c.in.append((const char *)data,len);
+		unsigned long p = 0;
+		while ((c.in.length() - p) >= 5) {
+			const unsigned long mlen = _recordLength(c.in.data() + p);
+			if ((c.in.length() - p) < (mlen + 5))
+				break;
+			if (mlen >= (7 + 4)) {
+				uint32_t id = 0;
+				memcpy(&id,c.in.data() + p + 5 + 7,4);
+				if (id == c.id)
+					++roundTrips;
+				else ++misrouted;
+				sendPacket(c);
+			}
+			p += mlen + 5;
+		}
+		c.in.erase(0,p);
+	}
+
+	void phyOnTcpWritable(PhySocket *sock,void **uptr) {}
+	void phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable) {}
+	void phyOnUnixAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN) {}
+	void phyOnUnixClose(PhySocket *sock,void **uptr) {}
+	void phyOnUnixData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
+	void phyOnUnixWritable(PhySocket *sock,void **uptr,bool lwip_invoked) {}
+
+	Phy<TcpProxyLoadGenerator *> *phy;
+	PhySocket *echo;
+	struct sockaddr_in echoAddr;
+	std::vector<Conn> conns;
+	unsigned long connected;
+	unsigned long closed;
+	uint64_t roundTrips;
+	uint64_t misrouted;
 };
 
+static void printHelp(const char *cn)
+{
+	printf("Usage: %s [-t <threads>] [-p <port>]" ZT_EOL_S,cn);
+	printf("       %s -b <clients> <seconds> [-t <threads>]" ZT_EOL_S,cn);
+	printf(ZT_EOL_S "  -t <threads>  - Worker threads (default: one per core)" ZT_EOL_S);
+	printf("  -p <port>     - TCP port to listen on (default: %d)" ZT_EOL_S,ZT_TCP_PROXY_TCP_PORT);
+	printf("  -b            - Benchmark a local proxy with a load generator" ZT_EOL_S);
+}
+
+static bool startWorkers(std::vector<TcpProxyService *> &workers,unsigned int threads,unsigned int port)
+{
+	struct sockaddr_in laddr;
+	memset(&laddr,0,sizeof(laddr));
+	laddr.sin_family = AF_INET;
+	laddr.sin_port = htons((uint16_t)port);
+	for(unsigned int i=0;i<threads;++i) {
+		TcpProxyService *const w = new TcpProxyService();
+		workers.push_back(w);
+		if (!w->start(laddr))
+			return false;
+		if (!port) {
+			// Benchmark listens on an OS-chosen port; the rest of the workers join it
+			port = w->listenPort();
+			laddr.sin_port = htons((uint16_t)port);
+		}
+	}
+	return true;
+}
+
+static int runBenchmark(const char *cn,unsigned int clients,unsigned int seconds,unsigned int threads)
+{
+	{
+		// Every client is two descriptors here (both ends of its connection)
+		struct rlimit rl;
+		if (getrlimit(RLIMIT_NOFILE,&rl) == 0) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE,&rl);
+		}
+	}
+
+	std::vector<TcpProxyService *> workers;
+	if (!startWorkers(workers,threads,0)) {
+		fprintf(stderr,"%s: fatal error: unable to start proxy workers" ZT_EOL_S,cn);
+		return 1;
+	}
+
+	TcpProxyLoadGenerator gen;
+	if (!gen.start(workers[0]->listenPort(),clients)) {
+		fprintf(stderr,"%s: fatal error: unable to open %u client connections (check ulimit -n)" ZT_EOL_S,cn,clients);
+		return 1;
+	}
+
+	const time_t started = time((time_t *)0);
+	time_t lastReport = started;
+	uint64_t lastRoundTrips = 0;
+	for(;;) {
+		gen.phy->poll(100);
+		const time_t now = time((time_t *)0);
+		if (now != lastReport) {
+			printf("%u: %lu clients connected, %llu round trips/sec" ZT_EOL_S,(unsigned int)(now - started),gen.connected,(unsigned long long)((gen.roundTrips - lastRoundTrips) / (uint64_t)(now - lastReport)));
+			lastReport = now;
+			lastRoundTrips = gen.roundTrips;
+			if ((now - started) >= (time_t)seconds)
+				break;
+		}
+	}
+
+	unsigned long udpSockets = 0,bufferBytes = 0,dropped = 0;
+	for(std::vector<TcpProxyService *>::iterator w(workers.begin());w!=workers.end();++w) {
+		(*w)->stop();
+		udpSockets += (unsigned long)(*w)->udp.size();
+		bufferBytes += (*w)->pool.inUseBytes() + (*w)->pool.freeBytes();
+		dropped += (*w)->dropped;
+	}
+
+	printf(ZT_EOL_S "%u clients (%lu connected) over %u threads for %u seconds:" ZT_EOL_S,clients,gen.connected,threads,seconds);
+	printf("  %llu round trips (%llu/sec), %llu misrouted, %lu dropped" ZT_EOL_S,(unsigned long long)gen.roundTrips,(unsigned long long)(gen.roundTrips / (uint64_t)seconds),(unsigned long long)gen.misrouted,dropped);
+	printf("  %lu UDP sockets, %lu KB of pooled buffer memory" ZT_EOL_S,udpSockets,bufferBytes / 1024);
+
+	for(std::vector<TcpProxyService *>::iterator w(workers.begin());w!=workers.end();++w)
+		delete *w;
+	return (((gen.misrouted == 0)&&(gen.roundTrips > 0)) ? 0 : 1);
+}
+
 int main(int argc,char **argv)
 {
 	signal(SIGPIPE,SIG_IGN);
 	signal(SIGHUP,SIG_IGN);
 	srand(time((time_t *)0));
 
-	TcpProxyService svc;
-	Phy<TcpProxyService *> phy(&svc,false,true);
-	svc.phy = &phy;
-	svc.udpPortCounter = 1023;
-
-	{
-		struct sockaddr_in laddr;
-		memset(&laddr,0,sizeof(laddr));
-		laddr.sin_family = AF_INET;
-		laddr.sin_port = htons(ZT_TCP_PROXY_TCP_PORT);
-		if (!phy.tcpListen((const struct sockaddr *)&laddr)) {
-			fprintf(stderr,"%s: fatal error: unable to bind TCP port %d\n",argv[0],ZT_TCP_PROXY_TCP_PORT);
+	unsigned int threads = 0;
+	unsigned int port = ZT_TCP_PROXY_TCP_PORT;
+	unsigned int benchClients = 0;
+	unsigned int benchSeconds = 0;
+	for(int i=1;i<argc;++i) {
+		if ((!strcmp(argv[i],"-t"))&&((i + 1) < argc)) {
+			threads = (unsigned int)strtoul(argv[++i],(char **)0,10);
+		} else if ((!strcmp(argv[i],"-p"))&&((i + 1) < argc)) {
+			port = (unsigned int)strtoul(argv[++i],(char **)0,10);
+		} else if ((!strcmp(argv[i],"-b"))&&((i + 2) < argc)) {
+			benchClients = (unsigned int)strtoul(argv[++i],(char **)0,10);
+			benchSeconds = (unsigned int)strtoul(argv[++i],(char **)0,10);
+		} else {
+			printHelp(argv[0]);
 			return 1;
 		}
 	}
+	if (!threads) {
+		const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cores > 0) ? (unsigned int)cores : 1;
+	}
+	if (threads > ZT_TCP_PROXY_MAX_THREADS)
+		threads = ZT_TCP_PROXY_MAX_THREADS;
+	if ((!port)||(port > 0xffff)) {
+		printHelp(argv[0]);
+		return 1;
+	}
 
-	time_t lastDidHousekeeping = time((time_t *)0);
-	for(;;) {
-		phy.poll(120000);
-		time_t now = time((time_t *)0);
-		if ((now - lastDidHousekeeping) > 120) {
-			lastDidHousekeeping = now;
-			svc.doHousekeeping();
-		}
+	if (benchClients)
+		return runBenchmark(argv[0],benchClients,(benchSeconds > 0) ? benchSeconds : 1,threads);
+
+	std::vector<TcpProxyService *> workers;
+	if (!startWorkers(workers,threads,port)) {
+		fprintf(stderr,"%s: fatal error: unable to bind TCP port %u" ZT_EOL_S,argv[0],port);
+		return 1;
 	}
+	for(;;)
+		sleep(3600);
 
 	return 0;
 }
@@ -1,5 +1,5 @@
 Name:           zerotier-one
-Version:        1.2.2
+Version:        1.3.0
 Release:        1%{?dist}
 Summary:        ZeroTier One network virtualization service
 